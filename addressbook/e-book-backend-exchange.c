@@ -523,9 +523,11 @@ e_contact_from_props (EBookBackendExchange *be,
 	if (!data || !atoi (data))
 		return contact;
 
-	/* Fetch the body and parse out the photo */
-	status = e2k_context_get (be->priv->ctx, NULL, result->href,
-				  NULL, &response);
+	/* Fetch the body and parse out the photo. Every view that
+	 * reaches this contact at the same time wants the same body.
+	 */
+	status = e2k_context_get_shared (be->priv->ctx, NULL, result->href,
+					 NULL, &response);
 	if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status)) {
 		g_warning ("e_contact_from_props: %d", status);
 		return contact;
@@ -750,9 +752,9 @@ e_book_backend_exchange_connect (EBookBackendExchange *be,
 	g_object_ref (bepriv->folder);
 
 	/* check permissions on the folder */
-	status = e_folder_exchange_propfind (bepriv->folder, NULL,
-					     folder_props, G_N_ELEMENTS (folder_props),
-					     &results, &nresults);
+	status = e_folder_exchange_propfind_shared (bepriv->folder, NULL,
+						    folder_props, G_N_ELEMENTS (folder_props),
+						    &results, &nresults);
 
 	if (status != E2K_HTTP_MULTI_STATUS) {
 		bepriv->connected = FALSE;
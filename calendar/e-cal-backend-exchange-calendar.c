@@ -344,20 +344,149 @@ static const gchar *new_event_properties[] = {
 };
 static const gint n_new_event_properties = G_N_ELEMENTS (new_event_properties);
 
+/* Bodies that BPROPFIND didn't return are fetched with one GET each.
+ * Rather than waiting out a full round trip per item, keep as many
+ * GETs in flight as the context allows, without a thread for each,
+ * and parse each body on the calling thread as soon as it arrives.
+ *
+ * An item that has gone since the SEARCH is simply skipped, and one
+ * that can't be fetched doesn't stop the others; only losing the
+ * connection or the session does.
+ */
+typedef struct {
+	ECalBackendExchange *cbex;
+	E2kContext *ctx;
+	GPtrArray *hrefs;
+	GHashTable *modtimes, *attachments;
+
+	GMainLoop *loop;
+	guint next, in_flight;
+	E2kHTTPStatus status;
+	gboolean stored;
+} ExchangeBodyPipeline;
+
+typedef struct {
+	ExchangeBodyPipeline *pipeline;
+	const gchar *href;
+} ExchangeBodyFetch;
+
+static void fetch_body_done (GObject *source, GAsyncResult *result,
+			     gpointer user_data);
+
+static void
+fetch_body_next (ExchangeBodyPipeline *pipeline)
+{
+	ExchangeBodyFetch *fetch;
+
+	fetch = g_new0 (ExchangeBodyFetch, 1);
+	fetch->pipeline = pipeline;
+	fetch->href = pipeline->hrefs->pdata[pipeline->next++];
+	pipeline->in_flight++;
+
+	e2k_context_get_async (pipeline->ctx, fetch->href, NULL,
+			       fetch_body_done, fetch);
+}
+
+static void
+fetch_body_done (GObject *source,
+                 GAsyncResult *result,
+                 gpointer user_data)
+{
+	ExchangeBodyFetch *fetch = user_data;
+	ExchangeBodyPipeline *pipeline = fetch->pipeline;
+	SoupBuffer *response = NULL;
+	E2kHTTPStatus status;
+	const gchar *modtime, *uid;
+
+	status = e2k_context_get_finish (pipeline->ctx, result, NULL, &response);
+	if (SOUP_STATUS_IS_SUCCESSFUL (status)) {
+		modtime = g_hash_table_lookup (pipeline->modtimes, fetch->href);
+		uid = g_hash_table_lookup (pipeline->attachments, fetch->href);
+
+		add_ical (pipeline->cbex, fetch->href, modtime, uid,
+			  response->data, response->length, 0);
+		soup_buffer_free (response);
+	} else if (E2K_HTTP_STATUS_IS_TRANSPORT_ERROR (status) ||
+		   status == E2K_HTTP_UNAUTHORIZED ||
+		   status == E2K_HTTP_TIMEOUT) {
+		pipeline->status = status;
+		pipeline->stored = FALSE;
+	} else if (status != E2K_HTTP_NOT_FOUND && status != SOUP_STATUS_GONE)
+		pipeline->stored = FALSE;
+
+	g_free (fetch);
+	pipeline->in_flight--;
+
+	if (pipeline->next < pipeline->hrefs->len &&
+	    SOUP_STATUS_IS_SUCCESSFUL (pipeline->status))
+		fetch_body_next (pipeline);
+	else if (!pipeline->in_flight)
+		g_main_loop_quit (pipeline->loop);
+}
+
+/* Returns an error only if the connection or session failed. *stored
+ * is set to whether every body was fetched, or found to be gone.
+ */
+static E2kHTTPStatus
+fetch_bodies (ECalBackendExchange *cbex,
+              E2kContext *ctx,
+              GPtrArray *hrefs,
+              GHashTable *modtimes,
+              GHashTable *attachments,
+              gboolean *stored)
+{
+	ExchangeBodyPipeline pipeline;
+	GMainContext *context;
+	gint i, window;
+
+	*stored = TRUE;
+	if (!hrefs->len)
+		return SOUP_STATUS_OK;
+
+	memset (&pipeline, 0, sizeof (pipeline));
+	pipeline.cbex = cbex;
+	pipeline.ctx = ctx;
+	pipeline.hrefs = hrefs;
+	pipeline.modtimes = modtimes;
+	pipeline.attachments = attachments;
+	pipeline.status = SOUP_STATUS_OK;
+	pipeline.stored = TRUE;
+
+	/* The GETs complete in the thread-default context of the
+	 * thread that started them, so give this one its own.
+	 */
+	context = g_main_context_new ();
+	g_main_context_push_thread_default (context);
+	pipeline.loop = g_main_loop_new (context, FALSE);
+
+	window = MIN (MAX (e2k_context_get_max_parallel (ctx), 1), hrefs->len);
+	for (i = 0; i < window; i++)
+		fetch_body_next (&pipeline);
+	g_main_loop_run (pipeline.loop);
+
+	g_main_loop_unref (pipeline.loop);
+	g_main_context_pop_thread_default (context);
+	g_main_context_unref (context);
+
+	*stored = pipeline.stored;
+	return pipeline.status;
+}
+
 static guint
 get_changed_events (ECalBackendExchange *cbex)
 {
 	GPtrArray *hrefs;
 	GHashTable *modtimes;
 	GHashTable *attachments;
-	E2kRestriction *rn;
+	E2kRestriction *rn, *search_rn;
 	E2kResultIter *iter;
 	E2kResult *result;
 	const gchar *uid, *modtime, *attach_prop, *receipts, *rid;
 	guint status;
 	E2kContext *ctx;
 	gint i, status_tracking = EX_NO_RECEIPTS;
-	const gchar *since = NULL;
+	gchar *since;
+	gboolean complete, stored;
 	ECalBackendExchangeCalendar *cbexc = E_CAL_BACKEND_EXCHANGE_CALENDAR (cbex);
 
 	g_return_val_if_fail (E_IS_CAL_BACKEND_EXCHANGE (cbex), SOUP_STATUS_CANCELLED);
@@ -383,35 +512,50 @@ get_changed_events (ECalBackendExchange *cbex)
 					   cbex->private_item_restriction,
 					   NULL);
 	}
-	e_cal_backend_exchange_cache_lock (cbex);
+
+	hrefs = g_ptr_array_new ();
+	modtimes = g_hash_table_new_full (g_str_hash, g_str_equal,
+					  g_free, g_free);
+	attachments = g_hash_table_new_full (g_str_hash, g_str_equal,
+					  g_free, g_free);
+
+	/* Look only at what changed since the last sync if we can */
+	since = e_cal_backend_exchange_cache_delta_start (cbex, rn);
+
 	if (since) {
-		rn = e2k_restriction_andv (
+		e2k_restriction_ref (rn);
+		search_rn = e2k_restriction_andv (
 			rn,
 			e2k_restriction_prop_date (E2K_PR_DAV_LAST_MODIFIED,
-						   E2K_RELOP_GT, since),
+						   E2K_RELOP_GE, since),
 			NULL);
-	} else
+	} else {
+		e_cal_backend_exchange_cache_lock (cbex);
 		e_cal_backend_exchange_cache_sync_start (cbex);
-	e_cal_backend_exchange_cache_unlock (cbex);
+		e_cal_backend_exchange_cache_unlock (cbex);
+
+		e2k_restriction_ref (rn);
+		search_rn = rn;
+	}
 
 	iter = e_folder_exchange_search_start (cbex->folder, NULL,
 					       event_properties,
 					       n_event_properties,
-					       rn, NULL, TRUE);
-	e2k_restriction_unref (rn);
+					       search_rn, NULL, TRUE);
+	e2k_restriction_unref (search_rn);
 
-	hrefs = g_ptr_array_new ();
-	modtimes = g_hash_table_new_full (g_str_hash, g_str_equal,
-					  g_free, g_free);
-	attachments = g_hash_table_new_full (g_str_hash, g_str_equal,
-					  g_free, g_free);
 	while ((result = e2k_result_iter_next (iter))) {
+		modtime = e2k_properties_get_prop (result->props,
+						   E2K_PR_DAV_LAST_MODIFIED);
+
+		e_cal_backend_exchange_cache_lock (cbex);
+		e_cal_backend_exchange_cache_sync_row (cbex, modtime);
+		e_cal_backend_exchange_cache_unlock (cbex);
+
 		uid = e2k_properties_get_prop (result->props,
 						E2K_PR_CALENDAR_UID);
 		if (!uid)
 			continue;
-		modtime = e2k_properties_get_prop (result->props,
-						   E2K_PR_DAV_LAST_MODIFIED);
 		rid = e2k_properties_get_prop (result->props, PR_CAL_RECURRING_ID);
 
 		attach_prop = e2k_properties_get_prop (result->props,
@@ -433,7 +577,8 @@ get_changed_events (ECalBackendExchange *cbex)
 		}
 
 		e_cal_backend_exchange_cache_lock (cbex);
-		if (!e_cal_backend_exchange_in_cache (cbex, uid, modtime, result->href, rid)) {
+		if (!e_cal_backend_exchange_in_cache (cbex, uid, modtime, result->href, rid) &&
+		    !g_hash_table_lookup_extended (modtimes, result->href, NULL, NULL)) {
 			g_ptr_array_add (hrefs, g_strdup (result->href));
 			g_hash_table_insert (modtimes, g_strdup (result->href),
 					     g_strdup (modtime));
@@ -444,14 +589,21 @@ get_changed_events (ECalBackendExchange *cbex)
 		e_cal_backend_exchange_cache_unlock (cbex);
 	}
 	status = e2k_result_iter_free (iter);
+	complete = SOUP_STATUS_IS_SUCCESSFUL (status);
 
-	if (!SOUP_STATUS_IS_SUCCESSFUL (status)) {
-		if (!since) {
-			e_cal_backend_exchange_cache_lock (cbex);
-			e_cal_backend_exchange_cache_sync_end (cbex);
-			e_cal_backend_exchange_cache_unlock (cbex);
-		}
+	e_cal_backend_exchange_cache_lock (cbex);
+	if (since)
+		e_cal_backend_exchange_cache_delta_end (cbex, complete);
+	else
+		e_cal_backend_exchange_cache_sync_end (cbex, complete);
+	e_cal_backend_exchange_cache_unlock (cbex);
 
+	e2k_restriction_unref (rn);
+	g_free (since);
+
+	if (!complete) {
+		for (i = 0; i < hrefs->len; i++)
+			g_free (hrefs->pdata[i]);
 		g_ptr_array_free (hrefs, TRUE);
 		g_hash_table_destroy (modtimes);
 		g_hash_table_destroy (attachments);
@@ -460,13 +612,8 @@ get_changed_events (ECalBackendExchange *cbex)
 		return status;
 	}
 
-	if (!since) {
-		e_cal_backend_exchange_cache_lock (cbex);
-		e_cal_backend_exchange_cache_sync_end (cbex);
-		e_cal_backend_exchange_cache_unlock (cbex);
-	}
-
 	if (!hrefs->len) {
+		e_cal_backend_exchange_cache_sync_commit (cbex, TRUE);
 		g_ptr_array_free (hrefs, TRUE);
 		g_hash_table_destroy (modtimes);
 		g_hash_table_destroy (attachments);
@@ -483,6 +630,7 @@ get_changed_events (ECalBackendExchange *cbex)
 						  (const gchar **) hrefs->pdata,
 						  hrefs->len,
 						  new_event_properties, n_new_event_properties);
+	e2k_result_iter_set_read_ahead (iter, E_CAL_BACKEND_EXCHANGE_READ_AHEAD);
 	for (i = 0; i < hrefs->len; i++)
 		g_free (hrefs->pdata[i]);
 	g_ptr_array_set_size (hrefs, 0);
@@ -523,6 +671,7 @@ get_changed_events (ECalBackendExchange *cbex)
 	status = e2k_result_iter_free (iter);
 
 	if (!SOUP_STATUS_IS_SUCCESSFUL (status)) {
+		e_cal_backend_exchange_cache_sync_commit (cbex, FALSE);
 		g_ptr_array_free (hrefs, TRUE);
 		g_hash_table_destroy (modtimes);
 		g_hash_table_destroy (attachments);
@@ -531,6 +680,7 @@ get_changed_events (ECalBackendExchange *cbex)
 		return status;
 	}
 	if (!hrefs->len) {
+		e_cal_backend_exchange_cache_sync_commit (cbex, TRUE);
 		g_ptr_array_free (hrefs, TRUE);
 		g_hash_table_destroy (modtimes);
 		g_hash_table_destroy (attachments);
@@ -543,26 +693,19 @@ get_changed_events (ECalBackendExchange *cbex)
 	/* Get the remaining ones the hard way */
 	ctx = exchange_account_get_context (cbex->account);
 	if (!ctx) {
+		e_cal_backend_exchange_cache_sync_commit (cbex, FALSE);
+		for (i = 0; i < hrefs->len; i++)
+			g_free (hrefs->pdata[i]);
+		g_ptr_array_free (hrefs, TRUE);
+		g_hash_table_destroy (modtimes);
+		g_hash_table_destroy (attachments);
 		g_mutex_unlock (cbexc->priv->mutex);
 		g_object_unref (cbexc);
 		/* This either means we lost connection or we are in offline mode */
 		return SOUP_STATUS_CANT_CONNECT;
 	}
-	for (i = 0; i < hrefs->len; i++) {
-		SoupBuffer *response;
-
-		status = e2k_context_get (ctx, NULL, hrefs->pdata[i],
-					  NULL, &response);
-		if (!SOUP_STATUS_IS_SUCCESSFUL (status))
-			continue;
-		modtime = g_hash_table_lookup (modtimes, hrefs->pdata[i]);
-
-		uid = g_hash_table_lookup (attachments, hrefs->pdata[i]);
-
-		add_ical (cbex, hrefs->pdata[i], modtime, uid,
-			  response->data, response->length, 0);
-		soup_buffer_free (response);
-	}
+	status = fetch_bodies (cbex, ctx, hrefs, modtimes, attachments, &stored);
+	e_cal_backend_exchange_cache_sync_commit (cbex, stored);
 
 	for (i = 0; i < hrefs->len; i++)
 		g_free (hrefs->pdata[i]);
@@ -587,7 +587,7 @@ static guint
 get_changed_tasks (ECalBackendExchange *cbex)
 {
 	ECalBackendExchangeComponent *ecalbexcomp;
-	E2kRestriction *rn;
+	E2kRestriction *rn, *search_rn;
 	E2kResultIter *iter;
 	GPtrArray *hrefs, *array;
 	GHashTable *modtimes, *attachments;
@@ -604,7 +604,8 @@ get_changed_tasks (ECalBackendExchange *cbex)
 	const icaltimezone *itzone;
 	ECalComponentDateTime ecdatetime;
 	icalcomponent *icalcomp;
-	const gchar *since = NULL;
+	gchar *since;
+	gboolean complete, stored = TRUE;
 	ECalBackendExchangeTasks *cbext = E_CAL_BACKEND_EXCHANGE_TASKS (cbex);
 
 	g_return_val_if_fail (E_IS_CAL_BACKEND_EXCHANGE (cbex), SOUP_STATUS_CANCELLED);
@@ -615,36 +616,51 @@ get_changed_tasks (ECalBackendExchange *cbex)
 					  E2K_RELOP_EQ,
 					  "urn:content-classes:task");
 
-	e_cal_backend_exchange_cache_lock (cbex);
-	if (since) {
-		rn = e2k_restriction_andv (rn,
-					   e2k_restriction_prop_date (
-						   E2K_PR_DAV_LAST_MODIFIED,
-						   E2K_RELOP_GT,
-						   since),
-					   NULL);
-	} else
-		e_cal_backend_exchange_cache_sync_start (cbex);
-	e_cal_backend_exchange_cache_unlock (cbex);
-
 	if (cbex->private_item_restriction) {
 		e2k_restriction_ref (cbex->private_item_restriction);
 		rn = e2k_restriction_andv (rn, cbex->private_item_restriction, NULL);
 	}
 
-	iter = e_folder_exchange_search_start (cbex->folder, NULL,
-					       task_props,
-					       G_N_ELEMENTS (task_props),
-					       rn, NULL, TRUE);
-	e2k_restriction_unref (rn);
-
 	hrefs = g_ptr_array_new ();
 	modtimes = g_hash_table_new_full (g_str_hash, g_str_equal,
 					  g_free, g_free);
 	attachments = g_hash_table_new_full (g_str_hash, g_str_equal,
 					  g_free, g_free);
 
+	/* Look only at what changed since the last sync if we can */
+	since = e_cal_backend_exchange_cache_delta_start (cbex, rn);
+
+	if (since) {
+		e2k_restriction_ref (rn);
+		search_rn = e2k_restriction_andv (rn,
+						  e2k_restriction_prop_date (
+							  E2K_PR_DAV_LAST_MODIFIED,
+							  E2K_RELOP_GE,
+							  since),
+						  NULL);
+	} else {
+		e_cal_backend_exchange_cache_lock (cbex);
+		e_cal_backend_exchange_cache_sync_start (cbex);
+		e_cal_backend_exchange_cache_unlock (cbex);
+
+		e2k_restriction_ref (rn);
+		search_rn = rn;
+	}
+
+	iter = e_folder_exchange_search_start (cbex->folder, NULL,
+					       task_props,
+					       G_N_ELEMENTS (task_props),
+					       search_rn, NULL, TRUE);
+	e2k_restriction_unref (search_rn);
+
 	while ((result = e2k_result_iter_next (iter))) {
+		modtime = e2k_properties_get_prop (result->props,
+						   E2K_PR_DAV_LAST_MODIFIED);
+
+		e_cal_backend_exchange_cache_lock (cbex);
+		e_cal_backend_exchange_cache_sync_row (cbex, modtime);
+		e_cal_backend_exchange_cache_unlock (cbex);
+
 		uid = e2k_properties_get_prop (result->props,
 					       E2K_PR_CALENDAR_UID);
 		if (!uid) {
@@ -659,11 +675,9 @@ get_changed_tasks (ECalBackendExchange *cbex)
 		e_cal_component_set_icalcomponent (ecal, icalcomp);
 		e_cal_component_set_uid (ecal, (const gchar *) uid);
 
-		modtime = e2k_properties_get_prop (result->props,
-						   E2K_PR_DAV_LAST_MODIFIED);
-
 		e_cal_backend_exchange_cache_lock (cbex);
-		if (!e_cal_backend_exchange_in_cache (cbex, uid, modtime, result->href, NULL)) {
+		if (!e_cal_backend_exchange_in_cache (cbex, uid, modtime, result->href, NULL) &&
+		    !g_hash_table_lookup_extended (modtimes, result->href, NULL, NULL)) {
 			g_ptr_array_add (hrefs, g_strdup (result->href));
 			g_hash_table_insert (modtimes, g_strdup (result->href),
 					     g_strdup (modtime));
@@ -872,11 +886,21 @@ get_changed_tasks (ECalBackendExchange *cbex)
 		g_object_unref (ecal);
 	} /* End while */
 	status = e2k_result_iter_free (iter);
+	complete = SOUP_STATUS_IS_SUCCESSFUL (status);
 
-	if (!SOUP_STATUS_IS_SUCCESSFUL (status)) {
-		if (!since)
-			e_cal_backend_exchange_cache_sync_end (cbex);
+	e_cal_backend_exchange_cache_lock (cbex);
+	if (since)
+		e_cal_backend_exchange_cache_delta_end (cbex, complete);
+	else
+		e_cal_backend_exchange_cache_sync_end (cbex, complete);
+	e_cal_backend_exchange_cache_unlock (cbex);
+
+	e2k_restriction_unref (rn);
+	g_free (since);
 
+	if (!complete) {
+		for (i = 0; i < hrefs->len; i++)
+			g_free (hrefs->pdata[i]);
 		g_ptr_array_free (hrefs, TRUE);
 		g_hash_table_destroy (modtimes);
 		g_hash_table_destroy (attachments);
@@ -885,12 +909,8 @@ get_changed_tasks (ECalBackendExchange *cbex)
 		return status;
 	}
 
-	e_cal_backend_exchange_cache_lock (cbex);
-	if (!since)
-		e_cal_backend_exchange_cache_sync_end (cbex);
-	e_cal_backend_exchange_cache_unlock (cbex);
-
 	if (!hrefs->len) {
+		e_cal_backend_exchange_cache_sync_commit (cbex, TRUE);
 		g_ptr_array_free (hrefs, TRUE);
 		g_hash_table_destroy (modtimes);
 		g_hash_table_destroy (attachments);
@@ -904,6 +924,7 @@ get_changed_tasks (ECalBackendExchange *cbex)
 	iter = e_folder_exchange_bpropfind_start (cbex->folder, NULL,
 						(const gchar **) hrefs->pdata,
 						hrefs->len, &prop, 1);
+	e2k_result_iter_set_read_ahead (iter, E_CAL_BACKEND_EXCHANGE_READ_AHEAD);
 	for (i = 0; i < hrefs->len; i++)
 		g_free (hrefs->pdata[i]);
 	g_ptr_array_set_size (hrefs, 0);
@@ -939,6 +960,7 @@ get_changed_tasks (ECalBackendExchange *cbex)
 	status = e2k_result_iter_free (iter);
 
 	if (!SOUP_STATUS_IS_SUCCESSFUL (status)) {
+		e_cal_backend_exchange_cache_sync_commit (cbex, FALSE);
 		g_ptr_array_free (hrefs, TRUE);
 		g_hash_table_destroy (attachments);
 		g_mutex_unlock (cbext->priv->mutex);
@@ -947,6 +969,7 @@ get_changed_tasks (ECalBackendExchange *cbex)
 	}
 
 	if (!hrefs->len) {
+		e_cal_backend_exchange_cache_sync_commit (cbex, TRUE);
 		g_ptr_array_free (hrefs, TRUE);
 		g_hash_table_destroy (attachments);
 		cbext->priv->is_loaded = TRUE;
@@ -957,6 +980,12 @@ get_changed_tasks (ECalBackendExchange *cbex)
 
 	ctx = exchange_account_get_context (cbex->account);
 	if (!ctx) {
+		e_cal_backend_exchange_cache_sync_commit (cbex, FALSE);
+		for (i = 0; i < hrefs->len; i++)
+			g_free (hrefs->pdata[i]);
+		g_ptr_array_free (hrefs, TRUE);
+		g_hash_table_destroy (modtimes);
+		g_hash_table_destroy (attachments);
 		g_mutex_unlock (cbext->priv->mutex);
 		g_object_unref (cbext);
 		/* This either means we lost connection or we are in offline mode */
@@ -968,8 +997,19 @@ get_changed_tasks (ECalBackendExchange *cbex)
 
 		status = e2k_context_get (ctx, NULL, hrefs->pdata[i],
 					  NULL, &response);
-		if (!SOUP_STATUS_IS_SUCCESSFUL (status))
+		if (E2K_HTTP_STATUS_IS_TRANSPORT_ERROR (status) ||
+		    status == E2K_HTTP_UNAUTHORIZED ||
+		    status == E2K_HTTP_TIMEOUT) {
+			stored = FALSE;
+			break;
+		}
+		if (!SOUP_STATUS_IS_SUCCESSFUL (status)) {
+			/* One that has gone since the SEARCH is done with */
+			if (status != E2K_HTTP_NOT_FOUND && status != SOUP_STATUS_GONE)
+				stored = FALSE;
+			status = SOUP_STATUS_OK;
 			continue;
+		}
 		uid = g_hash_table_lookup (attachments, hrefs->pdata[i]);
 		e_cal_backend_exchange_cache_lock (cbex);
 		/* Fetch component from cache and update it */
@@ -989,6 +1029,8 @@ get_changed_tasks (ECalBackendExchange *cbex)
 		soup_buffer_free (response);
 	}
 
+	e_cal_backend_exchange_cache_sync_commit (cbex, stored);
+
 	for (i = 0; i < hrefs->len; i++)
 		g_free (hrefs->pdata[i]);
 	g_ptr_array_free (hrefs, TRUE);
@@ -37,7 +37,11 @@
 
 #include <camel/camel.h>
 
+#include <libedata-cal/e-cal-backend-intervaltree.h>
+
 #include "e-cal-backend-exchange.h"
+#include "e2k-cal-match.h"
+#include "e2k-cal-store.h"
 #include "e2k-cal-utils.h"
 #include <e2k-uri.h>
 
@@ -61,10 +65,35 @@ struct ECalBackendExchangePrivate {
 	gboolean read_only;
 	gboolean is_loaded;
 
-	/* Objects */
+	/* Objects. Only those that have been used since the cache
+	 * was opened are in @objects; the rest are still in @store.
+	 */
 	GHashTable *objects, *cache_unseen;
 	gchar *object_cache_file;
+	E2kCalStore *store;
+
+	/* UIDs whose objects have changed since the last save */
+	GHashTable *dirty;
+
+	/* When each object's occurrences start and end, by UID, for
+	 * time range queries. Built the first time one is made.
+	 */
+	EIntervalTree *interval_tree;
+
+	/* What the last complete sync saw: the newest
+	 * DAV:getlastmodified, and how many items there were.
+	 */
 	gchar *lastmod;
+	gint sync_count;
+
+	/* The sync in progress. Once its SEARCH has been read, the
+	 * watermark stays pending until the bodies it asked for have
+	 * been stored too.
+	 */
+	gboolean sync_delta;
+	gboolean sync_pending;
+	gint sync_rows;
+	gchar *sync_lastmod;
 	guint save_timeout_id;
 	GMutex *set_lock;
 	GMutex *open_lock;
@@ -76,8 +105,24 @@ struct ECalBackendExchangePrivate {
 
 #define d(x)
 
+/* Where the sync state was kept in cache.ics, before the store */
+#define SYNC_LASTMOD_PROP "X-EVOLUTION-EXCHANGE-SYNC-LASTMOD"
+#define SYNC_COUNT_PROP   "X-EVOLUTION-EXCHANGE-SYNC-COUNT"
+
+/* How far back from the last sync an incremental one starts, in case
+ * something saved just before it turned up just after.
+ */
+#define SYNC_OVERLAP (5 * 60)
+
 static icaltimezone *
 internal_get_timezone (ECalBackend *backend, const gchar *tzid);
+static gboolean timeout_save_cache (gpointer user_data);
+static gboolean get_comp_range (ECalBackendExchange *cbex,
+				ECalBackendExchangeComponent *ecomp,
+				time_t *start, time_t *end);
+static void insert_interval (ECalBackendExchange *cbex, const gchar *uid,
+			     time_t start, time_t end);
+static gboolean uncache (gpointer key, gpointer value, gpointer data);
 
 G_DEFINE_TYPE (
 	ECalBackendExchange,
@@ -155,17 +200,83 @@ get_cal_owner (ECalBackendSync *backend,
 	*name = g_strdup (hier->owner_name);
 }
 
+/* Reads in the cache.ics that older versions kept everything in */
+static gboolean
+import_ics_cache (ECalBackendExchange *cbex,
+                  GError **perror)
+{
+	icalcomponent *vcalcomp, *comp, *tmp_comp;
+	struct icaltimetype comp_last_mod;
+	icalcomponent_kind kind;
+	icalproperty *prop;
+	gchar *lastmod;
+
+	vcalcomp = e_cal_util_parse_ics_file (cbex->priv->object_cache_file);
+	if (!vcalcomp) {
+		g_propagate_error (perror, EDC_ERROR (InvalidObject));
+		return FALSE;
+	}
+
+	if (icalcomponent_isa (vcalcomp) != ICAL_VCALENDAR_COMPONENT) {
+		icalcomponent_free (vcalcomp);
+		g_propagate_error (perror, EDC_ERROR (InvalidObject));
+		return FALSE;
+	}
+
+	kind = e_cal_backend_get_kind (E_CAL_BACKEND (cbex));
+
+	for (comp = icalcomponent_get_first_component (vcalcomp, kind);
+	     comp;
+	     comp = icalcomponent_get_next_component (vcalcomp, kind)) {
+		prop = icalcomponent_get_first_property (comp, ICAL_LASTMODIFIED_PROPERTY);
+		if (prop)
+			comp_last_mod = icalproperty_get_lastmodified (prop);
+
+		lastmod = e2k_timestamp_from_icaltime (comp_last_mod);
+		e_cal_backend_exchange_add_object (cbex, NULL, lastmod, comp);
+		g_free (lastmod);
+	}
+
+	/* The LAST-MODIFIED values above are the clients' idea of
+	 * the time, so the sync state is only taken from what we
+	 * saved ourselves.
+	 */
+	for (prop = icalcomponent_get_first_property (vcalcomp, ICAL_X_PROPERTY);
+	     prop;
+	     prop = icalcomponent_get_next_property (vcalcomp, ICAL_X_PROPERTY)) {
+		const gchar *x_name = icalproperty_get_x_name (prop);
+
+		if (!strcmp (x_name, SYNC_LASTMOD_PROP)) {
+			g_free (cbex->priv->lastmod);
+			cbex->priv->lastmod = g_strdup (icalproperty_get_x (prop));
+		} else if (!strcmp (x_name, SYNC_COUNT_PROP))
+			cbex->priv->sync_count = atoi (icalproperty_get_x (prop));
+	}
+
+	for (comp = icalcomponent_get_first_component (vcalcomp, ICAL_VTIMEZONE_COMPONENT);
+	     comp;
+	     comp = icalcomponent_get_next_component (vcalcomp, ICAL_VTIMEZONE_COMPONENT)) {
+		tmp_comp = icalcomponent_new_clone (comp);
+		if (tmp_comp) {
+			e_cal_backend_exchange_add_timezone (cbex, tmp_comp, perror);
+			icalcomponent_free (tmp_comp);
+		}
+	}
+
+	icalcomponent_free (vcalcomp);
+	return !perror || !*perror;
+}
+
 static gboolean
 load_cache (ECalBackendExchange *cbex,
             E2kUri *e2kuri,
             GError **perror)
 {
 	ESource *source;
-	icalcomponent *vcalcomp, *comp, *tmp_comp;
-	struct icaltimetype comp_last_mod, folder_last_mod;
-	icalcomponent_kind kind;
-	icalproperty *prop;
-	gchar *lastmod, *mangled_uri, *storage_dir, *local_store;
+	E2kCalStore *store;
+	icalcomponent *comp;
+	GSList *timezones, *l;
+	gchar *mangled_uri, *storage_dir, *local_store, *store_file;
 	const gchar *user_cache_dir;
 	const gchar *uristr;
 	gint i;
@@ -234,65 +345,52 @@ load_cache (ECalBackendExchange *cbex,
 	g_free (mangled_uri);
 	g_free (local_store);
 
-       /* Check if the cache file is present. If it is not present the account might
-	  be newly created one. It will be created while save the cache */
-       if (!g_file_test (cbex->priv->object_cache_file, G_FILE_TEST_EXISTS))
-	       return TRUE;
+	if (cbex->priv->store)
+		return TRUE;
 
-	vcalcomp = e_cal_util_parse_ics_file (cbex->priv->object_cache_file);
-	if (!vcalcomp) {
-		g_propagate_error (perror, EDC_ERROR (InvalidObject));
-		return FALSE;
-	}
-
-	if (icalcomponent_isa (vcalcomp) != ICAL_VCALENDAR_COMPONENT) {
-		icalcomponent_free (vcalcomp);
-		g_propagate_error (perror, EDC_ERROR (InvalidObject));
+	store_file = e_folder_exchange_get_storage_file (cbex->folder, "cache.db");
+	store = store_file ? e2k_cal_store_open (store_file) : NULL;
+	g_free (store_file);
+	if (!store) {
+		g_propagate_error (perror, EDC_ERROR (OfflineUnavailable));
 		return FALSE;
 	}
 
-	kind = e_cal_backend_get_kind (E_CAL_BACKEND (cbex));
-
-	folder_last_mod = icaltime_null_time ();
-	for (comp = icalcomponent_get_first_component (vcalcomp, kind);
-	     comp;
-	     comp = icalcomponent_get_next_component (vcalcomp, kind)) {
-		prop = icalcomponent_get_first_property (comp, ICAL_LASTMODIFIED_PROPERTY);
-		if (prop) {
-			comp_last_mod = icalproperty_get_lastmodified (prop);
-			if (icaltime_compare (comp_last_mod, folder_last_mod) > 0)
-				folder_last_mod = comp_last_mod;
-		}
+	/* Move an old cache.ics over into the new store */
+	if (e2k_cal_store_is_empty (store) &&
+	    g_file_test (cbex->priv->object_cache_file, G_FILE_TEST_EXISTS)) {
+		cbex->priv->store = store;
+		if (!import_ics_cache (cbex, perror))
+			return FALSE;
 
-		lastmod = e2k_timestamp_from_icaltime (comp_last_mod);
-		e_cal_backend_exchange_add_object (cbex, NULL, lastmod, comp);
-		g_free (lastmod);
+		if (cbex->priv->save_timeout_id)
+			g_source_remove (cbex->priv->save_timeout_id);
+		timeout_save_cache (cbex);
+		g_unlink (cbex->priv->object_cache_file);
+		return TRUE;
 	}
-	cbex->priv->lastmod = e2k_timestamp_from_icaltime (folder_last_mod);
 
-	for (comp = icalcomponent_get_first_component (vcalcomp, ICAL_VTIMEZONE_COMPONENT);
-	     comp;
-	     comp = icalcomponent_get_next_component (vcalcomp, ICAL_VTIMEZONE_COMPONENT)) {
-		tmp_comp = icalcomponent_new_clone (comp);
-		if (tmp_comp) {
-			e_cal_backend_exchange_add_timezone (cbex, tmp_comp, perror);
-			icalcomponent_free (tmp_comp);
+	/* Only the timezones are read now; objects are read from the
+	 * store as they are needed.
+	 */
+	timezones = e2k_cal_store_get_timezones (store);
+	for (l = timezones; l; l = l->next) {
+		comp = icalcomponent_new_from_string (l->data);
+		if (comp) {
+			e_cal_backend_exchange_add_timezone (cbex, comp, NULL);
+			icalcomponent_free (comp);
 		}
 	}
+	g_slist_free_full (timezones, g_free);
 
-	icalcomponent_free (vcalcomp);
-	return !perror || !*perror;
-}
-
-static void
-save_timezone (gpointer key,
-               gpointer tz,
-               gpointer vcalcomp)
-{
-	icalcomponent *tzcomp;
+	e_cal_backend_exchange_cache_lock (cbex);
+	g_free (cbex->priv->lastmod);
+	e2k_cal_store_get_sync_state (store, &cbex->priv->lastmod,
+				      &cbex->priv->sync_count);
+	e_cal_backend_exchange_cache_unlock (cbex);
 
-	tzcomp = icalcomponent_new_clone (icaltimezone_get_component (tz));
-	icalcomponent_add_component (vcalcomp, tzcomp);
+	cbex->priv->store = store;
+	return TRUE;
 }
 
 static void
@@ -317,39 +415,65 @@ save_object (gpointer key,
 	}
 }
 
+/* Writes out the objects that have changed since the last save */
 static gboolean
 timeout_save_cache (gpointer user_data)
 {
 	ECalBackendExchange *cbex = user_data;
+	ECalBackendExchangeComponent *ecomp;
 	icalcomponent *vcalcomp;
-	gchar *data = NULL, *tmpfile;
-	gsize len, nwrote;
-	FILE *f;
+	GHashTableIter iter;
+	gpointer uid;
+	gchar *data;
+	time_t start, end;
+	gboolean have_range;
 
 	d(printf("timeout_save_cache\n"));
 	cbex->priv->save_timeout_id = 0;
 
-	vcalcomp = e_cal_util_new_top_level ();
-	g_hash_table_foreach (cbex->priv->timezones, save_timezone, vcalcomp);
-	g_hash_table_foreach (cbex->priv->objects, save_object, vcalcomp);
-	data = icalcomponent_as_ical_string_r (vcalcomp);
-	icalcomponent_free (vcalcomp);
+	if (!cbex->priv->store)
+		return FALSE;
 
-	tmpfile = g_strdup_printf ("%s~", cbex->priv->object_cache_file);
-	f = g_fopen (tmpfile, "wb");
-	if (!f)
-		goto error;
+	g_mutex_lock (cbex->priv->cache_lock);
 
-	len = strlen (data);
-	nwrote = fwrite (data, 1, len, f);
-	if (fclose (f) != 0 || nwrote != len)
-		goto error;
+	g_hash_table_iter_init (&iter, cbex->priv->dirty);
+	while (g_hash_table_iter_next (&iter, &uid, NULL)) {
+		ecomp = g_hash_table_lookup (cbex->priv->objects, uid);
+		if (!ecomp) {
+			e2k_cal_store_remove_object (cbex->priv->store, uid);
+			continue;
+		}
 
-	if (g_rename (tmpfile, cbex->priv->object_cache_file) != 0)
-		g_unlink (tmpfile);
-error:
-	g_free (tmpfile);
-	g_free (data);
+		vcalcomp = e_cal_util_new_top_level ();
+		save_object (uid, ecomp, vcalcomp);
+		data = icalcomponent_as_ical_string_r (vcalcomp);
+		icalcomponent_free (vcalcomp);
+
+		/* This also catches anything changed in place through
+		 * get_exchange_comp().
+		 */
+		have_range = get_comp_range (cbex, ecomp, &start, &end);
+		if (!have_range)
+			start = end = 0;
+		if (cbex->priv->interval_tree) {
+			e_intervaltree_remove (cbex->priv->interval_tree, uid, NULL);
+			if (have_range)
+				insert_interval (cbex, uid, start, end);
+		}
+
+		e2k_cal_store_put_object (cbex->priv->store, uid,
+					  ecomp->href, ecomp->lastmod,
+					  start, end, data);
+		g_free (data);
+	}
+	g_hash_table_remove_all (cbex->priv->dirty);
+
+	e2k_cal_store_set_sync_state (cbex->priv->store, cbex->priv->lastmod,
+				      cbex->priv->sync_count);
+
+	g_mutex_unlock (cbex->priv->cache_lock);
+
+	e2k_cal_store_flush (cbex->priv->store);
 	return FALSE;
 }
 
@@ -366,6 +490,218 @@ save_cache (ECalBackendExchange *cbex)
 						     cbex);
 }
 
+static void
+mark_dirty (ECalBackendExchange *cbex,
+            const gchar *uid)
+{
+	g_hash_table_insert (cbex->priv->dirty, g_strdup (uid), NULL);
+}
+
+/* Returns @uid's object, reading it in from the store if it hasn't
+ * been used since the cache was opened.
+ */
+static ECalBackendExchangeComponent *
+lookup_comp (ECalBackendExchange *cbex,
+             const gchar *uid)
+{
+	ECalBackendExchangeComponent *ecomp;
+	icalcomponent *vcalcomp, *comp;
+	icalcomponent_kind kind;
+	gchar *data, *href = NULL, *lastmod = NULL;
+
+	ecomp = g_hash_table_lookup (cbex->priv->objects, uid);
+	if (ecomp || !cbex->priv->store)
+		return ecomp;
+
+	/* Anything changed since the last save is already in
+	 * @objects, unless it has been removed.
+	 */
+	if (g_hash_table_lookup_extended (cbex->priv->dirty, uid, NULL, NULL))
+		return NULL;
+
+	data = e2k_cal_store_get_object (cbex->priv->store, uid, &href, &lastmod);
+	if (!data)
+		return NULL;
+
+	vcalcomp = icalparser_parse_string (data);
+	g_free (data);
+	if (!vcalcomp) {
+		g_free (href);
+		g_free (lastmod);
+		return NULL;
+	}
+
+	ecomp = g_new0 (ECalBackendExchangeComponent, 1);
+	ecomp->uid = g_strdup (uid);
+	ecomp->href = href;
+	ecomp->lastmod = lastmod;
+
+	kind = e_cal_backend_get_kind (E_CAL_BACKEND (cbex));
+	for (comp = icalcomponent_get_first_component (vcalcomp, kind);
+	     comp;
+	     comp = icalcomponent_get_next_component (vcalcomp, kind)) {
+		if (icalcomponent_get_first_property (comp, ICAL_RECURRENCEID_PROPERTY)) {
+			ecomp->instances = g_list_prepend (ecomp->instances,
+							   icalcomponent_new_clone (comp));
+		} else if (!ecomp->icomp)
+			ecomp->icomp = icalcomponent_new_clone (comp);
+	}
+	icalcomponent_free (vcalcomp);
+
+	g_hash_table_insert (cbex->priv->objects, ecomp->uid, ecomp);
+	return ecomp;
+}
+
+/* Reads in everything that is still only in the store */
+static void
+lookup_all_comps (ECalBackendExchange *cbex)
+{
+	GPtrArray *uids;
+	gint i;
+
+	if (!cbex->priv->store)
+		return;
+
+	uids = e2k_cal_store_get_uids (cbex->priv->store);
+	for (i = 0; i < uids->len; i++)
+		lookup_comp (cbex, uids->pdata[i]);
+	g_ptr_array_free (uids, TRUE);
+}
+
+static icaltimezone *
+resolve_tzid (const gchar *tzid,
+              gpointer user_data)
+{
+	if (!tzid || !*tzid)
+		return NULL;
+
+	return internal_get_timezone (E_CAL_BACKEND (user_data), tzid);
+}
+
+static gboolean
+add_comp_range (ECalBackendExchange *cbex,
+                icalcomponent *icomp,
+                gboolean have_range,
+                time_t *start,
+                time_t *end)
+{
+	ECalComponent *comp;
+	time_t comp_start, comp_end;
+
+	comp = e_cal_component_new_from_icalcomponent (icalcomponent_new_clone (icomp));
+	if (!comp)
+		return have_range;
+
+	e_cal_util_get_component_occur_times (
+		comp, &comp_start, &comp_end,
+		resolve_tzid, cbex, icaltimezone_get_utc_timezone (),
+		e_cal_backend_get_kind (E_CAL_BACKEND (cbex)));
+	g_object_unref (comp);
+
+	if (!have_range || comp_start < *start)
+		*start = comp_start;
+	if (!have_range || comp_end > *end)
+		*end = comp_end;
+
+	return TRUE;
+}
+
+/* Works out when the first of @ecomp's occurrences starts and the
+ * last one ends, counting its recurrences and detached instances.
+ */
+static gboolean
+get_comp_range (ECalBackendExchange *cbex,
+                ECalBackendExchangeComponent *ecomp,
+                time_t *start,
+                time_t *end)
+{
+	gboolean have_range = FALSE;
+	GList *l;
+
+	if (ecomp->icomp)
+		have_range = add_comp_range (cbex, ecomp->icomp, have_range, start, end);
+	for (l = ecomp->instances; l; l = l->next)
+		have_range = add_comp_range (cbex, l->data, have_range, start, end);
+
+	return have_range;
+}
+
+static void
+insert_interval (ECalBackendExchange *cbex,
+                 const gchar *uid,
+                 time_t start,
+                 time_t end)
+{
+	ECalComponent *key;
+
+	/* The tree wants a component, but only the UID is needed
+	 * to find the object again.
+	 */
+	key = e_cal_component_new ();
+	e_cal_component_set_new_vtype (key, E_CAL_COMPONENT_EVENT);
+	e_cal_component_set_uid (key, uid);
+	e_intervaltree_insert (cbex->priv->interval_tree, start, end, key);
+	g_object_unref (key);
+}
+
+/* Brings @uid's entry in the time index up to date with @ecomp, or
+ * removes it if @ecomp is %NULL.
+ */
+static void
+update_interval_tree (ECalBackendExchange *cbex,
+                      const gchar *uid,
+                      ECalBackendExchangeComponent *ecomp)
+{
+	time_t start, end;
+
+	if (!cbex->priv->interval_tree)
+		return;
+
+	e_intervaltree_remove (cbex->priv->interval_tree, uid, NULL);
+	if (ecomp && get_comp_range (cbex, ecomp, &start, &end))
+		insert_interval (cbex, uid, start, end);
+}
+
+/* Builds the time index, using the times saved in the store for the
+ * objects that haven't been read in, so that they still needn't be.
+ */
+static void
+ensure_interval_tree (ECalBackendExchange *cbex)
+{
+	ECalBackendExchangeComponent *ecomp;
+	GHashTableIter iter;
+	GPtrArray *uids;
+	const gchar *uid;
+	time_t start, end;
+	gint i;
+
+	if (cbex->priv->interval_tree)
+		return;
+
+	cbex->priv->interval_tree = e_intervaltree_new ();
+
+	g_hash_table_iter_init (&iter, cbex->priv->objects);
+	while (g_hash_table_iter_next (&iter, (gpointer *) &uid, (gpointer *) &ecomp)) {
+		if (get_comp_range (cbex, ecomp, &start, &end))
+			insert_interval (cbex, uid, start, end);
+	}
+
+	if (!cbex->priv->store)
+		return;
+
+	uids = e2k_cal_store_get_uids (cbex->priv->store);
+	for (i = 0; i < uids->len; i++) {
+		uid = uids->pdata[i];
+		if (g_hash_table_lookup_extended (cbex->priv->objects, uid, NULL, NULL) ||
+		    g_hash_table_lookup_extended (cbex->priv->dirty, uid, NULL, NULL))
+			continue;
+
+		if (e2k_cal_store_get_object_range (cbex->priv->store, uid, &start, &end))
+			insert_interval (cbex, uid, start, end);
+	}
+	g_ptr_array_free (uids, TRUE);
+}
+
 static void
 open_calendar (ECalBackendSync *backend,
                EDataCal *cal,
@@ -557,9 +893,9 @@ authenticate_user (ECalBackendSync *backend,
 	} else
 		cbex->private_item_restriction = NULL;
 
-	status = e_folder_exchange_propfind (cbex->folder, NULL,
-					     &prop, 1,
-					     &results, &nresults);
+	status = e_folder_exchange_propfind_shared (cbex->folder, NULL,
+						    &prop, 1,
+						    &results, &nresults);
 	if (E2K_HTTP_STATUS_IS_SUCCESSFUL (status) && nresults >= 1) {
 		prop = e2k_properties_get_prop (results[0].props, PR_ACCESS);
 		if (prop)
@@ -632,7 +968,236 @@ e_cal_backend_exchange_cache_sync_start (ECalBackendExchange *cbex)
 	g_return_if_fail (cbex->priv->cache_unseen == NULL);
 
 	cbex->priv->cache_unseen = g_hash_table_new (NULL, NULL);
+	lookup_all_comps (cbex);
 	g_hash_table_foreach (cbex->priv->objects, add_to_unseen, cbex);
+
+	cbex->priv->sync_delta = FALSE;
+	cbex->priv->sync_pending = FALSE;
+	cbex->priv->sync_rows = 0;
+	g_free (cbex->priv->sync_lastmod);
+	cbex->priv->sync_lastmod = NULL;
+}
+
+/**
+ * e_cal_backend_exchange_cache_sync_row:
+ * @cbex: an #ECalBackendExchange
+ * @lastmod: the item's DAV:getlastmodified
+ *
+ * Counts an item returned by the SEARCH of a sync (whether or not it
+ * can be used), and moves the sync's watermark up to its @lastmod.
+ **/
+void
+e_cal_backend_exchange_cache_sync_row (ECalBackendExchange *cbex,
+                                       const gchar *lastmod)
+{
+	/* An incremental sync counted the items when it swept */
+	if (!cbex->priv->sync_delta)
+		cbex->priv->sync_rows++;
+
+	if (lastmod && (!cbex->priv->sync_lastmod ||
+			strcmp (lastmod, cbex->priv->sync_lastmod) > 0)) {
+		g_free (cbex->priv->sync_lastmod);
+		cbex->priv->sync_lastmod = g_strdup (lastmod);
+	}
+}
+
+/* Leaves the watermark of a sync whose SEARCH was read in full to be
+ * committed by e_cal_backend_exchange_cache_sync_commit(), or drops it.
+ */
+static void
+end_sync (ECalBackendExchange *cbex,
+          gboolean complete)
+{
+	cbex->priv->sync_pending = complete;
+	if (!complete) {
+		g_free (cbex->priv->sync_lastmod);
+		cbex->priv->sync_lastmod = NULL;
+	}
+}
+
+/**
+ * e_cal_backend_exchange_cache_sync_commit:
+ * @cbex: an #ECalBackendExchange
+ * @stored: whether every item the sync asked for was stored
+ *
+ * Finishes a sync once the bodies it found it needed have been
+ * fetched. Only if its SEARCH was complete and @stored is %TRUE does
+ * the next incremental sync start from its watermark; otherwise the
+ * next one looks at the same items again, so none are left behind.
+ *
+ * Call without the cache lock held.
+ **/
+void
+e_cal_backend_exchange_cache_sync_commit (ECalBackendExchange *cbex,
+                                          gboolean stored)
+{
+	e_cal_backend_exchange_cache_lock (cbex);
+
+	if (cbex->priv->sync_pending && stored) {
+		g_free (cbex->priv->lastmod);
+		cbex->priv->lastmod = cbex->priv->sync_lastmod;
+		cbex->priv->sync_lastmod = NULL;
+		cbex->priv->sync_count = cbex->priv->lastmod ? cbex->priv->sync_rows : -1;
+		save_cache (cbex);
+	} else {
+		g_free (cbex->priv->sync_lastmod);
+		cbex->priv->sync_lastmod = NULL;
+	}
+	cbex->priv->sync_pending = FALSE;
+
+	e_cal_backend_exchange_cache_unlock (cbex);
+}
+
+static const gchar *sweep_props[] = {
+	E2K_PR_CALENDAR_UID,
+	E2K_PR_DAV_UID
+};
+
+/* Lists just the uids of the folder's items matching @rn, and removes
+ * any cached object that isn't among them. Returns the number of
+ * items, or -1 if the SEARCH failed, in which case nothing is removed.
+ */
+static gint
+sweep_deleted (ECalBackendExchange *cbex,
+               E2kRestriction *rn)
+{
+	ECalBackendExchangeComponent *ecomp;
+	E2kResultIter *iter;
+	E2kResult *result;
+	E2kHTTPStatus status;
+	GHashTable *server_uids;
+	GHashTableIter hiter;
+	GPtrArray *uids;
+	const gchar *uid;
+	gint count = 0, i;
+
+	server_uids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+	iter = e_folder_exchange_search_start (cbex->folder, NULL,
+					       sweep_props,
+					       G_N_ELEMENTS (sweep_props),
+					       rn, NULL, TRUE);
+	while ((result = e2k_result_iter_next (iter))) {
+		count++;
+
+		uid = e2k_properties_get_prop (result->props, E2K_PR_CALENDAR_UID);
+		if (!uid)
+			uid = e2k_properties_get_prop (result->props, E2K_PR_DAV_UID);
+		if (uid)
+			g_hash_table_insert (server_uids, g_strdup (uid), NULL);
+	}
+	status = e2k_result_iter_free (iter);
+	if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status)) {
+		g_hash_table_destroy (server_uids);
+		return -1;
+	}
+
+	e_cal_backend_exchange_cache_lock (cbex);
+
+	/* Collect the candidates first, without reading in objects
+	 * from the store; only the ones that are gone get read, to
+	 * tell the views about them.
+	 */
+	uids = cbex->priv->store ? e2k_cal_store_get_uids (cbex->priv->store) : g_ptr_array_new_with_free_func (g_free);
+	g_hash_table_iter_init (&hiter, cbex->priv->objects);
+	while (g_hash_table_iter_next (&hiter, (gpointer *) &uid, NULL))
+		g_ptr_array_add (uids, g_strdup (uid));
+
+	for (i = 0; i < uids->len; i++) {
+		uid = uids->pdata[i];
+		if (g_hash_table_lookup_extended (server_uids, uid, NULL, NULL))
+			continue;
+
+		ecomp = lookup_comp (cbex, uid);
+		if (!ecomp)
+			continue;
+
+		uncache (ecomp->uid, ecomp, cbex);
+		mark_dirty (cbex, uid);
+		update_interval_tree (cbex, uid, NULL);
+		g_hash_table_remove (cbex->priv->objects, uid);
+	}
+
+	e_cal_backend_exchange_cache_unlock (cbex);
+
+	g_ptr_array_free (uids, TRUE);
+	g_hash_table_destroy (server_uids);
+
+	return count;
+}
+
+/**
+ * e_cal_backend_exchange_cache_delta_start:
+ * @cbex: an #ECalBackendExchange
+ * @rn: the restriction matching all of the folder's items
+ *
+ * Tries to start an incremental sync, which only looks at items
+ * modified since the last complete one. That can't see deletions, so
+ * this first lists just the uids of the folder's items, which is much
+ * cheaper than fetching their properties, and removes any cached
+ * object that is no longer among them.
+ *
+ * Call without the cache lock held.
+ *
+ * Return value: the timestamp to search from, or %NULL if a complete
+ * sync is needed.
+ **/
+gchar *
+e_cal_backend_exchange_cache_delta_start (ECalBackendExchange *cbex,
+                                          E2kRestriction *rn)
+{
+	gchar *lastmod, *since;
+	gint count;
+
+	e_cal_backend_exchange_cache_lock (cbex);
+	lastmod = g_strdup (cbex->priv->lastmod);
+	count = cbex->priv->sync_count;
+	e_cal_backend_exchange_cache_unlock (cbex);
+
+	if (!lastmod || count < 0) {
+		g_free (lastmod);
+		return NULL;
+	}
+
+	count = sweep_deleted (cbex, rn);
+	if (count < 0) {
+		g_free (lastmod);
+		return NULL;
+	}
+
+	since = e2k_make_timestamp (e2k_parse_timestamp (lastmod) - SYNC_OVERLAP);
+
+	e_cal_backend_exchange_cache_lock (cbex);
+	cbex->priv->sync_delta = TRUE;
+	cbex->priv->sync_pending = FALSE;
+	cbex->priv->sync_rows = count;
+	g_free (cbex->priv->sync_lastmod);
+	cbex->priv->sync_lastmod = lastmod;
+	e_cal_backend_exchange_cache_unlock (cbex);
+
+	return since;
+}
+
+/**
+ * e_cal_backend_exchange_cache_delta_end:
+ * @cbex: an #ECalBackendExchange
+ * @complete: whether the SEARCH returned all of its results
+ *
+ * Finishes reading the SEARCH of an incremental sync. If it didn't
+ * return all of its results, the watermark stays where it was, so the
+ * next sync looks at them again; otherwise it is left for
+ * e_cal_backend_exchange_cache_sync_commit().
+ **/
+void
+e_cal_backend_exchange_cache_delta_end (ECalBackendExchange *cbex,
+                                        gboolean complete)
+{
+	g_return_if_fail (cbex->priv->sync_delta);
+
+	cbex->priv->sync_delta = FALSE;
+	end_sync (cbex, complete);
+
+	save_cache (cbex);
 }
 
 static gboolean
@@ -708,26 +1273,30 @@ e_cal_backend_exchange_in_cache (ECalBackendExchange *cbex,
 {
 	ECalBackendExchangeComponent *ecomp;
 
-	g_return_val_if_fail (cbex->priv->cache_unseen != NULL, FALSE);
+	g_return_val_if_fail (cbex->priv->cache_unseen != NULL || cbex->priv->sync_delta, FALSE);
 
-	ecomp = g_hash_table_lookup (cbex->priv->objects, uid);
+	ecomp = lookup_comp (cbex, uid);
 	if (!ecomp)
 		return FALSE;
-	g_hash_table_remove (cbex->priv->cache_unseen, ecomp->uid);
+	if (cbex->priv->cache_unseen)
+		g_hash_table_remove (cbex->priv->cache_unseen, ecomp->uid);
 
 	if (rid)
 		return find_instance (cbex, ecomp, rid, lastmod);
 
 	if (strcmp (ecomp->lastmod, lastmod) < 0) {
+		mark_dirty (cbex, uid);
+		update_interval_tree (cbex, uid, NULL);
 		g_hash_table_remove (cbex->priv->objects, uid);
 		return FALSE;
 	}
 
 	/* Update the cache with the new href */
-	if (href) {
+	if (href && g_strcmp0 (ecomp->href, href) != 0) {
 		if (ecomp->href)
 			g_free (ecomp->href);
 		ecomp->href = g_strdup (href);
+		mark_dirty (cbex, uid);
 	}
 
 	return TRUE;
@@ -760,12 +1329,20 @@ uncache (gpointer key,
 	return TRUE;
 }
 
+/* If the SEARCH didn't return everything, the objects it didn't get
+ * to can't be assumed to be gone, so they are only removed when
+ * @complete is %TRUE. As with delta_end(), the watermark is then left
+ * for e_cal_backend_exchange_cache_sync_commit().
+ */
 void
-e_cal_backend_exchange_cache_sync_end (ECalBackendExchange *cbex)
+e_cal_backend_exchange_cache_sync_end (ECalBackendExchange *cbex,
+                                       gboolean complete)
 {
 	g_return_if_fail (cbex->priv->cache_unseen != NULL);
 
-	g_hash_table_foreach_remove (cbex->priv->cache_unseen, uncache, cbex);
+	if (complete)
+		g_hash_table_foreach_remove (cbex->priv->cache_unseen, uncache, cbex);
+	end_sync (cbex, complete);
 
 	g_hash_table_destroy (cbex->priv->cache_unseen);
 	cbex->priv->cache_unseen = NULL;
@@ -802,7 +1379,7 @@ e_cal_backend_exchange_add_object (ECalBackendExchange *cbex,
 	if (!uid)
 		return FALSE;
 
-	ecomp = g_hash_table_lookup (cbex->priv->objects, uid);
+	ecomp = lookup_comp (cbex, uid);
 
 	is_instance = (icalcomponent_get_first_property (comp, ICAL_RECURRENCEID_PROPERTY) != NULL);
 
@@ -849,6 +1426,8 @@ e_cal_backend_exchange_add_object (ECalBackendExchange *cbex,
 	} else
 		ecomp->icomp = icalcomponent_new_clone (comp);
 
+	mark_dirty (cbex, uid);
+	update_interval_tree (cbex, uid, ecomp);
 	save_cache (cbex);
 	return TRUE;
 }
@@ -907,7 +1486,7 @@ e_cal_backend_exchange_modify_object (ECalBackendExchange *cbex,
 
 	rid = icalcomponent_get_recurrenceid (comp);
 
-	ecomp = g_hash_table_lookup (cbex->priv->objects, uid);
+	ecomp = lookup_comp (cbex, uid);
 	if (!ecomp)
 		return FALSE;
 
@@ -925,6 +1504,8 @@ e_cal_backend_exchange_modify_object (ECalBackendExchange *cbex,
 			e_cal_util_remove_instances (ecomp->icomp, rid, CALOBJ_MOD_THIS);
 	}
 
+	mark_dirty (cbex, uid);
+	update_interval_tree (cbex, uid, ecomp);
 	save_cache (cbex);
 	return TRUE;
 }
@@ -944,9 +1525,11 @@ e_cal_backend_exchange_remove_object (ECalBackendExchange *cbex,
 {
 	d(printf("ecbe_remove_object(%p, %s)\n", cbex, uid));
 
-	if (!g_hash_table_lookup (cbex->priv->objects, uid))
+	if (!lookup_comp (cbex, uid))
 		return FALSE;
 
+	mark_dirty (cbex, uid);
+	update_interval_tree (cbex, uid, NULL);
 	g_hash_table_remove (cbex->priv->objects, uid);
 
 	save_cache (cbex);
@@ -1014,11 +1597,17 @@ get_exchange_comp (ECalBackendExchange *cbex,
 	if (!uid)
 		return NULL;
 
-	ecomp = g_hash_table_lookup (cbex->priv->objects, uid);
-	if (ecomp)
-		return ecomp;
+	/* Callers may change what they get back, so it gets saved
+	 * again to be sure. Until then its entry in the time index
+	 * may be out of date, so match_objects() checks it anyway.
+	 */
+	ecomp = lookup_comp (cbex, uid);
+	if (ecomp) {
+		mark_dirty (cbex, uid);
+		save_cache (cbex);
+	}
 
-	return NULL;
+	return ecomp;
 }
 
 static void
@@ -1054,7 +1643,7 @@ get_object (ECalBackendSync *backend,
 	*object = NULL;
 
 	g_mutex_lock (cbex->priv->cache_lock);
-	ecomp = g_hash_table_lookup (cbex->priv->objects, uid);
+	ecomp = lookup_comp (cbex, uid);
 	if (!ecomp) {
 		g_mutex_unlock (cbex->priv->cache_lock);
 		g_propagate_error (error, EDC_ERROR (ObjectNotFound));
@@ -1218,32 +1807,37 @@ typedef struct {
 	gboolean search_needed;
 	ECalBackendSExp *obj_sexp;
 	ECalBackend *backend;
+	E2kCalMatcher *matcher;
 } MatchObjectData;
 
+static gpointer
+match_result (MatchObjectData *match_data,
+              icalcomponent *icomp)
+{
+	if (match_data->as_string)
+		return icalcomponent_as_ical_string_r (icomp);
+	else
+		return e_cal_component_new_from_icalcomponent (icalcomponent_new_clone (icomp));
+}
+
 static void
 match_recurrence_sexp (gpointer data,
                        gpointer user_data)
 {
 	icalcomponent *icomp = data;
 	MatchObjectData *match_data = user_data;
-	ECalComponent *comp = NULL;
+	gpointer result;
 
 	d(printf("ecbe_match_recurrence_sexp(%p, %p)\n", icomp, match_data));
 
 	if (!icomp || !match_data)
 		return;
 
-	comp = e_cal_component_new ();
-	e_cal_component_set_icalcomponent (comp, icalcomponent_new_clone (icomp));
-
-	if ((!match_data->search_needed) ||
-	    (e_cal_backend_sexp_match_comp (match_data->obj_sexp, comp, match_data->backend))) {
-		if (match_data->as_string)
-			match_data->comps_list = g_slist_prepend (match_data->comps_list, e_cal_component_get_as_string (comp));
-		else
-			match_data->comps_list = g_slist_prepend (match_data->comps_list, g_object_ref (comp));
+	if (e2k_cal_matcher_match (match_data->matcher, icomp)) {
+		result = match_result (match_data, icomp);
+		if (result)
+			match_data->comps_list = g_slist_prepend (match_data->comps_list, result);
 	}
-	g_object_unref (comp);
 }
 
 static void
@@ -1253,7 +1847,7 @@ match_object_sexp (gpointer key,
 {
 	ECalBackendExchangeComponent *ecomp = value;
 	MatchObjectData *match_data = data;
-	ECalComponent *comp;
+	gpointer result;
 
 	/*
 	 * In case of detached instances with no master object,
@@ -1263,18 +1857,10 @@ match_object_sexp (gpointer key,
 	if (!ecomp || !match_data)
 		return;
 
-	if (ecomp->icomp) {
-		comp = e_cal_component_new ();
-		e_cal_component_set_icalcomponent (comp, icalcomponent_new_clone (ecomp->icomp));
-
-		if ((!match_data->search_needed) ||
-		    (e_cal_backend_sexp_match_comp (match_data->obj_sexp, comp, match_data->backend))) {
-			if (match_data->as_string)
-				match_data->comps_list = g_slist_append (match_data->comps_list, e_cal_component_get_as_string (comp));
-			else
-				match_data->comps_list = g_slist_append (match_data->comps_list, g_object_ref (comp));
-		}
-		g_object_unref (comp);
+	if (ecomp->icomp && e2k_cal_matcher_match (match_data->matcher, ecomp->icomp)) {
+		result = match_result (match_data, ecomp->icomp);
+		if (result)
+			match_data->comps_list = g_slist_append (match_data->comps_list, result);
 	}
 
 	/* match also recurrences */
@@ -1283,6 +1869,63 @@ match_object_sexp (gpointer key,
 			match_data);
 }
 
+/* Matches the objects against @match_data's expression, only looking
+ * at those that occur in its time range if it has one. Objects that
+ * have changed since the last save may have been changed in place,
+ * and not be where the time index says, so those are always looked
+ * at; the expression itself still checks their times.
+ */
+static void
+match_objects (ECalBackendExchange *cbex,
+               MatchObjectData *match_data)
+{
+	ECalBackendExchangeComponent *ecomp;
+	GHashTable *seen;
+	GHashTableIter iter;
+	GList *comps, *l;
+	const gchar *uid;
+	time_t start, end;
+
+	match_data->matcher = e2k_cal_matcher_new (
+		match_data->search_needed ? match_data->obj_sexp : NULL,
+		match_data->backend);
+
+	if (!match_data->search_needed ||
+	    !e_cal_backend_sexp_evaluate_occur_times (match_data->obj_sexp, &start, &end)) {
+		lookup_all_comps (cbex);
+		g_hash_table_foreach (cbex->priv->objects, (GHFunc) match_object_sexp, match_data);
+	} else {
+		ensure_interval_tree (cbex);
+
+		seen = g_hash_table_new (g_str_hash, g_str_equal);
+
+		comps = e_intervaltree_search (cbex->priv->interval_tree, start, end);
+		for (l = comps; l; l = l->next) {
+			e_cal_component_get_uid (l->data, &uid);
+			ecomp = lookup_comp (cbex, uid);
+			if (ecomp) {
+				match_object_sexp (NULL, ecomp, match_data);
+				g_hash_table_insert (seen, (gpointer) uid, NULL);
+			}
+		}
+
+		g_hash_table_iter_init (&iter, cbex->priv->dirty);
+		while (g_hash_table_iter_next (&iter, (gpointer *) &uid, NULL)) {
+			if (g_hash_table_lookup_extended (seen, uid, NULL, NULL))
+				continue;
+			ecomp = g_hash_table_lookup (cbex->priv->objects, uid);
+			if (ecomp)
+				match_object_sexp (NULL, ecomp, match_data);
+		}
+
+		g_hash_table_destroy (seen);
+		g_list_free_full (comps, g_object_unref);
+	}
+
+	e2k_cal_matcher_free (match_data->matcher);
+	match_data->matcher = NULL;
+}
+
 static void
 get_object_list (ECalBackendSync *backend,
                  EDataCal *cal,
@@ -1313,7 +1956,7 @@ get_object_list (ECalBackendSync *backend,
 	}
 
 	g_mutex_lock (priv->cache_lock);
-	g_hash_table_foreach (cbex->priv->objects, (GHFunc) match_object_sexp, &match_data);
+	match_objects (cbex, &match_data);
 	g_mutex_unlock (priv->cache_lock);
 
 	*objects = match_data.comps_list;
@@ -1352,6 +1995,13 @@ e_cal_backend_exchange_add_timezone (ECalBackendExchange *cbex,
 	}
 
 	g_hash_table_insert (cbex->priv->timezones, g_strdup (tzid), zone);
+
+	if (cbex->priv->store) {
+		gchar *data = icalcomponent_as_ical_string_r (vtzcomp);
+
+		e2k_cal_store_put_timezone (cbex->priv->store, tzid, data);
+		g_free (data);
+	}
 }
 
 static void
@@ -1423,7 +2073,7 @@ start_view (ECalBackend *backend,
 		match_data.search_needed = FALSE;
 
 	g_mutex_lock (priv->cache_lock);
-	g_hash_table_foreach (cbex->priv->objects, (GHFunc) match_object_sexp, &match_data);
+	match_objects (cbex, &match_data);
 	g_mutex_unlock (priv->cache_lock);
 
 	if (match_data.comps_list) {
@@ -2137,11 +2787,17 @@ finalize (GObject *object)
 		timeout_save_cache (cbex);
 	}
 
+	if (cbex->priv->store)
+		e2k_cal_store_free (cbex->priv->store);
+	if (cbex->priv->interval_tree)
+		e_intervaltree_destroy (cbex->priv->interval_tree);
+	g_hash_table_destroy (cbex->priv->dirty);
 	g_hash_table_destroy (cbex->priv->objects);
 	if (cbex->priv->cache_unseen)
 		g_hash_table_destroy (cbex->priv->cache_unseen);
 	g_free (cbex->priv->object_cache_file);
 	g_free (cbex->priv->lastmod);
+	g_free (cbex->priv->sync_lastmod);
 
 	g_hash_table_destroy (cbex->priv->timezones);
 
@@ -2207,10 +2863,15 @@ e_cal_backend_exchange_init (ECalBackendExchange *cbex)
 		g_str_hash, g_str_equal,
 		g_free, (GDestroyNotify) icaltimezone_free);
 
+	cbex->priv->dirty = g_hash_table_new_full (
+		g_str_hash, g_str_equal,
+		g_free, NULL);
+
 	cbex->priv->set_lock = g_mutex_new ();
 	cbex->priv->open_lock = g_mutex_new ();
 	cbex->priv->cache_lock = g_mutex_new ();
 	cbex->priv->cache_unseen = NULL;
+	cbex->priv->sync_count = -1;
 
 	e_cal_backend_sync_set_lock (E_CAL_BACKEND_SYNC (cbex), TRUE);
 
@@ -16,6 +16,9 @@ G_BEGIN_DECLS
 #define EDC_ERROR_EX(_code, _msg) e_data_cal_create_error (_code, _msg)
 #define EDC_ERROR_HTTP_STATUS(_status) e_data_cal_create_error_fmt (OtherError, _("Failed with E2K HTTP status %d"), _status)
 
+/* How many BPROPFIND batches to have in flight when fetching bodies */
+#define E_CAL_BACKEND_EXCHANGE_READ_AHEAD 4
+
 #define E_TYPE_CAL_BACKEND_EXCHANGE            (e_cal_backend_exchange_get_type ())
 #define E_CAL_BACKEND_EXCHANGE(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), E_TYPE_CAL_BACKEND_EXCHANGE, ECalBackendExchange))
 #define E_CAL_BACKEND_EXCHANGE_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), E_TYPE_CAL_BACKEND_EXCHANGE, ECalBackendExchangeClass))
@@ -62,7 +65,17 @@ gboolean  e_cal_backend_exchange_in_cache         (ECalBackendExchange *cbex,
 						   const gchar	       *rid
 						   );
 
-void      e_cal_backend_exchange_cache_sync_end   (ECalBackendExchange *cbex);
+void      e_cal_backend_exchange_cache_sync_row   (ECalBackendExchange *cbex,
+						   const gchar          *lastmod);
+void      e_cal_backend_exchange_cache_sync_end   (ECalBackendExchange *cbex,
+						   gboolean             complete);
+
+gchar    *e_cal_backend_exchange_cache_delta_start (ECalBackendExchange *cbex,
+						    E2kRestriction      *rn);
+void      e_cal_backend_exchange_cache_delta_end   (ECalBackendExchange *cbex,
+						    gboolean             complete);
+void      e_cal_backend_exchange_cache_sync_commit (ECalBackendExchange *cbex,
+						    gboolean             stored);
 
 gboolean  e_cal_backend_exchange_add_object       (ECalBackendExchange *cbex,
 						   const gchar          *href,
@@ -0,0 +1,119 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/* Copyright (C) 2001-2004 Novell, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Matching cached components against a query. ECalBackendSExp only
+ * matches ECalComponents, and an ECalComponent frees the
+ * icalcomponent it wraps, so wrapping a cached component used to
+ * mean copying it first. An E2kCalMatcher instead lends each
+ * icalcomponent to a single ECalComponent for the length of the
+ * match, and takes it back afterwards.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "e2k-cal-match.h"
+
+struct _E2kCalMatcher {
+	ECalBackendSExp *sexp;
+	ECalBackend *backend;
+
+	ECalComponent *comp;
+	icalcomponent *holder;
+};
+
+/**
+ * e2k_cal_matcher_new:
+ * @sexp: the query to match, or %NULL to match everything
+ * @backend: the backend the components belong to, used to resolve
+ * their timezones
+ *
+ * Creates a matcher for checking cached components against @sexp.
+ *
+ * Return value: the new matcher
+ **/
+E2kCalMatcher *
+e2k_cal_matcher_new (ECalBackendSExp *sexp,
+                     ECalBackend *backend)
+{
+	E2kCalMatcher *matcher;
+
+	matcher = g_new0 (E2kCalMatcher, 1);
+	if (sexp)
+		matcher->sexp = g_object_ref (sexp);
+	matcher->backend = backend;
+	matcher->comp = e_cal_component_new ();
+	matcher->holder = icalcomponent_new (ICAL_VCALENDAR_COMPONENT);
+
+	return matcher;
+}
+
+/**
+ * e2k_cal_matcher_match:
+ * @matcher: the matcher
+ * @icomp: a VEVENT, VTODO or VJOURNAL
+ *
+ * Checks whether @icomp matches @matcher's query, without copying it.
+ * As with any ECalComponent, this fills in @icomp's UID and DTSTAMP
+ * if it doesn't have them.
+ *
+ * Return value: %TRUE if @icomp matches
+ **/
+gboolean
+e2k_cal_matcher_match (E2kCalMatcher *matcher,
+                       icalcomponent *icomp)
+{
+	gboolean matches;
+
+	if (!e_cal_component_set_icalcomponent (matcher->comp, icomp))
+		return FALSE;
+
+	matches = !matcher->sexp ||
+		e_cal_backend_sexp_match_comp (matcher->sexp, matcher->comp, matcher->backend);
+
+	/* The ECalComponent won't free an icalcomponent that has a
+	 * parent, so give @icomp one while taking it back.
+	 */
+	if (icalcomponent_get_parent (icomp)) {
+		e_cal_component_set_icalcomponent (matcher->comp, NULL);
+	} else {
+		icalcomponent_add_component (matcher->holder, icomp);
+		e_cal_component_set_icalcomponent (matcher->comp, NULL);
+		icalcomponent_remove_component (matcher->holder, icomp);
+	}
+
+	return matches;
+}
+
+/**
+ * e2k_cal_matcher_free:
+ * @matcher: the matcher
+ *
+ * Frees @matcher.
+ **/
+void
+e2k_cal_matcher_free (E2kCalMatcher *matcher)
+{
+	g_object_unref (matcher->comp);
+	icalcomponent_free (matcher->holder);
+	if (matcher->sexp)
+		g_object_unref (matcher->sexp);
+	g_free (matcher);
+}
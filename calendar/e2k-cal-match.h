@@ -0,0 +1,22 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* Copyright (C) 2001-2004 Novell, Inc. */
+
+#ifndef E2K_CAL_MATCH_H
+#define E2K_CAL_MATCH_H
+
+#include <libical/ical.h>
+#include <libedata-cal/e-cal-backend-sexp.h>
+
+G_BEGIN_DECLS
+
+typedef struct _E2kCalMatcher E2kCalMatcher;
+
+E2kCalMatcher *e2k_cal_matcher_new   (ECalBackendSExp *sexp,
+				      ECalBackend     *backend);
+gboolean       e2k_cal_matcher_match (E2kCalMatcher   *matcher,
+				      icalcomponent   *icomp);
+void           e2k_cal_matcher_free  (E2kCalMatcher   *matcher);
+
+G_END_DECLS
+
+#endif
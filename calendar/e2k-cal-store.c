@@ -0,0 +1,1339 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/* Copyright (C) 2001-2004 Novell, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* A calendar folder's cached objects and timezones, kept so that
+ * saving a change only writes that change, and opening the folder
+ * doesn't read anything until it is asked for.
+ *
+ * The data lives in an append-only log:
+ *
+ *   header     E2kCalStoreLogHeader
+ *   records    E2kCalStoreRecord, followed by the key, lastmod, href
+ *              and data bytes whose lengths it gives
+ *
+ * where a later record for a key replaces the earlier ones. Next to
+ * it is an index (the log's filename plus ".idx"), which is mapped
+ * rather than read:
+ *
+ *   header     E2kCalStoreIndexHeader
+ *   records    nentries x E2kCalStoreIndexRecord, sorted by kind
+ *              and then by key
+ *   strings    strings_len bytes of NUL-terminated strings
+ *
+ * saying where each live key's data was as of the first log_length
+ * bytes of the log. Anything appended after that is read back when
+ * the store is opened; the index is rewritten once enough of that
+ * has piled up, and the log is rewritten once it is mostly records
+ * that have been replaced.
+ *
+ * Each object's record also gives the range of time its occurrences
+ * fall in, so that queries on a time range can skip objects without
+ * reading them.
+ *
+ * Both files are in host byte order. Like the folder index in the
+ * mail code, anything that doesn't check out is simply thrown away,
+ * since it is only a cache.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/fcntl.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#include "e2k-cal-store.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define E2K_CAL_STORE_LOG_MAGIC "ExCalLg2"
+#define E2K_CAL_STORE_INDEX_MAGIC "ExCalIx2"
+#define E2K_CAL_STORE_BYTE_ORDER 0x01020304
+#define E2K_CAL_STORE_RECORD_MAGIC 0x4563524c
+#define E2K_CAL_STORE_NONE G_MAXUINT32
+
+/* Rewrite the index once this many keys (or a quarter of the index,
+ * if that is more) have changed since it was written.
+ */
+#define E2K_CAL_STORE_MIN_PENDING 64
+
+/* Don't bother compacting logs smaller than this */
+#define E2K_CAL_STORE_MIN_COMPACT (256 * 1024)
+
+enum {
+	KIND_OBJECT = 1,
+	KIND_TIMEZONE,
+	KIND_REMOVED,
+	KIND_STATE
+};
+
+typedef struct {
+	gchar magic[8];
+	guint32 byte_order;
+	guint32 generation;
+} E2kCalStoreLogHeader;
+
+typedef struct {
+	guint32 magic;
+	guint32 kind;
+	/* E2K_CAL_STORE_NONE for a NULL lastmod or href */
+	guint32 key_len, lastmod_len, href_len, data_len;
+	/* When an object's occurrences start and end */
+	gint64 start, end;
+} E2kCalStoreRecord;
+
+typedef struct {
+	gchar magic[8];
+	guint32 byte_order;
+	guint32 generation;	/* must match the log's */
+	guint64 log_length;
+	guint64 live_length;
+	gint32 sync_count;
+	guint32 sync_lastmod;
+	guint32 nentries;
+	guint32 strings_len;
+} E2kCalStoreIndexHeader;
+
+typedef struct {
+	/* Where the data is in the log */
+	guint64 offset;
+	guint32 length;
+	guint32 kind;
+	/* Offsets into the string table */
+	guint32 key, lastmod, href;
+	guint32 reserved;
+	gint64 start, end;
+} E2kCalStoreIndexRecord;
+
+/* A key's latest record. The strings belong to the entry when it is
+ * one of the pending ones, and to the mapped index otherwise.
+ */
+typedef struct {
+	guint32 kind;
+	guint32 length;
+	guint64 offset;
+	gint64 start, end;
+	gchar *key, *lastmod, *href;
+} StoreEntry;
+
+struct _E2kCalStore {
+	GMutex *lock;
+	gchar *filename, *index_filename;
+
+	gint fd;
+	guint32 generation;
+	guint64 log_length;
+	/* How much of the log is records that haven't been replaced */
+	guint64 live_length;
+
+	GMappedFile *index;
+	const E2kCalStoreIndexHeader *header;
+	const E2kCalStoreIndexRecord *records;
+	const gchar *strings;
+
+	/* Records appended since the index was written, by key */
+	GHashTable *objects, *timezones;
+
+	gchar *sync_lastmod;
+	gint sync_count;
+};
+
+static void
+entry_free (gpointer data)
+{
+	StoreEntry *entry = data;
+
+	g_free (entry->key);
+	g_free (entry->lastmod);
+	g_free (entry->href);
+	g_free (entry);
+}
+
+static StoreEntry *
+entry_copy (const StoreEntry *entry)
+{
+	StoreEntry *copy;
+
+	copy = g_new (StoreEntry, 1);
+	copy->kind = entry->kind;
+	copy->length = entry->length;
+	copy->offset = entry->offset;
+	copy->start = entry->start;
+	copy->end = entry->end;
+	copy->key = g_strdup (entry->key);
+	copy->lastmod = g_strdup (entry->lastmod);
+	copy->href = g_strdup (entry->href);
+
+	return copy;
+}
+
+static gint
+entry_cmp (gconstpointer a,
+           gconstpointer b)
+{
+	const StoreEntry *entry_a = *(const StoreEntry **) a;
+	const StoreEntry *entry_b = *(const StoreEntry **) b;
+
+	if (entry_a->kind != entry_b->kind)
+		return entry_a->kind < entry_b->kind ? -1 : 1;
+	return strcmp (entry_a->key, entry_b->key);
+}
+
+static guint64
+record_size (const gchar *key,
+             const gchar *lastmod,
+             const gchar *href,
+             guint32 length)
+{
+	return sizeof (E2kCalStoreRecord) + strlen (key) +
+		(lastmod ? strlen (lastmod) : 0) +
+		(href ? strlen (href) : 0) + length;
+}
+
+static GHashTable *
+pending_table (E2kCalStore *store,
+               guint32 kind)
+{
+	return kind == KIND_TIMEZONE ? store->timezones : store->objects;
+}
+
+static guint
+pending_count (E2kCalStore *store)
+{
+	return g_hash_table_size (store->objects) +
+		g_hash_table_size (store->timezones);
+}
+
+/* The index */
+
+static const gchar *
+index_string (E2kCalStore *store,
+              guint32 offset)
+{
+	if (offset == E2K_CAL_STORE_NONE || offset >= store->header->strings_len)
+		return NULL;
+	return store->strings + offset;
+}
+
+/* Records are only checked when they are used, so that opening the
+ * store doesn't have to look at all of them.
+ */
+static gboolean
+index_get (E2kCalStore *store,
+           guint n,
+           StoreEntry *entry)
+{
+	const E2kCalStoreIndexRecord *record = &store->records[n];
+
+	entry->kind = record->kind;
+	entry->length = record->length;
+	entry->offset = record->offset;
+	entry->start = record->start;
+	entry->end = record->end;
+	entry->key = (gchar *) index_string (store, record->key);
+	entry->lastmod = (gchar *) index_string (store, record->lastmod);
+	entry->href = (gchar *) index_string (store, record->href);
+
+	return entry->key &&
+		record->offset <= store->header->log_length &&
+		record->length <= store->header->log_length - record->offset;
+}
+
+/* Returns the first record that doesn't sort before (@kind, @key),
+ * where a NULL @key sorts before any other.
+ */
+static guint
+index_lower_bound (E2kCalStore *store,
+                   guint32 kind,
+                   const gchar *key)
+{
+	const E2kCalStoreIndexRecord *record;
+	const gchar *record_key;
+	guint low = 0, high, mid;
+	gint cmp;
+
+	if (!store->index)
+		return 0;
+
+	high = store->header->nentries;
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		record = &store->records[mid];
+
+		if (record->kind != kind)
+			cmp = record->kind < kind ? -1 : 1;
+		else if (!key)
+			cmp = 1;
+		else {
+			record_key = index_string (store, record->key);
+			cmp = record_key ? strcmp (record_key, key) : -1;
+		}
+
+		if (cmp < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+static gboolean
+index_lookup (E2kCalStore *store,
+              guint32 kind,
+              const gchar *key,
+              StoreEntry *entry)
+{
+	guint n;
+
+	n = index_lower_bound (store, kind, key);
+	if (!store->index || n >= store->header->nentries)
+		return FALSE;
+
+	return index_get (store, n, entry) &&
+		entry->kind == kind && !strcmp (entry->key, key);
+}
+
+static GMappedFile *
+index_map (E2kCalStore *store)
+{
+	const E2kCalStoreIndexHeader *header;
+	const gchar *data, *strings;
+	GMappedFile *file;
+	gsize length;
+
+	file = g_mapped_file_new (store->index_filename, FALSE, NULL);
+	if (!file)
+		return NULL;
+
+	data = g_mapped_file_get_contents (file);
+	length = g_mapped_file_get_length (file);
+	if (!data || length < sizeof (E2kCalStoreIndexHeader))
+		goto bad;
+
+	header = (const E2kCalStoreIndexHeader *) data;
+	if (memcmp (header->magic, E2K_CAL_STORE_INDEX_MAGIC, sizeof (header->magic)) ||
+	    header->byte_order != E2K_CAL_STORE_BYTE_ORDER ||
+	    header->generation != store->generation ||
+	    header->log_length < sizeof (E2kCalStoreLogHeader) ||
+	    header->log_length > store->log_length)
+		goto bad;
+
+	if (header->nentries > (length - sizeof (*header)) / sizeof (E2kCalStoreIndexRecord) ||
+	    length != sizeof (*header) +
+	    (gsize) header->nentries * sizeof (E2kCalStoreIndexRecord) +
+	    header->strings_len)
+		goto bad;
+
+	/* With a NUL at the end, every string that starts inside
+	 * the table also ends inside it.
+	 */
+	strings = data + length - header->strings_len;
+	if (header->strings_len == 0 || strings[header->strings_len - 1] != '\0')
+		goto bad;
+
+	return file;
+
+ bad:
+	g_mapped_file_unref (file);
+	return NULL;
+}
+
+static void
+index_set (E2kCalStore *store,
+           GMappedFile *file)
+{
+	if (store->index)
+		g_mapped_file_unref (store->index);
+
+	store->index = file;
+	if (file) {
+		store->header = (const E2kCalStoreIndexHeader *) g_mapped_file_get_contents (file);
+		store->records = (const E2kCalStoreIndexRecord *) (store->header + 1);
+		store->strings = (const gchar *) (store->records + store->header->nentries);
+	} else {
+		store->header = NULL;
+		store->records = NULL;
+		store->strings = NULL;
+	}
+}
+
+/* Looking things up */
+
+static gboolean
+store_lookup (E2kCalStore *store,
+              guint32 kind,
+              const gchar *key,
+              StoreEntry *entry)
+{
+	StoreEntry *pending;
+
+	pending = g_hash_table_lookup (pending_table (store, kind), key);
+	if (pending) {
+		if (pending->kind != kind)
+			return FALSE;
+		*entry = *pending;
+		return TRUE;
+	}
+
+	return index_lookup (store, kind, key, entry);
+}
+
+/* Returns copies of the live entries of @kind (or of every kind, if
+ * @kind is 0), sorted as they are in the index.
+ */
+static GPtrArray *
+store_collect (E2kCalStore *store,
+               guint32 kind)
+{
+	GPtrArray *entries;
+	GHashTableIter iter;
+	StoreEntry entry, *pending;
+	guint n, end;
+
+	entries = g_ptr_array_new ();
+
+	if (store->index) {
+		n = kind ? index_lower_bound (store, kind, NULL) : 0;
+		end = kind ? index_lower_bound (store, kind + 1, NULL) : store->header->nentries;
+		for (; n < end; n++) {
+			if (!index_get (store, n, &entry) ||
+			    (entry.kind != KIND_OBJECT && entry.kind != KIND_TIMEZONE))
+				continue;
+			if (g_hash_table_lookup (pending_table (store, entry.kind), entry.key))
+				continue;
+			g_ptr_array_add (entries, entry_copy (&entry));
+		}
+	}
+
+	if (!kind || kind == KIND_OBJECT) {
+		g_hash_table_iter_init (&iter, store->objects);
+		while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &pending)) {
+			if (pending->kind == KIND_OBJECT)
+				g_ptr_array_add (entries, entry_copy (pending));
+		}
+	}
+	if (!kind || kind == KIND_TIMEZONE) {
+		g_hash_table_iter_init (&iter, store->timezones);
+		while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &pending))
+			g_ptr_array_add (entries, entry_copy (pending));
+	}
+
+	g_ptr_array_sort (entries, entry_cmp);
+
+	return entries;
+}
+
+static void
+free_entries (GPtrArray *entries)
+{
+	g_ptr_array_foreach (entries, (GFunc) entry_free, NULL);
+	g_ptr_array_free (entries, TRUE);
+}
+
+/* Records @key's new record (or removal) at @offset */
+static void
+store_apply (E2kCalStore *store,
+             guint32 kind,
+             const gchar *key,
+             const gchar *lastmod,
+             const gchar *href,
+             gint64 start,
+             gint64 end,
+             guint64 offset,
+             guint32 length)
+{
+	StoreEntry old, *entry;
+	guint32 live_kind = kind == KIND_REMOVED ? KIND_OBJECT : kind;
+
+	if (store_lookup (store, live_kind, key, &old))
+		store->live_length -= MIN (store->live_length,
+					   record_size (old.key, old.lastmod, old.href, old.length));
+
+	entry = g_new (StoreEntry, 1);
+	entry->kind = kind;
+	entry->length = length;
+	entry->offset = offset;
+	entry->start = start;
+	entry->end = end;
+	entry->key = g_strdup (key);
+	entry->lastmod = g_strdup (lastmod);
+	entry->href = g_strdup (href);
+
+	if (kind != KIND_REMOVED)
+		store->live_length += record_size (key, lastmod, href, length);
+
+	g_hash_table_replace (pending_table (store, live_kind), entry->key, entry);
+}
+
+/* The log */
+
+static gboolean
+write_all (gint fd,
+           const gchar *data,
+           gsize length)
+{
+	gssize n;
+
+	while (length > 0) {
+		n = write (fd, data, length);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return FALSE;
+		data += n;
+		length -= n;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+read_all (gint fd,
+          guint64 offset,
+          gchar *data,
+          gsize length)
+{
+	gssize n;
+
+	if (lseek (fd, offset, SEEK_SET) == (off_t) -1)
+		return FALSE;
+
+	while (length > 0) {
+		n = read (fd, data, length);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return FALSE;
+		data += n;
+		length -= n;
+	}
+
+	return TRUE;
+}
+
+static gint
+log_create (const gchar *filename,
+            guint32 *generation,
+            guint64 *log_length)
+{
+	E2kCalStoreLogHeader header;
+	gint fd;
+
+	fd = g_open (filename, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0600);
+	if (fd == -1)
+		return -1;
+
+	memset (&header, 0, sizeof (header));
+	memcpy (header.magic, E2K_CAL_STORE_LOG_MAGIC, sizeof (header.magic));
+	header.byte_order = E2K_CAL_STORE_BYTE_ORDER;
+	header.generation = g_random_int ();
+
+	if (!write_all (fd, (gchar *) &header, sizeof (header))) {
+		close (fd);
+		return -1;
+	}
+
+	*generation = header.generation;
+	*log_length = sizeof (header);
+	return fd;
+}
+
+static guint32
+string_len (const gchar *str)
+{
+	return str ? strlen (str) : E2K_CAL_STORE_NONE;
+}
+
+/* Appends a record to the log in @fd, which is @log_length bytes
+ * long, in a single write. On success, @log_length is updated and
+ * @offset set to where the data went.
+ */
+static gboolean
+log_append (gint fd,
+            guint64 *log_length,
+            guint32 kind,
+            const gchar *key,
+            const gchar *lastmod,
+            const gchar *href,
+            gint64 start,
+            gint64 end,
+            const gchar *data,
+            guint32 length,
+            guint64 *offset)
+{
+	E2kCalStoreRecord record;
+	GByteArray *buf;
+	gboolean ok;
+
+	record.magic = E2K_CAL_STORE_RECORD_MAGIC;
+	record.kind = kind;
+	record.key_len = strlen (key);
+	record.lastmod_len = string_len (lastmod);
+	record.href_len = string_len (href);
+	record.data_len = length;
+	record.start = start;
+	record.end = end;
+
+	buf = g_byte_array_sized_new (record_size (key, lastmod, href, length));
+	g_byte_array_append (buf, (guint8 *) &record, sizeof (record));
+	g_byte_array_append (buf, (guint8 *) key, record.key_len);
+	if (lastmod)
+		g_byte_array_append (buf, (guint8 *) lastmod, record.lastmod_len);
+	if (href)
+		g_byte_array_append (buf, (guint8 *) href, record.href_len);
+	if (offset)
+		*offset = *log_length + buf->len;
+	g_byte_array_append (buf, (guint8 *) data, length);
+
+	ok = lseek (fd, *log_length, SEEK_SET) != (off_t) -1 &&
+		write_all (fd, (gchar *) buf->data, buf->len);
+	if (ok)
+		*log_length += buf->len;
+	else if (ftruncate (fd, *log_length) != 0)
+		g_warning ("%s: ftruncate() failed: %s", G_STRFUNC, g_strerror (errno));
+
+	g_byte_array_free (buf, TRUE);
+	return ok;
+}
+
+static gchar *
+read_string (gint fd,
+             guint64 offset,
+             guint32 length)
+{
+	gchar *str;
+
+	if (length == E2K_CAL_STORE_NONE)
+		return NULL;
+
+	str = g_malloc (length + 1);
+	if (!read_all (fd, offset, str, length)) {
+		g_free (str);
+		return NULL;
+	}
+	str[length] = '\0';
+
+	return str;
+}
+
+/* Reads back the records from @offset on, and cuts off whatever
+ * follows the last whole one, left by a crash in the middle of a
+ * write.
+ */
+static void
+log_replay (E2kCalStore *store,
+            guint64 offset)
+{
+	E2kCalStoreRecord record;
+	gchar *key, *lastmod, *href, *data;
+	guint64 size, pos, length;
+	struct stat st;
+
+	if (fstat (store->fd, &st) != 0)
+		return;
+	size = st.st_size;
+
+	for (pos = offset; pos + sizeof (record) <= size; pos += length) {
+		if (!read_all (store->fd, pos, (gchar *) &record, sizeof (record)) ||
+		    record.magic != E2K_CAL_STORE_RECORD_MAGIC ||
+		    record.kind < KIND_OBJECT || record.kind > KIND_STATE ||
+		    record.key_len == E2K_CAL_STORE_NONE ||
+		    record.data_len == E2K_CAL_STORE_NONE)
+			break;
+
+		length = sizeof (record) + (guint64) record.key_len + record.data_len;
+		if (record.lastmod_len != E2K_CAL_STORE_NONE)
+			length += record.lastmod_len;
+		if (record.href_len != E2K_CAL_STORE_NONE)
+			length += record.href_len;
+		if (length > size - pos)
+			break;
+
+		offset = pos + sizeof (record);
+		key = read_string (store->fd, offset, record.key_len);
+		offset += record.key_len;
+		lastmod = read_string (store->fd, offset, record.lastmod_len);
+		if (lastmod)
+			offset += record.lastmod_len;
+		href = read_string (store->fd, offset, record.href_len);
+		if (href)
+			offset += record.href_len;
+
+		if (!key) {
+			g_free (lastmod);
+			g_free (href);
+			break;
+		}
+
+		if (record.kind == KIND_STATE) {
+			data = read_string (store->fd, offset, record.data_len);
+			g_free (store->sync_lastmod);
+			store->sync_lastmod = lastmod;
+			store->sync_count = data ? atoi (data) : -1;
+			lastmod = NULL;
+			g_free (data);
+		} else
+			store_apply (store, record.kind, key, lastmod, href,
+				     record.start, record.end,
+				     offset, record.data_len);
+
+		g_free (key);
+		g_free (lastmod);
+		g_free (href);
+	}
+
+	if (pos < size && ftruncate (store->fd, pos) != 0)
+		g_warning ("%s: ftruncate() failed: %s", G_STRFUNC, g_strerror (errno));
+	store->log_length = pos;
+}
+
+static gboolean
+log_append_state (gint fd,
+                  guint64 *log_length,
+                  const gchar *lastmod,
+                  gint count)
+{
+	gchar *data;
+	gboolean ok;
+
+	data = g_strdup_printf ("%d", count);
+	ok = log_append (fd, log_length, KIND_STATE, "", lastmod, NULL,
+			 0, 0, data, strlen (data), NULL);
+	g_free (data);
+
+	return ok;
+}
+
+/* Writing the index */
+
+static guint32
+add_string (GString *strings,
+            const gchar *str)
+{
+	guint32 offset;
+
+	if (!str)
+		return E2K_CAL_STORE_NONE;
+
+	offset = strings->len;
+	g_string_append_len (strings, str, strlen (str) + 1);
+	return offset;
+}
+
+/* Writes an index for the live @entries, and switches to it */
+static gboolean
+store_write_index (E2kCalStore *store,
+                   GPtrArray *entries)
+{
+	E2kCalStoreIndexHeader header;
+	E2kCalStoreIndexRecord *records;
+	StoreEntry *entry;
+	GMappedFile *file;
+	GString *strings, *data;
+	gboolean ok;
+	guint i;
+
+	memset (&header, 0, sizeof (header));
+	memcpy (header.magic, E2K_CAL_STORE_INDEX_MAGIC, sizeof (header.magic));
+	header.byte_order = E2K_CAL_STORE_BYTE_ORDER;
+	header.generation = store->generation;
+	header.log_length = store->log_length;
+	header.live_length = store->live_length;
+	header.sync_count = store->sync_count;
+	header.nentries = entries->len;
+
+	strings = g_string_new ("");
+	header.sync_lastmod = add_string (strings, store->sync_lastmod);
+
+	records = g_new0 (E2kCalStoreIndexRecord, entries->len);
+	for (i = 0; i < entries->len; i++) {
+		entry = entries->pdata[i];
+		records[i].offset = entry->offset;
+		records[i].length = entry->length;
+		records[i].kind = entry->kind;
+		records[i].key = add_string (strings, entry->key);
+		records[i].lastmod = add_string (strings, entry->lastmod);
+		records[i].href = add_string (strings, entry->href);
+		records[i].start = entry->start;
+		records[i].end = entry->end;
+	}
+	/* The table is never empty, so that it always ends in a NUL */
+	add_string (strings, "");
+	header.strings_len = strings->len;
+
+	data = g_string_sized_new (sizeof (header) +
+				   entries->len * sizeof (E2kCalStoreIndexRecord) +
+				   strings->len);
+	g_string_append_len (data, (gchar *) &header, sizeof (header));
+	g_string_append_len (data, (gchar *) records,
+			     entries->len * sizeof (E2kCalStoreIndexRecord));
+	g_string_append_len (data, strings->str, strings->len);
+	g_free (records);
+	g_string_free (strings, TRUE);
+
+	ok = g_file_set_contents (store->index_filename, data->str, data->len, NULL);
+	g_string_free (data, TRUE);
+	if (!ok)
+		return FALSE;
+
+	file = index_map (store);
+	if (!file)
+		return FALSE;
+
+	index_set (store, file);
+	g_hash_table_remove_all (store->objects);
+	g_hash_table_remove_all (store->timezones);
+
+	return TRUE;
+}
+
+/* Rewrites the log with only its live records, then indexes it */
+static gboolean
+store_compact (E2kCalStore *store)
+{
+	GPtrArray *entries;
+	StoreEntry *entry;
+	gchar *tmpfile, *data;
+	guint64 log_length, live_length;
+	guint32 generation;
+	gboolean ok = TRUE;
+	gint fd;
+	guint i;
+
+	tmpfile = g_strdup_printf ("%s~", store->filename);
+	fd = log_create (tmpfile, &generation, &log_length);
+	if (fd == -1) {
+		g_free (tmpfile);
+		return FALSE;
+	}
+
+	entries = store_collect (store, 0);
+	live_length = 0;
+	for (i = 0; ok && i < entries->len; i++) {
+		entry = entries->pdata[i];
+
+		data = g_malloc (entry->length);
+		ok = read_all (store->fd, entry->offset, data, entry->length) &&
+			log_append (fd, &log_length, entry->kind, entry->key,
+				    entry->lastmod, entry->href,
+				    entry->start, entry->end,
+				    data, entry->length, &entry->offset);
+		g_free (data);
+
+		live_length += record_size (entry->key, entry->lastmod,
+					    entry->href, entry->length);
+	}
+	if (ok && store->sync_count >= 0)
+		ok = log_append_state (fd, &log_length, store->sync_lastmod,
+				       store->sync_count);
+
+	if (!ok || g_rename (tmpfile, store->filename) != 0) {
+		close (fd);
+		g_unlink (tmpfile);
+		g_free (tmpfile);
+		free_entries (entries);
+		return FALSE;
+	}
+	g_free (tmpfile);
+
+	close (store->fd);
+	store->fd = fd;
+	store->generation = generation;
+	store->log_length = log_length;
+	store->live_length = live_length;
+
+	/* The old index doesn't go with this log any more */
+	index_set (store, NULL);
+	g_hash_table_remove_all (store->objects);
+	g_hash_table_remove_all (store->timezones);
+	for (i = 0; i < entries->len; i++) {
+		entry = entries->pdata[i];
+		g_hash_table_replace (pending_table (store, entry->kind),
+				      entry->key, entry);
+	}
+	g_ptr_array_free (entries, TRUE);
+
+	entries = store_collect (store, 0);
+	ok = store_write_index (store, entries);
+	free_entries (entries);
+
+	return ok;
+}
+
+/**
+ * e2k_cal_store_open:
+ * @filename: the store's log file
+ *
+ * Opens the store in @filename (creating it if needed), using the
+ * index next to it to avoid reading the log.
+ *
+ * Return value: the store, or %NULL if @filename can't be written.
+ **/
+E2kCalStore *
+e2k_cal_store_open (const gchar *filename)
+{
+	E2kCalStore *store;
+	E2kCalStoreLogHeader header;
+	GMappedFile *file;
+	struct stat st;
+
+	g_return_val_if_fail (filename != NULL, NULL);
+
+	store = g_new0 (E2kCalStore, 1);
+	store->lock = g_mutex_new ();
+	store->filename = g_strdup (filename);
+	store->index_filename = g_strconcat (filename, ".idx", NULL);
+	store->objects = g_hash_table_new_full (g_str_hash, g_str_equal,
+						NULL, entry_free);
+	store->timezones = g_hash_table_new_full (g_str_hash, g_str_equal,
+						  NULL, entry_free);
+	store->sync_count = -1;
+
+	store->fd = g_open (filename, O_RDWR | O_BINARY, 0);
+	if (store->fd != -1 &&
+	    read_all (store->fd, 0, (gchar *) &header, sizeof (header)) &&
+	    !memcmp (header.magic, E2K_CAL_STORE_LOG_MAGIC, sizeof (header.magic)) &&
+	    header.byte_order == E2K_CAL_STORE_BYTE_ORDER &&
+	    fstat (store->fd, &st) == 0) {
+		store->generation = header.generation;
+		store->log_length = st.st_size;
+	} else {
+		if (store->fd != -1)
+			close (store->fd);
+		store->fd = log_create (filename, &store->generation, &store->log_length);
+		if (store->fd == -1) {
+			e2k_cal_store_free (store);
+			return NULL;
+		}
+	}
+
+	file = index_map (store);
+	if (file) {
+		index_set (store, file);
+		store->live_length = store->header->live_length;
+		store->sync_count = store->header->sync_count;
+		store->sync_lastmod = g_strdup (index_string (store, store->header->sync_lastmod));
+		log_replay (store, store->header->log_length);
+	} else
+		log_replay (store, sizeof (E2kCalStoreLogHeader));
+
+	return store;
+}
+
+/**
+ * e2k_cal_store_free:
+ * @store: the store
+ *
+ * Closes @store, first bringing its index up to date so that the
+ * next e2k_cal_store_open() has nothing to read back.
+ **/
+void
+e2k_cal_store_free (E2kCalStore *store)
+{
+	GPtrArray *entries;
+
+	g_return_if_fail (store != NULL);
+
+	if (store->fd != -1 && pending_count (store) > 0) {
+		entries = store_collect (store, 0);
+		store_write_index (store, entries);
+		free_entries (entries);
+	}
+
+	if (store->fd != -1)
+		close (store->fd);
+	index_set (store, NULL);
+	g_hash_table_destroy (store->objects);
+	g_hash_table_destroy (store->timezones);
+	g_free (store->sync_lastmod);
+	g_free (store->filename);
+	g_free (store->index_filename);
+	if (store->lock)
+		g_mutex_free (store->lock);
+	g_free (store);
+}
+
+/**
+ * e2k_cal_store_flush:
+ * @store: the store
+ *
+ * Changes are written to the log as they are made; this does the
+ * housekeeping that keeps the store quick to open, rewriting the
+ * index once enough has changed since it was written, and the log
+ * once it is mostly records that have since been replaced. Both cost
+ * about as much as the changes that made them necessary.
+ *
+ * Return value: %FALSE if something couldn't be written.
+ **/
+gboolean
+e2k_cal_store_flush (E2kCalStore *store)
+{
+	GPtrArray *entries;
+	guint nentries;
+	gboolean ok = TRUE;
+
+	g_return_val_if_fail (store != NULL, FALSE);
+
+	g_mutex_lock (store->lock);
+
+	nentries = store->index ? store->header->nentries : 0;
+	if (store->log_length > E2K_CAL_STORE_MIN_COMPACT &&
+	    store->log_length > 2 * store->live_length)
+		ok = store_compact (store);
+	else if (pending_count (store) > MAX (E2K_CAL_STORE_MIN_PENDING, nentries / 4)) {
+		entries = store_collect (store, 0);
+		ok = store_write_index (store, entries);
+		free_entries (entries);
+	}
+
+	g_mutex_unlock (store->lock);
+
+	return ok;
+}
+
+/**
+ * e2k_cal_store_is_empty:
+ * @store: the store
+ *
+ * Return value: whether nothing has been written to @store since it
+ * was created.
+ **/
+gboolean
+e2k_cal_store_is_empty (E2kCalStore *store)
+{
+	gboolean empty;
+
+	g_return_val_if_fail (store != NULL, TRUE);
+
+	g_mutex_lock (store->lock);
+	empty = store->log_length == sizeof (E2kCalStoreLogHeader);
+	g_mutex_unlock (store->lock);
+
+	return empty;
+}
+
+gboolean
+e2k_cal_store_has_object (E2kCalStore *store,
+                          const gchar *uid)
+{
+	StoreEntry entry;
+	gboolean found;
+
+	g_return_val_if_fail (store != NULL, FALSE);
+	g_return_val_if_fail (uid != NULL, FALSE);
+
+	g_mutex_lock (store->lock);
+	found = store_lookup (store, KIND_OBJECT, uid, &entry);
+	g_mutex_unlock (store->lock);
+
+	return found;
+}
+
+/**
+ * e2k_cal_store_get_object:
+ * @store: the store
+ * @uid: the object's UID
+ * @href: if not %NULL, set to the object's href
+ * @lastmod: if not %NULL, set to the object's last modtime
+ *
+ * Reads @uid's data from @store.
+ *
+ * Return value: the data, or %NULL if @uid isn't in @store.
+ **/
+gchar *
+e2k_cal_store_get_object (E2kCalStore *store,
+                          const gchar *uid,
+                          gchar **href,
+                          gchar **lastmod)
+{
+	StoreEntry entry;
+	gchar *data = NULL;
+
+	g_return_val_if_fail (store != NULL, NULL);
+	g_return_val_if_fail (uid != NULL, NULL);
+
+	g_mutex_lock (store->lock);
+	if (store_lookup (store, KIND_OBJECT, uid, &entry)) {
+		data = g_malloc (entry.length + 1);
+		if (read_all (store->fd, entry.offset, data, entry.length)) {
+			data[entry.length] = '\0';
+			if (href)
+				*href = g_strdup (entry.href);
+			if (lastmod)
+				*lastmod = g_strdup (entry.lastmod);
+		} else {
+			g_free (data);
+			data = NULL;
+		}
+	}
+	g_mutex_unlock (store->lock);
+
+	return data;
+}
+
+/**
+ * e2k_cal_store_get_uids:
+ * @store: the store
+ *
+ * Return value: the UIDs of the objects in @store, for the caller
+ * to free with the array.
+ **/
+GPtrArray *
+e2k_cal_store_get_uids (E2kCalStore *store)
+{
+	GPtrArray *entries, *uids;
+	StoreEntry *entry;
+	guint i;
+
+	g_return_val_if_fail (store != NULL, NULL);
+
+	g_mutex_lock (store->lock);
+	entries = store_collect (store, KIND_OBJECT);
+	g_mutex_unlock (store->lock);
+
+	uids = g_ptr_array_new_with_free_func (g_free);
+	for (i = 0; i < entries->len; i++) {
+		entry = entries->pdata[i];
+		g_ptr_array_add (uids, entry->key);
+		entry->key = NULL;
+	}
+	free_entries (entries);
+
+	return uids;
+}
+
+/**
+ * e2k_cal_store_get_object_range:
+ * @store: the store
+ * @uid: the object's UID
+ * @start: set to when the first of its occurrences starts
+ * @end: set to when the last of them ends
+ *
+ * Gets the times given for @uid to e2k_cal_store_put_object(),
+ * without reading the object.
+ *
+ * Return value: %FALSE if @uid isn't in @store.
+ **/
+gboolean
+e2k_cal_store_get_object_range (E2kCalStore *store,
+                                const gchar *uid,
+                                time_t *start,
+                                time_t *end)
+{
+	StoreEntry entry;
+	gboolean found;
+
+	g_return_val_if_fail (store != NULL, FALSE);
+	g_return_val_if_fail (uid != NULL, FALSE);
+
+	g_mutex_lock (store->lock);
+	found = store_lookup (store, KIND_OBJECT, uid, &entry);
+	if (found) {
+		*start = entry.start;
+		*end = entry.end;
+	}
+	g_mutex_unlock (store->lock);
+
+	return found;
+}
+
+/**
+ * e2k_cal_store_put_object:
+ * @store: the store
+ * @uid: the object's UID
+ * @href: the object's href, or %NULL
+ * @lastmod: the object's last modtime, or %NULL
+ * @start: when the first of the object's occurrences starts
+ * @end: when the last of them ends
+ * @data: the object's data
+ *
+ * Saves @uid's object, replacing what was there.
+ *
+ * Return value: %FALSE if it couldn't be written.
+ **/
+gboolean
+e2k_cal_store_put_object (E2kCalStore *store,
+                          const gchar *uid,
+                          const gchar *href,
+                          const gchar *lastmod,
+                          time_t start,
+                          time_t end,
+                          const gchar *data)
+{
+	guint64 offset;
+	guint32 length;
+	gboolean ok;
+
+	g_return_val_if_fail (store != NULL, FALSE);
+	g_return_val_if_fail (uid != NULL, FALSE);
+	g_return_val_if_fail (data != NULL, FALSE);
+
+	length = strlen (data);
+
+	g_mutex_lock (store->lock);
+	ok = log_append (store->fd, &store->log_length, KIND_OBJECT,
+			 uid, lastmod, href, start, end, data, length, &offset);
+	if (ok)
+		store_apply (store, KIND_OBJECT, uid, lastmod, href,
+			     start, end, offset, length);
+	g_mutex_unlock (store->lock);
+
+	return ok;
+}
+
+gboolean
+e2k_cal_store_remove_object (E2kCalStore *store,
+                             const gchar *uid)
+{
+	StoreEntry entry;
+	gboolean ok = TRUE;
+
+	g_return_val_if_fail (store != NULL, FALSE);
+	g_return_val_if_fail (uid != NULL, FALSE);
+
+	g_mutex_lock (store->lock);
+	if (store_lookup (store, KIND_OBJECT, uid, &entry)) {
+		ok = log_append (store->fd, &store->log_length, KIND_REMOVED,
+				 uid, NULL, NULL, 0, 0, "", 0, NULL);
+		if (ok)
+			store_apply (store, KIND_REMOVED, uid, NULL, NULL, 0, 0, 0, 0);
+	}
+	g_mutex_unlock (store->lock);
+
+	return ok;
+}
+
+/**
+ * e2k_cal_store_get_timezones:
+ * @store: the store
+ *
+ * Return value: the data of each of the timezones in @store, for the
+ * caller to free.
+ **/
+GSList *
+e2k_cal_store_get_timezones (E2kCalStore *store)
+{
+	GPtrArray *entries;
+	StoreEntry *entry;
+	GSList *timezones = NULL;
+	gchar *data;
+	guint i;
+
+	g_return_val_if_fail (store != NULL, NULL);
+
+	g_mutex_lock (store->lock);
+	entries = store_collect (store, KIND_TIMEZONE);
+	for (i = 0; i < entries->len; i++) {
+		entry = entries->pdata[i];
+
+		data = g_malloc (entry->length + 1);
+		if (read_all (store->fd, entry->offset, data, entry->length)) {
+			data[entry->length] = '\0';
+			timezones = g_slist_prepend (timezones, data);
+		} else
+			g_free (data);
+	}
+	g_mutex_unlock (store->lock);
+
+	free_entries (entries);
+
+	return timezones;
+}
+
+gboolean
+e2k_cal_store_put_timezone (E2kCalStore *store,
+                            const gchar *tzid,
+                            const gchar *data)
+{
+	guint64 offset;
+	guint32 length;
+	gboolean ok;
+
+	g_return_val_if_fail (store != NULL, FALSE);
+	g_return_val_if_fail (tzid != NULL, FALSE);
+	g_return_val_if_fail (data != NULL, FALSE);
+
+	length = strlen (data);
+
+	g_mutex_lock (store->lock);
+	ok = log_append (store->fd, &store->log_length, KIND_TIMEZONE,
+			 tzid, NULL, NULL, 0, 0, data, length, &offset);
+	if (ok)
+		store_apply (store, KIND_TIMEZONE, tzid, NULL, NULL,
+			     0, 0, offset, length);
+	g_mutex_unlock (store->lock);
+
+	return ok;
+}
+
+/**
+ * e2k_cal_store_get_sync_state:
+ * @store: the store
+ * @lastmod: set to the saved sync watermark (or %NULL), to be freed
+ * @count: set to the saved item count, or -1
+ *
+ * Returns what was last given to e2k_cal_store_set_sync_state().
+ **/
+void
+e2k_cal_store_get_sync_state (E2kCalStore *store,
+                              gchar **lastmod,
+                              gint *count)
+{
+	g_return_if_fail (store != NULL);
+
+	g_mutex_lock (store->lock);
+	*lastmod = g_strdup (store->sync_lastmod);
+	*count = store->sync_count;
+	g_mutex_unlock (store->lock);
+}
+
+gboolean
+e2k_cal_store_set_sync_state (E2kCalStore *store,
+                              const gchar *lastmod,
+                              gint count)
+{
+	gboolean ok = TRUE;
+
+	g_return_val_if_fail (store != NULL, FALSE);
+
+	g_mutex_lock (store->lock);
+	if (count != store->sync_count ||
+	    g_strcmp0 (lastmod, store->sync_lastmod) != 0) {
+		ok = log_append_state (store->fd, &store->log_length, lastmod, count);
+		if (ok) {
+			g_free (store->sync_lastmod);
+			store->sync_lastmod = g_strdup (lastmod);
+			store->sync_count = count;
+		}
+	}
+	g_mutex_unlock (store->lock);
+
+	return ok;
+}
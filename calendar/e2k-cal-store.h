@@ -0,0 +1,55 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* Copyright (C) 2001-2004 Novell, Inc. */
+
+#ifndef E2K_CAL_STORE_H
+#define E2K_CAL_STORE_H
+
+#include <time.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _E2kCalStore E2kCalStore;
+
+E2kCalStore *e2k_cal_store_open             (const gchar *filename);
+void         e2k_cal_store_free             (E2kCalStore *store);
+gboolean     e2k_cal_store_flush            (E2kCalStore *store);
+
+gboolean     e2k_cal_store_is_empty         (E2kCalStore *store);
+
+gboolean     e2k_cal_store_has_object       (E2kCalStore *store,
+					     const gchar *uid);
+gchar       *e2k_cal_store_get_object       (E2kCalStore *store,
+					     const gchar *uid,
+					     gchar      **href,
+					     gchar      **lastmod);
+GPtrArray   *e2k_cal_store_get_uids         (E2kCalStore *store);
+gboolean     e2k_cal_store_get_object_range (E2kCalStore *store,
+					     const gchar *uid,
+					     time_t      *start,
+					     time_t      *end);
+gboolean     e2k_cal_store_put_object       (E2kCalStore *store,
+					     const gchar *uid,
+					     const gchar *href,
+					     const gchar *lastmod,
+					     time_t       start,
+					     time_t       end,
+					     const gchar *data);
+gboolean     e2k_cal_store_remove_object    (E2kCalStore *store,
+					     const gchar *uid);
+
+GSList      *e2k_cal_store_get_timezones    (E2kCalStore *store);
+gboolean     e2k_cal_store_put_timezone     (E2kCalStore *store,
+					     const gchar *tzid,
+					     const gchar *data);
+
+void         e2k_cal_store_get_sync_state   (E2kCalStore *store,
+					     gchar      **lastmod,
+					     gint        *count);
+gboolean     e2k_cal_store_set_sync_state   (E2kCalStore *store,
+					     const gchar *lastmod,
+					     gint         count);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,165 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/* Copyright (C) 2001-2004 Novell, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Times running a selective query over a large calendar cache, the
+ * way start_view() does, with E2kCalMatcher and with the copy of every
+ * component that it replaced, and counts the components each one
+ * copies. With E2kCalMatcher only the matching ones are copied, to
+ * hand to the view.
+ *
+ * Build with:
+ *   cc -o matchtest matchtest.c e2k-cal-match.c `pkg-config --cflags --libs libedata-cal-1.2`
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "e2k-cal-match.h"
+
+#define QUERY "(contains? \"summary\" \"Meeting 42\")"
+
+static icalcomponent *
+make_event (guint i)
+{
+	icalcomponent *icomp;
+	time_t start = 1325376000 + (time_t) i * 3600;
+	gchar *str;
+
+	icomp = icalcomponent_new (ICAL_VEVENT_COMPONENT);
+
+	str = g_strdup_printf ("matchtest-%u", i);
+	icalcomponent_set_uid (icomp, str);
+	g_free (str);
+
+	str = g_strdup_printf ("Meeting %u", i);
+	icalcomponent_set_summary (icomp, str);
+	g_free (str);
+
+	icalcomponent_set_description (icomp,
+		"Agenda: review the previous minutes, go through the "
+		"open items, and agree on a date for the next meeting.");
+	icalcomponent_set_location (icomp, "Conference Room B");
+	icalcomponent_set_dtstart (icomp, icaltime_from_timet (start, FALSE));
+	icalcomponent_set_dtend (icomp, icaltime_from_timet (start + 1800, FALSE));
+	icalcomponent_set_dtstamp (icomp, icaltime_from_timet (start, FALSE));
+
+	return icomp;
+}
+
+gint
+main (gint argc,
+      gchar **argv)
+{
+	guint nevents = 50000, i;
+	icalcomponent **events;
+	ECalBackendSExp *sexp;
+	E2kCalMatcher *matcher;
+	ECalComponent *comp;
+	GSList *clone_matches = NULL, *matcher_matches = NULL, *l, *m;
+	guint clone_copies = 0, matcher_copies = 0;
+	gint64 start, clone_usecs, matcher_usecs;
+
+	if (argc == 2) {
+		nevents = atoi (argv[1]);
+	} else if (argc != 1) {
+		fprintf (stderr, "Usage: %s [events]\n", argv[0]);
+		return 1;
+	}
+
+#if !GLIB_CHECK_VERSION (2, 35, 0)
+	g_type_init ();
+#endif
+
+	events = g_new (icalcomponent *, nevents);
+	for (i = 0; i < nevents; i++)
+		events[i] = make_event (i);
+
+	sexp = e_cal_backend_sexp_new (QUERY);
+	if (!sexp) {
+		fprintf (stderr, "Couldn't parse %s\n", QUERY);
+		return 1;
+	}
+
+	start = g_get_monotonic_time ();
+	for (i = 0; i < nevents; i++) {
+		comp = e_cal_component_new ();
+		e_cal_component_set_icalcomponent (comp, icalcomponent_new_clone (events[i]));
+		clone_copies++;
+
+		if (e_cal_backend_sexp_match_comp (sexp, comp, NULL))
+			clone_matches = g_slist_prepend (clone_matches, g_object_ref (comp));
+		g_object_unref (comp);
+	}
+	clone_usecs = g_get_monotonic_time () - start;
+
+	start = g_get_monotonic_time ();
+	matcher = e2k_cal_matcher_new (sexp, NULL);
+	for (i = 0; i < nevents; i++) {
+		if (!e2k_cal_matcher_match (matcher, events[i]))
+			continue;
+
+		comp = e_cal_component_new_from_icalcomponent (icalcomponent_new_clone (events[i]));
+		matcher_copies++;
+		matcher_matches = g_slist_prepend (matcher_matches, comp);
+	}
+	e2k_cal_matcher_free (matcher);
+	matcher_usecs = g_get_monotonic_time () - start;
+
+	for (l = clone_matches, m = matcher_matches; l && m; l = l->next, m = m->next) {
+		gchar *clone_str, *matcher_str;
+		gboolean same;
+
+		clone_str = e_cal_component_get_as_string (l->data);
+		matcher_str = e_cal_component_get_as_string (m->data);
+		same = strcmp (clone_str, matcher_str) == 0;
+		g_free (clone_str);
+		g_free (matcher_str);
+		if (!same)
+			break;
+	}
+	if (l || m) {
+		fprintf (stderr, "The two ways matched different components\n");
+		return 1;
+	}
+
+	/* Every event must still be intact, and not have been freed */
+	for (i = 0; i < nevents; i++) {
+		if (icalcomponent_get_parent (events[i]) ||
+		    !icalcomponent_get_uid (events[i])) {
+			fprintf (stderr, "Event %u was damaged by matching\n", i);
+			return 1;
+		}
+	}
+
+	printf ("Matching %s against %u events (%u match):\n",
+		QUERY, nevents, g_slist_length (matcher_matches));
+	printf ("  Copying each:  %10.1f ms, %8u components copied\n",
+		clone_usecs / 1000.0, clone_copies);
+	printf ("  E2kCalMatcher: %10.1f ms, %8u components copied\n",
+		matcher_usecs / 1000.0, matcher_copies);
+
+	g_slist_free_full (clone_matches, g_object_unref);
+	g_slist_free_full (matcher_matches, g_object_unref);
+	g_object_unref (sexp);
+	for (i = 0; i < nevents; i++)
+		icalcomponent_free (events[i]);
+	g_free (events);
+	return 0;
+}
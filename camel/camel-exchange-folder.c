@@ -28,14 +28,22 @@
 #include <sys/stat.h>
 
 #include <glib/gi18n-lib.h>
+#include <glib/gstdio.h>
 #include <libedataserver/e-data-server-util.h>
 
 #include "camel-exchange-folder.h"
 #include "camel-exchange-search.h"
+#include "camel-exchange-settings.h"
 #include "camel-exchange-store.h"
 #include "camel-exchange-summary.h"
 #include "camel-exchange-journal.h"
 #include "camel-exchange-utils.h"
+#include "exchange-folder-index.h"
+
+/* How many messages to download at once for offline use; the rest
+ * of the connections are left for whatever the user is doing.
+ */
+#define EXCHANGE_PREFETCH_THREADS 2
 
 #define CAMEL_EXCHANGE_SERVER_FLAGS \
 	(CAMEL_MESSAGE_ANSWERED | CAMEL_MESSAGE_ANSWERED_ALL | \
@@ -51,6 +59,93 @@ static const gchar *mailing_list_headers =
 
 G_DEFINE_TYPE (CamelExchangeFolder, camel_exchange_folder, CAMEL_TYPE_OFFLINE_FOLDER)
 
+/* Message bodies are written into a "tmp" cache entry, and only
+ * renamed into "cache" once all of the message is there, so a
+ * download or copy that is cut off part way never leaves a truncated
+ * message to be taken for the whole thing. Anything in "cache" is
+ * therefore complete.
+ */
+static CamelStream *
+exchange_folder_cache_begin (CamelExchangeFolder *exch,
+                             const gchar *uid,
+                             GError **error)
+{
+	return camel_data_cache_add (exch->cache, "tmp", uid, error);
+}
+
+/* Discards @stream, from exchange_folder_cache_begin(), and what was
+ * written to it.
+ */
+static void
+exchange_folder_cache_abort (CamelExchangeFolder *exch,
+                             const gchar *uid,
+                             CamelStream *stream)
+{
+	g_object_unref (stream);
+	camel_data_cache_remove (exch->cache, "tmp", uid, NULL);
+}
+
+/* Moves what was written to @stream, from exchange_folder_cache_begin(),
+ * into the cache as @uid. Consumes @stream either way.
+ */
+static gboolean
+exchange_folder_cache_commit (CamelExchangeFolder *exch,
+                              const gchar *uid,
+                              CamelStream *stream,
+                              GCancellable *cancellable,
+                              GError **error)
+{
+	gchar *tmp_name, *cache_name, *dir;
+	gboolean success = FALSE;
+
+	if (camel_stream_flush (stream, cancellable, error) == -1) {
+		exchange_folder_cache_abort (exch, uid, stream);
+		return FALSE;
+	}
+	g_object_unref (stream);
+
+	tmp_name = camel_data_cache_get_filename (exch->cache, "tmp", uid, NULL);
+	cache_name = camel_data_cache_get_filename (exch->cache, "cache", uid, NULL);
+	dir = g_path_get_dirname (cache_name);
+
+	/* Drop any stale entry, and a stream still open on it */
+	camel_data_cache_remove (exch->cache, "cache", uid, NULL);
+
+	if (g_mkdir_with_parents (dir, S_IRWXU) == 0 &&
+	    g_rename (tmp_name, cache_name) == 0)
+		success = TRUE;
+	else {
+		g_set_error (
+			error, G_IO_ERROR,
+			g_io_error_from_errno (errno),
+			_("Could not cache message %s: %s"),
+			uid, g_strerror (errno));
+		camel_data_cache_remove (exch->cache, "tmp", uid, NULL);
+	}
+
+	g_free (dir);
+	g_free (cache_name);
+	g_free (tmp_name);
+
+	return success;
+}
+
+/* Whether all of @uid is in the cache */
+static gboolean
+exchange_folder_is_cached (CamelExchangeFolder *exch,
+                           const gchar *uid)
+{
+	struct stat st;
+	gchar *filename;
+	gboolean cached;
+
+	filename = camel_data_cache_get_filename (exch->cache, "cache", uid, NULL);
+	cached = g_stat (filename, &st) == 0 && st.st_size > 0;
+	g_free (filename);
+
+	return cached;
+}
+
 static gboolean
 exchange_folder_append_message_data (CamelFolder *folder,
                                      GByteArray *message,
@@ -81,13 +176,12 @@ exchange_folder_append_message_data (CamelFolder *folder,
 		subject, message, &new_uid, error);
 
 	if (success) {
-		stream_cache = camel_data_cache_add (
-			exch->cache, "cache", new_uid, NULL);
+		stream_cache = exchange_folder_cache_begin (exch, new_uid, NULL);
 		if (stream_cache) {
-			if (camel_stream_write (stream_cache, (gchar *) message->data, message->len, cancellable, NULL) <= 0 ||
-			    camel_stream_flush (stream_cache, cancellable, NULL) == -1)
-				camel_data_cache_remove (exch->cache, "cache", new_uid, NULL);
-			g_object_unref (stream_cache);
+			if (camel_stream_write (stream_cache, (gchar *) message->data, message->len, cancellable, NULL) <= 0)
+				exchange_folder_cache_abort (exch, new_uid, stream_cache);
+			else
+				exchange_folder_cache_commit (exch, new_uid, stream_cache, cancellable, NULL);
 		}
 		if (appended_uid)
 			*appended_uid = new_uid;
@@ -99,17 +193,152 @@ exchange_folder_append_message_data (CamelFolder *folder,
 	return success;
 }
 
-static GByteArray *
-exchange_folder_get_message_data (CamelFolder *folder,
-                                  const gchar *uid,
-                                  GCancellable *cancellable,
-                                  GError **error)
+/* Downloading messages for offline use ahead of time. */
+
+typedef struct {
+	CamelFolder *folder;
+	GCancellable *cancellable;
+
+	GMutex *lock;
+	guint done, total;
+	GError *error;
+
+	/* Bytes per second, or 0 for no limit */
+	guint64 rate_limit;
+	gint64 start;
+	guint64 bytes;
+} ExchangePrefetch;
+
+/* Sleeps for @usecs, or until @cancellable is cancelled */
+static void
+prefetch_sleep (GCancellable *cancellable,
+                gint64 usecs)
+{
+	gint64 end = g_get_monotonic_time () + usecs;
+	gint64 left;
+
+	while (!g_cancellable_is_cancelled (cancellable) &&
+	       (left = end - g_get_monotonic_time ()) > 0)
+		g_usleep (MIN (left, G_USEC_PER_SEC / 10));
+}
+
+/* Passes a download straight through, holding it up as it arrives
+ * whenever the prefetch's average rate since it started is over its
+ * limit, so a single large message is throttled too.
+ */
+typedef struct {
+	CamelMimeFilter parent;
+	ExchangePrefetch *prefetch;
+} ExchangeThrottleFilter;
+
+typedef struct {
+	CamelMimeFilterClass parent_class;
+} ExchangeThrottleFilterClass;
+
+GType exchange_throttle_filter_get_type (void);
+
+G_DEFINE_TYPE (ExchangeThrottleFilter, exchange_throttle_filter, CAMEL_TYPE_MIME_FILTER)
+
+static void
+throttle_filter_filter (CamelMimeFilter *mime_filter,
+                        const gchar *in,
+                        gsize len,
+                        gsize prespace,
+                        gchar **out,
+                        gsize *outlen,
+                        gsize *outprespace)
+{
+	ExchangePrefetch *prefetch = ((ExchangeThrottleFilter *) mime_filter)->prefetch;
+	gint64 delay;
+
+	g_mutex_lock (prefetch->lock);
+	prefetch->bytes += len;
+	delay = prefetch->start +
+		(gint64) (prefetch->bytes * G_USEC_PER_SEC / prefetch->rate_limit) -
+		g_get_monotonic_time ();
+	g_mutex_unlock (prefetch->lock);
+
+	if (delay > 0)
+		prefetch_sleep (prefetch->cancellable, delay);
+
+	*out = (gchar *) in;
+	*outlen = len;
+	*outprespace = prespace;
+}
+
+static void
+throttle_filter_complete (CamelMimeFilter *mime_filter,
+                          const gchar *in,
+                          gsize len,
+                          gsize prespace,
+                          gchar **out,
+                          gsize *outlen,
+                          gsize *outprespace)
+{
+	throttle_filter_filter (mime_filter, in, len, prespace, out, outlen, outprespace);
+}
+
+static void
+exchange_throttle_filter_class_init (ExchangeThrottleFilterClass *class)
+{
+	CamelMimeFilterClass *mime_filter_class;
+
+	mime_filter_class = CAMEL_MIME_FILTER_CLASS (class);
+	mime_filter_class->filter = throttle_filter_filter;
+	mime_filter_class->complete = throttle_filter_complete;
+}
+
+static void
+exchange_throttle_filter_init (ExchangeThrottleFilter *filter)
+{
+}
+
+static CamelMimeFilter *
+exchange_throttle_filter_new (ExchangePrefetch *prefetch)
+{
+	ExchangeThrottleFilter *filter;
+
+	filter = g_object_new (exchange_throttle_filter_get_type (), NULL);
+	filter->prefetch = prefetch;
+
+	return CAMEL_MIME_FILTER (filter);
+}
+
+/* Returns the cached copy of @uid positioned at its start, or %NULL
+ * if it isn't cached. Call with download_lock held.
+ */
+static CamelStream *
+exchange_folder_get_cached_stream (CamelExchangeFolder *exch,
+                                   const gchar *uid)
+{
+	CamelStream *stream;
+
+	if (!exchange_folder_is_cached (exch, uid))
+		return NULL;
+
+	stream = camel_data_cache_get (exch->cache, "cache", uid, NULL);
+	if (stream)
+		g_seekable_seek (G_SEEKABLE (stream), 0, G_SEEK_SET, NULL, NULL);
+
+	return stream;
+}
+
+/* Returns the cached copy of @uid, downloading it into the cache
+ * first if need be, positioned at its start. If @prefetch has a rate
+ * limit, the download is held to it.
+ */
+static CamelStream *
+exchange_folder_get_message_stream_full (CamelFolder *folder,
+                                         const gchar *uid,
+                                         ExchangePrefetch *prefetch,
+                                         GCancellable *cancellable,
+                                         GError **error)
 {
 	CamelExchangeFolder *exch;
 	CamelExchangeStore *store;
-	CamelStream *stream, *stream_mem;
+	CamelStream *stream, *target;
+	CamelMimeFilter *throttle;
 	CamelStore *parent_store;
-	GByteArray *ba;
 	const gchar *full_name;
 
 	full_name = camel_folder_get_full_name (folder);
@@ -118,63 +347,139 @@ exchange_folder_get_message_data (CamelFolder *folder,
 	exch = CAMEL_EXCHANGE_FOLDER (folder);
 	store = CAMEL_EXCHANGE_STORE (parent_store);
 
-	stream = camel_data_cache_get (exch->cache, "cache", uid, NULL);
-	if (stream) {
-		CamelStream *null_stream = camel_stream_null_new ();
+	/* A message can be wanted by the prefetcher and by the user
+	 * at the same time; only one of them gets to write its cache
+	 * file, and the other waits for that.
+	 */
+	g_mutex_lock (exch->download_lock);
+	while (g_hash_table_lookup (exch->downloads, uid))
+		g_cond_wait (exch->download_cond, exch->download_lock);
+	stream = exchange_folder_get_cached_stream (exch, uid);
+	if (!stream)
+		g_hash_table_insert (exch->downloads, g_strdup (uid), GINT_TO_POINTER (TRUE));
+	g_mutex_unlock (exch->download_lock);
+
+	if (stream)
+		return stream;
 
-		g_seekable_seek (
-			G_SEEKABLE (stream), 0,
-			G_SEEK_SET, NULL, NULL);
+	if (!camel_exchange_store_connected (store, cancellable, NULL)) {
+		g_set_error (
+			error, CAMEL_SERVICE_ERROR,
+			CAMEL_SERVICE_ERROR_UNAVAILABLE,
+			_("This message is not available in offline mode."));
+		goto done;
+	}
 
-		if (camel_stream_write_to_stream (stream, null_stream, cancellable, NULL) <= 0) {
-			stream = NULL;
-		}
+	stream = exchange_folder_cache_begin (exch, uid, error);
+	if (!stream)
+		goto done;
+
+	target = g_object_ref (stream);
+	if (prefetch && prefetch->rate_limit) {
+		g_object_unref (target);
+		target = camel_stream_filter_new (stream);
+		throttle = exchange_throttle_filter_new (prefetch);
+		camel_stream_filter_add (CAMEL_STREAM_FILTER (target), throttle);
+		g_object_unref (throttle);
+	}
 
-		g_object_unref (null_stream);
+	if (!camel_exchange_utils_get_message_to_stream (
+		CAMEL_SERVICE (parent_store), full_name, uid,
+		target, cancellable, error) ||
+	    camel_stream_flush (target, cancellable, error) == -1) {
+		g_object_unref (target);
+		exchange_folder_cache_abort (exch, uid, stream);
+		stream = NULL;
+		goto done;
 	}
+	g_object_unref (target);
 
-	if (stream) {
-		ba = g_byte_array_new ();
-		stream_mem = camel_stream_mem_new ();
-		camel_stream_mem_set_byte_array (CAMEL_STREAM_MEM (stream_mem), ba);
+	if (exchange_folder_cache_commit (exch, uid, stream, cancellable, error))
+		stream = camel_data_cache_get (exch->cache, "cache", uid, error);
+	else
+		stream = NULL;
 
-		g_seekable_seek (
-			G_SEEKABLE (stream), 0,
-			G_SEEK_SET, NULL, NULL);
+ done:
+	g_mutex_lock (exch->download_lock);
+	g_hash_table_remove (exch->downloads, uid);
+	g_cond_broadcast (exch->download_cond);
+	g_mutex_unlock (exch->download_lock);
 
-		camel_stream_write_to_stream (stream, stream_mem, cancellable, NULL);
-		g_object_unref (stream_mem);
-		g_object_unref (stream);
+	return stream;
+}
 
-		return ba;
-	}
+static CamelStream *
+exchange_folder_get_message_stream (CamelFolder *folder,
+                                    const gchar *uid,
+                                    GCancellable *cancellable,
+                                    GError **error)
+{
+	return exchange_folder_get_message_stream_full (
+		folder, uid, NULL, cancellable, error);
+}
 
-	if (!camel_exchange_store_connected (store, cancellable, NULL)) {
-		g_set_error (
-			error, CAMEL_SERVICE_ERROR,
-			CAMEL_SERVICE_ERROR_UNAVAILABLE,
-			_("This message is not available in offline mode."));
-		return NULL;
-	}
+static GByteArray *
+exchange_folder_get_message_data (CamelFolder *folder,
+                                  const gchar *uid,
+                                  GCancellable *cancellable,
+                                  GError **error)
+{
+	CamelStream *stream, *stream_mem;
+	GByteArray *ba;
 
-	if (!camel_exchange_utils_get_message (
-		CAMEL_SERVICE (parent_store), full_name, uid, &ba, error))
+	stream = exchange_folder_get_message_stream (folder, uid, cancellable, error);
+	if (!stream)
 		return NULL;
 
-	stream = camel_data_cache_add (exch->cache, "cache", uid, error);
-	if (!stream) {
-		g_byte_array_free (ba, TRUE);
-		return NULL;
-	}
+	ba = g_byte_array_new ();
+	stream_mem = camel_stream_mem_new ();
+	camel_stream_mem_set_byte_array (CAMEL_STREAM_MEM (stream_mem), ba);
 
-	if (camel_stream_write (stream, (gchar *) ba->data, ba->len, cancellable, NULL) <= 0 ||
-	    camel_stream_flush (stream, cancellable, NULL) == -1)
-		camel_data_cache_remove (exch->cache, "cache", uid, NULL);
+	camel_stream_write_to_stream (stream, stream_mem, cancellable, NULL);
+	g_object_unref (stream_mem);
 	g_object_unref (stream);
 
 	return ba;
 }
 
+/* Messages can start with an SMTP envelope, and blank lines; returns
+ * how many bytes of that there are at the start of @stream, however
+ * long it is, or -1 if @stream couldn't be read.
+ */
+static goffset
+exchange_folder_skip_envelope (CamelStream *stream,
+                               GCancellable *cancellable,
+                               GError **error)
+{
+	CamelStream *buffer;
+	gchar line[1024];
+	gboolean in_line = FALSE;
+	goffset skip = 0;
+	gint len;
+
+	buffer = camel_stream_buffer_new (stream, CAMEL_STREAM_BUFFER_READ);
+
+	/* A line longer than @line comes back in pieces, which are
+	 * skipped along with its start.
+	 */
+	while ((len = camel_stream_buffer_gets (
+			CAMEL_STREAM_BUFFER (buffer), line,
+			sizeof (line), cancellable, error)) > 0) {
+		if (!in_line &&
+		    !g_str_has_prefix (line, "MAIL FROM:") &&
+		    !g_str_has_prefix (line, "RCPT TO:") &&
+		    !(len <= 2 && line[len - 1] == '\n'))
+			break;
+
+		skip += len;
+		in_line = line[len - 1] != '\n';
+	}
+
+	g_object_unref (buffer);
+
+	return len < 0 ? -1 : skip;
+}
+
 static void
 fix_broken_multipart_related (CamelMimePart *part)
 {
@@ -306,11 +611,12 @@ exchange_folder_cache_xfer (CamelExchangeFolder *folder_source,
 		if (!src)
 			continue;
 
-		dest = camel_data_cache_add (folder_dest->cache, "cache",
-					     dest_uids->pdata[i], NULL);
+		dest = exchange_folder_cache_begin (folder_dest, dest_uids->pdata[i], NULL);
 		if (dest) {
-			camel_stream_write_to_stream (src, dest, NULL, NULL);
-			g_object_unref (dest);
+			if (camel_stream_write_to_stream (src, dest, NULL, NULL) == -1)
+				exchange_folder_cache_abort (folder_dest, dest_uids->pdata[i], dest);
+			else
+				exchange_folder_cache_commit (folder_dest, dest_uids->pdata[i], dest, NULL, NULL);
 		}
 		g_object_unref (src);
 
@@ -344,6 +650,11 @@ exchange_folder_finalize (GObject *object)
 		g_hash_table_destroy (exch->thread_index_to_message_id);
 
 	g_free (exch->source);
+	g_free (exch->index_file);
+
+	g_hash_table_destroy (exch->downloads);
+	g_mutex_free (exch->download_lock);
+	g_cond_free (exch->download_cond);
 
 	/* Chain up to parent's finalize() method. */
 	G_OBJECT_CLASS (camel_exchange_folder_parent_class)->finalize (object);
@@ -546,36 +857,22 @@ exchange_folder_get_message_sync (CamelFolder *folder,
 	CamelStream *stream;
 	CamelStream *filtered_stream;
 	CamelMimeFilter *crlffilter;
-	GByteArray *ba;
 	gchar **list_headers = NULL;
 	gboolean found_list = FALSE;
+	goffset skip;
 
-	ba = exchange_folder_get_message_data (folder, uid, cancellable, error);
-	if (!ba)
+	stream = exchange_folder_get_message_stream (folder, uid, cancellable, error);
+	if (!stream)
 		return NULL;
 
-	g_byte_array_append (ba, (guint8 *) "", 1);
-
-	while ((ba->len > 10 && g_str_has_prefix ((const gchar *)ba->data, "MAIL FROM:")) ||
-	       (ba->len >  8 && g_str_has_prefix ((const gchar *)ba->data, "RCPT TO:")) ||
-	       (ba->len >  2 && (ba->data[0] == '\n' || ba->data[1] == '\n'))) {
-		guint i;
-
-		i = 0;
-		while (i < ba->len && ba->data[i] != '\n')
-			i++;
-
-		if (i < ba->len)
-			g_byte_array_remove_range (ba, 0, i + 1);
-		else
-			break;
+	skip = exchange_folder_skip_envelope (stream, cancellable, error);
+	if (skip < 0 ||
+	    !g_seekable_seek (G_SEEKABLE (stream), skip, G_SEEK_SET,
+			      cancellable, error)) {
+		g_object_unref (stream);
+		return NULL;
 	}
 
-	if (ba->len > 0 && ba->data[ba->len - 1] == 0)
-		g_byte_array_remove_index (ba, ba->len - 1);
-
-	stream = camel_stream_mem_new_with_byte_array (ba);
-
 	crlffilter = camel_mime_filter_crlf_new (CAMEL_MIME_FILTER_CRLF_DECODE, CAMEL_MIME_FILTER_CRLF_MODE_CRLF_ONLY);
 	filtered_stream = camel_stream_filter_new (stream);
 	camel_stream_filter_add (
@@ -612,6 +909,250 @@ exchange_folder_get_message_sync (CamelFolder *folder,
 	return msg;
 }
 
+static gboolean
+exchange_folder_synchronize_message_sync (CamelFolder *folder,
+                                          const gchar *uid,
+                                          GCancellable *cancellable,
+                                          GError **error)
+{
+	CamelStream *stream;
+
+	/* Getting it into the cache is all that's wanted */
+	stream = exchange_folder_get_message_stream (folder, uid, cancellable, error);
+	if (!stream)
+		return FALSE;
+
+	g_object_unref (stream);
+	return TRUE;
+}
+
+static GPtrArray *
+exchange_folder_get_uncached_uids (CamelFolder *folder,
+                                   GPtrArray *uids,
+                                   GError **error)
+{
+	CamelExchangeFolder *exch = CAMEL_EXCHANGE_FOLDER (folder);
+	GPtrArray *uncached;
+	gint i;
+
+	uncached = g_ptr_array_new ();
+	for (i = 0; i < uids->len; i++) {
+		if (!exchange_folder_is_cached (exch, uids->pdata[i]))
+			g_ptr_array_add (
+				uncached, (gpointer) camel_pstring_strdup (uids->pdata[i]));
+	}
+
+	return uncached;
+}
+
+typedef struct {
+	const gchar *uid;
+	time_t date;
+} ExchangePrefetchMessage;
+
+static gint
+prefetch_message_cmp (gconstpointer a,
+                      gconstpointer b)
+{
+	const ExchangePrefetchMessage *ma = a, *mb = b;
+
+	/* Newest first */
+	return ma->date < mb->date ? 1 : ma->date > mb->date ? -1 : 0;
+}
+
+static void
+prefetch_message_thread (gpointer data,
+                         gpointer user_data)
+{
+	gchar *uid = data;
+	ExchangePrefetch *prefetch = user_data;
+	CamelStream *stream = NULL;
+	GError *local_error = NULL;
+	gboolean skip;
+
+	g_mutex_lock (prefetch->lock);
+	skip = prefetch->error != NULL;
+	g_mutex_unlock (prefetch->lock);
+
+	if (!skip && !g_cancellable_is_cancelled (prefetch->cancellable))
+		stream = exchange_folder_get_message_stream_full (
+			prefetch->folder, uid, prefetch,
+			prefetch->cancellable, &local_error);
+	if (stream)
+		g_object_unref (stream);
+
+	g_mutex_lock (prefetch->lock);
+	prefetch->done++;
+	if (local_error && !prefetch->error) {
+		prefetch->error = local_error;
+		local_error = NULL;
+	}
+	camel_operation_progress (
+		prefetch->cancellable,
+		prefetch->done * 100 / prefetch->total);
+	g_mutex_unlock (prefetch->lock);
+
+	if (local_error)
+		g_error_free (local_error);
+
+	g_free (uid);
+}
+
+/* Downloads the uncached messages matching @expression (or all of
+ * them), newest first. In the @background, those that the account's
+ * prefetch settings rule out are skipped, and the rest are held to
+ * its rate limit; otherwise the user asked for everything, now.
+ */
+static gboolean
+exchange_folder_download (CamelFolder *folder,
+                          const gchar *expression,
+                          gboolean background,
+                          GCancellable *cancellable,
+                          GError **error)
+{
+	CamelExchangeSettings *settings;
+	CamelStore *parent_store;
+	CamelMessageInfo *info;
+	ExchangePrefetchMessage message;
+	ExchangePrefetch prefetch;
+	GThreadPool *pool;
+	GPtrArray *uids, *uncached;
+	GArray *messages;
+	guint64 max_size = 0, rate_limit = 0;
+	gboolean unread_only = FALSE, success = TRUE;
+	gint i;
+
+	parent_store = camel_folder_get_parent_store (folder);
+	settings = CAMEL_EXCHANGE_SETTINGS (
+		camel_service_get_settings (CAMEL_SERVICE (parent_store)));
+
+	if (background) {
+		unread_only = camel_exchange_settings_get_prefetch_unread_only (settings);
+		max_size = (guint64) camel_exchange_settings_get_prefetch_max_size (settings) * 1024;
+		rate_limit = (guint64) camel_exchange_settings_get_prefetch_rate_limit (settings) * 1024;
+	}
+
+	if (expression)
+		uids = camel_folder_search_by_expression (folder, expression, cancellable, error);
+	else
+		uids = camel_folder_get_uids (folder);
+	if (!uids)
+		return FALSE;
+
+	uncached = camel_folder_get_uncached_uids (folder, uids, NULL);
+	if (expression)
+		camel_folder_search_free (folder, uids);
+	else
+		camel_folder_free_uids (folder, uids);
+	if (!uncached)
+		return TRUE;
+
+	messages = g_array_sized_new (FALSE, FALSE, sizeof (ExchangePrefetchMessage), uncached->len);
+	for (i = 0; i < uncached->len; i++) {
+		info = camel_folder_summary_get (folder->summary, uncached->pdata[i]);
+		if (!info)
+			continue;
+
+		if ((!unread_only || !(camel_message_info_flags (info) & CAMEL_MESSAGE_SEEN)) &&
+		    (!max_size || camel_message_info_size (info) <= max_size)) {
+			message.uid = uncached->pdata[i];
+			message.date = camel_message_info_date_received (info);
+			g_array_append_val (messages, message);
+		}
+		camel_message_info_free (info);
+	}
+	g_array_sort (messages, prefetch_message_cmp);
+
+	if (messages->len > 0) {
+		camel_operation_push_message (
+			cancellable, _("Downloading messages for offline use in %s"),
+			camel_folder_get_display_name (folder));
+
+		memset (&prefetch, 0, sizeof (prefetch));
+		prefetch.folder = folder;
+		prefetch.cancellable = cancellable;
+		prefetch.lock = g_mutex_new ();
+		prefetch.total = messages->len;
+		prefetch.rate_limit = rate_limit;
+		prefetch.start = g_get_monotonic_time ();
+
+		pool = g_thread_pool_new (prefetch_message_thread, &prefetch,
+					  EXCHANGE_PREFETCH_THREADS, FALSE, NULL);
+		for (i = 0; i < messages->len; i++) {
+			message = g_array_index (messages, ExchangePrefetchMessage, i);
+			g_thread_pool_push (pool, g_strdup (message.uid), NULL);
+		}
+		g_thread_pool_free (pool, FALSE, TRUE);
+
+		g_mutex_free (prefetch.lock);
+
+		if (g_cancellable_set_error_if_cancelled (cancellable, error)) {
+			if (prefetch.error)
+				g_error_free (prefetch.error);
+			success = FALSE;
+		} else if (prefetch.error) {
+			g_propagate_error (error, prefetch.error);
+			success = FALSE;
+		}
+
+		camel_operation_pop_message (cancellable);
+	}
+
+	g_array_free (messages, TRUE);
+	camel_folder_free_uids (folder, uncached);
+
+	return success;
+}
+
+static gboolean
+exchange_folder_downsync_sync (CamelOfflineFolder *offline_folder,
+                               const gchar *expression,
+                               GCancellable *cancellable,
+                               GError **error)
+{
+	return exchange_folder_download (
+		CAMEL_FOLDER (offline_folder), expression,
+		FALSE, cancellable, error);
+}
+
+static void
+exchange_folder_prefetch_job (CamelSession *session,
+                              GCancellable *cancellable,
+                              CamelFolder *folder,
+                              GError **error)
+{
+	exchange_folder_download (folder, NULL, TRUE, cancellable, error);
+
+	g_atomic_int_set (&CAMEL_EXCHANGE_FOLDER (folder)->prefetching, FALSE);
+}
+
+/* Starts downloading the folder's messages in the background if it
+ * is meant to be available offline, unless that's already going on.
+ */
+static void
+exchange_folder_start_prefetch (CamelFolder *folder)
+{
+	CamelExchangeFolder *exch = CAMEL_EXCHANGE_FOLDER (folder);
+	CamelService *service;
+	CamelSettings *settings;
+
+	service = CAMEL_SERVICE (camel_folder_get_parent_store (folder));
+	settings = camel_service_get_settings (service);
+
+	if (!camel_offline_folder_get_offline_sync (CAMEL_OFFLINE_FOLDER (folder)) &&
+	    !camel_offline_settings_get_stay_synchronized (CAMEL_OFFLINE_SETTINGS (settings)))
+		return;
+
+	if (!g_atomic_int_compare_and_exchange (&exch->prefetching, FALSE, TRUE))
+		return;
+
+	camel_session_submit_job (
+		camel_service_get_session (service),
+		(CamelSessionCallback) exchange_folder_prefetch_job,
+		g_object_ref (folder),
+		(GDestroyNotify) g_object_unref);
+}
+
 static gboolean
 exchange_folder_refresh_info_sync (CamelFolder *folder,
                                    GCancellable *cancellable,
@@ -637,6 +1178,9 @@ exchange_folder_refresh_info_sync (CamelFolder *folder,
 		success = camel_exchange_utils_refresh_folder (
 			CAMEL_SERVICE (parent_store),
 			full_name, cancellable, error);
+
+		if (success)
+			exchange_folder_start_prefetch (folder);
 	}
 
 	/* sync up the counts now */
@@ -663,10 +1207,29 @@ exchange_folder_synchronize_sync (CamelFolder *folder,
                                   GCancellable *cancellable,
                                   GError **error)
 {
+	CamelExchangeFolder *exch = CAMEL_EXCHANGE_FOLDER (folder);
+	CamelStore *parent_store;
+
 	if (expunge)
 		exchange_folder_expunge_sync (folder, cancellable, NULL);
 
-	return camel_folder_summary_save_to_db (folder->summary, error);
+	if (!camel_folder_summary_save_to_db (folder->summary, error))
+		return FALSE;
+
+	/* While there are offline changes waiting to be replayed, the
+	 * summary knows better than we do, so don't leave an index
+	 * around to be preferred over it.
+	 */
+	parent_store = camel_folder_get_parent_store (folder);
+	if (!g_queue_is_empty (&exch->journal->queue))
+		g_unlink (exch->index_file);
+	else if (!camel_exchange_utils_save_folder_index (
+			 CAMEL_SERVICE (parent_store),
+			 camel_folder_get_full_name (folder),
+			 exch->index_file, NULL))
+		g_unlink (exch->index_file);
+
+	return TRUE;
 }
 
 static gboolean
@@ -774,6 +1337,7 @@ camel_exchange_folder_class_init (CamelExchangeFolderClass *class)
 {
 	GObjectClass *object_class;
 	CamelFolderClass *folder_class;
+	CamelOfflineFolderClass *offline_folder_class;
 
 	object_class = G_OBJECT_CLASS (class);
 	object_class->dispose = exchange_folder_dispose;
@@ -791,6 +1355,11 @@ camel_exchange_folder_class_init (CamelExchangeFolderClass *class)
 	folder_class->refresh_info_sync = exchange_folder_refresh_info_sync;
 	folder_class->synchronize_sync = exchange_folder_synchronize_sync;
 	folder_class->transfer_messages_to_sync = exchange_folder_transfer_messages_to_sync;
+	folder_class->synchronize_message_sync = exchange_folder_synchronize_message_sync;
+	folder_class->get_uncached_uids = exchange_folder_get_uncached_uids;
+
+	offline_folder_class = CAMEL_OFFLINE_FOLDER_CLASS (class);
+	offline_folder_class->downsync_sync = exchange_folder_downsync_sync;
 }
 
 static void
@@ -802,6 +1371,11 @@ camel_exchange_folder_init (CamelExchangeFolder *exchange_folder)
 	folder->permanent_flags =
 		CAMEL_EXCHANGE_SERVER_FLAGS | CAMEL_MESSAGE_FLAGGED |
 		CAMEL_MESSAGE_JUNK | CAMEL_MESSAGE_USER;
+
+	exchange_folder->download_lock = g_mutex_new ();
+	exchange_folder->download_cond = g_cond_new ();
+	exchange_folder->downloads = g_hash_table_new_full (
+		g_str_hash, g_str_equal, g_free, NULL);
 }
 
 /* A new post to a folder gets a 27-byte-long thread index. (The value
@@ -811,6 +1385,46 @@ camel_exchange_folder_init (CamelExchangeFolder *exchange_folder)
  * 37-byte-long thread index, etc. The Thread-Index header contains a
  * base64 representation of this value.
  */
+/* Maps the Thread-Index of each message in @exch to its Message-ID.
+ * This needs every message's summary info, so it is only built the
+ * first time it is wanted rather than when the folder is opened.
+ */
+static GHashTable *
+get_thread_index_map (CamelExchangeFolder *exch)
+{
+	CamelFolder *folder = CAMEL_FOLDER (exch);
+	CamelMessageInfo *info;
+	CamelExchangeMessageInfo *einfo;
+	GPtrArray *known_uids;
+	gint i;
+
+	if (exch->thread_index_to_message_id)
+		return exch->thread_index_to_message_id;
+
+	exch->thread_index_to_message_id =
+		g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+	known_uids = camel_folder_summary_get_array (folder->summary);
+	for (i = 0; known_uids && i < known_uids->len; i++) {
+		info = camel_folder_summary_get (folder->summary, g_ptr_array_index (known_uids, i));
+		if (!info)
+			continue;
+		einfo = (CamelExchangeMessageInfo *) info;
+
+		if (einfo->thread_index && einfo->info.message_id.id.id) {
+			g_hash_table_insert (exch->thread_index_to_message_id,
+					     g_strdup (einfo->thread_index),
+					     g_memdup (&einfo->info.message_id, sizeof (CamelSummaryMessageID)));
+		}
+
+		camel_message_info_free (info);
+	}
+
+	camel_folder_summary_free_array (known_uids);
+
+	return exch->thread_index_to_message_id;
+}
+
 static CamelSummaryMessageID *
 find_parent (CamelExchangeFolder *exch,
              const gchar *thread_index)
@@ -830,7 +1444,7 @@ find_parent (CamelExchangeFolder *exch,
 	parent = g_base64_encode (decoded, dlen - 5);
 	g_free (decoded);
 
-	msgid = g_hash_table_lookup (exch->thread_index_to_message_id,
+	msgid = g_hash_table_lookup (get_thread_index_map (exch),
 				     parent);
 	g_free (parent);
 	return msgid;
@@ -881,7 +1495,7 @@ camel_exchange_folder_add_message (CamelExchangeFolder *exch,
 		CamelSummaryMessageID *parent;
 
 		if (einfo->info.message_id.id.id)
-			g_hash_table_insert (exch->thread_index_to_message_id,
+			g_hash_table_insert (get_thread_index_map (exch),
 					     g_strdup (einfo->thread_index),
 					     g_memdup (&einfo->info.message_id, sizeof (CamelSummaryMessageID)));
 
@@ -930,7 +1544,10 @@ camel_exchange_folder_remove_message (CamelExchangeFolder *exch,
 		return;
 
 	einfo = (CamelExchangeMessageInfo *) info;
-	if (einfo->thread_index) {
+	/* If the map hasn't been built yet, it will be built without
+	 * this message.
+	 */
+	if (einfo->thread_index && exch->thread_index_to_message_id) {
 		gpointer key, value;
 
 		if (g_hash_table_lookup_extended (exch->thread_index_to_message_id,
@@ -1065,6 +1682,36 @@ camel_exchange_folder_update_message_tag (CamelExchangeFolder *exch,
 	}
 }
 
+/* Whether @index lists exactly the messages in @summary (an array of
+ * uids), and was saved at the same high article number.
+ */
+static gboolean
+index_matches_summary (ExchangeFolderIndex *index,
+                       GPtrArray *summary,
+                       guint32 high_article_num)
+{
+	ExchangeFolderIndexEntry entry;
+	GHashTable *uids;
+	gboolean matches = TRUE;
+	guint i;
+
+	if (exchange_folder_index_get_length (index) != summary->len ||
+	    exchange_folder_index_get_high_article_num (index) != high_article_num)
+		return FALSE;
+
+	uids = g_hash_table_new (g_str_hash, g_str_equal);
+	for (i = 0; i < summary->len; i++) {
+		exchange_folder_index_get (index, i, &entry);
+		g_hash_table_insert (uids, (gchar *) entry.uid, (gchar *) entry.uid);
+	}
+	matches = g_hash_table_size (uids) == summary->len;
+	for (i = 0; i < summary->len && matches; i++)
+		matches = g_hash_table_lookup (uids, summary->pdata[i]) != NULL;
+	g_hash_table_destroy (uids);
+
+	return matches;
+}
+
 /**
  * camel_exchange_folder_construct:
  * @folder: the folder
@@ -1092,11 +1739,11 @@ camel_exchange_folder_construct (CamelFolder *folder,
 	GByteArray *flags;
 	guint32 folder_flags;
 	CamelMessageInfo *info;
-	CamelExchangeMessageInfo *einfo;
 	CamelStore *parent_store;
 	const gchar *full_name;
 	gint i, len = 0;
-	GPtrArray *known_uids;
+	ExchangeFolderIndex *index;
+	GArray *article_nums;
 
 	full_name = camel_folder_get_full_name (folder);
 	parent_store = camel_folder_get_parent_store (folder);
@@ -1141,30 +1788,13 @@ camel_exchange_folder_construct (CamelFolder *folder,
 	g_free (path);
 	camel_object_state_read (CAMEL_OBJECT (folder));
 
-	exch->thread_index_to_message_id =
-		g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
-
-	known_uids = camel_folder_summary_get_array (folder->summary);
-	for (i = 0; known_uids && i < known_uids->len; i++) {
-		info = camel_folder_summary_get (folder->summary, g_ptr_array_index (known_uids, i));
-		einfo = (CamelExchangeMessageInfo *) info;
-
-		if (einfo->thread_index && einfo->info.message_id.id.id) {
-			g_hash_table_insert (exch->thread_index_to_message_id,
-					     g_strdup (einfo->thread_index),
-					     g_memdup (&einfo->info.message_id, sizeof (CamelSummaryMessageID)));
-		}
-
-		camel_message_info_free (info);
-	}
-
-	camel_folder_summary_free_array (known_uids);
+	exch->index_file = g_build_filename (folder_dir, "index", NULL);
 
 	if (parent_store != NULL) {
 		gboolean ok, create = camel_flags & CAMEL_STORE_FOLDER_CREATE, readonly = FALSE;
+		guint32 high_article_num;
 
-		camel_folder_summary_prepare_fetch_all (folder->summary, NULL);
-
+		high_article_num = CAMEL_EXCHANGE_SUMMARY (folder->summary)->high_article_num;
 		summary = camel_folder_get_summary (folder);
 		uids = g_ptr_array_new ();
 		g_ptr_array_set_size (uids, summary->len);
@@ -1172,26 +1802,55 @@ camel_exchange_folder_construct (CamelFolder *folder,
 		g_byte_array_set_size (flags, summary->len);
 		hrefs = g_ptr_array_new ();
 		g_ptr_array_set_size (hrefs, summary->len);
+		article_nums = NULL;
+
+		/* The index saves loading every message's info out of
+		 * the summary, if it describes the same messages.
+		 */
+		index = exchange_folder_index_open (exch->index_file);
+		if (index && !index_matches_summary (index, summary, high_article_num)) {
+			exchange_folder_index_free (index);
+			index = NULL;
+		}
+
+		if (index) {
+			ExchangeFolderIndexEntry entry;
 
-		for (i = 0; i < summary->len; i++) {
-			uids->pdata[i] = summary->pdata[i];
-			info = camel_folder_summary_get (folder->summary, uids->pdata[i]);
-			flags->data[i] = ((CamelMessageInfoBase *) info)->flags & CAMEL_EXCHANGE_SERVER_FLAGS;
-			hrefs->pdata[i] = ((CamelExchangeMessageInfo *) info)->href;
-			//camel_tag_list_free (&((CamelMessageInfoBase *) info)->user_tags);
+			article_nums = g_array_sized_new (FALSE, FALSE, sizeof (guint32), summary->len);
+			for (i = 0; i < summary->len; i++) {
+				exchange_folder_index_get (index, i, &entry);
+				uids->pdata[i] = (gchar *) entry.uid;
+				flags->data[i] = entry.flags & CAMEL_EXCHANGE_SERVER_FLAGS;
+				hrefs->pdata[i] = (gchar *) entry.href;
+				g_array_append_val (article_nums, entry.article_num);
+			}
+		} else {
+			camel_folder_summary_prepare_fetch_all (folder->summary, NULL);
+
+			for (i = 0; i < summary->len; i++) {
+				uids->pdata[i] = summary->pdata[i];
+				info = camel_folder_summary_get (folder->summary, uids->pdata[i]);
+				flags->data[i] = ((CamelMessageInfoBase *) info)->flags & CAMEL_EXCHANGE_SERVER_FLAGS;
+				hrefs->pdata[i] = ((CamelExchangeMessageInfo *) info)->href;
+				//camel_tag_list_free (&((CamelMessageInfoBase *) info)->user_tags);
+			}
 		}
 
 		camel_operation_push_message (
 			cancellable, _("Scanning for changed messages"));
 		ok = camel_exchange_utils_get_folder (
 			CAMEL_SERVICE (parent_store),
-			full_name, create, uids, flags, hrefs,
-			CAMEL_EXCHANGE_SUMMARY (folder->summary)->high_article_num,
+			full_name, create, uids, flags, hrefs, article_nums,
+			high_article_num,
 			&folder_flags, &exch->source, &readonly, error);
 		camel_operation_pop_message (cancellable);
 		g_ptr_array_free (uids, TRUE);
 		g_byte_array_free (flags, TRUE);
 		g_ptr_array_free (hrefs, TRUE);
+		if (article_nums)
+			g_array_free (article_nums, TRUE);
+		if (index)
+			exchange_folder_index_free (index);
 		camel_folder_free_summary (folder, summary);
 		if (!ok)
 			return FALSE;
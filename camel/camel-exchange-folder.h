@@ -40,6 +40,15 @@ struct _CamelExchangeFolder {
 	gchar *source;
 
 	GHashTable *thread_index_to_message_id;
+
+	gchar *index_file;
+
+	/* uids whose bodies are being downloaded into the cache */
+	GMutex *download_lock;
+	GCond *download_cond;
+	GHashTable *downloads;
+
+	volatile gint prefetching;
 };
 
 struct _CamelExchangeFolderClass {
@@ -22,6 +22,7 @@
 #endif
 
 #include <glib/gi18n-lib.h>
+#include <glib/gstdio.h>
 
 #include <ctype.h>
 #include <stdlib.h>
@@ -42,12 +43,22 @@
 #include "camel-exchange-store.h"
 #include "camel-exchange-summary.h"
 #include "camel-exchange-utils.h"
+#include "exchange-folder-index.h"
+#include "exchange-message-list.h"
 #include "mail-utils.h"
 
 #include "exchange-share-config-listener.h"
 
 #define d(x)
 
+/* Number of SEARCH/BPROPFIND batches to keep in flight while
+ * walking a large folder.
+ */
+#define EXCHANGE_READ_AHEAD_BATCHES 4
+
+/* Number of folders that can be refreshed in the background at once */
+#define EXCHANGE_REFRESH_THREADS 4
+
 typedef struct {
 	/* the first two are set immediately, the rest after connect */
 	CamelExchangeStore *estore;
@@ -58,17 +69,40 @@ typedef struct {
 	const gchar *mail_submission_uri;
 	EFolder *inbox, *deleted_items, *sent_items;
 
-	GStaticRecMutex changed_msgs_mutex;
+	/* Serializes get_folder_info; each folder has its own lock */
+	GStaticRecMutex folder_info_mutex;
+
+	/* Runs background refreshes; see schedule_refresh() */
+	GThreadPool *refresh_pool;
+	volatile gint closing;
 
 	guint new_folder_id, removed_folder_id;
 	const gchar *ignore_new_folder, *ignore_removed_folder;
 } ExchangeData;
 
+/* The strings belonging to a folder's messages. A removed message's
+ * strings stay in the chunk until it is compacted, which replaces it
+ * with a new ExchangeStrings.
+ */
+typedef struct {
+	GStringChunk *chunk;
+	gsize live, dead;
+} ExchangeStrings;
+
 typedef struct {
-	gchar *uid, *href;
+	/* In the folder's ExchangeStrings. href is relative to the
+	 * folder; see message_href().
+	 */
+	const gchar *uid, *href;
 	guint32 seq, flags;
 	guint32 change_flags, change_mask;
 	GData *tag_updates;
+
+	/* PR_INTERNET_ARTICLE_NUMBER, or 0 if we haven't seen it yet */
+	guint32 article_num;
+
+	/* Position in changed_messages, or -1 */
+	gint changed_index;
 } ExchangeMessage;
 
 typedef enum {
@@ -86,8 +120,15 @@ typedef struct {
 	ExchangeFolderType type;
 	guint32 access;
 
-	GPtrArray *messages;
+	/* Protects the messages and everything about them. Take it
+	 * only around local bookkeeping, not across requests to the
+	 * server, and never hold two folders' locks at once.
+	 */
+	GStaticRecMutex lock;
+
+	ExchangeMessageList *messages;
 	GHashTable *messages_by_uid, *messages_by_href;
+	ExchangeStrings *strings;
 	guint32 seq, high_article_num, deleted_count;
 
 	guint32 unread_count;
@@ -98,8 +139,23 @@ typedef struct {
 
 	time_t last_activity;
 	guint sync_deletion_timeout;
+
+	/* What schedule_refresh() has been asked to do, but hasn't
+	 * started on yet. Protected by the refresh_queue lock.
+	 */
+	guint refresh_pending;
+
+	/* Held by folders_by_name and by queued refreshes */
+	volatile gint ref_count;
+	gboolean removed;
 } ExchangeFolder;
 
+typedef enum {
+	EXCHANGE_REFRESH_NEW_MESSAGES = 1 << 0,
+	EXCHANGE_REFRESH_CONTENTS     = 1 << 1,
+	EXCHANGE_REFRESH_DELETIONS    = 1 << 2
+} ExchangeRefreshType;
+
 static const gchar *mapi_message_props[] = {
 	E2K_PR_MAILHEADER_SUBJECT,
 	E2K_PR_MAILHEADER_FROM,
@@ -177,6 +233,9 @@ is_same_ed (CamelExchangeStore *estore,
 }
 
 static void free_folder (gpointer value);
+static void schedule_refresh (ExchangeFolder *mfld, guint what);
+static void refresh_folder_thread (gpointer data, gpointer user_data);
+static gint refresh_priority_cmp (gconstpointer a, gconstpointer b, gpointer user_data);
 G_LOCK_DEFINE_STATIC (edies);
 
 static void
@@ -193,8 +252,12 @@ estore_gone_cb (gpointer edies_ptr,
 		ExchangeData *ed = l->data;
 
 		if (ed && ed->estore == (CamelExchangeStore *) gone_eservice) {
+			/* Let queued refreshes drain without doing anything */
+			g_atomic_int_set (&ed->closing, TRUE);
+			g_thread_pool_free (ed->refresh_pool, FALSE, TRUE);
+
 			g_hash_table_destroy (ed->folders_by_name);
-			g_static_rec_mutex_free (&ed->changed_msgs_mutex);
+			g_static_rec_mutex_free (&ed->folder_info_mutex);
 			g_free (ed);
 
 			*edies_lst_ptr = g_slist_remove (*edies_lst_ptr, ed);
@@ -239,7 +302,12 @@ get_data_for_service (CamelService *service)
 				g_object_weak_ref (G_OBJECT (service), estore_gone_cb, &edies);
 			}
 			res->folders_by_name = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, free_folder);
-			g_static_rec_mutex_init (&res->changed_msgs_mutex);
+			g_static_rec_mutex_init (&res->folder_info_mutex);
+			res->refresh_pool = g_thread_pool_new (refresh_folder_thread, res,
+							       EXCHANGE_REFRESH_THREADS,
+							       FALSE, NULL);
+			g_thread_pool_set_sort_function (res->refresh_pool,
+							 refresh_priority_cmp, res);
 
 			edies = g_slist_prepend (edies, res);
 			break;
@@ -308,30 +376,6 @@ folder_changed (ExchangeFolder *mfld)
 	e_folder_set_unread_count (mfld->folder, mfld->unread_count);
 }
 
-static gint
-find_message_index (ExchangeFolder *mfld,
-                    gint seq)
-{
-	ExchangeMessage *mmsg;
-	gint low, high, mid;
-
-	low = 0;
-	high = mfld->messages->len - 1;
-
-	while (low <= high) {
-		mid = (low + high) / 2;
-		mmsg = mfld->messages->pdata[mid];
-		if (seq == mmsg->seq)
-			return mid;
-		else if (seq < mmsg->seq)
-			high = mid - 1;
-		else
-			low = mid + 1;
-	}
-
-	return -1;
-}
-
 static inline ExchangeMessage *
 find_message (ExchangeFolder *mfld,
               const gchar *uid)
@@ -339,42 +383,201 @@ find_message (ExchangeFolder *mfld,
 	return g_hash_table_lookup (mfld->messages_by_uid, uid);
 }
 
+/* Messages are direct children of their folder, so only the last
+ * path component of their hrefs is kept.
+ */
+static inline const gchar *
+href_leaf (const gchar *href)
+{
+	const gchar *slash;
+
+	slash = strrchr (href, '/');
+	return slash ? slash + 1 : href;
+}
+
 static inline ExchangeMessage *
 find_message_by_href (ExchangeFolder *mfld,
                       const gchar *href)
 {
-	return g_hash_table_lookup (mfld->messages_by_href, href);
+	return g_hash_table_lookup (mfld->messages_by_href, href_leaf (href));
+}
+
+/* Returns the absolute URI of @mmsg, which the caller must free */
+static gchar *
+message_href (ExchangeFolder *mfld,
+              ExchangeMessage *mmsg)
+{
+	return e2k_uri_concat (e_folder_exchange_get_internal_uri (mfld->folder),
+			       mmsg->href);
+}
+
+static ExchangeStrings *
+strings_new (void)
+{
+	ExchangeStrings *strings;
+
+	strings = g_new0 (ExchangeStrings, 1);
+	strings->chunk = g_string_chunk_new (4096);
+
+	return strings;
+}
+
+static void
+strings_free (ExchangeStrings *strings)
+{
+	g_string_chunk_free (strings->chunk);
+	g_free (strings);
+}
+
+static const gchar *
+strings_add (ExchangeStrings *strings,
+             const gchar *str)
+{
+	if (!str)
+		return NULL;
+
+	strings->live += strlen (str) + 1;
+	return g_string_chunk_insert (strings->chunk, str);
+}
+
+static void
+strings_drop (ExchangeStrings *strings,
+              const gchar *str)
+{
+	gsize len;
+
+	if (!str)
+		return;
+
+	len = strlen (str) + 1;
+	strings->live -= len;
+	strings->dead += len;
 }
 
 static ExchangeMessage *
-new_message (const gchar *uid,
-             const gchar *uri,
+new_message (ExchangeFolder *mfld,
+             const gchar *uid,
+             const gchar *href,
              guint32 seq,
              guint32 flags)
 {
 	ExchangeMessage *mmsg;
 
-	mmsg = g_new0 (ExchangeMessage, 1);
-	mmsg->uid = g_strdup (uid);
-	mmsg->href = g_strdup (uri);
+	mmsg = g_slice_new0 (ExchangeMessage);
+	mmsg->uid = strings_add (mfld->strings, uid);
+	mmsg->href = href ? strings_add (mfld->strings, href_leaf (href)) : NULL;
 	mmsg->seq = seq;
 	mmsg->flags = flags;
+	mmsg->changed_index = -1;
 
 	return mmsg;
 }
 
 static void
-message_remove_at_index (ExchangeFolder *mfld,
-                         CamelFolder *folder,
-                         gint index)
+set_message_href (ExchangeFolder *mfld,
+                  ExchangeMessage *mmsg,
+                  const gchar *href)
+{
+	strings_drop (mfld->strings, mmsg->href);
+	mmsg->href = href ? strings_add (mfld->strings, href_leaf (href)) : NULL;
+}
+
+static void
+free_message (ExchangeMessage *mmsg)
+{
+	g_datalist_clear (&mmsg->tag_updates);
+	g_slice_free (ExchangeMessage, mmsg);
+}
+
+static void
+move_message_strings (gpointer data,
+                      gpointer user_data)
+{
+	ExchangeMessage *mmsg = data;
+	ExchangeFolder *mfld = user_data;
+
+	mmsg->uid = strings_add (mfld->strings, mmsg->uid);
+	g_hash_table_insert (mfld->messages_by_uid, (gchar *) mmsg->uid, mmsg);
+
+	if (mmsg->href) {
+		mmsg->href = strings_add (mfld->strings, mmsg->href);
+		if (!g_hash_table_lookup (mfld->messages_by_href, mmsg->href))
+			g_hash_table_insert (mfld->messages_by_href, (gchar *) mmsg->href, mmsg);
+	}
+}
+
+/* Once most of the folder's strings belong to removed messages, copy
+ * the rest into a new chunk. Call with mfld->lock held.
+ */
+static void
+compact_strings (ExchangeFolder *mfld)
+{
+	ExchangeStrings *old = mfld->strings;
+
+	if (old->dead < 65536 || old->dead < old->live)
+		return;
+
+	mfld->strings = strings_new ();
+	g_hash_table_remove_all (mfld->messages_by_uid);
+	g_hash_table_remove_all (mfld->messages_by_href);
+	exchange_message_list_foreach (mfld->messages, move_message_strings, mfld);
+	strings_free (old);
+}
+
+/* changed_messages is unordered, and each message in it knows its
+ * position, so that it can be taken out without searching for it.
+ * Call these with mfld->lock held.
+ */
+static void
+changed_messages_add (ExchangeFolder *mfld,
+                      ExchangeMessage *mmsg)
+{
+	if (mmsg->changed_index != -1)
+		return;
+
+	mmsg->changed_index = mfld->changed_messages->len;
+	g_ptr_array_add (mfld->changed_messages, mmsg);
+}
+
+static void
+changed_messages_remove_index (ExchangeFolder *mfld,
+                               guint index)
+{
+	ExchangeMessage *mmsg;
+
+	mmsg = mfld->changed_messages->pdata[index];
+	mmsg->changed_index = -1;
+
+	g_ptr_array_remove_index_fast (mfld->changed_messages, index);
+	if (index < mfld->changed_messages->len) {
+		mmsg = mfld->changed_messages->pdata[index];
+		mmsg->changed_index = index;
+	}
+}
+
+static void
+changed_messages_clear (ExchangeFolder *mfld)
 {
 	ExchangeMessage *mmsg;
+	gint i;
+
+	for (i = 0; i < mfld->changed_messages->len; i++) {
+		mmsg = mfld->changed_messages->pdata[i];
+		mmsg->changed_index = -1;
+	}
+	g_ptr_array_set_size (mfld->changed_messages, 0);
+}
+
+static void
+message_remove (ExchangeFolder *mfld,
+                CamelFolder *folder,
+                ExchangeMessage *mmsg)
+{
 	CamelMessageInfo *info;
 
-	mmsg = mfld->messages->pdata[index];
 	d(printf("Deleting mmsg %p\n", mmsg));
-	g_static_rec_mutex_lock (&mfld->ed->changed_msgs_mutex);
-	g_ptr_array_remove_index (mfld->messages, index);
+	g_static_rec_mutex_lock (&mfld->lock);
+	exchange_message_list_remove (mfld->messages, mmsg->seq);
 	g_hash_table_remove (mfld->messages_by_uid, mmsg->uid);
 	if (mmsg->href)
 		g_hash_table_remove (mfld->messages_by_href, mmsg->href);
@@ -382,32 +585,26 @@ message_remove_at_index (ExchangeFolder *mfld,
 		mfld->unread_count--;
 		folder_changed (mfld);
 	}
-	g_static_rec_mutex_unlock (&mfld->ed->changed_msgs_mutex);
-
-	if (mmsg->change_mask || mmsg->tag_updates) {
-		gint i;
-
-		g_static_rec_mutex_lock (&mfld->ed->changed_msgs_mutex);
-
-		for (i = 0; i < mfld->changed_messages->len; i++) {
-			if (mfld->changed_messages->pdata[i] == (gpointer) mmsg) {
-				g_ptr_array_remove_index_fast (mfld->changed_messages, i);
-				break;
-			}
-		}
-		g_static_rec_mutex_unlock (&mfld->ed->changed_msgs_mutex);
+	g_static_rec_mutex_unlock (&mfld->lock);
 
-		g_datalist_clear (&mmsg->tag_updates);
+	if (mmsg->changed_index != -1) {
+		g_static_rec_mutex_lock (&mfld->lock);
+		changed_messages_remove_index (mfld, mmsg->changed_index);
+		g_static_rec_mutex_unlock (&mfld->lock);
 	}
+	g_datalist_clear (&mmsg->tag_updates);
 
 	if (folder && (info = camel_folder_summary_get (folder->summary, mmsg->uid))) {
 		camel_message_info_free (info);
 		camel_exchange_folder_remove_message (CAMEL_EXCHANGE_FOLDER (folder), mmsg->uid);
 	}
 
-	g_free (mmsg->uid);
-	g_free (mmsg->href);
-	g_free (mmsg);
+	g_static_rec_mutex_lock (&mfld->lock);
+	strings_drop (mfld->strings, mmsg->uid);
+	strings_drop (mfld->strings, mmsg->href);
+	free_message (mmsg);
+	compact_strings (mfld);
+	g_static_rec_mutex_unlock (&mfld->lock);
 }
 
 static void
@@ -416,23 +613,16 @@ message_removed (ExchangeFolder *mfld,
                  const gchar *href)
 {
 	ExchangeMessage *mmsg;
-	guint index;
 
-	g_static_rec_mutex_lock (&mfld->ed->changed_msgs_mutex);
-	mmsg = g_hash_table_lookup (mfld->messages_by_href, href);
-	if (!mmsg) {
-		g_static_rec_mutex_unlock (&mfld->ed->changed_msgs_mutex);
+	g_static_rec_mutex_lock (&mfld->lock);
+	mmsg = find_message_by_href (mfld, href);
+	if (!mmsg || !exchange_message_list_lookup (mfld->messages, mmsg->seq)) {
+		g_static_rec_mutex_unlock (&mfld->lock);
 		return;
 	}
-	index = find_message_index (mfld, mmsg->seq);
 
-	if (index == -1) {
-		g_static_rec_mutex_unlock (&mfld->ed->changed_msgs_mutex);
-		return;
-	}
-
-	message_remove_at_index (mfld, folder, index);
-	g_static_rec_mutex_unlock (&mfld->ed->changed_msgs_mutex);
+	message_remove (mfld, folder, mmsg);
+	g_static_rec_mutex_unlock (&mfld->lock);
 }
 
 static const gchar *
@@ -545,6 +735,7 @@ refresh_folder_internal (ExchangeFolder *mfld,
 					       G_N_ELEMENTS (new_message_props),
 					       rn, NULL, TRUE);
 	e2k_restriction_unref (rn);
+	e2k_result_iter_set_read_ahead (iter, EXCHANGE_READ_AHEAD_BATCHES);
 
 	got = 0;
 	total = e2k_result_iter_get_total (iter);
@@ -630,6 +821,7 @@ refresh_folder_internal (ExchangeFolder *mfld,
 						  mapi_hrefs->len,
 						  mapi_message_props,
 						  G_N_ELEMENTS (mapi_message_props));
+	e2k_result_iter_set_read_ahead (iter, EXCHANGE_READ_AHEAD_BATCHES);
 	while ((result = e2k_result_iter_next (iter))) {
 		if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (result->status))
 			continue;
@@ -667,7 +859,7 @@ refresh_folder_internal (ExchangeFolder *mfld,
 	if (folder)
 		camel_folder_freeze (folder);
 
-	g_static_rec_mutex_lock (&mfld->ed->changed_msgs_mutex);
+	g_static_rec_mutex_lock (&mfld->lock);
 	qsort (messages->data, messages->len,
 	       sizeof (rm), refresh_message_compar);
 	for (i = 0; i < messages->len; i++) {
@@ -682,15 +874,15 @@ refresh_folder_internal (ExchangeFolder *mfld,
 			if (rm.flags != mmsg->flags)
 				change_flags (mfld, folder, mmsg, rm.flags);
 		} else {
-			if (g_hash_table_lookup (mfld->messages_by_href, rm.href)) {
+			if (find_message_by_href (mfld, rm.href)) {
 				mfld->deleted_count++;
 				message_removed (mfld, folder, rm.href);
 			}
 
-			mmsg = new_message (rm.uid, rm.href, mfld->seq++, rm.flags);
-			g_ptr_array_add (mfld->messages, mmsg);
-			g_hash_table_insert (mfld->messages_by_uid, mmsg->uid, mmsg);
-			g_hash_table_insert (mfld->messages_by_href, mmsg->href, mmsg);
+			mmsg = new_message (mfld, rm.uid, rm.href, mfld->seq++, rm.flags);
+			exchange_message_list_append (mfld->messages, mmsg->seq, mmsg);
+			g_hash_table_insert (mfld->messages_by_uid, (gchar *) mmsg->uid, mmsg);
+			g_hash_table_insert (mfld->messages_by_href, (gchar *) mmsg->href, mmsg);
 
 			if (!(mmsg->flags & CAMEL_MESSAGE_SEEN))
 				mfld->unread_count++;
@@ -698,6 +890,7 @@ refresh_folder_internal (ExchangeFolder *mfld,
 			if (folder)
 				camel_exchange_folder_add_message (CAMEL_EXCHANGE_FOLDER (folder), rm.uid, rm.flags, rm.size, rm.headers, rm.href);
 		}
+		mmsg->article_num = rm.article_num;
 
 		if (rm.article_num > mfld->high_article_num) {
 			mfld->high_article_num = rm.article_num;
@@ -717,7 +910,7 @@ refresh_folder_internal (ExchangeFolder *mfld,
 		camel_folder_thaw (folder);
 
 	mfld->scanned = TRUE;
-	g_static_rec_mutex_unlock (&mfld->ed->changed_msgs_mutex);
+	g_static_rec_mutex_unlock (&mfld->lock);
 	folder_changed (mfld);
 
  done:
@@ -739,68 +932,45 @@ refresh_folder_internal (ExchangeFolder *mfld,
 	g_ptr_array_free (mapi_hrefs, TRUE);
 }
 
+struct unknown_messages {
+	GHashTable *known;
+	guint32 before_seq;
+	GPtrArray *messages;
+};
+
 static void
-sync_deletions (ExchangeFolder *mfld)
+find_unknown_message (gpointer data,
+                      gpointer user_data)
 {
-	static const gchar *sync_deleted_props[] = {
-		PR_DELETED_COUNT_TOTAL,
-		E2K_PR_DAV_VISIBLE_COUNT
-	};
+	struct unknown_messages *unknown = user_data;
+	ExchangeMessage *mmsg = data;
 
+	/* Messages added since the listing started may not be in it */
+	if (mmsg->seq >= unknown->before_seq)
+		return;
+
+	if (!g_hash_table_lookup (unknown->known, mmsg))
+		g_ptr_array_add (unknown->messages, mmsg);
+}
+
+/* Finds deleted messages by listing every message in the folder */
+static void
+sync_deletions_full (ExchangeFolder *mfld)
+{
 	E2kHTTPStatus status;
-	E2kResult *results;
-	gint nresults = 0;
 	const gchar *prop;
-	gint deleted_count = -1, visible_count = -1;
 	E2kRestriction *rn;
 	E2kResultIter *iter;
 	E2kResult *result;
-	gint my_i, read;
+	gint i, read;
 	ExchangeMessage *mmsg;
 	GHashTable *known_messages;
+	struct unknown_messages unknown;
 	CamelFolder *folder;
 
-	g_return_if_fail (mfld != NULL);
-	g_return_if_fail (mfld->ed != NULL);
-
-	if (is_online (mfld->ed) != ONLINE_MODE)
-		return;
-
-	status = e_folder_exchange_propfind (mfld->folder, NULL,
-					     sync_deleted_props,
-					     G_N_ELEMENTS (sync_deleted_props),
-					     &results, &nresults);
-
-	if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status) || !nresults) {
-		g_warning ("got_sync_deleted_props: %d", status);
-		return;
-	}
-
-	prop = e2k_properties_get_prop (results[0].props,
-					PR_DELETED_COUNT_TOTAL);
-	if (prop)
-		deleted_count = atoi (prop);
-
-	prop = e2k_properties_get_prop (results[0].props,
-					E2K_PR_DAV_VISIBLE_COUNT);
-	if (prop)
-		visible_count = atoi (prop);
-
-	e2k_results_free (results, nresults);
-
-	g_static_rec_mutex_lock (&mfld->ed->changed_msgs_mutex);
-	if (visible_count >= mfld->messages->len) {
-		if (mfld->deleted_count == deleted_count) {
-			g_static_rec_mutex_unlock (&mfld->ed->changed_msgs_mutex);
-			return;
-		}
-
-		if (mfld->deleted_count == 0) {
-			mfld->deleted_count = deleted_count;
-			g_static_rec_mutex_unlock (&mfld->ed->changed_msgs_mutex);
-			return;
-		}
-	}
+	g_static_rec_mutex_lock (&mfld->lock);
+	unknown.before_seq = mfld->seq;
+	g_static_rec_mutex_unlock (&mfld->lock);
 
 	prop = E2K_PR_HTTPMAIL_READ;
 	rn = e2k_restriction_andv (
@@ -815,15 +985,17 @@ sync_deletions (ExchangeFolder *mfld)
 					       E2K_PR_DAV_CREATION_DATE,
 					       FALSE);
 	e2k_restriction_unref (rn);
+	e2k_result_iter_set_read_ahead (iter, EXCHANGE_READ_AHEAD_BATCHES);
 
 	known_messages = g_hash_table_new (g_direct_hash, g_direct_equal);
 
 	folder = get_camel_folder (mfld);
 
-	my_i = mfld->messages->len - 1;
 	while ((result = e2k_result_iter_next (iter))) {
+		g_static_rec_mutex_lock (&mfld->lock);
 		mmsg = find_message_by_href (mfld, result->href);
 		if (!mmsg) {
+			g_static_rec_mutex_unlock (&mfld->lock);
 			/* oops, message from the server not found in our list;
 			 * return failure to possibly do full resync again? */
 			g_message ("%s: Oops, message %s not found in %s", G_STRFUNC, result->href, mfld->name);
@@ -839,24 +1011,326 @@ sync_deletions (ExchangeFolder *mfld)
 		if ((mmsg->flags & CAMEL_MESSAGE_SEEN) != read) {
 			change_flags (mfld, folder, mmsg, mmsg->flags ^ CAMEL_MESSAGE_SEEN);
 		}
-
+		g_static_rec_mutex_unlock (&mfld->lock);
 	}
 	status = e2k_result_iter_free (iter);
 
-	if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status))
+	if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status)) {
+		/* We don't know what we missed, so don't throw
+		 * anything away.
+		 */
 		g_warning ("synced_deleted: %d", status);
+		g_hash_table_destroy (known_messages);
+		return;
+	}
 
 	/* Clear out removed messages from mfld */
-	for (my_i = mfld->messages->len - 1; my_i >= 0; my_i--) {
-		mmsg = mfld->messages->pdata[my_i];
-		if (!g_hash_table_lookup (known_messages, mmsg)) {
-			mfld->deleted_count++;
-			message_remove_at_index (mfld, folder, my_i);
-		}
+	g_static_rec_mutex_lock (&mfld->lock);
+	unknown.known = known_messages;
+	unknown.messages = g_ptr_array_new ();
+	exchange_message_list_foreach (mfld->messages, find_unknown_message, &unknown);
+	for (i = 0; i < unknown.messages->len; i++) {
+		mfld->deleted_count++;
+		message_remove (mfld, folder, unknown.messages->pdata[i]);
 	}
+	g_ptr_array_free (unknown.messages, TRUE);
+	g_static_rec_mutex_unlock (&mfld->lock);
 
 	g_hash_table_destroy (known_messages);
-	g_static_rec_mutex_unlock (&mfld->ed->changed_msgs_mutex);
+}
+
+/* Ranges with no more than this many local messages in them are
+ * listed rather than split further.
+ */
+#define SYNC_DELETIONS_LEAF_SIZE 64
+
+typedef struct {
+	guint32 article_num, seq;
+} ExchangeArticle;
+
+static void
+collect_article (gpointer data,
+                 gpointer user_data)
+{
+	ExchangeMessage *mmsg = data;
+	GArray *articles = user_data;
+	ExchangeArticle article;
+
+	article.article_num = mmsg->article_num;
+	article.seq = mmsg->seq;
+	g_array_append_val (articles, article);
+}
+
+static gint
+article_cmp (gconstpointer a,
+             gconstpointer b)
+{
+	const ExchangeArticle *art1 = a, *art2 = b;
+
+	if (art1->article_num < art2->article_num)
+		return -1;
+	return art1->article_num > art2->article_num;
+}
+
+static E2kRestriction *
+article_range_restriction (guint32 first,
+                           guint32 last)
+{
+	return e2k_restriction_andv (
+		e2k_restriction_prop_bool (E2K_PR_DAV_IS_COLLECTION,
+					   E2K_RELOP_EQ, FALSE),
+		e2k_restriction_prop_bool (E2K_PR_DAV_IS_HIDDEN,
+					   E2K_RELOP_EQ, FALSE),
+		e2k_restriction_prop_int (PR_INTERNET_ARTICLE_NUMBER,
+					  E2K_RELOP_GE, first),
+		e2k_restriction_prop_int (PR_INTERNET_ARTICLE_NUMBER,
+					  E2K_RELOP_LE, last),
+		NULL);
+}
+
+static gboolean
+count_articles (ExchangeFolder *mfld,
+                guint32 first,
+                guint32 last,
+                gint *count)
+{
+	E2kRestriction *rn;
+	E2kHTTPStatus status;
+
+	rn = article_range_restriction (first, last);
+	status = e_folder_exchange_search_count (mfld->folder, NULL, rn, count);
+	e2k_restriction_unref (rn);
+
+	if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status)) {
+		g_warning ("count_articles: %d", status);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* Adds the seqs of the messages in @articles[@lo..@hi) that aren't
+ * on the server any more to @deleted. Every message in the article
+ * number range [@first, @last] is in @articles[@lo..@hi), and
+ * @server_count of them are on the server. Ranges that still add up
+ * are assumed to be intact; the others are split in half, so a
+ * single deletion costs a count for each level of the split, plus
+ * one listing of SYNC_DELETIONS_LEAF_SIZE messages.
+ */
+static gboolean
+find_deleted_articles (ExchangeFolder *mfld,
+                       GArray *articles,
+                       guint lo,
+                       guint hi,
+                       guint32 first,
+                       guint32 last,
+                       gint server_count,
+                       GArray *deleted)
+{
+	ExchangeArticle *art;
+	guint i, mid;
+	gint left_count;
+
+	if (server_count == (gint) (hi - lo))
+		return TRUE;
+
+	if (server_count == 0) {
+		for (i = lo; i < hi; i++) {
+			art = &g_array_index (articles, ExchangeArticle, i);
+			g_array_append_val (deleted, art->seq);
+		}
+		return TRUE;
+	}
+
+	if (hi - lo <= SYNC_DELETIONS_LEAF_SIZE) {
+		const gchar *prop = PR_INTERNET_ARTICLE_NUMBER;
+		E2kRestriction *rn;
+		E2kResultIter *iter;
+		E2kResult *result;
+		E2kHTTPStatus status;
+		GHashTable *found;
+		const gchar *num;
+
+		found = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+		rn = article_range_restriction (first, last);
+		iter = e_folder_exchange_search_start (mfld->folder, NULL,
+						       &prop, 1, rn, NULL, TRUE);
+		e2k_restriction_unref (rn);
+
+		while ((result = e2k_result_iter_next (iter))) {
+			num = e2k_properties_get_prop (result->props, prop);
+			if (num) {
+				g_hash_table_insert (found, GUINT_TO_POINTER (strtoul (num, NULL, 10)),
+						     GINT_TO_POINTER (1));
+			}
+		}
+		status = e2k_result_iter_free (iter);
+		if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status)) {
+			g_warning ("find_deleted_articles: %d", status);
+			g_hash_table_destroy (found);
+			return FALSE;
+		}
+
+		for (i = lo; i < hi; i++) {
+			art = &g_array_index (articles, ExchangeArticle, i);
+			if (!g_hash_table_lookup (found, GUINT_TO_POINTER (art->article_num)))
+				g_array_append_val (deleted, art->seq);
+		}
+		g_hash_table_destroy (found);
+		return TRUE;
+	}
+
+	/* Split at a local message, so that both halves have some */
+	mid = lo + (hi - lo) / 2;
+	art = &g_array_index (articles, ExchangeArticle, mid);
+
+	if (!count_articles (mfld, first, art->article_num - 1, &left_count))
+		return FALSE;
+
+	return find_deleted_articles (mfld, articles, lo, mid,
+				      first, art->article_num - 1,
+				      left_count, deleted) &&
+		find_deleted_articles (mfld, articles, mid, hi,
+				       art->article_num, last,
+				       server_count - left_count, deleted);
+}
+
+/* Finds deleted messages by comparing counts of article number ranges
+ * with the server's. Returns %FALSE if that can't be done, in which
+ * case nothing has been removed.
+ */
+static gboolean
+sync_deletions_bisect (ExchangeFolder *mfld)
+{
+	GArray *articles, *deleted;
+	ExchangeArticle *first, *last;
+	ExchangeMessage *mmsg;
+	CamelFolder *folder;
+	gint server_count;
+	gboolean ok;
+	guint i;
+
+	g_static_rec_mutex_lock (&mfld->lock);
+	articles = g_array_sized_new (FALSE, FALSE, sizeof (ExchangeArticle),
+				      exchange_message_list_get_length (mfld->messages));
+	exchange_message_list_foreach (mfld->messages, collect_article, articles);
+	g_static_rec_mutex_unlock (&mfld->lock);
+
+	if (articles->len == 0) {
+		g_array_free (articles, TRUE);
+		return TRUE;
+	}
+
+	g_array_sort (articles, article_cmp);
+	first = &g_array_index (articles, ExchangeArticle, 0);
+	last = &g_array_index (articles, ExchangeArticle, articles->len - 1);
+
+	/* Messages whose article numbers haven't been seen yet (or
+	 * that somehow share one) can't be told apart this way.
+	 */
+	if (first->article_num == 0) {
+		g_array_free (articles, TRUE);
+		return FALSE;
+	}
+	for (i = 1; i < articles->len; i++) {
+		if (g_array_index (articles, ExchangeArticle, i - 1).article_num ==
+		    g_array_index (articles, ExchangeArticle, i).article_num) {
+			g_array_free (articles, TRUE);
+			return FALSE;
+		}
+	}
+
+	deleted = g_array_new (FALSE, FALSE, sizeof (guint32));
+	ok = count_articles (mfld, first->article_num, last->article_num,
+			     &server_count) &&
+		find_deleted_articles (mfld, articles, 0, articles->len,
+				       first->article_num, last->article_num,
+				       server_count, deleted);
+	g_array_free (articles, TRUE);
+
+	if (!ok) {
+		g_array_free (deleted, TRUE);
+		return FALSE;
+	}
+
+	folder = get_camel_folder (mfld);
+
+	g_static_rec_mutex_lock (&mfld->lock);
+	for (i = 0; i < deleted->len; i++) {
+		/* The user may have removed it in the meantime */
+		mmsg = exchange_message_list_lookup (mfld->messages,
+						     g_array_index (deleted, guint32, i));
+		if (!mmsg)
+			continue;
+
+		mfld->deleted_count++;
+		message_remove (mfld, folder, mmsg);
+	}
+	g_static_rec_mutex_unlock (&mfld->lock);
+
+	g_array_free (deleted, TRUE);
+	return TRUE;
+}
+
+static void
+sync_deletions (ExchangeFolder *mfld)
+{
+	static const gchar *sync_deleted_props[] = {
+		PR_DELETED_COUNT_TOTAL,
+		E2K_PR_DAV_VISIBLE_COUNT
+	};
+
+	E2kHTTPStatus status;
+	E2kResult *results;
+	gint nresults = 0;
+	const gchar *prop;
+	gint deleted_count = -1, visible_count = -1;
+
+	g_return_if_fail (mfld != NULL);
+	g_return_if_fail (mfld->ed != NULL);
+
+	if (is_online (mfld->ed) != ONLINE_MODE)
+		return;
+
+	status = e_folder_exchange_propfind (mfld->folder, NULL,
+					     sync_deleted_props,
+					     G_N_ELEMENTS (sync_deleted_props),
+					     &results, &nresults);
+
+	if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status) || !nresults) {
+		g_warning ("got_sync_deleted_props: %d", status);
+		return;
+	}
+
+	prop = e2k_properties_get_prop (results[0].props,
+					PR_DELETED_COUNT_TOTAL);
+	if (prop)
+		deleted_count = atoi (prop);
+
+	prop = e2k_properties_get_prop (results[0].props,
+					E2K_PR_DAV_VISIBLE_COUNT);
+	if (prop)
+		visible_count = atoi (prop);
+
+	e2k_results_free (results, nresults);
+
+	g_static_rec_mutex_lock (&mfld->lock);
+	if (visible_count >= exchange_message_list_get_length (mfld->messages)) {
+		if (mfld->deleted_count == deleted_count) {
+			g_static_rec_mutex_unlock (&mfld->lock);
+			return;
+		}
+
+		if (mfld->deleted_count == 0) {
+			mfld->deleted_count = deleted_count;
+			g_static_rec_mutex_unlock (&mfld->lock);
+			return;
+		}
+	}
+	g_static_rec_mutex_unlock (&mfld->lock);
+
+	if (!sync_deletions_bisect (mfld))
+		sync_deletions_full (mfld);
 }
 
 static void
@@ -866,46 +1340,69 @@ storage_folder_changed (EFolder *folder,
 	ExchangeFolder *mfld = user_data;
 
 	if (e_folder_get_unread_count (folder) > mfld->unread_count)
-		refresh_folder_internal (mfld, NULL, NULL);
+		schedule_refresh (mfld, EXCHANGE_REFRESH_NEW_MESSAGES);
 }
 
 static void
-free_message (ExchangeMessage *mmsg)
+clear_message_href (gpointer data,
+                    gpointer user_data)
 {
-	g_datalist_clear (&mmsg->tag_updates);
-	g_free (mmsg->uid);
-	g_free (mmsg->href);
-	g_free (mmsg);
+	set_message_href (user_data, data, NULL);
+}
+
+static ExchangeFolder *
+folder_ref (ExchangeFolder *mfld)
+{
+	g_atomic_int_inc (&mfld->ref_count);
+	return mfld;
 }
 
 static void
-free_folder (gpointer value)
+folder_unref (ExchangeFolder *mfld)
 {
-	ExchangeFolder *mfld = value;
-	gint i;
+	if (!g_atomic_int_dec_and_test (&mfld->ref_count))
+		return;
 
 	d(g_print ("%s:%s:%d: freeing mfld: name=[%s]\n", __FILE__, __PRETTY_FUNCTION__, __LINE__,
 		   mfld->name));
 
-	e_folder_exchange_unsubscribe (mfld->folder);
-	g_signal_handlers_disconnect_by_func (mfld->folder, storage_folder_changed, mfld);
 	g_object_unref (mfld->folder);
 	mfld->folder = NULL;
 
-	for (i = 0; i < mfld->messages->len; i++)
-		free_message (mfld->messages->pdata[i]);
-	g_ptr_array_free (mfld->messages, TRUE);
+	exchange_message_list_foreach (mfld->messages, (GFunc) free_message, NULL);
+	exchange_message_list_free (mfld->messages);
 	g_hash_table_destroy (mfld->messages_by_uid);
 	g_hash_table_destroy (mfld->messages_by_href);
+	strings_free (mfld->strings);
 
 	g_ptr_array_free (mfld->changed_messages, TRUE);
+	g_static_rec_mutex_free (&mfld->lock);
+	g_free (mfld);
+}
+
+/* Called when @mfld is taken out of folders_by_name. A refresh that
+ * is already queued or running keeps it alive until it's done.
+ */
+static void
+free_folder (gpointer value)
+{
+	ExchangeFolder *mfld = value;
+
+	e_folder_exchange_unsubscribe (mfld->folder);
+	g_signal_handlers_disconnect_by_func (mfld->folder, storage_folder_changed, mfld);
+
 	if (mfld->flag_timeout) {
 		g_warning ("unreffing mfld with unsynced flags");
 		g_source_remove (mfld->flag_timeout);
+		mfld->flag_timeout = 0;
 	}
-	if (mfld->sync_deletion_timeout)
+	if (mfld->sync_deletion_timeout) {
 		g_source_remove (mfld->sync_deletion_timeout);
-	g_free (mfld);
+		mfld->sync_deletion_timeout = 0;
+	}
+
+	mfld->removed = TRUE;
+	folder_unref (mfld);
 }
 
 static void
@@ -924,59 +1421,13 @@ got_folder_error (ExchangeFolder *mfld,
 	/* g_hash_table_remove (mfld->ed->folders_by_name, mfld->name); */
 }
 
-static void
-mfld_get_folder_online_sync_updates (gpointer key,
-                                     gpointer value,
-                                     gpointer user_data)
-{
-	guint index, seq, i;
-	ExchangeFolder *mfld = (ExchangeFolder *) user_data;
-	ExchangeMessage *mmsg = NULL;
-
-	index = GPOINTER_TO_UINT (key);
-	seq = GPOINTER_TO_UINT (value);
-
-	g_static_rec_mutex_lock (&mfld->ed->changed_msgs_mutex);
-
-	/* Camel DB Summary changes are not fetching all the messages at start-up.
-	 * Use this else it would crash badly.
-	*/
-	if (index >= mfld->messages->len) {
-		g_static_rec_mutex_unlock (&mfld->ed->changed_msgs_mutex);
-		return;
-	}
-
-	mmsg = mfld->messages->pdata[index];
-	if (mmsg->seq != seq) {
-		for (i = 0; i < mfld->messages->len; i++) {
-			mmsg = mfld->messages->pdata[i];
-			if (mmsg->seq == seq)
-				break;
-		}
-		seq = i;
-	}
-	g_static_rec_mutex_unlock (&mfld->ed->changed_msgs_mutex);
-
-	/* FIXME FIXME FIXME: Some miscalculation happens here,though,
-	not a serious one
-	*/
-	/* message_remove_at_index already handles lock/unlock */
-	/*message_remove_at_index (stub, mfld, seq);*/
-
-}
-
-static gint
-exchange_message_uid_cmp (gconstpointer a,
-                          gconstpointer b)
-{
-	ExchangeMessage **mmsg1, **mmsg2;
-
-	mmsg1 = (ExchangeMessage **) a;
-	mmsg2 = (ExchangeMessage **) b;
-
-	return strcmp ((*mmsg1)->uid, (*mmsg2)->uid);
-}
-
+/* Brings the flags, tags and hrefs of the folder's messages up to
+ * date with the server. Each row is matched to its message through
+ * messages_by_uid, so the order the server returns them in doesn't
+ * matter. Messages that are no longer on the server are left for
+ * sync_deletions() to notice, and ones camel doesn't know about yet
+ * for refresh_folder_internal().
+ */
 static gboolean
 get_folder_contents_online (ExchangeFolder *mfld,
                             GError **error)
@@ -993,39 +1444,17 @@ get_folder_contents_online (ExchangeFolder *mfld,
 		E2K_PR_MAILHEADER_COMPLETED
 	};
 
-	ExchangeMessage *mmsg, *mmsg_cpy;
+	ExchangeMessage *mmsg;
 	E2kHTTPStatus status;
 	gboolean readonly = FALSE;
 	E2kRestriction *rn;
 	E2kResultIter *iter;
 	E2kResult *result;
 	const gchar *prop, *uid;
-	guint32 article_num, camel_flags, high_article_num;
-	gint i;
-	guint m;
+	guint32 article_num, camel_flags, high_article_num, low_unknown_num;
 	CamelFolder *folder;
 	CamelFolderChangeInfo *ci;
 
-	GPtrArray *msgs_copy = NULL;
-	GHashTable *rm_idx_uid = NULL;
-
-	/* Make a copy of the mfld->messages array for our processing */
-	msgs_copy = g_ptr_array_new ();
-
-	/* Store the index/seq of the messages to be removed from mfld->messages */
-	rm_idx_uid = g_hash_table_new (g_direct_hash, g_direct_equal);
-
-	g_static_rec_mutex_lock (&mfld->ed->changed_msgs_mutex);
-
-	g_ptr_array_sort (mfld->messages, (GCompareFunc) exchange_message_uid_cmp);
-	for (i = 0; i < mfld->messages->len; i++) {
-		mmsg = mfld->messages->pdata[i];
-		mmsg_cpy = new_message (mmsg->uid, mmsg->href, mmsg->seq, mmsg->flags);
-		g_ptr_array_add (msgs_copy, mmsg_cpy);
-	}
-	high_article_num = 0;
-	g_static_rec_mutex_unlock (&mfld->ed->changed_msgs_mutex);
-
 	rn = e2k_restriction_andv (
 		e2k_restriction_prop_bool (E2K_PR_DAV_IS_COLLECTION,
 					   E2K_RELOP_EQ, FALSE),
@@ -1036,15 +1465,16 @@ get_folder_contents_online (ExchangeFolder *mfld,
 	iter = e_folder_exchange_search_start (mfld->folder, NULL,
 					       open_folder_sync_props,
 					       G_N_ELEMENTS (open_folder_sync_props),
-					       rn, E2K_PR_DAV_CREATION_DATE,
-					       TRUE);
+					       rn, NULL, TRUE);
 	e2k_restriction_unref (rn);
+	e2k_result_iter_set_read_ahead (iter, EXCHANGE_READ_AHEAD_BATCHES);
 
 	folder = get_camel_folder (mfld);
 	ci = camel_folder_change_info_new ();
 
-	m = 0;
-	while (m < msgs_copy->len && (result = e2k_result_iter_next (iter))) {
+	high_article_num = 0;
+	low_unknown_num = G_MAXUINT32;
+	while ((result = e2k_result_iter_next (iter))) {
 		gboolean changed = FALSE;
 
 		prop = e2k_properties_get_prop (result->props,
@@ -1062,60 +1492,27 @@ get_folder_contents_online (ExchangeFolder *mfld,
 		camel_flags = mail_util_props_to_camel_flags (result->props,
 							      !readonly);
 
-		mmsg_cpy = msgs_copy->pdata[m];
-		while (strcmp (uid, mmsg_cpy->uid)) {
-			/* Remove mmsg from our msgs_copy array */
-			g_ptr_array_remove_index (msgs_copy, m);
+		g_static_rec_mutex_lock (&mfld->lock);
 
-			/* Put the index/uid as key/value in the rm_idx_uid hashtable.
-			 * This hashtable will be used to sync with mfld->messages.
+		mmsg = find_message (mfld, uid);
+		if (!mmsg) {
+			/* Camel doesn't know about this one yet, so
+			 * make sure high_article_num stays below it
+			 * and refresh_info picks it up later.
 			 */
-			g_hash_table_insert (rm_idx_uid, GUINT_TO_POINTER (m),
-					     GUINT_TO_POINTER (mmsg_cpy->seq));
-			g_free (mmsg_cpy->uid);
-			g_free (mmsg_cpy->href);
-			g_free (mmsg_cpy);
-
-			if (m == msgs_copy->len) {
-				mmsg_cpy = NULL;
-				if (article_num < high_article_num)
-					high_article_num = article_num - 1;
-				break;
-			}
-			mmsg_cpy = msgs_copy->pdata[m];
+			g_static_rec_mutex_unlock (&mfld->lock);
+			if (article_num < low_unknown_num)
+				low_unknown_num = article_num;
+			continue;
 		}
-		if (!mmsg_cpy)
-			break;
 
-		if (article_num > high_article_num)
-			high_article_num = article_num;
-
-		g_static_rec_mutex_lock (&mfld->ed->changed_msgs_mutex);
-		mmsg = mfld->messages->pdata[m];
-
-		/* Validate mmsg == mmsg_cpy - this may fail if user has deleted some messages,
-		 * while we were updating in a separate thread.
-		*/
-		if (mmsg->seq != mmsg_cpy->seq) {
-			/* We don't want to scan all of mfld->messages, as some new messages
-			 * would have got added to the array and hence restrict to the original
-			 * array of messages that we loaded from summary.
-			*/
-			for (i = 0; i < msgs_copy->len; i++) {
-				mmsg = mfld->messages->pdata[i];
-				if (mmsg->seq == mmsg_cpy->seq)
-					break;
-			}
-		}
+		mmsg->article_num = article_num;
 
 		if (!mmsg->href) {
-			mmsg->href = g_strdup (result->href);
-			if (mmsg_cpy->href)
-				g_free (mmsg_cpy->href);
-			mmsg_cpy->href = g_strdup (result->href);
+			set_message_href (mfld, mmsg, result->href);
 			/* Do not allow duplicates */
 			if (!g_hash_table_lookup (mfld->messages_by_href, mmsg->href))
-				g_hash_table_insert (mfld->messages_by_href, mmsg->href, mmsg);
+				g_hash_table_insert (mfld->messages_by_href, (gchar *) mmsg->href, mmsg);
 		}
 
 		if (mmsg->flags != camel_flags) {
@@ -1123,24 +1520,23 @@ get_folder_contents_online (ExchangeFolder *mfld,
 			change_flags (mfld, folder, mmsg, camel_flags);
 		}
 
-		g_static_rec_mutex_unlock (&mfld->ed->changed_msgs_mutex);
+		g_static_rec_mutex_unlock (&mfld->lock);
 
 		if (article_num > high_article_num)
 			high_article_num = article_num;
 
 		prop = e2k_properties_get_prop (result->props, E2K_PR_HTTPMAIL_MESSAGE_FLAG);
 		if (prop && folder)
-			camel_exchange_folder_update_message_tag (CAMEL_EXCHANGE_FOLDER (folder), mmsg->uid, "follow-up", prop);
+			camel_exchange_folder_update_message_tag (CAMEL_EXCHANGE_FOLDER (folder), uid, "follow-up", prop);
 		prop = e2k_properties_get_prop (result->props, E2K_PR_MAILHEADER_REPLY_BY);
 		if (prop && folder)
-			camel_exchange_folder_update_message_tag (CAMEL_EXCHANGE_FOLDER (folder), mmsg->uid, "due-by", prop);
+			camel_exchange_folder_update_message_tag (CAMEL_EXCHANGE_FOLDER (folder), uid, "due-by", prop);
 		prop = e2k_properties_get_prop (result->props, E2K_PR_MAILHEADER_COMPLETED);
 		if (prop && folder)
-			camel_exchange_folder_update_message_tag (CAMEL_EXCHANGE_FOLDER (folder), mmsg->uid, "completed-on", prop);
+			camel_exchange_folder_update_message_tag (CAMEL_EXCHANGE_FOLDER (folder), uid, "completed-on", prop);
 
 		if (changed)
-			camel_folder_change_info_change_uid (ci, mmsg->uid);
-		m++;
+			camel_folder_change_info_change_uid (ci, uid);
 	}
 
 	/* folder might not be ready on folder rename */
@@ -1148,24 +1544,6 @@ get_folder_contents_online (ExchangeFolder *mfld,
 		camel_folder_changed (CAMEL_FOLDER (folder), ci);
 	camel_folder_change_info_free (ci);
 
-	/* If there are further messages beyond mfld->messages->len,
-	 * then that means camel doesn't know about them yet, and so
-	 * we need to ignore them for a while. But if any of them have
-	 * an article number lower than the highest article number
-	 * we've seen, bump high_article_num down so that that message
-	 * gets caught by refresh_info later too.
-	 */
-	while ((result = e2k_result_iter_next (iter))) {
-		prop = e2k_properties_get_prop (result->props,
-						PR_INTERNET_ARTICLE_NUMBER);
-		if (prop) {
-			article_num = strtoul (prop, NULL, 10);
-			if (article_num <= high_article_num)
-				high_article_num = article_num - 1;
-		}
-
-		m++;
-	}
 	status = e2k_result_iter_free (iter);
 	if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status)) {
 		g_warning ("got_folder: %d", status);
@@ -1173,52 +1551,90 @@ get_folder_contents_online (ExchangeFolder *mfld,
 		return FALSE;
 	}
 
-	/* Discard remaining messages that no longer exist.
-	 * Do not increment 'i', because the remove_index is decrementing array length. */
-	for (i = 0; i < msgs_copy->len;) {
-		mmsg_cpy = msgs_copy->pdata[i];
-		if (!mmsg_cpy->href) {
-			/* Put the index/uid as key/value in the rm_idx_uid hashtable.
-			 * This hashtable will be used to sync with mfld->messages.
-			 */
-			g_hash_table_insert (rm_idx_uid, GUINT_TO_POINTER (m),
-					     GUINT_TO_POINTER (mmsg_cpy->seq));
-		}
-
-		/* Remove mmsg from our msgs_copy array */
-		g_ptr_array_remove_index (msgs_copy, i);
-
-		g_free (mmsg_cpy->uid);
-		g_free (mmsg_cpy->href);
-		g_free (mmsg_cpy);
-	}
-
-	g_static_rec_mutex_lock (&mfld->ed->changed_msgs_mutex);
+	if (low_unknown_num <= high_article_num)
+		high_article_num = low_unknown_num - 1;
+
+	g_static_rec_mutex_lock (&mfld->lock);
 	mfld->high_article_num = high_article_num;
-	g_static_rec_mutex_unlock (&mfld->ed->changed_msgs_mutex);
+	g_static_rec_mutex_unlock (&mfld->lock);
 
 	if (folder)
 		camel_exchange_summary_set_article_num (folder->summary, mfld->high_article_num);
 
-	g_hash_table_foreach (rm_idx_uid, mfld_get_folder_online_sync_updates, mfld);
+	return TRUE;
+}
 
-	g_ptr_array_free (msgs_copy, TRUE);
-	g_hash_table_destroy (rm_idx_uid);
+G_LOCK_DEFINE_STATIC (refresh_queue);
 
-	return TRUE;
+/* Asks for @what (a mask of ExchangeRefreshType) to be done to @mfld
+ * in the store's refresh pool. Requests for a folder that is already
+ * waiting in the pool are merged into the one already there, so a
+ * burst of notifications costs one refresh.
+ */
+static void
+schedule_refresh (ExchangeFolder *mfld,
+                  guint what)
+{
+	gboolean queued;
+
+	G_LOCK (refresh_queue);
+	queued = mfld->refresh_pending != 0;
+	mfld->refresh_pending |= what;
+	G_UNLOCK (refresh_queue);
+
+	if (!queued)
+		g_thread_pool_push (mfld->ed->refresh_pool, folder_ref (mfld), NULL);
 }
 
-static gpointer
-get_folder_contents_online_func (gpointer data)
+static void
+refresh_folder_thread (gpointer data,
+                       gpointer user_data)
 {
 	ExchangeFolder *mfld = data;
+	ExchangeData *ed = user_data;
+	guint what;
 
-	if (!mfld)
-		return NULL;
+	G_LOCK (refresh_queue);
+	what = mfld->refresh_pending;
+	mfld->refresh_pending = 0;
+	G_UNLOCK (refresh_queue);
+
+	if (!g_atomic_int_get (&ed->closing) && !mfld->removed) {
+		if (what & EXCHANGE_REFRESH_CONTENTS) {
+			/* FIXME: Pass a GError and handle the error */
+			get_folder_contents_online (mfld, NULL);
+		}
+		if (what & EXCHANGE_REFRESH_NEW_MESSAGES)
+			refresh_folder_internal (mfld, NULL, NULL);
+		if (what & EXCHANGE_REFRESH_DELETIONS)
+			sync_deletions (mfld);
+	}
+
+	folder_unref (mfld);
+}
+
+/* The Inbox goes first, then whichever folders the user touched most
+ * recently, so that a long list of public folders doesn't hold up the
+ * ones being looked at.
+ */
+static gint
+refresh_priority_cmp (gconstpointer a,
+                      gconstpointer b,
+                      gpointer user_data)
+{
+	const ExchangeFolder *mfld1 = a, *mfld2 = b;
+	ExchangeData *ed = user_data;
+	gboolean inbox1, inbox2;
 
-	get_folder_contents_online (mfld, NULL);
+	inbox1 = mfld1->folder == ed->inbox;
+	inbox2 = mfld2->folder == ed->inbox;
+	if (inbox1 != inbox2)
+		return inbox1 ? -1 : 1;
 
-	return NULL;
+	if (mfld1->last_activity != mfld2->last_activity)
+		return mfld1->last_activity > mfld2->last_activity ? -1 : 1;
+
+	return 0;
 }
 
 #define FIVE_SECONDS (5)
@@ -1230,7 +1646,8 @@ timeout_sync_deletions (gpointer user_data)
 {
 	ExchangeFolder *mfld = user_data;
 
-	sync_deletions (mfld);
+	mfld->sync_deletion_timeout = 0;
+	schedule_refresh (mfld, EXCHANGE_REFRESH_DELETIONS);
 	return FALSE;
 }
 
@@ -1244,9 +1661,9 @@ notify_cb (E2kContext *ctx,
 	time_t now;
 
 	if (type == E2K_CONTEXT_OBJECT_ADDED)
-		refresh_folder_internal (mfld, NULL, NULL);
+		schedule_refresh (mfld, EXCHANGE_REFRESH_NEW_MESSAGES);
 	else if (type == E2K_CONTEXT_OBJECT_CHANGED)
-		get_folder_contents_online (mfld, NULL);
+		schedule_refresh (mfld, EXCHANGE_REFRESH_CONTENTS);
 	else {
 		now = time (NULL);
 
@@ -1285,7 +1702,7 @@ notify_cb (E2kContext *ctx,
 		}
 
 		if (now < mfld->last_activity + ONE_MINUTE)
-			sync_deletions (mfld);
+			schedule_refresh (mfld, EXCHANGE_REFRESH_DELETIONS);
 		else if (now < mfld->last_activity + FIVE_MINUTES) {
 			mfld->sync_deletion_timeout =
 				g_timeout_add (ONE_MINUTE * 1000,
@@ -1314,7 +1731,8 @@ get_folder_online (ExchangeFolder *mfld,
 	gint nresults = 0;
 	const gchar *prop;
 
-	mfld->changed_messages = g_ptr_array_new ();
+	if (!mfld->changed_messages)
+		mfld->changed_messages = g_ptr_array_new ();
 
 	status = e_folder_exchange_propfind (mfld->folder, NULL,
 					     open_folder_props,
@@ -1359,11 +1777,8 @@ get_folder_online (ExchangeFolder *mfld,
 	if (g_hash_table_size (mfld->messages_by_href) < 1) {
 		if (!get_folder_contents_online (mfld, error))
 			return FALSE;
-	} else {
-		/* FIXME: Pass a GError and handle the error */
-		g_thread_create (get_folder_contents_online_func,
-				 mfld, FALSE, NULL);
-	}
+	} else
+		schedule_refresh (mfld, EXCHANGE_REFRESH_CONTENTS);
 
 	e_folder_exchange_subscribe (mfld->folder,
 				     E2K_CONTEXT_OBJECT_ADDED, 30,
@@ -1465,6 +1880,58 @@ mark_read (EFolder *folder,
 		g_warning ("mark_read: %d", status);
 }
 
+/* Follow-up tags, and the PR_FLAG_STATUS they imply when set */
+static const struct {
+	const gchar *tag;
+	const gchar *prop;
+	gint flag_status;
+} flag_tags[] = {
+	{ "follow-up", E2K_PR_HTTPMAIL_MESSAGE_FLAG, MAPI_FOLLOWUP_FLAGGED },
+	{ "due-by", E2K_PR_MAILHEADER_REPLY_BY, 0 },
+	{ "completed-on", E2K_PR_MAILHEADER_COMPLETED, MAPI_FOLLOWUP_COMPLETED }
+};
+
+/* Messages that need the same PROPPATCH */
+typedef struct {
+	E2kProperties *props;
+	GPtrArray *hrefs;
+} ExchangeFlagBatch;
+
+static void
+flag_batch_free (gpointer data)
+{
+	ExchangeFlagBatch *batch = data;
+
+	e2k_properties_free (batch->props);
+	g_ptr_array_foreach (batch->hrefs, (GFunc) g_free, NULL);
+	g_ptr_array_free (batch->hrefs, TRUE);
+	g_free (batch);
+}
+
+static void
+flag_batch_send (gpointer key,
+                 gpointer value,
+                 gpointer user_data)
+{
+	ExchangeFlagBatch *batch = value;
+	EFolder *folder = user_data;
+	E2kResultIter *iter;
+	E2kResult *result;
+	E2kHTTPStatus status;
+
+	iter = e_folder_exchange_bproppatch_start (folder, NULL,
+						   (const gchar **) batch->hrefs->pdata,
+						   batch->hrefs->len, batch->props, FALSE);
+	while ((result = e2k_result_iter_next (iter))) {
+		if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (result->status))
+			g_warning ("process_flags: %s: %d", result->href, result->status);
+	}
+	status = e2k_result_iter_free (iter);
+
+	if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status))
+		g_warning ("process_flags: %d", status);
+}
+
 static gboolean
 process_flags (gpointer user_data)
 {
@@ -1472,10 +1939,23 @@ process_flags (gpointer user_data)
 	ExchangeData *ed = mfld->ed;
 	ExchangeMessage *mmsg;
 	GPtrArray *seen = NULL, *unseen = NULL, *deleted = NULL;
+	GHashTable *batches;
+	ExchangeFlagBatch *batch;
+	E2kProperties *props;
+	GString *key;
+	gchar *timestamp;
 	gint i;
 	guint32 hier_type = e_folder_exchange_get_hierarchy (mfld->folder)->type;
 
-	g_static_rec_mutex_lock (&ed->changed_msgs_mutex);
+	/* Changes other than SEEN are grouped by the PROPPATCH they
+	 * need, and each group is sent as one BPROPPATCH. Use the same
+	 * reply time for the whole run, so that replies group too.
+	 */
+	batches = g_hash_table_new_full (g_str_hash, g_str_equal,
+					 g_free, flag_batch_free);
+	timestamp = e2k_make_timestamp (time (NULL));
+
+	g_static_rec_mutex_lock (&mfld->lock);
 
 	for (i = 0; i < mfld->changed_messages->len; i++) {
 		mmsg = mfld->changed_messages->pdata[i];
@@ -1489,122 +1969,110 @@ process_flags (gpointer user_data)
 			if (mmsg->change_flags & CAMEL_MESSAGE_SEEN) {
 				if (!seen)
 					seen = g_ptr_array_new ();
-				g_ptr_array_add (seen, g_strdup (strrchr (mmsg->href, '/') + 1));
+				g_ptr_array_add (seen, g_strdup (mmsg->href));
 				mmsg->flags |= CAMEL_MESSAGE_SEEN;
 			} else {
 				if (!unseen)
 					unseen = g_ptr_array_new ();
-				g_ptr_array_add (unseen, g_strdup (strrchr (mmsg->href, '/') + 1));
+				g_ptr_array_add (unseen, g_strdup (mmsg->href));
 				mmsg->flags &= ~CAMEL_MESSAGE_SEEN;
 			}
 			mmsg->change_mask &= ~CAMEL_MESSAGE_SEEN;
 		}
 
-		if (mmsg->change_mask & CAMEL_MESSAGE_ANSWERED) {
-			E2kProperties *props;
-			E2kHTTPStatus status;
+		props = NULL;
+		key = g_string_new (NULL);
 
+		if (mmsg->change_mask & CAMEL_MESSAGE_ANSWERED) {
 			props = e2k_properties_new ();
 
 			if (mmsg->change_flags & CAMEL_MESSAGE_ANSWERED) {
+				gboolean all = (mmsg->change_flags & CAMEL_MESSAGE_ANSWERED_ALL) != 0;
+
 				e2k_properties_set_int (props, PR_ACTION, MAPI_ACTION_REPLIED);
-				e2k_properties_set_int (props, PR_ACTION_FLAG, (mmsg->change_flags & CAMEL_MESSAGE_ANSWERED_ALL) ?
+				e2k_properties_set_int (props, PR_ACTION_FLAG, all ?
 							MAPI_ACTION_FLAG_REPLIED_TO_ALL :
 							MAPI_ACTION_FLAG_REPLIED_TO_SENDER);
 				e2k_properties_set_date (props, PR_ACTION_DATE,
-							e2k_make_timestamp (time (NULL)));
+							 g_strdup (timestamp));
+				g_string_append (key, all ? "A2;" : "A1;");
 			} else {
 				e2k_properties_remove (props, PR_ACTION);
 				e2k_properties_remove (props, PR_ACTION_FLAG);
 				e2k_properties_remove (props, PR_ACTION_DATE);
+				g_string_append (key, "A0;");
 			}
 
-			status = e2k_context_proppatch (ed->ctx, NULL, mmsg->href, props, FALSE, NULL);
-
-			e2k_properties_free (props);
-
-			if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status))
-				g_warning ("set_replied_flags: %d", status);
-
 			mmsg->change_mask &= ~(CAMEL_MESSAGE_ANSWERED | CAMEL_MESSAGE_ANSWERED_ALL);
 		}
 
 		if (mmsg->change_mask & CAMEL_MESSAGE_FLAGGED) {
-			E2kProperties *props;
-			E2kHTTPStatus status;
-
-			props = e2k_properties_new ();
+			if (!props)
+				props = e2k_properties_new ();
 
 			if (mmsg->change_flags & CAMEL_MESSAGE_FLAGGED) {
 				e2k_properties_set_int (props, PR_IMPORTANCE, MAPI_IMPORTANCE_HIGH);
+				g_string_append (key, "F1;");
 			} else {
 				e2k_properties_set_int (props, PR_IMPORTANCE, MAPI_IMPORTANCE_NORMAL);
+				g_string_append (key, "F0;");
 			}
 
-			status = e2k_context_proppatch (ed->ctx, NULL, mmsg->href, props, FALSE, NULL);
-
-			e2k_properties_free (props);
-
-			if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status))
-				g_warning ("set_important_flag: %d", status);
-
 			mmsg->change_mask &= ~CAMEL_MESSAGE_FLAGGED;
 		}
 
 		if (mmsg->tag_updates) {
-			E2kProperties *props;
 			const gchar *value;
-			gint flag_status;
-			E2kHTTPStatus status;
-
-			flag_status = MAPI_FOLLOWUP_UNFLAGGED;
-			props = e2k_properties_new ();
+			gint flag_status, t;
 
-			value = g_datalist_get_data (&mmsg->tag_updates, "follow-up");
-			if (value) {
-				if (*value) {
-					e2k_properties_set_string (props, E2K_PR_HTTPMAIL_MESSAGE_FLAG, g_strdup (value));
-					flag_status = MAPI_FOLLOWUP_FLAGGED;
-				} else {
-					e2k_properties_remove (props, E2K_PR_HTTPMAIL_MESSAGE_FLAG);
-				}
-			}
+			if (!props)
+				props = e2k_properties_new ();
 
-			value = g_datalist_get_data (&mmsg->tag_updates, "due-by");
-			if (value) {
-				if (*value) {
-					e2k_properties_set_string (props, E2K_PR_MAILHEADER_REPLY_BY, g_strdup (value));
-				} else {
-					e2k_properties_remove (props, E2K_PR_MAILHEADER_REPLY_BY);
-				}
-			}
+			flag_status = MAPI_FOLLOWUP_UNFLAGGED;
+			for (t = 0; t < G_N_ELEMENTS (flag_tags); t++) {
+				value = g_datalist_get_data (&mmsg->tag_updates,
+							     flag_tags[t].tag);
+				if (!value)
+					continue;
 
-			value = g_datalist_get_data (&mmsg->tag_updates, "completed-on");
-			if (value) {
 				if (*value) {
-					e2k_properties_set_string (props, E2K_PR_MAILHEADER_COMPLETED, g_strdup (value));
-					flag_status = MAPI_FOLLOWUP_COMPLETED;
-				} else {
-					e2k_properties_remove (props, E2K_PR_MAILHEADER_COMPLETED);
-				}
+					e2k_properties_set_string (props, flag_tags[t].prop, g_strdup (value));
+					if (flag_tags[t].flag_status)
+						flag_status = flag_tags[t].flag_status;
+				} else
+					e2k_properties_remove (props, flag_tags[t].prop);
+
+				g_string_append_printf (key, "%s:%d:%s;", flag_tags[t].tag,
+							(gint) strlen (value), value);
 			}
 			g_datalist_clear (&mmsg->tag_updates);
 
 			e2k_properties_set_int (props, PR_FLAG_STATUS, flag_status);
+		}
 
-			status = e2k_context_proppatch (ed->ctx, NULL, mmsg->href, props, FALSE, NULL);
-
-			e2k_properties_free (props);
-
-			if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status))
-				g_warning ("update_tags: %d", status);
+		if (props) {
+			batch = g_hash_table_lookup (batches, key->str);
+			if (batch)
+				e2k_properties_free (props);
+			else {
+				batch = g_new0 (ExchangeFlagBatch, 1);
+				batch->props = props;
+				batch->hrefs = g_ptr_array_new ();
+				g_hash_table_insert (batches, g_strdup (key->str), batch);
+			}
+			g_ptr_array_add (batch->hrefs, g_strdup (mmsg->href));
 		}
+		g_string_free (key, TRUE);
 
 		if (!mmsg->change_mask)
-			g_ptr_array_remove_index_fast (mfld->changed_messages, i--);
+			changed_messages_remove_index (mfld, i--);
 	}
 
-	g_static_rec_mutex_unlock (&ed->changed_msgs_mutex);
+	g_static_rec_mutex_unlock (&mfld->lock);
+
+	g_hash_table_foreach (batches, flag_batch_send, mfld->folder);
+	g_hash_table_destroy (batches);
+	g_free (timestamp);
 
 	if (seen || unseen) {
 		if (seen) {
@@ -1626,17 +2094,20 @@ process_flags (gpointer user_data)
 			return TRUE;
 	}
 
-	g_static_rec_mutex_lock (&ed->changed_msgs_mutex);
+	/* The hrefs are copied, since once the lock is released the
+	 * folder's strings can be compacted out from under them.
+	 */
+	g_static_rec_mutex_lock (&mfld->lock);
 
 	for (i = 0; i < mfld->changed_messages->len; i++) {
 		mmsg = mfld->changed_messages->pdata[i];
 		if (mmsg->change_mask & mmsg->change_flags & CAMEL_MESSAGE_DELETED) {
 			if (!deleted)
 				deleted = g_ptr_array_new ();
-			g_ptr_array_add (deleted, strrchr (mmsg->href, '/') + 1);
+			g_ptr_array_add (deleted, g_strdup (mmsg->href));
 		}
 	}
-	g_static_rec_mutex_unlock (&ed->changed_msgs_mutex);
+	g_static_rec_mutex_unlock (&mfld->lock);
 
 	if (deleted) {
 		CamelFolder *folder = get_camel_folder (mfld);
@@ -1663,7 +2134,8 @@ process_flags (gpointer user_data)
 								(const gchar **) deleted->pdata,
 								deleted->len);
 		}
-		g_ptr_array_free (deleted, FALSE);
+		g_ptr_array_foreach (deleted, (GFunc) g_free, NULL);
+		g_ptr_array_free (deleted, TRUE);
 		while ((result = e2k_result_iter_next (iter))) {
 			if (hier_type == EXCHANGE_HIERARCHY_PERSONAL) {
 				if (!e2k_properties_get_prop (result->props,
@@ -1691,7 +2163,7 @@ process_flags (gpointer user_data)
 	}
 
 	if (mfld->changed_messages->len) {
-		g_ptr_array_set_size (mfld->changed_messages, 0);
+		changed_messages_clear (mfld);
 		/* change_complete (mfld); */
 	}
 
@@ -1736,6 +2208,28 @@ get_stickynote (E2kContext *ctx,
 	return status;
 }
 
+static E2kHTTPStatus
+get_document_headers (E2kContext *ctx,
+                      E2kOperation *op,
+                      const gchar *uri,
+                      gchar **headers)
+{
+	E2kHTTPStatus status;
+	E2kResult *results;
+	gint nresults = 0;
+
+	status = e2k_context_propfind (ctx, op, uri, mapi_message_props, G_N_ELEMENTS (mapi_message_props), &results, &nresults);
+	if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status))
+		return status;
+	if (!nresults)
+		return E2K_HTTP_MALFORMED;
+
+	*headers = mail_util_mapi_to_smtp_headers (results[0].props);
+
+	e2k_results_free (results, nresults);
+	return status;
+}
+
 static E2kHTTPStatus
 build_message_from_document (E2kContext *ctx,
                              E2kOperation *op,
@@ -1744,18 +2238,12 @@ build_message_from_document (E2kContext *ctx,
                              gint *len)
 {
 	E2kHTTPStatus status;
-	E2kResult *results;
-	gint nresults = 0;
 	GString *message;
 	gchar *headers;
 
-	status = e2k_context_propfind (ctx, op, uri, mapi_message_props, G_N_ELEMENTS (mapi_message_props), &results, &nresults);
+	status = get_document_headers (ctx, op, uri, &headers);
 	if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status))
 		return status;
-	if (!nresults)
-		return E2K_HTTP_MALFORMED;
-
-	headers = mail_util_mapi_to_smtp_headers (results[0].props);
 
 	message = g_string_new (headers);
 	g_string_append_len (message, *body, *len);
@@ -1766,7 +2254,6 @@ build_message_from_document (E2kContext *ctx,
 	*len = message->len;
 	*body = g_string_free (message, FALSE);
 
-	e2k_results_free (results, nresults);
 	return status;
 }
 
@@ -2357,6 +2844,7 @@ camel_exchange_utils_get_folder (CamelService *service,
                                  GPtrArray *uids,
                                  GByteArray *flags,
                                  GPtrArray *hrefs,
+                                 GArray *article_nums,
                                  guint32 high_article_num,
                                  guint32 *folder_flags, /* out */
                                  gchar **folder_uri, /* out */
@@ -2411,6 +2899,8 @@ camel_exchange_utils_get_folder (CamelService *service,
 	g_free (path);
 
 	mfld = g_new0 (ExchangeFolder, 1);
+	mfld->ref_count = 1;
+	g_static_rec_mutex_init (&mfld->lock);
 	mfld->ed = ed;
 	mfld->folder = folder;
 	g_object_ref (folder);
@@ -2432,18 +2922,23 @@ camel_exchange_utils_get_folder (CamelService *service,
 			mfld->type = EXCHANGE_FOLDER_OTHER;
 	}
 
-	mfld->messages = g_ptr_array_new ();
+	mfld->messages = exchange_message_list_new ();
 	mfld->messages_by_uid = g_hash_table_new (g_str_hash, g_str_equal);
 	mfld->messages_by_href = g_hash_table_new (g_str_hash, g_str_equal);
+	mfld->strings = strings_new ();
 	for (i = 0; i < uids->len; i++) {
-		mmsg = new_message (uids->pdata[i], NULL, mfld->seq++, flags->data[i]);
-		g_ptr_array_add (mfld->messages, mmsg);
-		g_hash_table_insert (mfld->messages_by_uid, mmsg->uid, mmsg);
-
-		if (hrefs->pdata[i] && *((gchar *) hrefs->pdata[i])) {
-			mmsg->href = g_strdup (hrefs->pdata[i]);
-			g_hash_table_insert (mfld->messages_by_href, mmsg->href, mmsg);
-		}
+		const gchar *href = hrefs->pdata[i];
+
+		mmsg = new_message (mfld, uids->pdata[i],
+				    href && *href ? href : NULL,
+				    mfld->seq++, flags->data[i]);
+		if (article_nums)
+			mmsg->article_num = g_array_index (article_nums, guint32, i);
+		exchange_message_list_append (mfld->messages, mmsg->seq, mmsg);
+		g_hash_table_insert (mfld->messages_by_uid, (gchar *) mmsg->uid, mmsg);
+
+		if (mmsg->href)
+			g_hash_table_insert (mfld->messages_by_href, (gchar *) mmsg->href, mmsg);
 		if (!(mmsg->flags & CAMEL_MESSAGE_SEEN))
 			mfld->unread_count++;
 	}
@@ -2480,6 +2975,63 @@ camel_exchange_utils_get_folder (CamelService *service,
 	return TRUE;
 }
 
+static void
+index_message (gpointer data,
+               gpointer user_data)
+{
+	ExchangeMessage *mmsg = data;
+	ExchangeFolderIndexEntry entry;
+
+	entry.uid = mmsg->uid;
+	entry.href = mmsg->href;
+	entry.flags = mmsg->flags;
+	entry.article_num = mmsg->article_num;
+	g_array_append_val (user_data, entry);
+}
+
+/* Saves what we know about each message in @folder_name to
+ * @filename, for camel_exchange_folder_construct() to pass back to
+ * camel_exchange_utils_get_folder() next time instead of reading it
+ * all out of the summary.
+ */
+gboolean
+camel_exchange_utils_save_folder_index (CamelService *service,
+                                        const gchar *folder_name,
+                                        const gchar *filename,
+                                        GError **error)
+{
+	ExchangeData *ed = get_data_for_service (service);
+	ExchangeFolder *mfld;
+	GArray *entries;
+	gchar *data;
+	gsize length;
+	gboolean success;
+
+	g_return_val_if_fail (ed != NULL, FALSE);
+	g_return_val_if_fail (filename != NULL, FALSE);
+
+	mfld = g_hash_table_lookup (ed->folders_by_name, folder_name);
+	if (!mfld) {
+		set_exception (error, _("No such folder"));
+		return FALSE;
+	}
+
+	g_static_rec_mutex_lock (&mfld->lock);
+	entries = g_array_sized_new (FALSE, FALSE, sizeof (ExchangeFolderIndexEntry),
+				     exchange_message_list_get_length (mfld->messages));
+	exchange_message_list_foreach (mfld->messages, index_message, entries);
+	data = exchange_folder_index_serialize (mfld->high_article_num,
+						(ExchangeFolderIndexEntry *) entries->data,
+						entries->len, &length);
+	g_static_rec_mutex_unlock (&mfld->lock);
+	g_array_free (entries, TRUE);
+
+	success = g_file_set_contents (filename, data, length, error);
+	g_free (data);
+
+	return success;
+}
+
 gboolean
 camel_exchange_utils_get_trash_name (CamelService *service,
                                      gchar **trash_name, /* out */
@@ -2538,7 +3090,7 @@ camel_exchange_utils_sync_count (CamelService *service,
 	mfld = folder_from_name (ed, folder_name, 0, error);
 	if (mfld) {
 		*unread_count = mfld->unread_count;
-		*visible_count = mfld->messages->len;
+		*visible_count = exchange_message_list_get_length (mfld->messages);
 	} else {
 		*unread_count = 0;
 		*visible_count = 0;
@@ -2574,12 +3126,12 @@ camel_exchange_utils_expunge_uids (CamelService *service,
 	if (!mfld)
 		return FALSE;
 
-	g_static_rec_mutex_lock (&ed->changed_msgs_mutex);
+	g_static_rec_mutex_lock (&mfld->lock);
 	hrefs = g_ptr_array_new ();
 	for (i = 0; i < uids->len; i++) {
 		mmsg = find_message (mfld, uids->pdata[i]);
 		if (mmsg)
-			g_ptr_array_add (hrefs, strrchr (mmsg->href, '/') + 1);
+			g_ptr_array_add (hrefs, (gchar *) mmsg->href);
 	}
 
 	if (!hrefs->len) {
@@ -2587,7 +3139,7 @@ camel_exchange_utils_expunge_uids (CamelService *service,
 		 * don't want to crash.
 		 */
 		g_ptr_array_free (hrefs, TRUE);
-		g_static_rec_mutex_unlock (&ed->changed_msgs_mutex);
+		g_static_rec_mutex_unlock (&mfld->lock);
 		return TRUE;
 	}
 
@@ -2595,9 +3147,14 @@ camel_exchange_utils_expunge_uids (CamelService *service,
 	if (folder)
 		camel_folder_freeze (folder);
 
+	/* The requests are all built by now, so the hrefs can't be
+	 * pulled out from under them while we wait for the server.
+	 */
 	iter = e_folder_exchange_bdelete_start (mfld->folder, NULL,
 						(const gchar **) hrefs->pdata,
 						hrefs->len);
+	g_static_rec_mutex_unlock (&mfld->lock);
+
 	ndeleted = 0;
 	while ((result = e2k_result_iter_next (iter))) {
 		if (result->status == E2K_HTTP_UNAUTHORIZED) {
@@ -2612,7 +3169,6 @@ camel_exchange_utils_expunge_uids (CamelService *service,
 			cancellable, ndeleted * 100 / hrefs->len);
 	}
 	status = e2k_result_iter_free (iter);
-	g_static_rec_mutex_unlock (&ed->changed_msgs_mutex);
 
 	if (folder)
 		camel_folder_thaw (folder);
@@ -2633,9 +3189,9 @@ camel_exchange_utils_expunge_uids (CamelService *service,
 static gboolean
 test_uri (E2kContext *ctx,
           const gchar *test_name,
-          gpointer messages_by_href)
+          gpointer mfld)
 {
-	return g_hash_table_lookup (messages_by_href, test_name) == NULL;
+	return find_message_by_href (mfld, test_name) == NULL;
 }
 
 gboolean
@@ -2662,7 +3218,7 @@ camel_exchange_utils_append_message (CamelService *service,
 		return FALSE;
 
 	status = e_folder_exchange_put_new (mfld->folder, NULL, subject,
-					    test_uri, mfld->messages_by_href,
+					    test_uri, mfld,
 					    "message/rfc822", (const gchar *)message->data, message->len,
 					    &location, &ru_header);
 	if (status != E2K_HTTP_CREATED) {
@@ -2698,20 +3254,10 @@ static void
 change_message (ExchangeFolder *mfld,
                 ExchangeMessage *mmsg)
 {
-	gint i;
-
-	g_static_rec_mutex_lock (&mfld->ed->changed_msgs_mutex);
-
-	for (i = 0; i < mfld->changed_messages->len; i++)  {
-		if (mfld->changed_messages->pdata[i] == mmsg)
-			break;
-	}
-
-	if (i == mfld->changed_messages->len) {
-		/*change_pending (mfld); !!!TODO!!! */
-		g_ptr_array_add (mfld->changed_messages, mmsg);
-	}
-	g_static_rec_mutex_unlock (&mfld->ed->changed_msgs_mutex);
+	g_static_rec_mutex_lock (&mfld->lock);
+	/*change_pending (mfld); !!!TODO!!! */
+	changed_messages_add (mfld, mmsg);
+	g_static_rec_mutex_unlock (&mfld->lock);
 
 	if (mfld->flag_timeout)
 		g_source_remove (mfld->flag_timeout);
@@ -2834,7 +3380,7 @@ camel_exchange_utils_get_message (CamelService *service,
 	ExchangeFolder *mfld;
 	ExchangeMessage *mmsg;
 	E2kHTTPStatus status;
-	gchar *body = NULL, *content_type = NULL, *owner_email = NULL;
+	gchar *href, *body = NULL, *content_type = NULL, *owner_email = NULL;
 	gint len = 0;
 	gboolean res = FALSE;
 	CamelMessageInfo *info;
@@ -2860,15 +3406,17 @@ camel_exchange_utils_get_message (CamelService *service,
 		return FALSE;
 	}
 
+	href = message_href (mfld, mmsg);
+
 	if (mfld->type == EXCHANGE_FOLDER_NOTES) {
-		status = get_stickynote (ed->ctx, NULL, mmsg->href, &body, &len);
+		status = get_stickynote (ed->ctx, NULL, href, &body, &len);
 		if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status))
 			goto error;
 		content_type = g_strdup ("message/rfc822");
 	} else {
 		SoupBuffer *response;
 
-		status = e2k_context_get (ed->ctx, NULL, mmsg->href, &content_type, &response);
+		status = e2k_context_get (ed->ctx, NULL, href, &content_type, &response);
 		if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status))
 			goto error;
 
@@ -2883,7 +3431,7 @@ camel_exchange_utils_get_message (CamelService *service,
 	 * courtesy of mp:x67200102.
 	 */
 	if (!content_type || g_ascii_strncasecmp (content_type, "message/", 8)) {
-		status = build_message_from_document (ed->ctx, NULL, mmsg->href, &body, &len);
+		status = build_message_from_document (ed->ctx, NULL, href, &body, &len);
 		if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status))
 			goto error;
 	}
@@ -2892,7 +3440,7 @@ camel_exchange_utils_get_message (CamelService *service,
 	 * delegated it to us.
 	 */
 	if (mmsg->flags & EXMAIL_DELEGATED) {
-		status = unmangle_delegated_meeting_request (ed, NULL, mmsg->href, &body, &len);
+		status = unmangle_delegated_meeting_request (ed, NULL, href, &body, &len);
 		if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status))
 			goto error;
 	}
@@ -2909,7 +3457,7 @@ camel_exchange_utils_get_message (CamelService *service,
 	/* If there is a sender field in the meeting request/response,
 	 * we need to know who it is.
 	 */
-	status = unmangle_sender_field (ed, NULL, mmsg->href, &body, &len);
+	status = unmangle_sender_field (ed, NULL, href, &body, &len);
 	if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status))
 		goto error;
 
@@ -2927,12 +3475,13 @@ camel_exchange_utils_get_message (CamelService *service,
 		 * message may actually have gone away before the last
 		 * time we recorded that.
 		 */
-		message_removed (mfld, folder, mmsg->href);
+		message_removed (mfld, folder, href);
 		set_exception (error, _("Message has been deleted"));
 	} else
 		set_exception (error, _("Error retrieving message"));
 
  cleanup:
+	g_free (href);
 	g_free (body);
 	g_free (content_type);
 	g_free (owner_email);
@@ -2940,6 +3489,207 @@ camel_exchange_utils_get_message (CamelService *service,
 	return res;
 }
 
+/* Whether unmangle_sender_field() would change @href's body. If that
+ * can't be found out, this says it would, so that the caller goes the
+ * way that reports the error.
+ */
+static gboolean
+sender_needs_unmangling (ExchangeData *ed,
+                         const gchar *href)
+{
+	const gchar *props[] = { PR_SENT_REPRESENTING_EMAIL_ADDRESS, PR_SENDER_EMAIL_ADDRESS };
+	gchar *delegator_dn, *sender_dn;
+	E2kHTTPStatus status;
+	E2kResult *results;
+	gint nresults = 0;
+	gboolean needs;
+
+	status = e2k_context_propfind (ed->ctx, NULL, href, props, 2, &results, &nresults);
+	if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status))
+		return TRUE;
+	if (!nresults)
+		return TRUE;
+
+	delegator_dn = e2k_properties_get_prop (results[0].props, PR_SENT_REPRESENTING_EMAIL_ADDRESS);
+	sender_dn = e2k_properties_get_prop (results[0].props, PR_SENDER_EMAIL_ADDRESS);
+	needs = delegator_dn && sender_dn && g_ascii_strcasecmp (delegator_dn, sender_dn);
+
+	e2k_results_free (results, nresults);
+	return needs;
+}
+
+typedef struct {
+	CamelStream *stream;
+	GCancellable *cancellable;
+	GError *error;
+
+	/* A body that isn't a message is kept here until we have
+	 * made up headers to go in front of it.
+	 */
+	gboolean started;
+	CamelStream *document;
+	gchar *document_path;
+} MessageStreamData;
+
+static gboolean
+is_message_content_type (const gchar *content_type)
+{
+	return content_type && !g_ascii_strncasecmp (content_type, "message/", 8);
+}
+
+static void
+message_stream_got_chunk (SoupMessage *msg,
+                          const gchar *data,
+                          gsize length,
+                          gpointer user_data)
+{
+	MessageStreamData *msd = user_data;
+	gint fd;
+
+	if (msd->error)
+		return;
+
+	if (!msd->started) {
+		msd->started = TRUE;
+
+		if (!is_message_content_type (soup_message_headers_get (msg->response_headers, "Content-Type"))) {
+			fd = g_file_open_tmp ("evolution-exchange-XXXXXX", &msd->document_path, &msd->error);
+			if (fd == -1)
+				return;
+			msd->document = camel_stream_fs_new_with_fd (fd);
+		}
+	}
+
+	camel_stream_write (msd->document ? msd->document : msd->stream,
+			    data, length, msd->cancellable, &msd->error);
+}
+
+static gboolean
+get_message_to_stream_buffered (CamelService *service,
+                                const gchar *folder_name,
+                                const gchar *uid,
+                                CamelStream *stream,
+                                GCancellable *cancellable,
+                                GError **error)
+{
+	GByteArray *ba;
+	gboolean res;
+
+	if (!camel_exchange_utils_get_message (service, folder_name, uid, &ba, error))
+		return FALSE;
+
+	res = camel_stream_write (stream, (const gchar *) ba->data, ba->len, cancellable, error) != -1;
+	g_byte_array_free (ba, TRUE);
+
+	return res;
+}
+
+/* As camel_exchange_utils_get_message(), but writes the message to
+ * @stream as it comes off the network rather than collecting it in
+ * memory first. Messages whose bodies have to be edited once they're
+ * all here (sticky notes, and meeting requests that came through a
+ * delegate or a subscribed inbox) are still fetched whole.
+ */
+gboolean
+camel_exchange_utils_get_message_to_stream (CamelService *service,
+                                            const gchar *folder_name,
+                                            const gchar *uid,
+                                            CamelStream *stream,
+                                            GCancellable *cancellable,
+                                            GError **error)
+{
+	ExchangeData *ed = get_data_for_service (service);
+	ExchangeFolder *mfld;
+	ExchangeMessage *mmsg;
+	MessageStreamData msd;
+	E2kHTTPStatus status;
+	gchar *href, *content_type = NULL, *owner_email = NULL, *headers;
+	gboolean res = FALSE;
+
+	g_return_val_if_fail (ed != NULL, FALSE);
+	g_return_val_if_fail (CAMEL_IS_STREAM (stream), FALSE);
+
+	mfld = folder_from_name (ed, folder_name, MAPI_ACCESS_READ, error);
+	if (!mfld)
+		return FALSE;
+
+	mmsg = find_message (mfld, uid);
+	if (!mmsg || mfld->type == EXCHANGE_FOLDER_NOTES ||
+	    (mmsg->flags & EXMAIL_DELEGATED))
+		return get_message_to_stream_buffered (service, folder_name, uid, stream, cancellable, error);
+
+	if (is_foreign_folder (ed, folder_name, &owner_email)) {
+		g_free (owner_email);
+		return get_message_to_stream_buffered (service, folder_name, uid, stream, cancellable, error);
+	}
+
+	href = message_href (mfld, mmsg);
+	if (sender_needs_unmangling (ed, href)) {
+		g_free (href);
+		return get_message_to_stream_buffered (service, folder_name, uid, stream, cancellable, error);
+	}
+
+	memset (&msd, 0, sizeof (msd));
+	msd.stream = stream;
+	msd.cancellable = cancellable;
+
+	status = e2k_context_get_chunked (ed->ctx, NULL, href, &content_type,
+					  message_stream_got_chunk, &msd);
+	if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status))
+		goto error;
+	if (msd.error) {
+		g_propagate_error (error, msd.error);
+		msd.error = NULL;
+		goto cleanup;
+	}
+
+	/* Public folders especially can contain non-email objects;
+	 * see camel_exchange_utils_get_message().
+	 */
+	if (!is_message_content_type (content_type)) {
+		status = get_document_headers (ed->ctx, NULL, href, &headers);
+		if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status))
+			goto error;
+
+		if (camel_stream_write_string (stream, headers, cancellable, error) == -1) {
+			g_free (headers);
+			goto cleanup;
+		}
+		g_free (headers);
+
+		if (msd.document) {
+			g_seekable_seek (G_SEEKABLE (msd.document), 0, G_SEEK_SET, NULL, NULL);
+			if (camel_stream_write_to_stream (msd.document, stream, cancellable, error) == -1)
+				goto cleanup;
+		}
+	}
+
+	res = TRUE;
+
+	goto cleanup;
+
+ error:
+	g_warning ("get_message: %d", status);
+	if (status == E2K_HTTP_NOT_FOUND) {
+		message_removed (mfld, get_camel_folder (mfld), href);
+		set_exception (error, _("Message has been deleted"));
+	} else
+		set_exception (error, _("Error retrieving message"));
+
+ cleanup:
+	if (msd.document) {
+		g_object_unref (msd.document);
+		g_unlink (msd.document_path);
+	}
+	g_free (msd.document_path);
+	if (msd.error)
+		g_error_free (msd.error);
+	g_free (href);
+	g_free (content_type);
+
+	return res;
+}
+
 gboolean
 camel_exchange_utils_search (CamelService *service,
                              const gchar *folder_name,
@@ -3030,20 +3780,26 @@ camel_exchange_utils_transfer_messages (CamelService *service,
 	order = g_hash_table_new (NULL, NULL);
 	hrefs = g_ptr_array_new ();
 	new_uids = g_ptr_array_new ();
+
+	/* The hrefs are copied, since once the lock is released the
+	 * folder's strings can be compacted out from under them.
+	 */
+	g_static_rec_mutex_lock (&source->lock);
 	for (i = 0; i < uids->len; i++) {
 		mmsg = find_message (source, uids->pdata[i]);
 		if (!mmsg)
 			continue;
 
-		if (!mmsg->href || !strrchr (mmsg->href, '/')) {
+		if (!mmsg->href || !*mmsg->href) {
 			g_warning ("%s: Message '%s' with invalid href '%s'", G_STRFUNC, (gchar *)uids->pdata[i], mmsg->href ? mmsg->href : "NULL");
 			continue;
 		}
 
 		g_hash_table_insert (order, mmsg, GINT_TO_POINTER (i));
-		g_ptr_array_add (hrefs, strrchr (mmsg->href, '/') + 1);
+		g_ptr_array_add (hrefs, g_strdup (mmsg->href));
 		g_ptr_array_add (new_uids, g_strdup (""));
 	}
+	g_static_rec_mutex_unlock (&source->lock);
 
 	folder = get_camel_folder (source);
 
@@ -3096,6 +3852,7 @@ camel_exchange_utils_transfer_messages (CamelService *service,
 		new_uids = NULL;
 	}
 
+	g_ptr_array_foreach (hrefs, (GFunc) g_free, NULL);
 	g_ptr_array_free (hrefs, TRUE);
 	g_hash_table_destroy (order);
 
@@ -3178,7 +3935,7 @@ camel_exchange_utils_get_folder_info (CamelService *service,
 	/* use lock here to have done scanning of foreign hierarchy
 	 * only once, and to not call get_folder_info_data simultaneously
 	 * from more than one thread */
-	g_static_rec_mutex_lock (&ed->changed_msgs_mutex);
+	g_static_rec_mutex_lock (&ed->folder_info_mutex);
 
 	*folder_names = NULL;
 	*folder_uris = NULL;
@@ -3195,7 +3952,7 @@ camel_exchange_utils_get_folder_info (CamelService *service,
 		ed->removed_folder_id = g_signal_connect (ed->account, "removed_folder", G_CALLBACK (account_removed_folder), ed);
 	}
 
-	g_static_rec_mutex_unlock (&ed->changed_msgs_mutex);
+	g_static_rec_mutex_unlock (&ed->folder_info_mutex);
 
 	return TRUE;
 }
@@ -3394,7 +4151,7 @@ camel_exchange_utils_rename_folder (CamelService *service,
 	gchar *old_path, *new_path;
 	GPtrArray *names = NULL, *uris = NULL;
 	GArray *unread = NULL, *flags = NULL;
-	gint i = 0, j = 0;
+	gint i = 0;
 	gchar **folder_name;
 	const gchar *uri;
 	gchar *new_name_mod, *old_name_remove, *uri_unescaped, *old_name_mod = NULL;
@@ -3439,12 +4196,7 @@ camel_exchange_utils_rename_folder (CamelService *service,
 
 		g_hash_table_remove_all (mfld->messages_by_href);
 
-		for (i = 0; i < mfld->messages->len; i++) {
-			ExchangeMessage *mmsg;
-			mmsg = mfld->messages->pdata[i];
-			g_free (mmsg->href);
-			mmsg->href = NULL;
-		}
+		exchange_message_list_foreach (mfld->messages, clear_message_href, mfld);
 
 		if (is_online (ed) == ONLINE_MODE) {
 			if (!get_folder_online (mfld, error))
@@ -3500,12 +4252,7 @@ camel_exchange_utils_rename_folder (CamelService *service,
 
 			g_hash_table_remove_all (mfld->messages_by_href);
 
-			for (j = 0; j < mfld->messages->len; j++) {
-				ExchangeMessage *mmsg;
-				mmsg = mfld->messages->pdata[j];
-				g_free (mmsg->href);
-				mmsg->href = NULL;
-			}
+			exchange_message_list_foreach (mfld->messages, clear_message_href, mfld);
 
 			if (is_online (ed) == ONLINE_MODE) {
 				if (!get_folder_online (mfld, error))
@@ -19,12 +19,19 @@ gboolean	camel_exchange_utils_get_folder	(CamelService *service,
 						 GPtrArray *uids,
 						 GByteArray *flags,
 						 GPtrArray *hrefs,
+						 GArray *article_nums,
 						 guint32 high_article_num,
 						 guint32 *folder_flags, /* out */
 						 gchar **folder_uri, /* out */
 						 gboolean *readonly, /* out */
 						 GError **error);
 
+gboolean	camel_exchange_utils_save_folder_index
+						(CamelService *service,
+						 const gchar *folder_name,
+						 const gchar *filename,
+						 GError **error);
+
 gboolean	camel_exchange_utils_get_trash_name
 						(CamelService *service,
 						 gchar **trash_name, /* out */
@@ -81,6 +88,14 @@ gboolean	camel_exchange_utils_get_message
 						 GByteArray **message_bytes, /* out */
 						GError **error);
 
+gboolean	camel_exchange_utils_get_message_to_stream
+						(CamelService *service,
+						 const gchar *folder_name,
+						 const gchar *uid,
+						 CamelStream *stream,
+						 GCancellable *cancellable,
+						 GError **error);
+
 gboolean	camel_exchange_utils_search	(CamelService *service,
 						 const gchar *folder_name,
 						 const gchar *text,
@@ -0,0 +1,247 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/* Copyright (C) 2001-2004 Novell, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* A folder's uid, href, flags and article number for each message,
+ * saved next to its summary so that the folder can be opened without
+ * loading every message's summary info. The file is mapped rather
+ * than read, and looks like:
+ *
+ *   header     ExchangeFolderIndexHeader
+ *   records    nentries x ExchangeFolderIndexRecord
+ *   strings    strings_len bytes of NUL-terminated strings
+ *
+ * in host byte order; it is a local cache, and one written on another
+ * machine just fails the byte order check and gets ignored.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "exchange-folder-index.h"
+
+#define EXCHANGE_FOLDER_INDEX_MAGIC "ExIdx001"
+#define EXCHANGE_FOLDER_INDEX_BYTE_ORDER 0x01020304
+#define EXCHANGE_FOLDER_INDEX_NO_HREF G_MAXUINT32
+
+typedef struct {
+	gchar magic[8];
+	guint32 byte_order;
+	guint32 nentries;
+	guint32 high_article_num;
+	guint32 strings_len;
+} ExchangeFolderIndexHeader;
+
+typedef struct {
+	/* Offsets into the string table */
+	guint32 uid, href;
+	guint32 flags, article_num;
+} ExchangeFolderIndexRecord;
+
+struct _ExchangeFolderIndex {
+	GMappedFile *file;
+
+	const ExchangeFolderIndexHeader *header;
+	const ExchangeFolderIndexRecord *records;
+	const gchar *strings;
+};
+
+static gboolean
+index_is_valid (const gchar *data,
+                gsize length)
+{
+	const ExchangeFolderIndexHeader *header;
+	const ExchangeFolderIndexRecord *records;
+	const gchar *strings;
+	guint32 i;
+
+	if (length < sizeof (ExchangeFolderIndexHeader))
+		return FALSE;
+
+	header = (const ExchangeFolderIndexHeader *) data;
+	if (memcmp (header->magic, EXCHANGE_FOLDER_INDEX_MAGIC, sizeof (header->magic)) ||
+	    header->byte_order != EXCHANGE_FOLDER_INDEX_BYTE_ORDER)
+		return FALSE;
+
+	if (header->nentries > (length - sizeof (*header)) / sizeof (ExchangeFolderIndexRecord) ||
+	    length != sizeof (*header) +
+	    (gsize) header->nentries * sizeof (ExchangeFolderIndexRecord) +
+	    header->strings_len)
+		return FALSE;
+
+	records = (const ExchangeFolderIndexRecord *) (header + 1);
+	strings = (const gchar *) (records + header->nentries);
+
+	/* With a NUL at the end, every string that starts inside
+	 * the table also ends inside it.
+	 */
+	if (header->strings_len == 0 || strings[header->strings_len - 1] != '\0')
+		return FALSE;
+
+	for (i = 0; i < header->nentries; i++) {
+		if (records[i].uid >= header->strings_len)
+			return FALSE;
+		if (records[i].href != EXCHANGE_FOLDER_INDEX_NO_HREF &&
+		    records[i].href >= header->strings_len)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Returns %NULL if @filename doesn't exist or isn't a valid index */
+ExchangeFolderIndex *
+exchange_folder_index_open (const gchar *filename)
+{
+	ExchangeFolderIndex *index;
+	GMappedFile *file;
+	const gchar *data;
+
+	g_return_val_if_fail (filename != NULL, NULL);
+
+	file = g_mapped_file_new (filename, FALSE, NULL);
+	if (!file)
+		return NULL;
+
+	data = g_mapped_file_get_contents (file);
+	if (!data || !index_is_valid (data, g_mapped_file_get_length (file))) {
+		g_mapped_file_unref (file);
+		return NULL;
+	}
+
+	index = g_new0 (ExchangeFolderIndex, 1);
+	index->file = file;
+	index->header = (const ExchangeFolderIndexHeader *) data;
+	index->records = (const ExchangeFolderIndexRecord *) (index->header + 1);
+	index->strings = (const gchar *) (index->records + index->header->nentries);
+
+	return index;
+}
+
+/* Unmaps @index; strings returned by exchange_folder_index_get() are
+ * no longer valid after this.
+ */
+void
+exchange_folder_index_free (ExchangeFolderIndex *index)
+{
+	g_return_if_fail (index != NULL);
+
+	g_mapped_file_unref (index->file);
+	g_free (index);
+}
+
+guint
+exchange_folder_index_get_length (ExchangeFolderIndex *index)
+{
+	g_return_val_if_fail (index != NULL, 0);
+
+	return index->header->nentries;
+}
+
+guint32
+exchange_folder_index_get_high_article_num (ExchangeFolderIndex *index)
+{
+	g_return_val_if_fail (index != NULL, 0);
+
+	return index->header->high_article_num;
+}
+
+void
+exchange_folder_index_get (ExchangeFolderIndex *index,
+                           guint n,
+                           ExchangeFolderIndexEntry *entry)
+{
+	const ExchangeFolderIndexRecord *record;
+
+	g_return_if_fail (index != NULL);
+	g_return_if_fail (n < index->header->nentries);
+	g_return_if_fail (entry != NULL);
+
+	record = &index->records[n];
+	entry->uid = index->strings + record->uid;
+	if (record->href == EXCHANGE_FOLDER_INDEX_NO_HREF)
+		entry->href = NULL;
+	else
+		entry->href = index->strings + record->href;
+	entry->flags = record->flags;
+	entry->article_num = record->article_num;
+}
+
+/* Returns the contents of an index file holding @entries, for the
+ * caller to write out (and then free). @length is set to its size.
+ */
+gchar *
+exchange_folder_index_serialize (guint32 high_article_num,
+                                 const ExchangeFolderIndexEntry *entries,
+                                 guint nentries,
+                                 gsize *length)
+{
+	ExchangeFolderIndexHeader header;
+	ExchangeFolderIndexRecord *records;
+	GString *strings;
+	GString *data;
+	guint i;
+
+	g_return_val_if_fail (entries != NULL || nentries == 0, NULL);
+	g_return_val_if_fail (length != NULL, NULL);
+
+	records = g_new (ExchangeFolderIndexRecord, nentries);
+	strings = g_string_new (NULL);
+
+	for (i = 0; i < nentries; i++) {
+		records[i].uid = strings->len;
+		g_string_append_len (strings, entries[i].uid, strlen (entries[i].uid) + 1);
+
+		if (entries[i].href) {
+			records[i].href = strings->len;
+			g_string_append_len (strings, entries[i].href, strlen (entries[i].href) + 1);
+		} else
+			records[i].href = EXCHANGE_FOLDER_INDEX_NO_HREF;
+
+		records[i].flags = entries[i].flags;
+		records[i].article_num = entries[i].article_num;
+	}
+
+	/* So that the string table is never empty */
+	if (strings->len == 0)
+		g_string_append_len (strings, "", 1);
+
+	memset (&header, 0, sizeof (header));
+	memcpy (header.magic, EXCHANGE_FOLDER_INDEX_MAGIC, sizeof (header.magic));
+	header.byte_order = EXCHANGE_FOLDER_INDEX_BYTE_ORDER;
+	header.nentries = nentries;
+	header.high_article_num = high_article_num;
+	header.strings_len = strings->len;
+
+	data = g_string_sized_new (sizeof (header) +
+				   nentries * sizeof (ExchangeFolderIndexRecord) +
+				   strings->len);
+	g_string_append_len (data, (const gchar *) &header, sizeof (header));
+	g_string_append_len (data, (const gchar *) records,
+			     nentries * sizeof (ExchangeFolderIndexRecord));
+	g_string_append_len (data, strings->str, strings->len);
+
+	g_free (records);
+	g_string_free (strings, TRUE);
+
+	*length = data->len;
+	return g_string_free (data, FALSE);
+}
@@ -0,0 +1,37 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* Copyright (C) 2001-2004 Novell, Inc. */
+
+#ifndef __EXCHANGE_FOLDER_INDEX_H__
+#define __EXCHANGE_FOLDER_INDEX_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _ExchangeFolderIndex ExchangeFolderIndex;
+
+typedef struct {
+	const gchar *uid;
+	const gchar *href; /* may be NULL */
+	guint32 flags, article_num;
+} ExchangeFolderIndexEntry;
+
+ExchangeFolderIndex *exchange_folder_index_open      (const gchar *filename);
+void                 exchange_folder_index_free      (ExchangeFolderIndex *index);
+
+guint                exchange_folder_index_get_length
+						     (ExchangeFolderIndex *index);
+guint32              exchange_folder_index_get_high_article_num
+						     (ExchangeFolderIndex *index);
+void                 exchange_folder_index_get       (ExchangeFolderIndex *index,
+						      guint n,
+						      ExchangeFolderIndexEntry *entry);
+
+gchar               *exchange_folder_index_serialize (guint32 high_article_num,
+						      const ExchangeFolderIndexEntry *entries,
+						      guint nentries,
+						      gsize *length);
+
+G_END_DECLS
+
+#endif /* __EXCHANGE_FOLDER_INDEX_H__ */
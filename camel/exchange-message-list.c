@@ -0,0 +1,187 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/* Copyright (C) 2001-2004 Novell, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* A list of a folder's messages, kept in order of their (increasing)
+ * sequence numbers. Removing a message just leaves a hole in its
+ * slot; the holes are squeezed out once they make up half of the
+ * list, so removal costs O(log n) plus amortized O(1), rather than
+ * the O(n) of shifting the rest of an array down each time.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "exchange-message-list.h"
+
+/* Don't bother compacting lists smaller than this */
+#define EXCHANGE_MESSAGE_LIST_MIN_COMPACT 64
+
+struct _ExchangeMessageList {
+	/* Parallel arrays, by slot. data is NULL for removed messages */
+	GArray *seqs;
+	GPtrArray *data;
+
+	guint length;
+};
+
+ExchangeMessageList *
+exchange_message_list_new (void)
+{
+	ExchangeMessageList *list;
+
+	list = g_new0 (ExchangeMessageList, 1);
+	list->seqs = g_array_new (FALSE, FALSE, sizeof (guint32));
+	list->data = g_ptr_array_new ();
+
+	return list;
+}
+
+/* Frees @list, but not the data in it */
+void
+exchange_message_list_free (ExchangeMessageList *list)
+{
+	g_return_if_fail (list != NULL);
+
+	g_array_free (list->seqs, TRUE);
+	g_ptr_array_free (list->data, TRUE);
+	g_free (list);
+}
+
+/* @seq must be greater than that of anything already in @list */
+void
+exchange_message_list_append (ExchangeMessageList *list,
+                              guint32 seq,
+                              gpointer data)
+{
+	g_return_if_fail (list != NULL);
+	g_return_if_fail (data != NULL);
+	g_return_if_fail (list->seqs->len == 0 ||
+			  seq > g_array_index (list->seqs, guint32, list->seqs->len - 1));
+
+	g_array_append_val (list->seqs, seq);
+	g_ptr_array_add (list->data, data);
+	list->length++;
+}
+
+static gint
+find_slot (ExchangeMessageList *list,
+           guint32 seq)
+{
+	guint32 *seqs = (guint32 *) list->seqs->data;
+	gint low, high, mid;
+
+	low = 0;
+	high = list->seqs->len - 1;
+
+	while (low <= high) {
+		mid = (low + high) / 2;
+		if (seq == seqs[mid])
+			return list->data->pdata[mid] ? mid : -1;
+		else if (seq < seqs[mid])
+			high = mid - 1;
+		else
+			low = mid + 1;
+	}
+
+	return -1;
+}
+
+gpointer
+exchange_message_list_lookup (ExchangeMessageList *list,
+                              guint32 seq)
+{
+	gint slot;
+
+	g_return_val_if_fail (list != NULL, NULL);
+
+	slot = find_slot (list, seq);
+	return slot == -1 ? NULL : list->data->pdata[slot];
+}
+
+static void
+compact (ExchangeMessageList *list)
+{
+	guint32 *seqs = (guint32 *) list->seqs->data;
+	gpointer *data = list->data->pdata;
+	guint from, to;
+
+	for (from = to = 0; from < list->data->len; from++) {
+		if (!data[from])
+			continue;
+		seqs[to] = seqs[from];
+		data[to] = data[from];
+		to++;
+	}
+
+	g_array_set_size (list->seqs, to);
+	g_ptr_array_set_size (list->data, to);
+}
+
+/* Returns the data that was removed, or %NULL if @seq wasn't in @list */
+gpointer
+exchange_message_list_remove (ExchangeMessageList *list,
+                              guint32 seq)
+{
+	gpointer data;
+	gint slot;
+
+	g_return_val_if_fail (list != NULL, NULL);
+
+	slot = find_slot (list, seq);
+	if (slot == -1)
+		return NULL;
+
+	data = list->data->pdata[slot];
+	list->data->pdata[slot] = NULL;
+	list->length--;
+
+	if (list->data->len >= EXCHANGE_MESSAGE_LIST_MIN_COMPACT &&
+	    list->length < list->data->len / 2)
+		compact (list);
+
+	return data;
+}
+
+guint
+exchange_message_list_get_length (ExchangeMessageList *list)
+{
+	g_return_val_if_fail (list != NULL, 0);
+
+	return list->length;
+}
+
+/* Calls @func on each message in @list, in order of sequence number.
+ * @func must not add to or remove from @list.
+ */
+void
+exchange_message_list_foreach (ExchangeMessageList *list,
+                               GFunc func,
+                               gpointer user_data)
+{
+	guint i;
+
+	g_return_if_fail (list != NULL);
+	g_return_if_fail (func != NULL);
+
+	for (i = 0; i < list->data->len; i++) {
+		if (list->data->pdata[i])
+			func (list->data->pdata[i], user_data);
+	}
+}
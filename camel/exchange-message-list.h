@@ -0,0 +1,30 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* Copyright (C) 2001-2004 Novell, Inc. */
+
+#ifndef __EXCHANGE_MESSAGE_LIST_H__
+#define __EXCHANGE_MESSAGE_LIST_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _ExchangeMessageList ExchangeMessageList;
+
+ExchangeMessageList *exchange_message_list_new        (void);
+void                 exchange_message_list_free       (ExchangeMessageList *list);
+
+void                 exchange_message_list_append     (ExchangeMessageList *list,
+						       guint32 seq,
+						       gpointer data);
+gpointer             exchange_message_list_lookup     (ExchangeMessageList *list,
+						       guint32 seq);
+gpointer             exchange_message_list_remove     (ExchangeMessageList *list,
+						       guint32 seq);
+guint                exchange_message_list_get_length (ExchangeMessageList *list);
+void                 exchange_message_list_foreach    (ExchangeMessageList *list,
+						       GFunc func,
+						       gpointer user_data);
+
+G_END_DECLS
+
+#endif /* __EXCHANGE_MESSAGE_LIST_H__ */
@@ -0,0 +1,226 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/* Copyright (C) 2001-2004 Novell, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Checks that a folder index written by exchange_folder_index_serialize()
+ * reads back the same through exchange_folder_index_open(), and that a
+ * truncated or damaged one is refused rather than read.
+ *
+ * Build with:
+ *   cc -o indextest indextest.c exchange-folder-index.c `pkg-config --cflags --libs glib-2.0`
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#include "exchange-folder-index.h"
+
+/* Where things are in the file, as laid out in exchange-folder-index.c */
+#define HEADER_MAGIC       0
+#define HEADER_BYTE_ORDER  8
+#define HEADER_NENTRIES    12
+#define HEADER_STRINGS_LEN 20
+#define HEADER_SIZE        24
+#define RECORD_UID         0
+#define RECORD_HREF        4
+#define RECORD_SIZE        16
+
+#define NENTRIES 1000
+
+static gchar *filename;
+static gint failures;
+
+static ExchangeFolderIndex *
+open_data (const gchar *data,
+           gsize length)
+{
+	GError *error = NULL;
+
+	if (!g_file_set_contents (filename, data, length, &error)) {
+		fprintf (stderr, "Couldn't write %s: %s\n", filename, error->message);
+		exit (1);
+	}
+
+	return exchange_folder_index_open (filename);
+}
+
+static void
+set_guint32 (gchar *data,
+             gsize offset,
+             guint32 value)
+{
+	memcpy (data + offset, &value, sizeof (value));
+}
+
+static void
+check_rejected (const gchar *what,
+                const gchar *data,
+                gsize length)
+{
+	ExchangeFolderIndex *index;
+
+	index = open_data (data, length);
+	if (index) {
+		fprintf (stderr, "Opened an index with %s\n", what);
+		exchange_folder_index_free (index);
+		failures++;
+	}
+}
+
+static void
+check_round_trip (const ExchangeFolderIndexEntry *entries,
+                  guint nentries)
+{
+	ExchangeFolderIndex *index;
+	ExchangeFolderIndexEntry entry;
+	gchar *data;
+	gsize length;
+	guint i;
+
+	data = exchange_folder_index_serialize (4242, entries, nentries, &length);
+	index = open_data (data, length);
+	g_free (data);
+	if (!index) {
+		fprintf (stderr, "Couldn't open an index of %u entries\n", nentries);
+		failures++;
+		return;
+	}
+
+	if (exchange_folder_index_get_length (index) != nentries ||
+	    exchange_folder_index_get_high_article_num (index) != 4242) {
+		fprintf (stderr, "Index of %u entries has the wrong header\n", nentries);
+		failures++;
+	}
+
+	for (i = 0; i < nentries && i < exchange_folder_index_get_length (index); i++) {
+		exchange_folder_index_get (index, i, &entry);
+		if (strcmp (entry.uid, entries[i].uid) != 0 ||
+		    g_strcmp0 (entry.href, entries[i].href) != 0 ||
+		    entry.flags != entries[i].flags ||
+		    entry.article_num != entries[i].article_num) {
+			fprintf (stderr, "Entry %u didn't read back the same\n", i);
+			failures++;
+			break;
+		}
+	}
+
+	exchange_folder_index_free (index);
+}
+
+gint
+main (gint argc,
+      gchar **argv)
+{
+	ExchangeFolderIndexEntry *entries;
+	gchar **strings, *data, *copy;
+	gsize length, cut;
+	guint32 strings_len;
+	gint fd;
+	guint i;
+
+	fd = g_file_open_tmp ("indextest-XXXXXX", &filename, NULL);
+	if (fd == -1) {
+		fprintf (stderr, "Couldn't create a temporary file\n");
+		return 1;
+	}
+	close (fd);
+
+	/* Every fourth message has no href, as for one that hasn't
+	 * been seen on the server yet.
+	 */
+	entries = g_new0 (ExchangeFolderIndexEntry, NENTRIES);
+	strings = g_new0 (gchar *, 2 * NENTRIES);
+	for (i = 0; i < NENTRIES; i++) {
+		strings[2 * i] = g_strdup_printf ("%u", i + 1);
+		entries[i].uid = strings[2 * i];
+		if (i % 4) {
+			strings[2 * i + 1] = g_strdup_printf ("Message-%u.EML", i + 1);
+			entries[i].href = strings[2 * i + 1];
+		}
+		entries[i].flags = i * 7;
+		entries[i].article_num = i * 3 + 1;
+	}
+
+	check_round_trip (entries, NENTRIES);
+	check_round_trip (entries, 1);
+	check_round_trip (NULL, 0);
+
+	data = exchange_folder_index_serialize (4242, entries, NENTRIES, &length);
+	copy = g_malloc (length + 1);
+	memcpy (&strings_len, data + HEADER_STRINGS_LEN, sizeof (strings_len));
+
+	/* Cut short anywhere: in the header, the records or the
+	 * strings.
+	 */
+	for (cut = 0; cut < length; cut += cut < HEADER_SIZE + RECORD_SIZE ? 1 : 97)
+		check_rejected ("its end cut off", data, cut);
+	check_rejected ("its last byte cut off", data, length - 1);
+
+	memcpy (copy, data, length);
+	copy[length] = '\0';
+	check_rejected ("a byte added to the end", copy, length + 1);
+
+	memcpy (copy, data, length);
+	copy[HEADER_MAGIC] = 'X';
+	check_rejected ("a bad magic number", copy, length);
+
+	memcpy (copy, data, length);
+	set_guint32 (copy, HEADER_BYTE_ORDER, GUINT32_SWAP_LE_BE (0x01020304));
+	check_rejected ("the wrong byte order", copy, length);
+
+	memcpy (copy, data, length);
+	set_guint32 (copy, HEADER_NENTRIES, G_MAXUINT32);
+	check_rejected ("too many entries", copy, length);
+
+	memcpy (copy, data, length);
+	set_guint32 (copy, HEADER_NENTRIES, NENTRIES - 1);
+	check_rejected ("too few entries", copy, length);
+
+	memcpy (copy, data, length);
+	set_guint32 (copy, HEADER_SIZE + 10 * RECORD_SIZE + RECORD_UID, strings_len);
+	check_rejected ("a uid past the strings", copy, length);
+
+	memcpy (copy, data, length);
+	set_guint32 (copy, HEADER_SIZE + 10 * RECORD_SIZE + RECORD_HREF, strings_len + 5);
+	check_rejected ("an href past the strings", copy, length);
+
+	memcpy (copy, data, length);
+	copy[length - 1] = 'x';
+	check_rejected ("an unterminated last string", copy, length);
+
+	g_free (copy);
+	g_free (data);
+	g_unlink (filename);
+	g_free (filename);
+	for (i = 0; i < 2 * NENTRIES; i++)
+		g_free (strings[i]);
+	g_free (strings);
+	g_free (entries);
+
+	if (failures) {
+		fprintf (stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+
+	printf ("All index checks passed\n");
+	return 0;
+}
@@ -0,0 +1,162 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/* Copyright (C) 2001-2004 Novell, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Times removing messages from a large folder's message list, the way
+ * sync_deletions() does, with ExchangeMessageList and with the sorted
+ * GPtrArray it replaced.
+ *
+ * Build with:
+ *   cc -o mltest mltest.c exchange-message-list.c `pkg-config --cflags --libs glib-2.0`
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "exchange-message-list.h"
+
+typedef struct {
+	guint32 seq;
+} Message;
+
+static gint
+find_index (GPtrArray *array,
+            guint32 seq)
+{
+	Message *msg;
+	gint low, high, mid;
+
+	low = 0;
+	high = array->len - 1;
+
+	while (low <= high) {
+		mid = (low + high) / 2;
+		msg = array->pdata[mid];
+		if (seq == msg->seq)
+			return mid;
+		else if (seq < msg->seq)
+			high = mid - 1;
+		else
+			low = mid + 1;
+	}
+
+	return -1;
+}
+
+static void
+count_message (gpointer data,
+               gpointer user_data)
+{
+	(*(guint *) user_data)++;
+}
+
+gint
+main (gint argc,
+      gchar **argv)
+{
+	guint nmessages = 100000, nremove = 10000, i, count;
+	Message *messages;
+	guint32 *doomed;
+	GPtrArray *array;
+	ExchangeMessageList *list;
+	GRand *rand;
+	gint64 start, array_usecs, list_usecs;
+	gint index;
+
+	if (argc == 3) {
+		nmessages = atoi (argv[1]);
+		nremove = atoi (argv[2]);
+	} else if (argc != 1) {
+		fprintf (stderr, "Usage: %s [messages remove]\n", argv[0]);
+		return 1;
+	}
+	if (nremove > nmessages) {
+		fprintf (stderr, "Can't remove more messages than there are\n");
+		return 1;
+	}
+
+	messages = g_new (Message, nmessages);
+	for (i = 0; i < nmessages; i++)
+		messages[i].seq = i;
+
+	/* Pick nremove distinct messages, scattered through the folder */
+	doomed = g_new (guint32, nmessages);
+	for (i = 0; i < nmessages; i++)
+		doomed[i] = i;
+	rand = g_rand_new_with_seed (42);
+	for (i = 0; i < nremove; i++) {
+		guint32 j = g_rand_int_range (rand, i, nmessages), tmp;
+
+		tmp = doomed[i];
+		doomed[i] = doomed[j];
+		doomed[j] = tmp;
+	}
+	g_rand_free (rand);
+
+	array = g_ptr_array_sized_new (nmessages);
+	for (i = 0; i < nmessages; i++)
+		g_ptr_array_add (array, &messages[i]);
+
+	start = g_get_monotonic_time ();
+	for (i = 0; i < nremove; i++) {
+		index = find_index (array, doomed[i]);
+		g_ptr_array_remove_index (array, index);
+	}
+	array_usecs = g_get_monotonic_time () - start;
+
+	if (array->len != nmessages - nremove) {
+		fprintf (stderr, "GPtrArray: %u left, expected %u\n",
+			 array->len, nmessages - nremove);
+		return 1;
+	}
+	g_ptr_array_free (array, TRUE);
+
+	list = exchange_message_list_new ();
+	for (i = 0; i < nmessages; i++)
+		exchange_message_list_append (list, messages[i].seq, &messages[i]);
+
+	start = g_get_monotonic_time ();
+	for (i = 0; i < nremove; i++)
+		exchange_message_list_remove (list, doomed[i]);
+	list_usecs = g_get_monotonic_time () - start;
+
+	count = 0;
+	exchange_message_list_foreach (list, count_message, &count);
+	if (count != nmessages - nremove ||
+	    exchange_message_list_get_length (list) != count) {
+		fprintf (stderr, "ExchangeMessageList: %u left, expected %u\n",
+			 count, nmessages - nremove);
+		return 1;
+	}
+	for (i = 0; i < nremove; i++) {
+		if (exchange_message_list_lookup (list, doomed[i])) {
+			fprintf (stderr, "ExchangeMessageList: %u not removed\n",
+				 doomed[i]);
+			return 1;
+		}
+	}
+	exchange_message_list_free (list);
+
+	printf ("Removing %u of %u messages:\n", nremove, nmessages);
+	printf ("  GPtrArray:           %10.1f ms\n", array_usecs / 1000.0);
+	printf ("  ExchangeMessageList: %10.1f ms\n", list_usecs / 1000.0);
+
+	g_free (doomed);
+	g_free (messages);
+	return 0;
+}
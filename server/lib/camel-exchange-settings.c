@@ -30,6 +30,17 @@
 #define PASSWD_EXP_WARN_PERIOD_MIN 1
 #define PASSWD_EXP_WARN_PERIOD_MAX 90
 
+#define IDLE_TIMEOUT_MAX 3600
+
+#define MAX_CONNECTIONS_MIN 1
+#define MAX_CONNECTIONS_MAX 16
+
+#define PREFETCH_MAX_SIZE_MAX (1024 * 1024)
+#define PREFETCH_RATE_LIMIT_MAX (1024 * 1024)
+
+#define REQUEST_TIMEOUT_MIN 5
+#define REQUEST_TIMEOUT_MAX 600
+
 struct _CamelExchangeSettingsPrivate {
 	GMutex *property_lock;
 
@@ -38,12 +49,23 @@ struct _CamelExchangeSettingsPrivate {
 	gchar *owa_url;
 
 	gboolean check_all;
+	gboolean compress_responses;
 	gboolean filter_junk;
 	gboolean filter_junk_inbox;
 	gboolean use_passwd_exp_warn_period;
 
 	guint passwd_exp_warn_period;
 
+	/* Downloading messages for offline use */
+	guint prefetch_max_size;
+	guint prefetch_rate_limit;
+	gboolean prefetch_unread_only;
+
+	/* Connection policy */
+	guint idle_timeout;
+	guint max_connections;
+	guint request_timeout;
+
 	/* Global Catalog settings */
 	gboolean gc_allow_browse;
 	E2kAutoconfigGalAuthPref gc_auth_method;
@@ -57,6 +79,7 @@ enum {
 	PROP_0,
 	PROP_AUTH_MECHANISM,
 	PROP_CHECK_ALL,
+	PROP_COMPRESS_RESPONSES,
 	PROP_FILTER_JUNK,
 	PROP_FILTER_JUNK_INBOX,
 	PROP_GC_ALLOW_BROWSE,
@@ -65,11 +88,17 @@ enum {
 	PROP_GC_RESULTS_LIMIT,
 	PROP_GC_SERVER_NAME,
 	PROP_HOST,
+	PROP_IDLE_TIMEOUT,
 	PROP_MAILBOX,
+	PROP_MAX_CONNECTIONS,
 	PROP_OWA_PATH,
 	PROP_OWA_URL,
 	PROP_PASSWD_EXP_WARN_PERIOD,
 	PROP_PORT,
+	PROP_PREFETCH_MAX_SIZE,
+	PROP_PREFETCH_RATE_LIMIT,
+	PROP_PREFETCH_UNREAD_ONLY,
+	PROP_REQUEST_TIMEOUT,
 	PROP_SECURITY_METHOD,
 	PROP_USER,
 	PROP_USE_GC_RESULTS_LIMIT,
@@ -102,6 +131,12 @@ exchange_settings_set_property (GObject *object,
 				g_value_get_boolean (value));
 			return;
 
+		case PROP_COMPRESS_RESPONSES:
+			camel_exchange_settings_set_compress_responses (
+				CAMEL_EXCHANGE_SETTINGS (object),
+				g_value_get_boolean (value));
+			return;
+
 		case PROP_FILTER_JUNK:
 			camel_exchange_settings_set_filter_junk (
 				CAMEL_EXCHANGE_SETTINGS (object),
@@ -150,12 +185,24 @@ exchange_settings_set_property (GObject *object,
 				g_value_get_string (value));
 			return;
 
+		case PROP_IDLE_TIMEOUT:
+			camel_exchange_settings_set_idle_timeout (
+				CAMEL_EXCHANGE_SETTINGS (object),
+				g_value_get_uint (value));
+			return;
+
 		case PROP_MAILBOX:
 			camel_exchange_settings_set_mailbox (
 				CAMEL_EXCHANGE_SETTINGS (object),
 				g_value_get_string (value));
 			return;
 
+		case PROP_MAX_CONNECTIONS:
+			camel_exchange_settings_set_max_connections (
+				CAMEL_EXCHANGE_SETTINGS (object),
+				g_value_get_uint (value));
+			return;
+
 		case PROP_OWA_PATH:
 			camel_exchange_settings_set_owa_path (
 				CAMEL_EXCHANGE_SETTINGS (object),
@@ -180,6 +227,30 @@ exchange_settings_set_property (GObject *object,
 				g_value_get_uint (value));
 			return;
 
+		case PROP_PREFETCH_MAX_SIZE:
+			camel_exchange_settings_set_prefetch_max_size (
+				CAMEL_EXCHANGE_SETTINGS (object),
+				g_value_get_uint (value));
+			return;
+
+		case PROP_PREFETCH_RATE_LIMIT:
+			camel_exchange_settings_set_prefetch_rate_limit (
+				CAMEL_EXCHANGE_SETTINGS (object),
+				g_value_get_uint (value));
+			return;
+
+		case PROP_PREFETCH_UNREAD_ONLY:
+			camel_exchange_settings_set_prefetch_unread_only (
+				CAMEL_EXCHANGE_SETTINGS (object),
+				g_value_get_boolean (value));
+			return;
+
+		case PROP_REQUEST_TIMEOUT:
+			camel_exchange_settings_set_request_timeout (
+				CAMEL_EXCHANGE_SETTINGS (object),
+				g_value_get_uint (value));
+			return;
+
 		case PROP_SECURITY_METHOD:
 			camel_network_settings_set_security_method (
 				CAMEL_NETWORK_SETTINGS (object),
@@ -229,6 +300,13 @@ exchange_settings_get_property (GObject *object,
 				CAMEL_EXCHANGE_SETTINGS (object)));
 			return;
 
+		case PROP_COMPRESS_RESPONSES:
+			g_value_set_boolean (
+				value,
+				camel_exchange_settings_get_compress_responses (
+				CAMEL_EXCHANGE_SETTINGS (object)));
+			return;
+
 		case PROP_FILTER_JUNK:
 			g_value_set_boolean (
 				value,
@@ -285,6 +363,13 @@ exchange_settings_get_property (GObject *object,
 				CAMEL_NETWORK_SETTINGS (object)));
 			return;
 
+		case PROP_IDLE_TIMEOUT:
+			g_value_set_uint (
+				value,
+				camel_exchange_settings_get_idle_timeout (
+				CAMEL_EXCHANGE_SETTINGS (object)));
+			return;
+
 		case PROP_MAILBOX:
 			g_value_take_string (
 				value,
@@ -292,6 +377,13 @@ exchange_settings_get_property (GObject *object,
 				CAMEL_EXCHANGE_SETTINGS (object)));
 			return;
 
+		case PROP_MAX_CONNECTIONS:
+			g_value_set_uint (
+				value,
+				camel_exchange_settings_get_max_connections (
+				CAMEL_EXCHANGE_SETTINGS (object)));
+			return;
+
 		case PROP_OWA_PATH:
 			g_value_take_string (
 				value,
@@ -320,6 +412,34 @@ exchange_settings_get_property (GObject *object,
 				CAMEL_NETWORK_SETTINGS (object)));
 			return;
 
+		case PROP_PREFETCH_MAX_SIZE:
+			g_value_set_uint (
+				value,
+				camel_exchange_settings_get_prefetch_max_size (
+				CAMEL_EXCHANGE_SETTINGS (object)));
+			return;
+
+		case PROP_PREFETCH_RATE_LIMIT:
+			g_value_set_uint (
+				value,
+				camel_exchange_settings_get_prefetch_rate_limit (
+				CAMEL_EXCHANGE_SETTINGS (object)));
+			return;
+
+		case PROP_PREFETCH_UNREAD_ONLY:
+			g_value_set_boolean (
+				value,
+				camel_exchange_settings_get_prefetch_unread_only (
+				CAMEL_EXCHANGE_SETTINGS (object)));
+			return;
+
+		case PROP_REQUEST_TIMEOUT:
+			g_value_set_uint (
+				value,
+				camel_exchange_settings_get_request_timeout (
+				CAMEL_EXCHANGE_SETTINGS (object)));
+			return;
+
 		case PROP_SECURITY_METHOD:
 			g_value_set_enum (
 				value,
@@ -400,6 +520,18 @@ camel_exchange_settings_class_init (CamelExchangeSettingsClass *class)
 			G_PARAM_CONSTRUCT |
 			G_PARAM_STATIC_STRINGS));
 
+	g_object_class_install_property (
+		object_class,
+		PROP_COMPRESS_RESPONSES,
+		g_param_spec_boolean (
+			"compress-responses",
+			"Compress Responses",
+			"Ask the server to compress its responses",
+			TRUE,
+			G_PARAM_READWRITE |
+			G_PARAM_CONSTRUCT |
+			G_PARAM_STATIC_STRINGS));
+
 	g_object_class_install_property (
 		object_class,
 		PROP_FILTER_JUNK,
@@ -493,6 +625,21 @@ camel_exchange_settings_class_init (CamelExchangeSettingsClass *class)
 		PROP_HOST,
 		"host");
 
+	g_object_class_install_property (
+		object_class,
+		PROP_IDLE_TIMEOUT,
+		g_param_spec_uint (
+			"idle-timeout",
+			"Idle Timeout",
+			"Seconds to keep an unused connection open, "
+			"or 0 to keep it until the server closes it",
+			0,
+			IDLE_TIMEOUT_MAX,
+			0,
+			G_PARAM_READWRITE |
+			G_PARAM_CONSTRUCT |
+			G_PARAM_STATIC_STRINGS));
+
 	g_object_class_install_property (
 		object_class,
 		PROP_MAILBOX,
@@ -505,6 +652,20 @@ camel_exchange_settings_class_init (CamelExchangeSettingsClass *class)
 			G_PARAM_CONSTRUCT |
 			G_PARAM_STATIC_STRINGS));
 
+	g_object_class_install_property (
+		object_class,
+		PROP_MAX_CONNECTIONS,
+		g_param_spec_uint (
+			"max-connections",
+			"Max Connections",
+			"Maximum number of connections to the server",
+			MAX_CONNECTIONS_MIN,
+			MAX_CONNECTIONS_MAX,
+			4,
+			G_PARAM_READWRITE |
+			G_PARAM_CONSTRUCT |
+			G_PARAM_STATIC_STRINGS));
+
 	g_object_class_install_property (
 		object_class,
 		PROP_OWA_PATH,
@@ -549,6 +710,63 @@ camel_exchange_settings_class_init (CamelExchangeSettingsClass *class)
 		PROP_PORT,
 		"port");
 
+	g_object_class_install_property (
+		object_class,
+		PROP_PREFETCH_MAX_SIZE,
+		g_param_spec_uint (
+			"prefetch-max-size",
+			"Prefetch Max Size",
+			"Largest message, in kilobytes, to download for "
+			"offline use ahead of time, or 0 for no limit",
+			0,
+			PREFETCH_MAX_SIZE_MAX,
+			0,
+			G_PARAM_READWRITE |
+			G_PARAM_CONSTRUCT |
+			G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (
+		object_class,
+		PROP_PREFETCH_RATE_LIMIT,
+		g_param_spec_uint (
+			"prefetch-rate-limit",
+			"Prefetch Rate Limit",
+			"Kilobytes per second to spend downloading messages "
+			"for offline use, or 0 for no limit",
+			0,
+			PREFETCH_RATE_LIMIT_MAX,
+			0,
+			G_PARAM_READWRITE |
+			G_PARAM_CONSTRUCT |
+			G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (
+		object_class,
+		PROP_PREFETCH_UNREAD_ONLY,
+		g_param_spec_boolean (
+			"prefetch-unread-only",
+			"Prefetch Unread Only",
+			"Whether to download only unread messages "
+			"for offline use ahead of time",
+			FALSE,
+			G_PARAM_READWRITE |
+			G_PARAM_CONSTRUCT |
+			G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (
+		object_class,
+		PROP_REQUEST_TIMEOUT,
+		g_param_spec_uint (
+			"request-timeout",
+			"Request Timeout",
+			"Seconds to wait for the server to respond",
+			REQUEST_TIMEOUT_MIN,
+			REQUEST_TIMEOUT_MAX,
+			30,
+			G_PARAM_READWRITE |
+			G_PARAM_CONSTRUCT |
+			G_PARAM_STATIC_STRINGS));
+
 	/* Inherited from CamelNetworkSettings. */
 	g_object_class_override_property (
 		object_class,
@@ -612,6 +830,25 @@ camel_exchange_settings_set_check_all (CamelExchangeSettings *settings,
 	g_object_notify (G_OBJECT (settings), "check-all");
 }
 
+gboolean
+camel_exchange_settings_get_compress_responses (CamelExchangeSettings *settings)
+{
+	g_return_val_if_fail (CAMEL_IS_EXCHANGE_SETTINGS (settings), FALSE);
+
+	return settings->priv->compress_responses;
+}
+
+void
+camel_exchange_settings_set_compress_responses (CamelExchangeSettings *settings,
+                                                gboolean compress_responses)
+{
+	g_return_if_fail (CAMEL_IS_EXCHANGE_SETTINGS (settings));
+
+	settings->priv->compress_responses = compress_responses;
+
+	g_object_notify (G_OBJECT (settings), "compress-responses");
+}
+
 gboolean
 camel_exchange_settings_get_filter_junk (CamelExchangeSettings *settings)
 {
@@ -777,6 +1014,25 @@ camel_exchange_settings_set_gc_server_name (CamelExchangeSettings *settings,
 	g_object_notify (G_OBJECT (settings), "gc-server-name");
 }
 
+guint
+camel_exchange_settings_get_idle_timeout (CamelExchangeSettings *settings)
+{
+	g_return_val_if_fail (CAMEL_IS_EXCHANGE_SETTINGS (settings), 0);
+
+	return settings->priv->idle_timeout;
+}
+
+void
+camel_exchange_settings_set_idle_timeout (CamelExchangeSettings *settings,
+                                          guint idle_timeout)
+{
+	g_return_if_fail (CAMEL_IS_EXCHANGE_SETTINGS (settings));
+
+	settings->priv->idle_timeout = MIN (idle_timeout, IDLE_TIMEOUT_MAX);
+
+	g_object_notify (G_OBJECT (settings), "idle-timeout");
+}
+
 const gchar *
 camel_exchange_settings_get_mailbox (CamelExchangeSettings *settings)
 {
@@ -823,6 +1079,28 @@ camel_exchange_settings_set_mailbox (CamelExchangeSettings *settings,
 	g_object_notify (G_OBJECT (settings), "mailbox");
 }
 
+guint
+camel_exchange_settings_get_max_connections (CamelExchangeSettings *settings)
+{
+	g_return_val_if_fail (CAMEL_IS_EXCHANGE_SETTINGS (settings), 0);
+
+	return settings->priv->max_connections;
+}
+
+void
+camel_exchange_settings_set_max_connections (CamelExchangeSettings *settings,
+                                             guint max_connections)
+{
+	g_return_if_fail (CAMEL_IS_EXCHANGE_SETTINGS (settings));
+
+	settings->priv->max_connections = CLAMP (
+		max_connections,
+		MAX_CONNECTIONS_MIN,
+		MAX_CONNECTIONS_MAX);
+
+	g_object_notify (G_OBJECT (settings), "max-connections");
+}
+
 const gchar *
 camel_exchange_settings_get_owa_path (CamelExchangeSettings *settings)
 {
@@ -937,6 +1215,87 @@ camel_exchange_settings_set_passwd_exp_warn_period (CamelExchangeSettings *setti
 	g_object_notify (G_OBJECT (settings), "passwd-exp-warn-period");
 }
 
+guint
+camel_exchange_settings_get_prefetch_max_size (CamelExchangeSettings *settings)
+{
+	g_return_val_if_fail (CAMEL_IS_EXCHANGE_SETTINGS (settings), 0);
+
+	return settings->priv->prefetch_max_size;
+}
+
+void
+camel_exchange_settings_set_prefetch_max_size (CamelExchangeSettings *settings,
+                                               guint prefetch_max_size)
+{
+	g_return_if_fail (CAMEL_IS_EXCHANGE_SETTINGS (settings));
+
+	settings->priv->prefetch_max_size = MIN (
+		prefetch_max_size, PREFETCH_MAX_SIZE_MAX);
+
+	g_object_notify (G_OBJECT (settings), "prefetch-max-size");
+}
+
+guint
+camel_exchange_settings_get_prefetch_rate_limit (CamelExchangeSettings *settings)
+{
+	g_return_val_if_fail (CAMEL_IS_EXCHANGE_SETTINGS (settings), 0);
+
+	return settings->priv->prefetch_rate_limit;
+}
+
+void
+camel_exchange_settings_set_prefetch_rate_limit (CamelExchangeSettings *settings,
+                                                 guint prefetch_rate_limit)
+{
+	g_return_if_fail (CAMEL_IS_EXCHANGE_SETTINGS (settings));
+
+	settings->priv->prefetch_rate_limit = MIN (
+		prefetch_rate_limit, PREFETCH_RATE_LIMIT_MAX);
+
+	g_object_notify (G_OBJECT (settings), "prefetch-rate-limit");
+}
+
+gboolean
+camel_exchange_settings_get_prefetch_unread_only (CamelExchangeSettings *settings)
+{
+	g_return_val_if_fail (CAMEL_IS_EXCHANGE_SETTINGS (settings), FALSE);
+
+	return settings->priv->prefetch_unread_only;
+}
+
+void
+camel_exchange_settings_set_prefetch_unread_only (CamelExchangeSettings *settings,
+                                                  gboolean prefetch_unread_only)
+{
+	g_return_if_fail (CAMEL_IS_EXCHANGE_SETTINGS (settings));
+
+	settings->priv->prefetch_unread_only = prefetch_unread_only;
+
+	g_object_notify (G_OBJECT (settings), "prefetch-unread-only");
+}
+
+guint
+camel_exchange_settings_get_request_timeout (CamelExchangeSettings *settings)
+{
+	g_return_val_if_fail (CAMEL_IS_EXCHANGE_SETTINGS (settings), 0);
+
+	return settings->priv->request_timeout;
+}
+
+void
+camel_exchange_settings_set_request_timeout (CamelExchangeSettings *settings,
+                                             guint request_timeout)
+{
+	g_return_if_fail (CAMEL_IS_EXCHANGE_SETTINGS (settings));
+
+	settings->priv->request_timeout = CLAMP (
+		request_timeout,
+		REQUEST_TIMEOUT_MIN,
+		REQUEST_TIMEOUT_MAX);
+
+	g_object_notify (G_OBJECT (settings), "request-timeout");
+}
+
 gboolean
 camel_exchange_settings_get_use_gc_results_limit (CamelExchangeSettings *settings)
 {
@@ -63,6 +63,11 @@ gboolean	camel_exchange_settings_get_check_all
 void		camel_exchange_settings_set_check_all
 					(CamelExchangeSettings *settings,
 					 gboolean check_all);
+gboolean	camel_exchange_settings_get_compress_responses
+					(CamelExchangeSettings *settings);
+void		camel_exchange_settings_set_compress_responses
+					(CamelExchangeSettings *settings,
+					 gboolean compress_responses);
 gboolean	camel_exchange_settings_get_filter_junk
 					(CamelExchangeSettings *settings);
 void		camel_exchange_settings_set_filter_junk
@@ -101,6 +106,11 @@ gchar *		camel_exchange_settings_dup_gc_server_name
 void		camel_exchange_settings_set_gc_server_name
 					(CamelExchangeSettings *settings,
 					 const gchar *gc_server_name);
+guint		camel_exchange_settings_get_idle_timeout
+					(CamelExchangeSettings *settings);
+void		camel_exchange_settings_set_idle_timeout
+					(CamelExchangeSettings *settings,
+					 guint idle_timeout);
 const gchar *	camel_exchange_settings_get_mailbox
 					(CamelExchangeSettings *settings);
 gchar *		camel_exchange_settings_dup_mailbox
@@ -108,6 +118,11 @@ gchar *		camel_exchange_settings_dup_mailbox
 void		camel_exchange_settings_set_mailbox
 					(CamelExchangeSettings *settings,
 					 const gchar *mailbox);
+guint		camel_exchange_settings_get_max_connections
+					(CamelExchangeSettings *settings);
+void		camel_exchange_settings_set_max_connections
+					(CamelExchangeSettings *settings,
+					 guint max_connections);
 const gchar *	camel_exchange_settings_get_owa_path
 					(CamelExchangeSettings *settings);
 gchar *		camel_exchange_settings_dup_owa_path
@@ -127,6 +142,26 @@ guint		camel_exchange_settings_get_passwd_exp_warn_period
 void		camel_exchange_settings_set_passwd_exp_warn_period
 					(CamelExchangeSettings *settings,
 					 guint passwd_exp_warn_period);
+guint		camel_exchange_settings_get_prefetch_max_size
+					(CamelExchangeSettings *settings);
+void		camel_exchange_settings_set_prefetch_max_size
+					(CamelExchangeSettings *settings,
+					 guint prefetch_max_size);
+guint		camel_exchange_settings_get_prefetch_rate_limit
+					(CamelExchangeSettings *settings);
+void		camel_exchange_settings_set_prefetch_rate_limit
+					(CamelExchangeSettings *settings,
+					 guint prefetch_rate_limit);
+gboolean	camel_exchange_settings_get_prefetch_unread_only
+					(CamelExchangeSettings *settings);
+void		camel_exchange_settings_set_prefetch_unread_only
+					(CamelExchangeSettings *settings,
+					 gboolean prefetch_unread_only);
+guint		camel_exchange_settings_get_request_timeout
+					(CamelExchangeSettings *settings);
+void		camel_exchange_settings_set_request_timeout
+					(CamelExchangeSettings *settings,
+					 guint request_timeout);
 gboolean	camel_exchange_settings_get_use_gc_results_limit
 					(CamelExchangeSettings *settings);
 void		camel_exchange_settings_set_use_gc_results_limit
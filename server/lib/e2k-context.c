@@ -23,12 +23,14 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 
 #ifndef G_OS_WIN32
 #include <sys/socket.h>
@@ -102,12 +104,55 @@ struct _E2kContextPrivate {
 	gchar *cookie;
 	gboolean cookie_verified;
 	EProxy * proxy;
+
+	/* SEARCH paging */
+	E2kContextBatchMode batch_mode;
+	gint max_batch_size;
+
+	/* Applied to both sessions */
+	E2kContextConnectionPolicy policy;
+	gboolean compress;
+
+	/* Request statistics, by method */
+	GMutex *stats_lock;
+	GHashTable *stats;
+	gchar *stats_file;
+	guint stats_dump_id;
+
+	/* Shared (single-flight) requests in flight, by key */
+	GMutex *shared_lock;
+	GCond *shared_cond;
+	GHashTable *shared;
 };
 
 /* For operations with progress */
 #define E2K_CONTEXT_MIN_BATCH_SIZE 25
 #define E2K_CONTEXT_MAX_BATCH_SIZE 100
 
+/* Upper bound and per-response targets for adaptive SEARCH paging.
+ * The targets keep each response comfortably inside the session
+ * timeout and avoid asking the server for huge result sets at once.
+ */
+#define E2K_CONTEXT_ADAPTIVE_MAX_BATCH_SIZE 5000
+#define E2K_CONTEXT_ADAPTIVE_TARGET_BYTES   (512 * 1024)
+#define E2K_CONTEXT_ADAPTIVE_TARGET_USECS   (3 * G_USEC_PER_SEC)
+
+/* Default connection policy. Each new connection costs a full NTLM
+ * handshake, so allow enough of them for several folders to be synced
+ * at once and keep them open for as long as the server lets us.
+ */
+#define E2K_CONTEXT_DEFAULT_MAX_CONNS          10
+#define E2K_CONTEXT_DEFAULT_MAX_CONNS_PER_HOST 4
+#define E2K_CONTEXT_DEFAULT_IDLE_TIMEOUT       0
+
+/* Upper bounds, in milliseconds, of all but the last latency bucket */
+static const guint stats_bucket_msecs[E2K_CONTEXT_STATS_N_BUCKETS - 1] = {
+	10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+/* Default interval for E2K_STATS_DUMP, in seconds */
+#define E2K_CONTEXT_STATS_DUMP_INTERVAL 60
+
 /* For soup sync session timeout */
 #define E2K_SOUP_SESSION_TIMEOUT 30
 
@@ -221,6 +266,16 @@ dispose (GObject *object)
 		g_free (ctx->priv->cookie);
 		g_free (ctx->priv->notification_uri);
 
+		if (ctx->priv->stats_dump_id)
+			g_source_remove (ctx->priv->stats_dump_id);
+		g_free (ctx->priv->stats_file);
+		g_hash_table_destroy (ctx->priv->stats);
+		g_mutex_free (ctx->priv->stats_lock);
+
+		g_hash_table_destroy (ctx->priv->shared);
+		g_mutex_free (ctx->priv->shared_lock);
+		g_cond_free (ctx->priv->shared_cond);
+
 		if (ctx->priv->proxy) {
 			g_object_unref (ctx->priv->proxy);
 			ctx->priv->proxy = NULL;
@@ -268,9 +323,27 @@ e2k_context_init (E2kContext *ctx)
 		g_hash_table_new (g_str_hash, g_str_equal);
 	ctx->priv->subscriptions_by_uri =
 		g_hash_table_new (g_str_hash, g_str_equal);
+	ctx->priv->batch_mode = E2K_CONTEXT_BATCH_ADAPTIVE;
+	ctx->priv->max_batch_size = E2K_CONTEXT_ADAPTIVE_MAX_BATCH_SIZE;
+	ctx->priv->policy.max_conns = E2K_CONTEXT_DEFAULT_MAX_CONNS;
+	ctx->priv->policy.max_conns_per_host = E2K_CONTEXT_DEFAULT_MAX_CONNS_PER_HOST;
+	ctx->priv->policy.idle_timeout = E2K_CONTEXT_DEFAULT_IDLE_TIMEOUT;
+	ctx->priv->policy.timeout = E2K_SOUP_SESSION_TIMEOUT;
+	if (g_getenv ("SOUP_SESSION_TIMEOUT"))
+		ctx->priv->policy.timeout = atoi (g_getenv ("SOUP_SESSION_TIMEOUT"));
+	ctx->priv->stats_lock = g_mutex_new ();
+	ctx->priv->stats = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+	ctx->priv->shared_lock = g_mutex_new ();
+	ctx->priv->shared_cond = g_cond_new ();
+	ctx->priv->shared = g_hash_table_new (g_str_hash, g_str_equal);
 	ctx->priv->proxy = e_proxy_new ();
 	e_proxy_setup_proxy (ctx->priv->proxy);
 	g_signal_connect (ctx->priv->proxy, "changed", G_CALLBACK (proxy_settings_changed), ctx);
+
+	if (g_getenv ("E2K_STATS_DUMP")) {
+		e2k_context_set_stats_dump (ctx, g_getenv ("E2K_STATS_DUMP"),
+					    E2K_CONTEXT_STATS_DUMP_INTERVAL);
+	}
 }
 
 static void
@@ -434,7 +507,6 @@ e2k_context_set_auth (E2kContext *ctx,
                       const gchar *authmech,
                       const gchar *password)
 {
-	guint timeout = E2K_SOUP_SESSION_TIMEOUT;
 	SoupURI * uri = NULL;
 	E2kContextPrivate *priv = ctx->priv;
 #ifdef E2K_DEBUG
@@ -465,19 +537,16 @@ e2k_context_set_auth (E2kContext *ctx,
 	if (ctx->priv->async_session)
 		g_object_unref (ctx->priv->async_session);
 
-	/* Set a default timeout value of 30 seconds.
-	 * FIXME: Make timeout configurable
-	*/
-	if (g_getenv ("SOUP_SESSION_TIMEOUT"))
-		timeout = atoi (g_getenv ("SOUP_SESSION_TIMEOUT"));
-
 	/* Check do we need a proxy to contact the server? */
 	if (e_proxy_require_proxy_for_uri (ctx->priv->proxy, ctx->priv->owa_uri))
 		uri = e_proxy_peek_uri_for (ctx->priv->proxy, ctx->priv->owa_uri);
 
 	ctx->priv->session = soup_session_sync_new_with_options (
 		SOUP_SESSION_USE_NTLM, !authmech || !strcmp (authmech, "NTLM"),
-		SOUP_SESSION_TIMEOUT, timeout,
+		SOUP_SESSION_TIMEOUT, priv->policy.timeout,
+		SOUP_SESSION_MAX_CONNS, priv->policy.max_conns,
+		SOUP_SESSION_MAX_CONNS_PER_HOST, priv->policy.max_conns_per_host,
+		SOUP_SESSION_IDLE_TIMEOUT, priv->policy.idle_timeout,
 		SOUP_SESSION_PROXY_URI, uri,
 		NULL);
 	g_signal_connect (ctx->priv->session, "authenticate",
@@ -492,12 +561,22 @@ e2k_context_set_auth (E2kContext *ctx,
 	ctx->priv->async_session = soup_session_async_new_with_options (
 		SOUP_SESSION_USE_NTLM, !authmech || !strcmp (authmech, "NTLM"),
 		SOUP_SESSION_ASYNC_CONTEXT, priv->soup_context,
+		SOUP_SESSION_MAX_CONNS, priv->policy.max_conns,
+		SOUP_SESSION_MAX_CONNS_PER_HOST, priv->policy.max_conns_per_host,
+		SOUP_SESSION_IDLE_TIMEOUT, priv->policy.idle_timeout,
 		SOUP_SESSION_PROXY_URI, uri, NULL);
 	g_signal_connect (ctx->priv->async_session, "authenticate",
 			  G_CALLBACK (session_authenticate), ctx);
 	g_signal_connect (ctx->priv->async_session, "request_started",
 			  G_CALLBACK (setup_message), ctx);
 
+	if (priv->compress) {
+		soup_session_add_feature_by_type (
+			ctx->priv->session, SOUP_TYPE_CONTENT_DECODER);
+		soup_session_add_feature_by_type (
+			ctx->priv->async_session, SOUP_TYPE_CONTENT_DECODER);
+	}
+
 #ifdef E2K_DEBUG
 	if (e2k_debug_level <= 0)
 		return;
@@ -535,6 +614,365 @@ e2k_context_get_last_timestamp (E2kContext *ctx)
 	return ctx->priv->last_timestamp;
 }
 
+/**
+ * e2k_context_set_batch_policy:
+ * @ctx: the context
+ * @mode: how SEARCH results should be paged
+ * @max_rows: the largest number of rows to request at once in
+ * %E2K_CONTEXT_BATCH_ADAPTIVE mode, or 0 for the default
+ *
+ * Sets how e2k_context_search_start() pages through results on @ctx.
+ * With %E2K_CONTEXT_BATCH_FIXED, results are always requested 100
+ * rows at a time. With %E2K_CONTEXT_BATCH_ADAPTIVE (the default),
+ * the number of rows per request grows or shrinks based on the
+ * size of and time taken by each response, so that searches asking
+ * for only a few small properties need far fewer round-trips.
+ **/
+void
+e2k_context_set_batch_policy (E2kContext *ctx,
+                              E2kContextBatchMode mode,
+                              gint max_rows)
+{
+	g_return_if_fail (E2K_IS_CONTEXT (ctx));
+
+	if (max_rows <= 0)
+		max_rows = E2K_CONTEXT_ADAPTIVE_MAX_BATCH_SIZE;
+
+	ctx->priv->batch_mode = mode;
+	ctx->priv->max_batch_size = MAX (max_rows, E2K_CONTEXT_MIN_BATCH_SIZE);
+}
+
+/**
+ * e2k_context_get_batch_policy:
+ * @ctx: the context
+ * @max_rows: if not %NULL, will contain the adaptive row limit
+ *
+ * Returns the SEARCH paging policy set on @ctx.
+ *
+ * Return value: the paging mode
+ **/
+E2kContextBatchMode
+e2k_context_get_batch_policy (E2kContext *ctx,
+                              gint *max_rows)
+{
+	g_return_val_if_fail (E2K_IS_CONTEXT (ctx), E2K_CONTEXT_BATCH_FIXED);
+
+	if (max_rows)
+		*max_rows = ctx->priv->max_batch_size;
+
+	return ctx->priv->batch_mode;
+}
+
+/**
+ * e2k_context_set_connection_policy:
+ * @ctx: the context
+ * @policy: the new policy
+ *
+ * Sets how @ctx manages its connections to the server:
+ * @policy->max_conns and @policy->max_conns_per_host limit how many
+ * connections may be open at once (requests beyond that wait for a
+ * connection to become free), @policy->idle_timeout is how many
+ * seconds an unused connection is kept open (0 means until the server
+ * closes it), and @policy->timeout is how many seconds a synchronous
+ * request may go without any response before it fails.
+ *
+ * Since NTLM authenticates connections rather than requests, keeping
+ * connections open avoids repeating the NTLM handshake.
+ *
+ * The policy takes effect immediately, and is kept across calls to
+ * e2k_context_set_auth().
+ **/
+void
+e2k_context_set_connection_policy (E2kContext *ctx,
+                                   const E2kContextConnectionPolicy *policy)
+{
+	E2kContextPrivate *priv;
+
+	g_return_if_fail (E2K_IS_CONTEXT (ctx));
+	g_return_if_fail (policy != NULL);
+	g_return_if_fail (policy->max_conns_per_host > 0);
+
+	priv = ctx->priv;
+	priv->policy = *policy;
+	priv->policy.max_conns = MAX (policy->max_conns,
+				      policy->max_conns_per_host);
+
+	if (priv->session) {
+		g_object_set (priv->session,
+			      SOUP_SESSION_TIMEOUT, priv->policy.timeout,
+			      SOUP_SESSION_MAX_CONNS, priv->policy.max_conns,
+			      SOUP_SESSION_MAX_CONNS_PER_HOST, priv->policy.max_conns_per_host,
+			      SOUP_SESSION_IDLE_TIMEOUT, priv->policy.idle_timeout,
+			      NULL);
+	}
+	if (priv->async_session) {
+		g_object_set (priv->async_session,
+			      SOUP_SESSION_MAX_CONNS, priv->policy.max_conns,
+			      SOUP_SESSION_MAX_CONNS_PER_HOST, priv->policy.max_conns_per_host,
+			      SOUP_SESSION_IDLE_TIMEOUT, priv->policy.idle_timeout,
+			      NULL);
+	}
+}
+
+/**
+ * e2k_context_get_connection_policy:
+ * @ctx: the context
+ * @policy: an #E2kContextConnectionPolicy to fill in
+ *
+ * Fills in @policy with @ctx's current connection policy.
+ **/
+void
+e2k_context_get_connection_policy (E2kContext *ctx,
+                                   E2kContextConnectionPolicy *policy)
+{
+	g_return_if_fail (E2K_IS_CONTEXT (ctx));
+	g_return_if_fail (policy != NULL);
+
+	*policy = ctx->priv->policy;
+}
+
+static void
+set_content_decoder (SoupSession *session,
+                     gboolean compress)
+{
+	if (!session)
+		return;
+
+	soup_session_remove_feature_by_type (session, SOUP_TYPE_CONTENT_DECODER);
+	if (compress)
+		soup_session_add_feature_by_type (session, SOUP_TYPE_CONTENT_DECODER);
+}
+
+/**
+ * e2k_context_set_compression:
+ * @ctx: the context
+ * @compress: whether or not to ask for compressed responses
+ *
+ * Sets whether @ctx tells the server that it accepts gzip- and
+ * deflate-encoded responses. The multistatus responses to SEARCH and
+ * BPROPFIND, and message and calendar bodies, typically shrink to a
+ * fraction of their size this way. Responses are decoded as they are
+ * read, so callers see the same bodies either way. This is off by
+ * default, and is kept across calls to e2k_context_set_auth().
+ **/
+void
+e2k_context_set_compression (E2kContext *ctx,
+                             gboolean compress)
+{
+	g_return_if_fail (E2K_IS_CONTEXT (ctx));
+
+	compress = compress != FALSE;
+	if (ctx->priv->compress == compress)
+		return;
+
+	ctx->priv->compress = compress;
+	set_content_decoder (ctx->priv->session, compress);
+	set_content_decoder (ctx->priv->async_session, compress);
+}
+
+/**
+ * e2k_context_get_compression:
+ * @ctx: the context
+ *
+ * Returns the value set by e2k_context_set_compression().
+ *
+ * Return value: whether or not @ctx asks for compressed responses
+ **/
+gboolean
+e2k_context_get_compression (E2kContext *ctx)
+{
+	g_return_val_if_fail (E2K_IS_CONTEXT (ctx), FALSE);
+
+	return ctx->priv->compress;
+}
+
+/**
+ * e2k_context_get_max_parallel:
+ * @ctx: the context
+ *
+ * Returns how many connections @ctx may open to the server, which is
+ * the max_conns_per_host of its connection policy (set from the
+ * account's max-connections setting). This limits how many requests
+ * can run at once, such as the batches that an #E2kResultIter fetches
+ * ahead of time after e2k_result_iter_set_read_ahead().
+ *
+ * Return value: the number of requests that may be in flight at once
+ **/
+gint
+e2k_context_get_max_parallel (E2kContext *ctx)
+{
+	g_return_val_if_fail (E2K_IS_CONTEXT (ctx), E2K_CONTEXT_DEFAULT_MAX_CONNS_PER_HOST);
+
+	return ctx->priv->policy.max_conns_per_host;
+}
+
+static void
+stats_append (gpointer key,
+              gpointer value,
+              gpointer user_data)
+{
+	g_array_append_vals (user_data, value, 1);
+}
+
+/**
+ * e2k_context_get_stats:
+ * @ctx: the context
+ * @nstats: pointer to a variable to store the length of the result in
+ *
+ * Returns a snapshot of the request statistics gathered by @ctx, one
+ * #E2kContextStats per HTTP method that has been used. A request is
+ * counted once it has finished, however many times it had to be
+ * sent. Each time it was sent again because the server asked for
+ * (NTLM or Basic) authentication counts as an auth round trip; any
+ * other resend, such as after a forms-based authentication timeout
+ * or a redirect, counts as a retry. Byte counts are of message
+ * bodies only, and bytes_in counts response bodies after any content
+ * decoding.
+ *
+ * For the responses that arrived compressed (see
+ * e2k_context_set_compression()) with a Content-Length,
+ * bytes_in_encoded is their size on the wire and bytes_in_decoded
+ * their size once decoded. (Chunked compressed responses are decoded
+ * before their size can be seen, and are left out of both.)
+ *
+ * latency[i] counts the requests that took less than 10, 25, 50,
+ * 100, 250, 500, 1000, 2500, 5000 and 10000 milliseconds
+ * respectively (and at least as long as the previous bound), with
+ * the last bucket counting everything slower.
+ *
+ * Return value: an array of statistics, which the caller should free
+ * with g_free().
+ **/
+E2kContextStats *
+e2k_context_get_stats (E2kContext *ctx,
+                       gint *nstats)
+{
+	GArray *stats;
+
+	g_return_val_if_fail (E2K_IS_CONTEXT (ctx), NULL);
+	g_return_val_if_fail (nstats != NULL, NULL);
+
+	stats = g_array_new (FALSE, FALSE, sizeof (E2kContextStats));
+	g_mutex_lock (ctx->priv->stats_lock);
+	g_hash_table_foreach (ctx->priv->stats, stats_append, stats);
+	g_mutex_unlock (ctx->priv->stats_lock);
+
+	*nstats = stats->len;
+	return (E2kContextStats *) g_array_free (stats, FALSE);
+}
+
+/**
+ * e2k_context_reset_stats:
+ * @ctx: the context
+ *
+ * Clears the request statistics gathered by @ctx.
+ **/
+void
+e2k_context_reset_stats (E2kContext *ctx)
+{
+	g_return_if_fail (E2K_IS_CONTEXT (ctx));
+
+	g_mutex_lock (ctx->priv->stats_lock);
+	g_hash_table_remove_all (ctx->priv->stats);
+	g_mutex_unlock (ctx->priv->stats_lock);
+}
+
+/**
+ * e2k_context_dump_stats:
+ * @ctx: the context
+ * @filename: file to append to
+ *
+ * Appends @ctx's request statistics to @filename as text, one line
+ * per method after a header naming the time and server.
+ *
+ * Return value: success or failure
+ **/
+gboolean
+e2k_context_dump_stats (E2kContext *ctx,
+                        const gchar *filename)
+{
+	E2kContextStats *stats;
+	gint nstats, i, b;
+	gchar timestamp[32];
+	time_t now;
+	FILE *f;
+
+	g_return_val_if_fail (E2K_IS_CONTEXT (ctx), FALSE);
+	g_return_val_if_fail (filename != NULL, FALSE);
+
+	f = g_fopen (filename, "a");
+	if (!f)
+		return FALSE;
+
+	now = time (NULL);
+	strftime (timestamp, sizeof (timestamp), "%Y-%m-%dT%H:%M:%SZ",
+		  gmtime (&now));
+	fprintf (f, "# %s %s [%d]\n", timestamp, ctx->priv->owa_uri,
+		 (gint) getpid ());
+	fprintf (f, "# method requests errors retries auths bytes-out bytes-in bytes-in-encoded bytes-in-decoded avg-ms latency-buckets\n");
+
+	stats = e2k_context_get_stats (ctx, &nstats);
+	for (i = 0; i < nstats; i++) {
+		fprintf (f, "%s %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+			 " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+			 " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+			 " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %.1f",
+			 stats[i].method, stats[i].requests, stats[i].errors,
+			 stats[i].retries, stats[i].auth_round_trips,
+			 stats[i].bytes_out, stats[i].bytes_in,
+			 stats[i].bytes_in_encoded, stats[i].bytes_in_decoded,
+			 stats[i].total_usecs / 1000.0 / MAX (stats[i].requests, 1));
+		for (b = 0; b < E2K_CONTEXT_STATS_N_BUCKETS; b++)
+			fprintf (f, " %" G_GUINT64_FORMAT, stats[i].latency[b]);
+		fputc ('\n', f);
+	}
+	g_free (stats);
+
+	return fclose (f) == 0;
+}
+
+static gboolean
+stats_dump_timeout (gpointer user_data)
+{
+	E2kContext *ctx = user_data;
+
+	e2k_context_dump_stats (ctx, ctx->priv->stats_file);
+	return TRUE;
+}
+
+/**
+ * e2k_context_set_stats_dump:
+ * @ctx: the context
+ * @filename: file to append to, or %NULL to stop dumping
+ * @interval: how often to dump, in seconds
+ *
+ * Arranges for e2k_context_dump_stats() to be called on @ctx every
+ * @interval seconds (from the default main loop). This is also done
+ * for every context, every minute, if the E2K_STATS_DUMP environment
+ * variable is set to a filename.
+ **/
+void
+e2k_context_set_stats_dump (E2kContext *ctx,
+                            const gchar *filename,
+                            guint interval)
+{
+	g_return_if_fail (E2K_IS_CONTEXT (ctx));
+
+	if (ctx->priv->stats_dump_id) {
+		g_source_remove (ctx->priv->stats_dump_id);
+		ctx->priv->stats_dump_id = 0;
+	}
+	g_free (ctx->priv->stats_file);
+	ctx->priv->stats_file = NULL;
+
+	if (!filename || !interval)
+		return;
+
+	ctx->priv->stats_file = g_strdup (filename);
+	ctx->priv->stats_dump_id =
+		g_timeout_add_seconds (interval, stats_dump_timeout, ctx);
+}
+
 #ifdef E2K_DEBUG
 /* Debug levels:
  * 0 - None
@@ -793,9 +1231,15 @@ fba_timeout_handler (SoupMessage *msg,
                      gpointer user_data)
 {
 	E2kContext *ctx = user_data;
+	SoupSession *session;
+
+	/* Requeue it on whichever session it was sent on */
+	session = g_object_get_data (G_OBJECT (msg), "e2k-session");
+	if (!session)
+		session = ctx->priv->session;
 
 	if (e2k_context_fba (ctx, msg))
-		soup_session_requeue_message (ctx->priv->session, msg);
+		soup_session_requeue_message (session, msg);
 	else
 		soup_message_set_status (msg, SOUP_STATUS_UNAUTHORIZED);
 }
@@ -835,6 +1279,108 @@ redirect_handler (SoupMessage *msg,
 	g_free (old_uri);
 }
 
+/* Per-message bookkeeping for the request statistics */
+typedef struct {
+	E2kContext *ctx;
+	gint64 start;
+	gint attempts, auths;
+	guint64 bytes_out, bytes_in;
+
+	/* Decoded body of the current attempt */
+	guint64 body_bytes;
+
+	/* What has been added to the context's stats so far. A message
+	 * that is sent again after it finished (eg, by
+	 * read_ahead_status()) only adds the difference, so it is still
+	 * counted as one request.
+	 */
+	E2kContextStats counted;
+} E2kRequestStats;
+
+static void
+stats_got_unauthorized (SoupMessage *msg,
+                        gpointer user_data)
+{
+	E2kRequestStats *rs = user_data;
+
+	rs->auths++;
+}
+
+static void
+stats_got_chunk (SoupMessage *msg,
+                 SoupBuffer *chunk,
+                 gpointer user_data)
+{
+	E2kRequestStats *rs = user_data;
+
+	rs->bytes_in += chunk->length;
+	rs->body_bytes += chunk->length;
+}
+
+static void
+stats_finished (SoupMessage *msg,
+                gpointer user_data)
+{
+	E2kRequestStats *rs = user_data;
+	E2kContextPrivate *priv = rs->ctx->priv;
+	E2kContextStats *stats, now;
+	gint64 elapsed;
+	gint i;
+
+	elapsed = g_get_monotonic_time () - rs->start;
+
+	/* This message's totals so far, over all of its attempts */
+	memset (&now, 0, sizeof (now));
+	now.requests = 1;
+	now.errors = !SOUP_STATUS_IS_SUCCESSFUL (msg->status_code);
+	now.retries = MAX (rs->attempts - 1 - rs->auths, 0);
+	now.auth_round_trips = rs->auths;
+	now.bytes_out = rs->bytes_out;
+	now.bytes_in = rs->bytes_in;
+	now.total_usecs = elapsed;
+
+	now.bytes_in_encoded = rs->counted.bytes_in_encoded;
+	now.bytes_in_decoded = rs->counted.bytes_in_decoded;
+	if ((soup_message_get_flags (msg) & SOUP_MESSAGE_CONTENT_DECODED) &&
+	    soup_message_headers_get_encoding (msg->response_headers) == SOUP_ENCODING_CONTENT_LENGTH) {
+		now.bytes_in_encoded +=
+			soup_message_headers_get_content_length (msg->response_headers);
+		now.bytes_in_decoded += rs->body_bytes;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (stats_bucket_msecs); i++) {
+		if (elapsed < stats_bucket_msecs[i] * (gint64) 1000)
+			break;
+	}
+	now.latency[i] = 1;
+
+	g_mutex_lock (priv->stats_lock);
+	stats = g_hash_table_lookup (priv->stats, msg->method);
+	if (!stats) {
+		stats = g_new0 (E2kContextStats, 1);
+		stats->method = msg->method;
+		g_hash_table_insert (priv->stats, (gpointer) msg->method, stats);
+	}
+
+	/* Unsigned, so a count that went down (an error that was
+	 * retried successfully, say) still comes out right.
+	 */
+	stats->requests += now.requests - rs->counted.requests;
+	stats->errors += now.errors - rs->counted.errors;
+	stats->retries += now.retries - rs->counted.retries;
+	stats->auth_round_trips += now.auth_round_trips - rs->counted.auth_round_trips;
+	stats->bytes_out += now.bytes_out - rs->counted.bytes_out;
+	stats->bytes_in += now.bytes_in - rs->counted.bytes_in;
+	stats->bytes_in_encoded += now.bytes_in_encoded - rs->counted.bytes_in_encoded;
+	stats->bytes_in_decoded += now.bytes_in_decoded - rs->counted.bytes_in_decoded;
+	stats->total_usecs += now.total_usecs - rs->counted.total_usecs;
+	for (i = 0; i < E2K_CONTEXT_STATS_N_BUCKETS; i++)
+		stats->latency[i] += now.latency[i] - rs->counted.latency[i];
+	g_mutex_unlock (priv->stats_lock);
+
+	rs->counted = now;
+}
+
 static void
 setup_message (SoupSession *session,
                SoupMessage *msg,
@@ -842,12 +1388,36 @@ setup_message (SoupSession *session,
                gpointer user_data)
 {
 	E2kContext *ctx = user_data;
+	E2kRequestStats *rs;
+
+	g_object_set_data (G_OBJECT (msg), "e2k-session", session);
 
 	if (ctx->priv->cookie) {
 		soup_message_headers_replace (msg->request_headers,
 					      "Cookie", ctx->priv->cookie);
 	}
 
+	rs = g_object_get_data (G_OBJECT (msg), "e2k-request-stats");
+	if (!rs) {
+		rs = g_new0 (E2kRequestStats, 1);
+		rs->ctx = ctx;
+		rs->start = g_get_monotonic_time ();
+		g_object_set_data_full (G_OBJECT (msg), "e2k-request-stats",
+					rs, g_free);
+
+		soup_message_add_status_code_handler (msg, "got-headers",
+						      E2K_HTTP_UNAUTHORIZED,
+						      G_CALLBACK (stats_got_unauthorized),
+						      rs);
+		g_signal_connect (msg, "got-chunk",
+				  G_CALLBACK (stats_got_chunk), rs);
+		g_signal_connect (msg, "finished",
+				  G_CALLBACK (stats_finished), rs);
+	}
+	rs->attempts++;
+	rs->bytes_out += msg->request_body->length;
+	rs->body_bytes = 0;
+
 	/* Only do this the first time through */
 	if (!soup_message_headers_get (msg->request_headers, "User-Agent")) {
 		g_signal_connect (msg, "got-headers",
@@ -1032,52 +1602,663 @@ e2k_context_send_message (E2kContext *ctx,
 	return status;
 }
 
-static void
-update_unique_uri (E2kContext *ctx,
-                   SoupMessage *msg,
-                   const gchar *folder_uri,
-                   const gchar *encoded_name,
-                   gint *count,
-                   E2kContextTestCallback test_callback,
-                   gpointer user_data)
-{
-	SoupURI *suri;
-	gchar *uri = NULL;
+/* Shared requests: a caller that opts in, and finds an identical
+ * request already in flight, waits for that one to finish and shares
+ * its response rather than sending its own.
+ */
 
-	do {
-		g_free (uri);
-		if (*count == 1) {
-			uri = g_strdup_printf ("%s%s.EML", folder_uri,
-					       encoded_name);
-		} else {
-			uri = g_strdup_printf ("%s%s-%d.EML", folder_uri,
-					       encoded_name, *count);
-		}
-		(*count)++;
-	} while (test_callback && !test_callback (ctx, uri, user_data));
+typedef struct {
+	gchar *key;
+	SoupMessage *msg;
+	E2kHTTPStatus status;
+	gboolean done;
 
-	suri = soup_uri_new (uri);
-	soup_message_set_uri (msg, suri);
-	soup_uri_free (suri);
+	/* Parsed once, if the response is a multistatus */
+	E2kResult *results;
+	gint nresults;
+
+	/* Protected by priv->shared_lock */
+	gint refs;
+} E2kSharedRequest;
+
+static gchar *
+shared_request_key (SoupMessage *msg)
+{
+	SoupBuffer *body;
+	gchar *uri, *hash, *key;
+
+	uri = soup_uri_to_string (soup_message_get_uri (msg), FALSE);
+	body = soup_message_body_flatten (msg->request_body);
+	hash = g_compute_checksum_for_data (G_CHECKSUM_MD5,
+					    (guchar *) body->data,
+					    body->length);
+	key = g_strdup_printf ("%s %s %s", msg->method, uri, hash);
+
+	soup_buffer_free (body);
+	g_free (hash);
 	g_free (uri);
+	return key;
 }
 
-/* GET */
-
-static SoupMessage *
-get_msg (E2kContext *ctx,
-         const gchar *uri,
-         gboolean owa,
-         gboolean claim_ie)
+static void
+shared_request_unref (E2kContext *ctx,
+                      E2kSharedRequest *req)
 {
-	SoupMessage *msg;
+	gboolean last;
 
-	msg = e2k_soup_message_new (ctx, uri, "GET");
-	if (!owa)
-		soup_message_headers_append (msg->request_headers, "Translate", "F");
-	if (claim_ie) {
-		soup_message_headers_replace (msg->request_headers, "User-Agent",
-					      "MSIE 6.0b (Windows NT 5.0; compatible; "
+	g_mutex_lock (ctx->priv->shared_lock);
+	last = --req->refs == 0;
+	g_mutex_unlock (ctx->priv->shared_lock);
+
+	if (!last)
+		return;
+
+	if (req->results)
+		e2k_results_free (req->results, req->nresults);
+	g_object_unref (req->msg);
+	g_free (req->key);
+	g_free (req);
+}
+
+static void
+shared_request_canceller (E2kOperation *op,
+                          gpointer owner,
+                          gpointer data)
+{
+	E2kContext *ctx = owner;
+
+	g_mutex_lock (ctx->priv->shared_lock);
+	g_cond_broadcast (ctx->priv->shared_cond);
+	g_mutex_unlock (ctx->priv->shared_lock);
+}
+
+/* Sends @msg, unless an identical request is already in flight, in
+ * which case it waits for that one. On return, *@shared holds the
+ * completed request (to be released with shared_request_unref()),
+ * or %NULL if @op was cancelled while waiting.
+ */
+static E2kHTTPStatus
+shared_request_send (E2kContext *ctx,
+                     E2kOperation *op,
+                     SoupMessage *msg,
+                     E2kSharedRequest **shared)
+{
+	E2kContextPrivate *priv = ctx->priv;
+	E2kSharedRequest *req;
+	gchar *key;
+
+	key = shared_request_key (msg);
+
+ try_again:
+	g_mutex_lock (priv->shared_lock);
+	req = g_hash_table_lookup (priv->shared, key);
+	if (req) {
+		req->refs++;
+		g_mutex_unlock (priv->shared_lock);
+
+		e2k_operation_start (op, shared_request_canceller, ctx, NULL);
+		g_mutex_lock (priv->shared_lock);
+		while (!req->done && !e2k_operation_is_cancelled (op))
+			g_cond_wait (priv->shared_cond, priv->shared_lock);
+		g_mutex_unlock (priv->shared_lock);
+		e2k_operation_finish (op);
+
+		if (!req->done) {
+			shared_request_unref (ctx, req);
+			g_free (key);
+			*shared = NULL;
+			return E2K_HTTP_CANCELLED;
+		}
+
+		/* If it was the other caller that gave up, try
+		 * again ourselves.
+		 */
+		if (req->status == E2K_HTTP_CANCELLED &&
+		    !e2k_operation_is_cancelled (op)) {
+			shared_request_unref (ctx, req);
+			goto try_again;
+		}
+
+		g_free (key);
+		*shared = req;
+		return req->status;
+	}
+
+	req = g_new0 (E2kSharedRequest, 1);
+	req->key = key;
+	req->msg = g_object_ref (msg);
+	req->refs = 1;
+	g_hash_table_insert (priv->shared, req->key, req);
+	g_mutex_unlock (priv->shared_lock);
+
+	req->status = e2k_context_send_message (ctx, op, msg);
+	if (req->status == E2K_HTTP_MULTI_STATUS)
+		e2k_results_from_multistatus (msg, &req->results, &req->nresults);
+	else
+		soup_message_body_flatten (msg->response_body);
+
+	/* Anyone asking from now on gets a fresh response */
+	g_mutex_lock (priv->shared_lock);
+	req->done = TRUE;
+	g_hash_table_remove (priv->shared, req->key);
+	g_cond_broadcast (priv->shared_cond);
+	g_mutex_unlock (priv->shared_lock);
+
+	*shared = req;
+	return req->status;
+}
+
+/* Asynchronous requests. These run on the async session in the soup
+ * thread; the callback is invoked in the thread-default main context
+ * of the thread that started the request.
+ */
+
+typedef struct {
+	E2kContext *ctx;
+	SoupMessage *msg;
+	GSimpleAsyncResult *simple;
+
+	GCancellable *cancellable;
+	gulong cancelled_id;
+
+	/* Only touched in the soup thread */
+	gboolean queued, done, cancelled;
+
+	volatile gint ref_count;
+} E2kAsyncRequest;
+
+static void
+async_request_unref (gpointer data)
+{
+	E2kAsyncRequest *req = data;
+
+	if (!g_atomic_int_dec_and_test (&req->ref_count))
+		return;
+
+	g_object_unref (req->msg);
+	g_object_unref (req->simple);
+	if (req->cancellable)
+		g_object_unref (req->cancellable);
+	g_free (req);
+}
+
+static void
+async_request_attach (E2kAsyncRequest *req,
+                      GSourceFunc func)
+{
+	GSource *source;
+
+	g_atomic_int_inc (&req->ref_count);
+
+	source = g_idle_source_new ();
+	g_source_set_priority (source, G_PRIORITY_DEFAULT);
+	g_source_set_callback (source, func, req, async_request_unref);
+	g_source_attach (source, req->ctx->priv->soup_context);
+	g_source_unref (source);
+}
+
+static void
+async_request_done (SoupSession *session,
+                    SoupMessage *msg,
+                    gpointer user_data)
+{
+	E2kAsyncRequest *req = user_data;
+
+	req->done = TRUE;
+	if (req->cancellable)
+		g_cancellable_disconnect (req->cancellable, req->cancelled_id);
+
+	g_simple_async_result_complete_in_idle (req->simple);
+	async_request_unref (req);
+}
+
+static gboolean
+async_request_queue_idle (gpointer data)
+{
+	E2kAsyncRequest *req = data;
+
+	req->queued = TRUE;
+	if (req->cancelled) {
+		soup_message_set_status (req->msg, E2K_HTTP_CANCELLED);
+		async_request_done (NULL, req->msg, req);
+		return FALSE;
+	}
+
+	/* The session drops this ref when the message is done */
+	g_object_ref (req->msg);
+	soup_session_queue_message (req->ctx->priv->async_session, req->msg,
+				    async_request_done, req);
+	return FALSE;
+}
+
+static gboolean
+async_request_cancel_idle (gpointer data)
+{
+	E2kAsyncRequest *req = data;
+
+	req->cancelled = TRUE;
+	if (req->queued && !req->done) {
+		soup_session_cancel_message (req->ctx->priv->async_session,
+					     req->msg, E2K_HTTP_CANCELLED);
+	}
+	return FALSE;
+}
+
+static void
+async_request_cancelled (GCancellable *cancellable,
+                         gpointer user_data)
+{
+	async_request_attach (user_data, async_request_cancel_idle);
+}
+
+/* Takes over the caller's reference on @msg */
+static void
+async_request_start (E2kContext *ctx,
+                     SoupMessage *msg,
+                     GCancellable *cancellable,
+                     GAsyncReadyCallback callback,
+                     gpointer user_data,
+                     gpointer source_tag)
+{
+	E2kAsyncRequest *req;
+
+	/* This reference is dropped by async_request_done() */
+	req = g_new0 (E2kAsyncRequest, 1);
+	req->ref_count = 1;
+	req->ctx = ctx;
+	req->msg = msg;
+	req->simple = g_simple_async_result_new (G_OBJECT (ctx), callback,
+						 user_data, source_tag);
+	g_simple_async_result_set_op_res_gpointer (req->simple,
+						   g_object_ref (msg),
+						   g_object_unref);
+
+	if (cancellable) {
+		req->cancellable = g_object_ref (cancellable);
+		req->cancelled_id = g_cancellable_connect (
+			cancellable, G_CALLBACK (async_request_cancelled),
+			req, NULL);
+	}
+	async_request_attach (req, async_request_queue_idle);
+}
+
+static SoupMessage *
+async_request_finish (E2kContext *ctx,
+                      GAsyncResult *result,
+                      gpointer source_tag)
+{
+	GSimpleAsyncResult *simple;
+
+	g_return_val_if_fail (g_simple_async_result_is_valid (
+				      result, G_OBJECT (ctx), source_tag), NULL);
+
+	simple = G_SIMPLE_ASYNC_RESULT (result);
+	return g_simple_async_result_get_op_res_gpointer (simple);
+}
+
+/**
+ * e2k_context_send_message_async:
+ * @ctx: the context
+ * @msg: the message to send
+ * @cancellable: optional #GCancellable object, or %NULL
+ * @callback: callback to invoke when @msg is done
+ * @user_data: data for @callback
+ *
+ * Asynchronously sends @msg in @ctx's session, without blocking the
+ * calling thread. @callback is invoked in the thread-default main
+ * context of the calling thread, and should call
+ * e2k_context_send_message_finish() to get the status. @msg keeps
+ * the response.
+ **/
+void
+e2k_context_send_message_async (E2kContext *ctx,
+                                SoupMessage *msg,
+                                GCancellable *cancellable,
+                                GAsyncReadyCallback callback,
+                                gpointer user_data)
+{
+	g_return_if_fail (E2K_IS_CONTEXT (ctx));
+	g_return_if_fail (SOUP_IS_MESSAGE (msg));
+
+	async_request_start (ctx, g_object_ref (msg), cancellable,
+			     callback, user_data,
+			     e2k_context_send_message_async);
+}
+
+/**
+ * e2k_context_send_message_finish:
+ * @ctx: the context
+ * @result: the #GAsyncResult passed to the callback
+ *
+ * Finishes an e2k_context_send_message_async() call.
+ *
+ * Return value: the HTTP status of the message
+ **/
+E2kHTTPStatus
+e2k_context_send_message_finish (E2kContext *ctx,
+                                 GAsyncResult *result)
+{
+	SoupMessage *msg;
+
+	msg = async_request_finish (ctx, result, e2k_context_send_message_async);
+	g_return_val_if_fail (msg != NULL, E2K_HTTP_MALFORMED);
+
+	return msg->status_code;
+}
+
+/* Read-ahead: keeps several messages in flight on the async session
+ * on behalf of a synchronous E2kResultIter consumer.
+ */
+
+typedef struct {
+	SoupMessage *msg;
+	gboolean done;
+} E2kReadAheadItem;
+
+typedef struct {
+	E2kContext *ctx;
+
+	GMutex *lock;
+	GCond *cond;
+	GQueue *items;
+	gint pending_cancels;
+} E2kReadAhead;
+
+static E2kReadAhead *
+read_ahead_new (E2kContext *ctx)
+{
+	E2kReadAhead *ra;
+
+	ra = g_new0 (E2kReadAhead, 1);
+	ra->ctx = ctx;
+	ra->lock = g_mutex_new ();
+	ra->cond = g_cond_new ();
+	ra->items = g_queue_new ();
+
+	return ra;
+}
+
+static void
+read_ahead_done (SoupSession *session,
+                 SoupMessage *msg,
+                 gpointer user_data)
+{
+	E2kReadAhead *ra = user_data;
+	E2kReadAheadItem *item;
+	GList *l;
+
+	g_mutex_lock (ra->lock);
+	for (l = ra->items->head; l; l = l->next) {
+		item = l->data;
+		if (item->msg == msg) {
+			item->done = TRUE;
+			break;
+		}
+	}
+	g_cond_broadcast (ra->cond);
+	g_mutex_unlock (ra->lock);
+}
+
+static void
+read_ahead_push (E2kReadAhead *ra,
+                 SoupMessage *msg)
+{
+	E2kReadAheadItem *item;
+
+	item = g_new0 (E2kReadAheadItem, 1);
+	item->msg = msg;
+
+	g_mutex_lock (ra->lock);
+	g_queue_push_tail (ra->items, item);
+	g_mutex_unlock (ra->lock);
+
+	/* The session drops its reference when it is done with the
+	 * message; we keep ours until the consumer gets to it.
+	 */
+	g_object_ref (msg);
+	e2k_context_queue_message (ra->ctx, msg, read_ahead_done, ra);
+}
+
+static gint
+read_ahead_length (E2kReadAhead *ra)
+{
+	gint len;
+
+	g_mutex_lock (ra->lock);
+	len = g_queue_get_length (ra->items);
+	g_mutex_unlock (ra->lock);
+
+	return len;
+}
+
+static gboolean
+read_ahead_cancel_idle (gpointer user_data)
+{
+	E2kReadAhead *ra = user_data;
+	E2kReadAheadItem *item;
+	GSList *msgs = NULL, *m;
+	GList *l;
+
+	g_mutex_lock (ra->lock);
+	for (l = ra->items->head; l; l = l->next) {
+		item = l->data;
+		if (!item->done)
+			msgs = g_slist_prepend (msgs, g_object_ref (item->msg));
+	}
+	g_mutex_unlock (ra->lock);
+
+	/* Runs in the soup thread, so the messages can't complete
+	 * behind our back between the check above and here.
+	 */
+	for (m = msgs; m; m = m->next) {
+		soup_session_cancel_message (ra->ctx->priv->async_session,
+					     m->data, SOUP_STATUS_CANCELLED);
+		g_object_unref (m->data);
+	}
+	g_slist_free (msgs);
+
+	g_mutex_lock (ra->lock);
+	ra->pending_cancels--;
+	g_cond_broadcast (ra->cond);
+	g_mutex_unlock (ra->lock);
+
+	return FALSE;
+}
+
+static void
+read_ahead_cancel (E2kReadAhead *ra)
+{
+	GSource *source;
+
+	g_mutex_lock (ra->lock);
+	ra->pending_cancels++;
+	g_mutex_unlock (ra->lock);
+
+	source = g_idle_source_new ();
+	g_source_set_priority (source, G_PRIORITY_DEFAULT);
+	g_source_set_callback (source, read_ahead_cancel_idle, ra, NULL);
+	g_source_attach (source, ra->ctx->priv->soup_context);
+	g_source_unref (source);
+}
+
+static void
+read_ahead_canceller (E2kOperation *op,
+                      gpointer owner,
+                      gpointer data)
+{
+	read_ahead_cancel (data);
+}
+
+/* Waits for the oldest in-flight message and returns it (with a
+ * reference the caller must drop), or %NULL if nothing is in flight.
+ */
+static SoupMessage *
+read_ahead_pop (E2kReadAhead *ra,
+                E2kOperation *op)
+{
+	E2kReadAheadItem *item;
+	SoupMessage *msg;
+
+	g_mutex_lock (ra->lock);
+	item = g_queue_peek_head (ra->items);
+	g_mutex_unlock (ra->lock);
+	if (!item)
+		return NULL;
+
+	e2k_operation_start (op, read_ahead_canceller, ra->ctx, ra);
+
+	g_mutex_lock (ra->lock);
+	while (!item->done)
+		g_cond_wait (ra->cond, ra->lock);
+	g_queue_pop_head (ra->items);
+	g_mutex_unlock (ra->lock);
+
+	e2k_operation_finish (op);
+
+	msg = item->msg;
+	g_free (item);
+
+	return msg;
+}
+
+/* Returns the oldest in-flight message without waiting for it (and
+ * without a reference), or %NULL if nothing is in flight.
+ */
+static SoupMessage *
+read_ahead_peek (E2kReadAhead *ra)
+{
+	E2kReadAheadItem *item;
+
+	g_mutex_lock (ra->lock);
+	item = g_queue_peek_head (ra->items);
+	g_mutex_unlock (ra->lock);
+
+	return item ? item->msg : NULL;
+}
+
+/* Returns the final status of a message popped off @ra. Anything
+ * that failed for a reason the sync session knows how to recover
+ * from (forms-based auth timeout, dropped connection) is resent
+ * through e2k_context_send_message().
+ */
+static E2kHTTPStatus
+read_ahead_status (E2kContext *ctx,
+                   E2kOperation *op,
+                   SoupMessage *msg)
+{
+	if (e2k_operation_is_cancelled (op) ||
+	    msg->status_code == E2K_HTTP_CANCELLED)
+		return E2K_HTTP_CANCELLED;
+
+	if (E2K_HTTP_STATUS_IS_TRANSPORT_ERROR (msg->status_code) ||
+	    msg->status_code == E2K_HTTP_TIMEOUT ||
+	    msg->status_code == E2K_HTTP_UNAUTHORIZED)
+		return e2k_context_send_message (ctx, op, msg);
+
+	return msg->status_code;
+}
+
+/* Must be called with ra->lock held */
+static gboolean
+read_ahead_all_done (E2kReadAhead *ra)
+{
+	GList *l;
+
+	for (l = ra->items->head; l; l = l->next) {
+		if (!((E2kReadAheadItem *) l->data)->done)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Drops everything still in flight on @ra. */
+static void
+read_ahead_clear (E2kReadAhead *ra)
+{
+	E2kReadAheadItem *item;
+
+	if (read_ahead_length (ra) == 0)
+		return;
+
+	read_ahead_cancel (ra);
+
+	/* The items have to stay queued until they complete, since
+	 * read_ahead_done() finds them there.
+	 */
+	g_mutex_lock (ra->lock);
+	while (ra->pending_cancels > 0 || !read_ahead_all_done (ra))
+		g_cond_wait (ra->cond, ra->lock);
+	while ((item = g_queue_pop_head (ra->items))) {
+		g_object_unref (item->msg);
+		g_free (item);
+	}
+	g_mutex_unlock (ra->lock);
+}
+
+static void
+read_ahead_free (E2kReadAhead *ra)
+{
+	read_ahead_clear (ra);
+
+	/* Wait for any canceller that an E2kOperation fired late */
+	g_mutex_lock (ra->lock);
+	while (ra->pending_cancels > 0)
+		g_cond_wait (ra->cond, ra->lock);
+	g_mutex_unlock (ra->lock);
+
+	g_queue_free (ra->items);
+	g_cond_free (ra->cond);
+	g_mutex_free (ra->lock);
+	g_free (ra);
+}
+
+static void
+update_unique_uri (E2kContext *ctx,
+                   SoupMessage *msg,
+                   const gchar *folder_uri,
+                   const gchar *encoded_name,
+                   gint *count,
+                   E2kContextTestCallback test_callback,
+                   gpointer user_data)
+{
+	SoupURI *suri;
+	gchar *uri = NULL;
+
+	do {
+		g_free (uri);
+		if (*count == 1) {
+			uri = g_strdup_printf ("%s%s.EML", folder_uri,
+					       encoded_name);
+		} else {
+			uri = g_strdup_printf ("%s%s-%d.EML", folder_uri,
+					       encoded_name, *count);
+		}
+		(*count)++;
+	} while (test_callback && !test_callback (ctx, uri, user_data));
+
+	suri = soup_uri_new (uri);
+	soup_message_set_uri (msg, suri);
+	soup_uri_free (suri);
+	g_free (uri);
+}
+
+/* GET */
+
+static SoupMessage *
+get_msg (E2kContext *ctx,
+         const gchar *uri,
+         gboolean owa,
+         gboolean claim_ie)
+{
+	SoupMessage *msg;
+
+	msg = e2k_soup_message_new (ctx, uri, "GET");
+	if (!owa)
+		soup_message_headers_append (msg->request_headers, "Translate", "F");
+	if (claim_ie) {
+		soup_message_headers_replace (msg->request_headers, "User-Agent",
+					      "MSIE 6.0b (Windows NT 5.0; compatible; "
 					      "Evolution/" VERSION ")");
 	}
 
@@ -1132,6 +2313,205 @@ e2k_context_get (E2kContext *ctx,
 	return status;
 }
 
+typedef struct {
+	E2kContextChunkCallback callback;
+	gpointer user_data;
+} E2kChunkedGet;
+
+static void
+chunked_got_chunk (SoupMessage *msg,
+                   SoupBuffer *chunk,
+                   gpointer user_data)
+{
+	E2kChunkedGet *cg = user_data;
+
+	/* Skip the bodies of 401s and redirects on the way */
+	if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
+		return;
+
+	cg->callback (msg, chunk->data, chunk->length, cg->user_data);
+}
+
+/**
+ * e2k_context_get_chunked:
+ * @ctx: the context
+ * @op: pointer to an #E2kOperation to use for cancellation
+ * @uri: URI of the object to GET
+ * @content_type: if not %NULL, will contain the Content-Type of the
+ * response on return.
+ * @callback: called with each piece of the response body
+ * @user_data: data for @callback
+ *
+ * As with e2k_context_get(), except that the response body is passed
+ * to @callback as it arrives rather than being accumulated, so that a
+ * large object can be written out without ever being held in memory
+ * all at once. @callback is only called for a successful response; it
+ * can look at @msg's response headers if it needs the Content-Type
+ * before the body is complete.
+ *
+ * Return value: the HTTP status
+ **/
+E2kHTTPStatus
+e2k_context_get_chunked (E2kContext *ctx,
+                         E2kOperation *op,
+                         const gchar *uri,
+                         gchar **content_type,
+                         E2kContextChunkCallback callback,
+                         gpointer user_data)
+{
+	SoupMessage *msg;
+	E2kChunkedGet cg;
+	E2kHTTPStatus status;
+
+	g_return_val_if_fail (E2K_IS_CONTEXT (ctx), E2K_HTTP_MALFORMED);
+	g_return_val_if_fail (uri != NULL, E2K_HTTP_MALFORMED);
+	g_return_val_if_fail (callback != NULL, E2K_HTTP_MALFORMED);
+
+	cg.callback = callback;
+	cg.user_data = user_data;
+
+	msg = get_msg (ctx, uri, FALSE, FALSE);
+#ifdef E2K_DEBUG
+	/* The logger needs the body to be accumulated */
+	if (e2k_debug_level < SOUP_LOGGER_LOG_BODY)
+#endif
+		soup_message_body_set_accumulate (msg->response_body, FALSE);
+	g_signal_connect (msg, "got-chunk",
+			  G_CALLBACK (chunked_got_chunk), &cg);
+
+	status = e2k_context_send_message (ctx, op, msg);
+
+	if (E2K_HTTP_STATUS_IS_SUCCESSFUL (status) && content_type) {
+		const gchar *header;
+		header = soup_message_headers_get (msg->response_headers,
+						   "Content-Type");
+		*content_type = g_strdup (header);
+	}
+
+	g_object_unref (msg);
+	return status;
+}
+
+/**
+ * e2k_context_get_shared:
+ * @ctx: the context
+ * @op: pointer to an #E2kOperation to use for cancellation
+ * @uri: URI of the object to GET
+ * @content_type: if not %NULL, will contain the Content-Type of the
+ * response on return.
+ * @response: if not %NULL, will contain the response on return
+ *
+ * As with e2k_context_get(), except that if an identical GET is
+ * already being done through this function on @ctx (by another
+ * thread), this waits for it and returns a copy of its response
+ * rather than sending another request. Use it only where a response
+ * that was already on its way is as good as a new one.
+ *
+ * Return value: the HTTP status
+ **/
+E2kHTTPStatus
+e2k_context_get_shared (E2kContext *ctx,
+                        E2kOperation *op,
+                        const gchar *uri,
+                        gchar **content_type,
+                        SoupBuffer **response)
+{
+	E2kSharedRequest *req;
+	SoupMessage *msg;
+	E2kHTTPStatus status;
+
+	g_return_val_if_fail (E2K_IS_CONTEXT (ctx), E2K_HTTP_MALFORMED);
+	g_return_val_if_fail (uri != NULL, E2K_HTTP_MALFORMED);
+
+	msg = get_msg (ctx, uri, FALSE, FALSE);
+	status = shared_request_send (ctx, op, msg, &req);
+	g_object_unref (msg);
+	if (!req)
+		return status;
+
+	if (E2K_HTTP_STATUS_IS_SUCCESSFUL (status)) {
+		if (content_type) {
+			const gchar *header;
+			header = soup_message_headers_get (req->msg->response_headers,
+							   "Content-Type");
+			*content_type = g_strdup (header);
+		}
+		if (response) {
+			*response = soup_buffer_new (SOUP_MEMORY_COPY,
+						     req->msg->response_body->data,
+						     req->msg->response_body->length);
+		}
+	}
+
+	shared_request_unref (ctx, req);
+	return status;
+}
+
+/**
+ * e2k_context_get_async:
+ * @ctx: the context
+ * @uri: URI of the object to GET
+ * @cancellable: optional #GCancellable object, or %NULL
+ * @callback: callback to invoke when the GET is done
+ * @user_data: data for @callback
+ *
+ * Asynchronous version of e2k_context_get(). @callback is invoked in
+ * the thread-default main context of the calling thread, and should
+ * call e2k_context_get_finish().
+ **/
+void
+e2k_context_get_async (E2kContext *ctx,
+                       const gchar *uri,
+                       GCancellable *cancellable,
+                       GAsyncReadyCallback callback,
+                       gpointer user_data)
+{
+	g_return_if_fail (E2K_IS_CONTEXT (ctx));
+	g_return_if_fail (uri != NULL);
+
+	async_request_start (ctx, get_msg (ctx, uri, FALSE, FALSE),
+			     cancellable, callback, user_data,
+			     e2k_context_get_async);
+}
+
+/**
+ * e2k_context_get_finish:
+ * @ctx: the context
+ * @result: the #GAsyncResult passed to the callback
+ * @content_type: if not %NULL, will contain the Content-Type of the
+ * response on return.
+ * @response: if not %NULL, will contain the response on return
+ *
+ * Finishes an e2k_context_get_async() call. @content_type and
+ * @response are set as with e2k_context_get().
+ *
+ * Return value: the HTTP status
+ **/
+E2kHTTPStatus
+e2k_context_get_finish (E2kContext *ctx,
+                        GAsyncResult *result,
+                        gchar **content_type,
+                        SoupBuffer **response)
+{
+	SoupMessage *msg;
+
+	msg = async_request_finish (ctx, result, e2k_context_get_async);
+	g_return_val_if_fail (msg != NULL, E2K_HTTP_MALFORMED);
+
+	if (E2K_HTTP_STATUS_IS_SUCCESSFUL (msg->status_code)) {
+		if (content_type) {
+			const gchar *header;
+			header = soup_message_headers_get (msg->response_headers,
+							   "Content-Type");
+			*content_type = g_strdup (header);
+		}
+		if (response)
+			*response = soup_message_body_flatten (msg->response_body);
+	}
+
+	return msg->status_code;
+}
+
 /**
  * e2k_context_get_owa:
  * @ctx: the context
@@ -1269,6 +2649,67 @@ e2k_context_put (E2kContext *ctx,
 	return status;
 }
 
+/**
+ * e2k_context_put_async:
+ * @ctx: the context
+ * @uri: the URI to PUT to
+ * @content_type: MIME Content-Type of the data
+ * @body: data to PUT
+ * @length: length of @body
+ * @cancellable: optional #GCancellable object, or %NULL
+ * @callback: callback to invoke when the PUT is done
+ * @user_data: data for @callback
+ *
+ * Asynchronous version of e2k_context_put(). @callback is invoked in
+ * the thread-default main context of the calling thread, and should
+ * call e2k_context_put_finish().
+ **/
+void
+e2k_context_put_async (E2kContext *ctx,
+                       const gchar *uri,
+                       const gchar *content_type,
+                       const gchar *body,
+                       gint length,
+                       GCancellable *cancellable,
+                       GAsyncReadyCallback callback,
+                       gpointer user_data)
+{
+	g_return_if_fail (E2K_IS_CONTEXT (ctx));
+	g_return_if_fail (uri != NULL);
+	g_return_if_fail (content_type != NULL);
+	g_return_if_fail (body != NULL);
+
+	async_request_start (ctx, put_msg (ctx, uri, content_type,
+					   SOUP_MEMORY_COPY, body, length),
+			     cancellable, callback, user_data,
+			     e2k_context_put_async);
+}
+
+/**
+ * e2k_context_put_finish:
+ * @ctx: the context
+ * @result: the #GAsyncResult passed to the callback
+ * @repl_uid: if not %NULL, will contain the Repl-UID of the PUT
+ * object on return
+ *
+ * Finishes an e2k_context_put_async() call.
+ *
+ * Return value: the HTTP status
+ **/
+E2kHTTPStatus
+e2k_context_put_finish (E2kContext *ctx,
+                        GAsyncResult *result,
+                        gchar **repl_uid)
+{
+	SoupMessage *msg;
+
+	msg = async_request_finish (ctx, result, e2k_context_put_async);
+	g_return_val_if_fail (msg != NULL, E2K_HTTP_MALFORMED);
+
+	extract_put_results (msg, NULL, repl_uid);
+	return msg->status_code;
+}
+
 /**
  * e2k_context_put_new:
  * @ctx: the context
@@ -1608,43 +3049,102 @@ patch_msg (E2kContext *ctx,
 }
 
 /**
- * e2k_context_proppatch:
+ * e2k_context_proppatch:
+ * @ctx: the context
+ * @op: pointer to an #E2kOperation to use for cancellation
+ * @uri: the URI to PROPPATCH
+ * @props: the properties to set/remove
+ * @create: whether or not to create @uri if it does not exist
+ * @repl_uid: if not %NULL, will contain the Repl-UID of the
+ * PROPPATCHed object on return
+ *
+ * Performs a PROPPATCH operation on @ctx for @uri.
+ *
+ * If @create is %FALSE and @uri does not already exist, the response
+ * code will be %E2K_HTTP_PRECONDITION_FAILED.
+ *
+ * Return value: the HTTP status
+ **/
+E2kHTTPStatus
+e2k_context_proppatch (E2kContext *ctx,
+                       E2kOperation *op,
+                       const gchar *uri,
+                       E2kProperties *props,
+                       gboolean create,
+                       gchar **repl_uid)
+{
+	SoupMessage *msg;
+	E2kHTTPStatus status;
+
+	g_return_val_if_fail (E2K_IS_CONTEXT (ctx), E2K_HTTP_MALFORMED);
+	g_return_val_if_fail (uri != NULL, E2K_HTTP_MALFORMED);
+	g_return_val_if_fail (props != NULL, E2K_HTTP_MALFORMED);
+
+	msg = patch_msg (ctx, uri, "PROPPATCH", NULL, 0, props, create);
+	status = e2k_context_send_message (ctx, op, msg);
+	extract_put_results (msg, NULL, repl_uid);
+
+	g_object_unref (msg);
+	return status;
+}
+
+/**
+ * e2k_context_proppatch_async:
+ * @ctx: the context
+ * @uri: the URI to PROPPATCH
+ * @props: the properties to set/remove
+ * @create: whether or not to create @uri if it does not exist
+ * @cancellable: optional #GCancellable object, or %NULL
+ * @callback: callback to invoke when the PROPPATCH is done
+ * @user_data: data for @callback
+ *
+ * Asynchronous version of e2k_context_proppatch(). @props is not
+ * used after this returns. @callback is invoked in the
+ * thread-default main context of the calling thread, and should call
+ * e2k_context_proppatch_finish().
+ **/
+void
+e2k_context_proppatch_async (E2kContext *ctx,
+                             const gchar *uri,
+                             E2kProperties *props,
+                             gboolean create,
+                             GCancellable *cancellable,
+                             GAsyncReadyCallback callback,
+                             gpointer user_data)
+{
+	g_return_if_fail (E2K_IS_CONTEXT (ctx));
+	g_return_if_fail (uri != NULL);
+	g_return_if_fail (props != NULL);
+
+	async_request_start (ctx, patch_msg (ctx, uri, "PROPPATCH", NULL, 0,
+					     props, create),
+			     cancellable, callback, user_data,
+			     e2k_context_proppatch_async);
+}
+
+/**
+ * e2k_context_proppatch_finish:
  * @ctx: the context
- * @op: pointer to an #E2kOperation to use for cancellation
- * @uri: the URI to PROPPATCH
- * @props: the properties to set/remove
- * @create: whether or not to create @uri if it does not exist
+ * @result: the #GAsyncResult passed to the callback
  * @repl_uid: if not %NULL, will contain the Repl-UID of the
  * PROPPATCHed object on return
  *
- * Performs a PROPPATCH operation on @ctx for @uri.
- *
- * If @create is %FALSE and @uri does not already exist, the response
- * code will be %E2K_HTTP_PRECONDITION_FAILED.
+ * Finishes an e2k_context_proppatch_async() call.
  *
  * Return value: the HTTP status
  **/
 E2kHTTPStatus
-e2k_context_proppatch (E2kContext *ctx,
-                       E2kOperation *op,
-                       const gchar *uri,
-                       E2kProperties *props,
-                       gboolean create,
-                       gchar **repl_uid)
+e2k_context_proppatch_finish (E2kContext *ctx,
+                              GAsyncResult *result,
+                              gchar **repl_uid)
 {
 	SoupMessage *msg;
-	E2kHTTPStatus status;
 
-	g_return_val_if_fail (E2K_IS_CONTEXT (ctx), E2K_HTTP_MALFORMED);
-	g_return_val_if_fail (uri != NULL, E2K_HTTP_MALFORMED);
-	g_return_val_if_fail (props != NULL, E2K_HTTP_MALFORMED);
+	msg = async_request_finish (ctx, result, e2k_context_proppatch_async);
+	g_return_val_if_fail (msg != NULL, E2K_HTTP_MALFORMED);
 
-	msg = patch_msg (ctx, uri, "PROPPATCH", NULL, 0, props, create);
-	status = e2k_context_send_message (ctx, op, msg);
 	extract_put_results (msg, NULL, repl_uid);
-
-	g_object_unref (msg);
-	return status;
+	return msg->status_code;
 }
 
 /**
@@ -1783,6 +3283,57 @@ e2k_context_bproppatch_start (E2kContext *ctx,
 				    msg);
 }
 
+static void
+stream_got_headers (SoupMessage *msg,
+                    gpointer user_data)
+{
+	g_object_set_data (G_OBJECT (msg), "e2k-response-length", NULL);
+}
+
+static void
+stream_got_chunk (SoupMessage *msg,
+                  SoupBuffer *chunk,
+                  gpointer user_data)
+{
+	gsize length;
+
+	length = GPOINTER_TO_SIZE (g_object_get_data (G_OBJECT (msg),
+						      "e2k-response-length"));
+	g_object_set_data (G_OBJECT (msg), "e2k-response-length",
+			   GSIZE_TO_POINTER (length + chunk->length));
+}
+
+/* Multi-Status responses to SEARCH and BPROPFIND can be very large,
+ * so parse them as they arrive rather than buffering the whole body.
+ */
+static void
+stream_multistatus (SoupMessage *msg)
+{
+#ifdef E2K_DEBUG
+	/* The logger needs the body to be accumulated */
+	if (e2k_debug_level >= SOUP_LOGGER_LOG_BODY)
+		return;
+#endif
+	e2k_results_stream_multistatus (msg);
+
+	/* Keep track of the size, since the body itself is gone */
+	g_signal_connect (msg, "got-headers",
+			  G_CALLBACK (stream_got_headers), NULL);
+	g_signal_connect (msg, "got-chunk",
+			  G_CALLBACK (stream_got_chunk), NULL);
+}
+
+static gsize
+response_length (SoupMessage *msg)
+{
+	gpointer length;
+
+	length = g_object_get_data (G_OBJECT (msg), "e2k-response-length");
+	if (length)
+		return GPOINTER_TO_SIZE (length);
+	return msg->response_body->length;
+}
+
 /* PROPFIND */
 
 static SoupMessage *
@@ -1888,6 +3439,122 @@ e2k_context_propfind (E2kContext *ctx,
 	return status;
 }
 
+/**
+ * e2k_context_propfind_shared:
+ * @ctx: the context
+ * @op: pointer to an #E2kOperation to use for cancellation
+ * @uri: the URI to PROPFIND on
+ * @props: array of properties to find
+ * @nprops: length of @props
+ * @results: on return, the results
+ * @nresults: length of @results
+ *
+ * As with e2k_context_propfind(), except that if an identical
+ * PROPFIND (same URI and properties) is already being done through
+ * this function on @ctx, this waits for it and returns a copy of its
+ * results rather than sending another request. Use it only where a
+ * response that was already on its way is as good as a new one.
+ *
+ * Return value: the HTTP status
+ **/
+E2kHTTPStatus
+e2k_context_propfind_shared (E2kContext *ctx,
+                             E2kOperation *op,
+                             const gchar *uri,
+                             const gchar **props,
+                             gint nprops,
+                             E2kResult **results,
+                             gint *nresults)
+{
+	E2kSharedRequest *req;
+	SoupMessage *msg;
+	E2kHTTPStatus status;
+
+	g_return_val_if_fail (E2K_IS_CONTEXT (ctx), E2K_HTTP_MALFORMED);
+	g_return_val_if_fail (uri != NULL, E2K_HTTP_MALFORMED);
+	g_return_val_if_fail (props != NULL, E2K_HTTP_MALFORMED);
+
+	msg = propfind_msg (ctx, uri, props, nprops, NULL, 0);
+	status = shared_request_send (ctx, op, msg, &req);
+	g_object_unref (msg);
+	if (!req)
+		return status;
+
+	if (status == E2K_HTTP_MULTI_STATUS) {
+		*results = e2k_results_copy (req->results, req->nresults);
+		*nresults = req->nresults;
+	}
+
+	shared_request_unref (ctx, req);
+	return status;
+}
+
+/**
+ * e2k_context_propfind_async:
+ * @ctx: the context
+ * @uri: the URI to PROPFIND on
+ * @props: array of properties to find
+ * @nprops: length of @props
+ * @cancellable: optional #GCancellable object, or %NULL
+ * @callback: callback to invoke when the PROPFIND is done
+ * @user_data: data for @callback
+ *
+ * Asynchronous version of e2k_context_propfind(). @callback is
+ * invoked in the thread-default main context of the calling thread,
+ * and should call e2k_context_propfind_finish().
+ **/
+void
+e2k_context_propfind_async (E2kContext *ctx,
+                            const gchar *uri,
+                            const gchar **props,
+                            gint nprops,
+                            GCancellable *cancellable,
+                            GAsyncReadyCallback callback,
+                            gpointer user_data)
+{
+	g_return_if_fail (E2K_IS_CONTEXT (ctx));
+	g_return_if_fail (uri != NULL);
+	g_return_if_fail (props != NULL);
+
+	async_request_start (ctx, propfind_msg (ctx, uri, props, nprops,
+						NULL, 0),
+			     cancellable, callback, user_data,
+			     e2k_context_propfind_async);
+}
+
+/**
+ * e2k_context_propfind_finish:
+ * @ctx: the context
+ * @result: the #GAsyncResult passed to the callback
+ * @results: on return, the results
+ * @nresults: length of @results
+ *
+ * Finishes an e2k_context_propfind_async() call. The results are
+ * returned as with e2k_context_propfind().
+ *
+ * Return value: the HTTP status
+ **/
+E2kHTTPStatus
+e2k_context_propfind_finish (E2kContext *ctx,
+                             GAsyncResult *result,
+                             E2kResult **results,
+                             gint *nresults)
+{
+	SoupMessage *msg;
+
+	msg = async_request_finish (ctx, result, e2k_context_propfind_async);
+	g_return_val_if_fail (msg != NULL, E2K_HTTP_MALFORMED);
+
+	if (msg->status_code == E2K_HTTP_MULTI_STATUS)
+		e2k_results_from_multistatus (msg, results, nresults);
+	return msg->status_code;
+}
+
+typedef struct {
+	GSList *msgs;
+	E2kReadAhead *read_ahead;
+} E2kBPropfindData;
+
 static E2kHTTPStatus
 bpropfind_fetch (E2kResultIter *iter,
                  E2kContext *ctx,
@@ -1898,17 +3565,23 @@ bpropfind_fetch (E2kResultIter *iter,
                  gint *total,
                  gpointer user_data)
 {
-	GSList **msgs = user_data;
+	E2kBPropfindData *bpropfind_data = user_data;
 	E2kHTTPStatus status;
 	SoupMessage *msg;
 
-	if (!*msgs)
-		return E2K_HTTP_OK;
+	msg = read_ahead_pop (bpropfind_data->read_ahead, op);
+	if (msg)
+		status = read_ahead_status (ctx, op, msg);
+	else {
+		if (!bpropfind_data->msgs)
+			return E2K_HTTP_OK;
 
-	msg = (*msgs)->data;
-	*msgs = g_slist_remove (*msgs, msg);
+		msg = bpropfind_data->msgs->data;
+		bpropfind_data->msgs = g_slist_remove (bpropfind_data->msgs, msg);
+
+		status = e2k_context_send_message (ctx, op, msg);
+	}
 
-	status = e2k_context_send_message (ctx, op, msg);
 	if (status == E2K_HTTP_MULTI_STATUS)
 		e2k_results_from_multistatus (msg, results, nresults);
 	g_object_unref (msg);
@@ -1916,16 +3589,38 @@ bpropfind_fetch (E2kResultIter *iter,
 	return status;
 }
 
+static void
+bpropfind_prefetch (E2kResultIter *iter,
+                    E2kContext *ctx,
+                    E2kOperation *op,
+                    gint depth,
+                    gpointer user_data)
+{
+	E2kBPropfindData *bpropfind_data = user_data;
+	SoupMessage *msg;
+
+	while (bpropfind_data->msgs &&
+	       read_ahead_length (bpropfind_data->read_ahead) < depth) {
+		msg = bpropfind_data->msgs->data;
+		bpropfind_data->msgs = g_slist_remove (bpropfind_data->msgs, msg);
+
+		read_ahead_push (bpropfind_data->read_ahead, msg);
+		g_object_unref (msg);
+	}
+}
+
 static void
 bpropfind_free (E2kResultIter *iter,
                 gpointer user_data)
 {
-	GSList **msgs = user_data, *m;
+	E2kBPropfindData *bpropfind_data = user_data;
+	GSList *m;
 
-	for (m = *msgs; m; m = m->next)
+	read_ahead_free (bpropfind_data->read_ahead);
+	for (m = bpropfind_data->msgs; m; m = m->next)
 		g_object_unref (m->data);
-	g_slist_free (*msgs);
-	g_free (msgs);
+	g_slist_free (bpropfind_data->msgs);
+	g_free (bpropfind_data);
 }
 
 /**
@@ -1939,6 +3634,10 @@ bpropfind_free (E2kResultIter *iter,
  * @nprops: length of @props
  *
  * Begins a BPROPFIND (bulk PROPFIND) operation on @ctx for @hrefs.
+ * The returned iterator supports e2k_result_iter_set_read_ahead(),
+ * in which case that many batches of hrefs are requested at once,
+ * over as many connections as e2k_context_get_max_parallel()
+ * allows. Results are still returned in the order of @hrefs.
  *
  * Return value: an iterator for getting the results
  **/
@@ -1952,7 +3651,7 @@ e2k_context_bpropfind_start (E2kContext *ctx,
                              gint nprops)
 {
 	SoupMessage *msg;
-	GSList **msgs;
+	E2kBPropfindData *bpropfind_data;
 	gint i;
 
 	g_return_val_if_fail (E2K_IS_CONTEXT (ctx), NULL);
@@ -1960,16 +3659,19 @@ e2k_context_bpropfind_start (E2kContext *ctx,
 	g_return_val_if_fail (props != NULL, NULL);
 	g_return_val_if_fail (hrefs != NULL, NULL);
 
-	msgs = g_new0 (GSList *, 1);
+	bpropfind_data = g_new0 (E2kBPropfindData, 1);
+	bpropfind_data->read_ahead = read_ahead_new (ctx);
 	for (i = 0; i < nhrefs; i += E2K_CONTEXT_MAX_BATCH_SIZE) {
 		msg = propfind_msg (ctx, uri, props, nprops,
 				    hrefs + i, MIN (E2K_CONTEXT_MAX_BATCH_SIZE, nhrefs - i));
-		*msgs = g_slist_append (*msgs, msg);
+		stream_multistatus (msg);
+		bpropfind_data->msgs = g_slist_prepend (bpropfind_data->msgs, msg);
 	}
+	bpropfind_data->msgs = g_slist_reverse (bpropfind_data->msgs);
 
-	return e2k_result_iter_new (ctx, op, TRUE, nhrefs,
-				    bpropfind_fetch, bpropfind_free,
-				    msgs);
+	return e2k_result_iter_new_full (ctx, op, TRUE, nhrefs,
+					 bpropfind_fetch, bpropfind_prefetch,
+					 bpropfind_free, bpropfind_data);
 }
 
 /* SEARCH */
@@ -1989,6 +3691,7 @@ search_msg (E2kContext *ctx,
 					 buffer_type, searchxml,
 					 strlen (searchxml));
 	soup_message_headers_append (msg->request_headers, "Brief", "t");
+	stream_multistatus (msg);
 
 	if (size) {
 		gchar *range;
@@ -2001,6 +3704,12 @@ search_msg (E2kContext *ctx,
 		}
 		soup_message_headers_append (msg->request_headers, "Range", range);
 		g_free (range);
+
+		/* Remembered so the response can be compared to it */
+		g_object_set_data (G_OBJECT (msg), "e2k-batch-size",
+				   GINT_TO_POINTER (size));
+		g_object_set_data (G_OBJECT (msg), "e2k-batch-first",
+				   GINT_TO_POINTER (offset));
 	}
 
 	return msg;
@@ -2086,8 +3795,96 @@ typedef struct {
 	gchar *uri, *xml;
 	gboolean ascending;
 	gint batch_size, next;
+	gint total;
+
+	E2kReadAhead *read_ahead;
 } E2kSearchData;
 
+/* Picks the size of the next Range window based on the last full
+ * batch: it at most doubles each time, but is held back so that a
+ * response stays under the byte and time targets. @elapsed is -1
+ * if the request time is unknown (eg, it was read ahead).
+ */
+static gint
+search_adapt_batch_size (E2kContext *ctx,
+                         gint batch_size,
+                         gint requested,
+                         gint nresults,
+                         gsize bytes,
+                         gint64 elapsed)
+{
+	gint64 rows, limit;
+	gsize row_bytes;
+
+	if (ctx->priv->batch_mode != E2K_CONTEXT_BATCH_ADAPTIVE)
+		return batch_size;
+
+	/* A short batch is the end of the results, and says nothing
+	 * about how big the next one could be.
+	 */
+	if (nresults <= 0 || nresults < requested)
+		return batch_size;
+
+	rows = (gint64) requested * 2;
+
+	row_bytes = MAX (bytes / nresults, 1);
+	limit = E2K_CONTEXT_ADAPTIVE_TARGET_BYTES / row_bytes;
+	rows = MIN (rows, limit);
+
+	if (elapsed >= 0) {
+		limit = (gint64) requested * E2K_CONTEXT_ADAPTIVE_TARGET_USECS /
+			MAX (elapsed, 1);
+		rows = MIN (rows, limit);
+	}
+
+	return CLAMP (rows, E2K_CONTEXT_MIN_BATCH_SIZE,
+		      ctx->priv->max_batch_size);
+}
+
+/* Works out the range following the one that started at @first and
+ * returned @nresults rows.
+ */
+static void
+search_advance (E2kSearchData *search_data,
+                gint first,
+                gint nresults,
+                gint total)
+{
+	if (search_data->ascending && first + nresults < total)
+		search_data->next = first + nresults;
+	else if (!search_data->ascending && first > 0) {
+		if (first >= search_data->batch_size)
+			search_data->next = first - search_data->batch_size;
+		else {
+			search_data->batch_size = first;
+			search_data->next = 0;
+		}
+	} else
+		search_data->batch_size = 0;
+}
+
+/* Whether @next, a read-ahead SEARCH, asks for the range that
+ * immediately follows the @nresults rows starting at @first.
+ */
+static gboolean
+search_follows (E2kSearchData *search_data,
+                SoupMessage *next,
+                gint first,
+                gint nresults)
+{
+	gint next_first, next_size;
+
+	next_first = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (next),
+							 "e2k-batch-first"));
+	next_size = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (next),
+							"e2k-batch-size"));
+
+	if (search_data->ascending)
+		return next_first == first + nresults;
+	else
+		return next_first + next_size == first;
+}
+
 static E2kHTTPStatus
 search_fetch (E2kResultIter *iter,
               E2kContext *ctx,
@@ -2100,19 +3897,32 @@ search_fetch (E2kResultIter *iter,
 {
 	E2kSearchData *search_data = user_data;
 	E2kHTTPStatus status;
-	SoupMessage *msg;
-
-	if (search_data->batch_size == 0)
-		return E2K_HTTP_OK;
+	SoupMessage *msg, *next;
+	gint64 elapsed = -1;
+	gint requested;
+
+	msg = read_ahead_pop (search_data->read_ahead, op);
+	if (msg)
+		status = read_ahead_status (ctx, op, msg);
+	else {
+		if (search_data->batch_size == 0)
+			return E2K_HTTP_OK;
+
+		msg = search_msg (ctx, search_data->uri,
+				  SOUP_MEMORY_COPY, search_data->xml,
+				  search_data->batch_size,
+				  search_data->ascending, search_data->next);
+		elapsed = g_get_monotonic_time ();
+		status = e2k_context_send_message (ctx, op, msg);
+		elapsed = g_get_monotonic_time () - elapsed;
+	}
+	requested = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (msg),
+							"e2k-batch-size"));
 
-	msg = search_msg (ctx, search_data->uri,
-			  SOUP_MEMORY_COPY, search_data->xml,
-			  search_data->batch_size,
-			  search_data->ascending, search_data->next);
-	status = e2k_context_send_message (ctx, op, msg);
-	if (msg->status_code == E2K_HTTP_REQUESTED_RANGE_NOT_SATISFIABLE)
+	if (msg->status_code == E2K_HTTP_REQUESTED_RANGE_NOT_SATISFIABLE) {
 		status = E2K_HTTP_OK;
-	else if (status == E2K_HTTP_MULTI_STATUS) {
+		read_ahead_clear (search_data->read_ahead);
+	} else if (status == E2K_HTTP_MULTI_STATUS) {
 		search_result_get_range (msg, first, total);
 		if (*total == 0)
 			goto cleanup;
@@ -2120,18 +3930,34 @@ search_fetch (E2kResultIter *iter,
 		e2k_results_from_multistatus (msg, results, nresults);
 		if (*total == -1)
 			*total = *first + *nresults;
+		search_data->total = *total;
 
-		if (search_data->ascending && *first + *nresults < *total)
-			search_data->next = *first + *nresults;
-		else if (!search_data->ascending && *first > 0) {
-			if (*first >= search_data->batch_size)
-				search_data->next = *first - search_data->batch_size;
-			else {
-				search_data->batch_size = *first;
-				search_data->next = 0;
-			}
-		} else
+		if (search_data->batch_size > 0) {
+			search_data->batch_size = search_adapt_batch_size (
+				ctx, search_data->batch_size, requested,
+				*nresults, response_length (msg),
+				elapsed);
+		}
+
+		/* If later ranges are already in flight, the read-ahead
+		 * cursor is ahead of this response. They were asked for
+		 * assuming this one would be full, so if it came back
+		 * short, throw them away and carry on from where it
+		 * actually stopped.
+		 */
+		next = read_ahead_peek (search_data->read_ahead);
+		if (next && !search_follows (search_data, next, *first, *nresults)) {
+			read_ahead_clear (search_data->read_ahead);
+			next = NULL;
+		}
+
+		if (!next)
+			search_advance (search_data, *first, *nresults, *total);
+		else if ((search_data->ascending && *first + *nresults >= *total) ||
+			 (!search_data->ascending && *first == 0)) {
+			read_ahead_clear (search_data->read_ahead);
 			search_data->batch_size = 0;
+		}
 	}
 
  cleanup:
@@ -2139,12 +3965,50 @@ search_fetch (E2kResultIter *iter,
 	return status;
 }
 
+static void
+search_prefetch (E2kResultIter *iter,
+                 E2kContext *ctx,
+                 E2kOperation *op,
+                 gint depth,
+                 gpointer user_data)
+{
+	E2kSearchData *search_data = user_data;
+	SoupMessage *msg;
+
+	/* We need the total from the first response to know where
+	 * the ranges stop.
+	 */
+	if (search_data->total <= 0)
+		return;
+
+	while (search_data->batch_size > 0 &&
+	       read_ahead_length (search_data->read_ahead) < depth) {
+		if (search_data->ascending &&
+		    search_data->next >= search_data->total)
+			break;
+
+		msg = search_msg (ctx, search_data->uri,
+				  SOUP_MEMORY_COPY, search_data->xml,
+				  search_data->batch_size,
+				  search_data->ascending, search_data->next);
+		read_ahead_push (search_data->read_ahead, msg);
+		g_object_unref (msg);
+
+		/* Assume a full batch comes back; search_fetch() starts
+		 * again from the right place if it doesn't.
+		 */
+		search_advance (search_data, search_data->next,
+				search_data->batch_size, search_data->total);
+	}
+}
+
 static void
 search_free (E2kResultIter *iter,
              gpointer user_data)
 {
 	E2kSearchData *search_data = user_data;
 
+	read_ahead_free (search_data->read_ahead);
 	g_free (search_data->uri);
 	g_free (search_data->xml);
 	g_free (search_data);
@@ -2161,7 +4025,8 @@ search_free (E2kResultIter *iter,
  * @orderby: if non-%NULL, the field to sort the search results by
  * @ascending: %TRUE for an ascending search, %FALSE for descending.
  *
- * Begins a SEARCH on @ctx at @uri.
+ * Begins a SEARCH on @ctx at @uri. The returned iterator supports
+ * e2k_result_iter_set_read_ahead().
  *
  * Return value: an iterator for returning the search results
  **/
@@ -2187,10 +4052,62 @@ e2k_context_search_start (E2kContext *ctx,
 	search_data->ascending = ascending;
 	search_data->batch_size = E2K_CONTEXT_MAX_BATCH_SIZE;
 	search_data->next = ascending ? 0 : INT_MAX;
+	search_data->total = -1;
+	search_data->read_ahead = read_ahead_new (ctx);
+
+	return e2k_result_iter_new_full (ctx, op, ascending, -1,
+					 search_fetch, search_prefetch,
+					 search_free, search_data);
+}
+
+/**
+ * e2k_context_search_count:
+ * @ctx: the context
+ * @op: pointer to an #E2kOperation to use for cancellation
+ * @uri: the folder to search
+ * @rn: the search restriction
+ * @count: on return, the number of objects matching @rn
+ *
+ * Counts the objects in @uri matching @rn, without listing them. This
+ * asks for a single row, and reads the total out of the Content-Range
+ * header of the response. If the server doesn't say what the total
+ * is, this returns %E2K_HTTP_MALFORMED.
+ *
+ * Return value: the HTTP status
+ **/
+E2kHTTPStatus
+e2k_context_search_count (E2kContext *ctx,
+                          E2kOperation *op,
+                          const gchar *uri,
+                          E2kRestriction *rn,
+                          gint *count)
+{
+	static const gchar *count_props[] = { E2K_PR_DAV_HREF };
+	SoupMessage *msg;
+	E2kHTTPStatus status;
+	gchar *xml;
+	gint total = -1;
+
+	g_return_val_if_fail (E2K_IS_CONTEXT (ctx), E2K_HTTP_MALFORMED);
+	g_return_val_if_fail (uri != NULL, E2K_HTTP_MALFORMED);
+	g_return_val_if_fail (count != NULL, E2K_HTTP_MALFORMED);
+
+	xml = search_xml (count_props, G_N_ELEMENTS (count_props), rn, NULL);
+	msg = search_msg (ctx, uri, SOUP_MEMORY_TAKE, xml, 1, TRUE, 0);
+
+	status = e2k_context_send_message (ctx, op, msg);
+	if (msg->status_code == E2K_HTTP_REQUESTED_RANGE_NOT_SATISFIABLE) {
+		/* There is no row 0 */
+		total = 0;
+		status = E2K_HTTP_OK;
+	} else if (status == E2K_HTTP_MULTI_STATUS) {
+		if (!search_result_get_range (msg, NULL, &total) || total < 0)
+			status = E2K_HTTP_MALFORMED;
+	}
 
-	return e2k_result_iter_new (ctx, op, ascending, -1,
-				    search_fetch, search_free,
-				    search_data);
+	*count = total;
+	g_object_unref (msg);
+	return status;
 }
 
 /* DELETE */
@@ -2230,6 +4147,54 @@ e2k_context_delete (E2kContext *ctx,
 	return status;
 }
 
+/**
+ * e2k_context_delete_async:
+ * @ctx: the context
+ * @uri: URI to DELETE
+ * @cancellable: optional #GCancellable object, or %NULL
+ * @callback: callback to invoke when the DELETE is done
+ * @user_data: data for @callback
+ *
+ * Asynchronous version of e2k_context_delete(). @callback is invoked
+ * in the thread-default main context of the calling thread, and
+ * should call e2k_context_delete_finish().
+ **/
+void
+e2k_context_delete_async (E2kContext *ctx,
+                          const gchar *uri,
+                          GCancellable *cancellable,
+                          GAsyncReadyCallback callback,
+                          gpointer user_data)
+{
+	g_return_if_fail (E2K_IS_CONTEXT (ctx));
+	g_return_if_fail (uri != NULL);
+
+	async_request_start (ctx, delete_msg (ctx, uri),
+			     cancellable, callback, user_data,
+			     e2k_context_delete_async);
+}
+
+/**
+ * e2k_context_delete_finish:
+ * @ctx: the context
+ * @result: the #GAsyncResult passed to the callback
+ *
+ * Finishes an e2k_context_delete_async() call.
+ *
+ * Return value: the HTTP status
+ **/
+E2kHTTPStatus
+e2k_context_delete_finish (E2kContext *ctx,
+                           GAsyncResult *result)
+{
+	SoupMessage *msg;
+
+	msg = async_request_finish (ctx, result, e2k_context_delete_async);
+	g_return_val_if_fail (msg != NULL, E2K_HTTP_MALFORMED);
+
+	return msg->status_code;
+}
+
 /* BDELETE */
 
 static SoupMessage *
@@ -9,6 +9,7 @@
 #include <sys/time.h>
 
 #include <glib-object.h>
+#include <gio/gio.h>
 
 #include "e2k-types.h"
 #include "e2k-operation.h"
@@ -50,6 +51,60 @@ gboolean       e2k_context_fba              (E2kContext  *ctx,
 
 time_t        e2k_context_get_last_timestamp    (E2kContext *ctx);
 
+typedef enum {
+	E2K_CONTEXT_BATCH_FIXED,
+	E2K_CONTEXT_BATCH_ADAPTIVE
+} E2kContextBatchMode;
+
+void          e2k_context_set_batch_policy      (E2kContext *ctx,
+						 E2kContextBatchMode mode,
+						 gint max_rows);
+E2kContextBatchMode e2k_context_get_batch_policy (E2kContext *ctx,
+						 gint *max_rows);
+
+typedef struct {
+	gint  max_conns;
+	gint  max_conns_per_host;
+	guint idle_timeout;
+	guint timeout;
+} E2kContextConnectionPolicy;
+
+void          e2k_context_set_connection_policy (E2kContext *ctx,
+						 const E2kContextConnectionPolicy *policy);
+void          e2k_context_get_connection_policy (E2kContext *ctx,
+						 E2kContextConnectionPolicy *policy);
+
+void          e2k_context_set_compression       (E2kContext *ctx,
+						 gboolean compress);
+gboolean      e2k_context_get_compression       (E2kContext *ctx);
+
+gint          e2k_context_get_max_parallel      (E2kContext *ctx);
+
+#define E2K_CONTEXT_STATS_N_BUCKETS 11
+
+typedef struct {
+	const gchar *method;
+	guint64 requests;
+	guint64 errors;
+	guint64 retries;
+	guint64 auth_round_trips;
+	guint64 bytes_out;
+	guint64 bytes_in;
+	guint64 bytes_in_encoded;
+	guint64 bytes_in_decoded;
+	guint64 total_usecs;
+	guint64 latency[E2K_CONTEXT_STATS_N_BUCKETS];
+} E2kContextStats;
+
+E2kContextStats *e2k_context_get_stats          (E2kContext *ctx,
+						 gint *nstats);
+void          e2k_context_reset_stats           (E2kContext *ctx);
+gboolean      e2k_context_dump_stats            (E2kContext *ctx,
+						 const gchar *filename);
+void          e2k_context_set_stats_dump        (E2kContext *ctx,
+						 const gchar *filename,
+						 guint interval);
+
 typedef gboolean (*E2kContextTestCallback)     (E2kContext *ctx,
 						const gchar *test_name,
 						gpointer user_data);
@@ -59,6 +114,30 @@ E2kHTTPStatus  e2k_context_get               (E2kContext *ctx,
 					      const gchar *uri,
 					      gchar **content_type,
 					      SoupBuffer **response);
+E2kHTTPStatus  e2k_context_get_shared        (E2kContext *ctx,
+					      E2kOperation *op,
+					      const gchar *uri,
+					      gchar **content_type,
+					      SoupBuffer **response);
+typedef void (*E2kContextChunkCallback)       (SoupMessage *msg,
+					      const gchar *data,
+					      gsize length,
+					      gpointer user_data);
+E2kHTTPStatus  e2k_context_get_chunked       (E2kContext *ctx,
+					      E2kOperation *op,
+					      const gchar *uri,
+					      gchar **content_type,
+					      E2kContextChunkCallback callback,
+					      gpointer user_data);
+void           e2k_context_get_async         (E2kContext *ctx,
+					      const gchar *uri,
+					      GCancellable *cancellable,
+					      GAsyncReadyCallback callback,
+					      gpointer user_data);
+E2kHTTPStatus  e2k_context_get_finish        (E2kContext *ctx,
+					      GAsyncResult *result,
+					      gchar **content_type,
+					      SoupBuffer **response);
 E2kHTTPStatus  e2k_context_get_owa           (E2kContext *ctx,
 					      E2kOperation *op,
 					      const gchar *uri,
@@ -71,6 +150,16 @@ E2kHTTPStatus  e2k_context_put               (E2kContext *ctx,
 					      const gchar *content_type,
 					      const gchar *body, gint length,
 					      gchar **repl_uid);
+void           e2k_context_put_async         (E2kContext *ctx,
+					      const gchar *uri,
+					      const gchar *content_type,
+					      const gchar *body, gint length,
+					      GCancellable *cancellable,
+					      GAsyncReadyCallback callback,
+					      gpointer user_data);
+E2kHTTPStatus  e2k_context_put_finish        (E2kContext *ctx,
+					      GAsyncResult *result,
+					      gchar **repl_uid);
 E2kHTTPStatus  e2k_context_put_new           (E2kContext *ctx,
 					      E2kOperation *op,
 					      const gchar *folder_uri,
@@ -95,6 +184,16 @@ E2kHTTPStatus  e2k_context_proppatch         (E2kContext *ctx,
 					      E2kProperties *props,
 					      gboolean create,
 					      gchar **repl_uid);
+void           e2k_context_proppatch_async   (E2kContext *ctx,
+					      const gchar *uri,
+					      E2kProperties *props,
+					      gboolean create,
+					      GCancellable *cancellable,
+					      GAsyncReadyCallback callback,
+					      gpointer user_data);
+E2kHTTPStatus  e2k_context_proppatch_finish  (E2kContext *ctx,
+					      GAsyncResult *result,
+					      gchar **repl_uid);
 E2kHTTPStatus  e2k_context_proppatch_new     (E2kContext *ctx,
 					      E2kOperation *op,
 					      const gchar *folder_uri,
@@ -119,6 +218,24 @@ E2kHTTPStatus  e2k_context_propfind          (E2kContext *ctx,
 					      gint nprops,
 					      E2kResult **results,
 					      gint *nresults);
+E2kHTTPStatus  e2k_context_propfind_shared   (E2kContext *ctx,
+					      E2kOperation *op,
+					      const gchar *uri,
+					      const gchar **props,
+					      gint nprops,
+					      E2kResult **results,
+					      gint *nresults);
+void           e2k_context_propfind_async    (E2kContext *ctx,
+					      const gchar *uri,
+					      const gchar **props,
+					      gint nprops,
+					      GCancellable *cancellable,
+					      GAsyncReadyCallback callback,
+					      gpointer user_data);
+E2kHTTPStatus  e2k_context_propfind_finish   (E2kContext *ctx,
+					      GAsyncResult *result,
+					      E2kResult **results,
+					      gint *nresults);
 E2kResultIter *e2k_context_bpropfind_start   (E2kContext *ctx,
 					      E2kOperation *op,
 					      const gchar *uri,
@@ -135,10 +252,22 @@ E2kResultIter *e2k_context_search_start      (E2kContext *ctx,
 					      E2kRestriction *rn,
 					      const gchar *orderby,
 					      gboolean ascending);
+E2kHTTPStatus  e2k_context_search_count      (E2kContext *ctx,
+					      E2kOperation *op,
+					      const gchar *uri,
+					      E2kRestriction *rn,
+					      gint *count);
 
 E2kHTTPStatus  e2k_context_delete            (E2kContext *ctx,
 					      E2kOperation *op,
 					      const gchar *uri);
+void           e2k_context_delete_async      (E2kContext *ctx,
+					      const gchar *uri,
+					      GCancellable *cancellable,
+					      GAsyncReadyCallback callback,
+					      gpointer user_data);
+E2kHTTPStatus  e2k_context_delete_finish     (E2kContext *ctx,
+					      GAsyncResult *result);
 
 E2kResultIter *e2k_context_bdelete_start     (E2kContext *ctx,
 					      E2kOperation *op,
@@ -207,6 +336,13 @@ void           e2k_context_queue_message (E2kContext *ctx,
 E2kHTTPStatus  e2k_context_send_message  (E2kContext *ctx,
 					  E2kOperation *op,
 					  SoupMessage *msg);
+void           e2k_context_send_message_async  (E2kContext *ctx,
+						SoupMessage *msg,
+						GCancellable *cancellable,
+						GAsyncReadyCallback callback,
+						gpointer user_data);
+E2kHTTPStatus  e2k_context_send_message_finish (E2kContext *ctx,
+						GAsyncResult *result);
 
 G_END_DECLS
 
@@ -187,10 +187,10 @@ e2k_freebusy_new (E2kContext *ctx,
 	uri = fb_uri_for_dn (public_uri, dn);
 	g_return_val_if_fail (uri, NULL);
 
-	status = e2k_context_propfind (ctx, NULL, uri,
-				       public_freebusy_props,
-				       G_N_ELEMENTS (public_freebusy_props),
-				       &results, &nresults);
+	status = e2k_context_propfind_shared (ctx, NULL, uri,
+					      public_freebusy_props,
+					      G_N_ELEMENTS (public_freebusy_props),
+					      &results, &nresults);
 	if (!E2K_HTTP_STATUS_IS_SUCCESSFUL (status) || nresults == 0) {
 		/* FIXME: create it */
 		g_free (uri);
@@ -30,6 +30,7 @@
 #include <string.h>
 
 #include <libxml/parser.h>
+#include <libxml/SAX2.h>
 #include <libxml/tree.h>
 #include <libxml/xmlmemory.h>
 
@@ -213,6 +214,46 @@ e2k_result_clear (E2kResult *result)
 	}
 }
 
+/* Parses a single <D:response> node into @result. Returns %FALSE
+ * (and leaves nothing to free in @result) if it had no href.
+ */
+static gboolean
+response_parse (xmlNode *node,
+                E2kResult *result)
+{
+	xmlNode *rnode;
+
+	if (!node->xmlChildrenNode)
+		return FALSE;
+
+	memset (result, 0, sizeof (*result));
+	result->status = E2K_HTTP_OK; /* sometimes omitted if Brief */
+
+	for (rnode = node->xmlChildrenNode; rnode; rnode = rnode->next) {
+		if (rnode->type != XML_ELEMENT_NODE)
+			continue;
+
+		if (E2K_IS_NODE (rnode, "DAV:", "href"))
+			result->href = (gchar *) xmlNodeGetContent (rnode);
+		else if (E2K_IS_NODE (rnode, "DAV:", "status")) {
+			result->status = e2k_http_parse_status (
+				(gchar *) rnode->xmlChildrenNode->content);
+		} else if (E2K_IS_NODE (rnode, "DAV:", "propstat"))
+			propstat_parse (rnode, result);
+		else
+			prop_parse (rnode, result);
+	}
+
+	if (!result->href) {
+		e2k_result_clear (result);
+		return FALSE;
+	}
+
+	if (E2K_HTTP_STATUS_IS_SUCCESSFUL (result->status) && !result->props)
+		result->props = e2k_properties_new ();
+	return TRUE;
+}
+
 /**
  * e2k_results_array_new:
  *
@@ -226,18 +267,159 @@ e2k_results_array_new (void)
 	return g_array_new (FALSE, FALSE, sizeof (E2kResult));
 }
 
+/* mapi/id name repair: drops the '0' from "<P:0x" and "</P:0x" where
+ * P is a prefix bound to a mapi/id namespace. This is a single linear
+ * pass, and the state carries over between calls, so the input can
+ * be split anywhere.
+ */
+enum {
+	MAPI_ID_TEXT,
+	MAPI_ID_LT,
+	MAPI_ID_SLASH,
+	MAPI_ID_PREFIX,
+	MAPI_ID_COLON,
+	MAPI_ID_ZERO
+};
+
+typedef struct {
+	gboolean prefixes[256];
+	gint state;
+} E2kMapiIdFilter;
+
+typedef void (*E2kMapiIdEmitFunc) (const gchar *data,
+				   gsize length,
+				   gpointer user_data);
+
+/* Finds the mapi/id namespace prefixes declared in the first start
+ * tag that has namespace declarations. Returns %FALSE if @buf does
+ * not yet contain the whole tag.
+ */
+static gboolean
+mapi_id_filter_scan_namespaces (E2kMapiIdFilter *filter,
+                                const gchar *buf,
+                                gsize length)
+{
+	const gchar *p, *end;
+
+	p = g_strstr_len (buf, length, " xmlns:");
+	if (!p)
+		return FALSE;
+	end = memchr (p, '>', buf + length - p);
+	if (!end)
+		return FALSE;
+
+	for (p++; (p = g_strstr_len (p, end - p, "xmlns:")); p += 6) {
+		if (p[7] == '=' && p[8] == '"' &&
+		    !strncmp (p + 9, E2K_NS_MAPI_ID, E2K_NS_MAPI_ID_LEN))
+			filter->prefixes[(guchar) p[6]] = TRUE;
+	}
+
+	return TRUE;
+}
+
+static void
+mapi_id_filter_run (E2kMapiIdFilter *filter,
+                    const gchar *buf,
+                    gsize length,
+                    E2kMapiIdEmitFunc emit,
+                    gpointer user_data)
+{
+	const gchar *p = buf, *end = buf + length, *span = buf;
+
+	while (p < end) {
+		guchar c = *p;
+
+		switch (filter->state) {
+		case MAPI_ID_TEXT:
+			p = memchr (p, '<', end - p);
+			if (!p) {
+				p = end;
+				continue;
+			}
+			filter->state = MAPI_ID_LT;
+			break;
+
+		case MAPI_ID_LT:
+			if (c == '/') {
+				filter->state = MAPI_ID_SLASH;
+				break;
+			}
+			/* fall through */
+		case MAPI_ID_SLASH:
+			if (!filter->prefixes[c]) {
+				filter->state = MAPI_ID_TEXT;
+				continue;
+			}
+			filter->state = MAPI_ID_PREFIX;
+			break;
+
+		case MAPI_ID_PREFIX:
+			if (c != ':') {
+				filter->state = MAPI_ID_TEXT;
+				continue;
+			}
+			filter->state = MAPI_ID_COLON;
+			break;
+
+		case MAPI_ID_COLON:
+			if (c != '0') {
+				filter->state = MAPI_ID_TEXT;
+				continue;
+			}
+			/* Hold the '0' back until we see what follows */
+			if (p > span)
+				emit (span, p - span, user_data);
+			span = p + 1;
+			filter->state = MAPI_ID_ZERO;
+			break;
+
+		case MAPI_ID_ZERO:
+			if (c != 'x')
+				emit ("0", 1, user_data);
+			filter->state = MAPI_ID_TEXT;
+			continue;
+		}
+
+		p++;
+	}
+
+	if (end > span)
+		emit (span, end - span, user_data);
+}
+
+static void
+mapi_id_filter_flush (E2kMapiIdFilter *filter,
+                      E2kMapiIdEmitFunc emit,
+                      gpointer user_data)
+{
+	if (filter->state == MAPI_ID_ZERO)
+		emit ("0", 1, user_data);
+	filter->state = MAPI_ID_TEXT;
+}
+
 /* Properties in the /mapi/id/{...} namespaces are usually (though not
  * always) returned with names that start with '0', which is illegal
- * and makes libxml choke. So we preprocess them to fix that.
+ * and makes libxml choke. So we preprocess them to fix that, in a
+ * single pass into a buffer of the original size (since we only ever
+ * remove characters).
  */
+static void
+sanitize_emit (const gchar *data,
+               gsize length,
+               gpointer user_data)
+{
+	gchar **out = user_data;
+
+	memcpy (*out, data, length);
+	*out += length;
+}
+
 static gchar *
 sanitize_bad_multistatus (const gchar *buf,
                           gint len)
 {
-	GString *body;
-	const gchar *p;
-	gint start;
-	gchar ns, badprop[7], *ret;
+	E2kMapiIdFilter filter;
+	gchar *body, *out;
 
 	/* If there are no "mapi/id/{...}" namespace declarations, then
 	 * we don't need any cleanup.
@@ -245,53 +427,317 @@ sanitize_bad_multistatus (const gchar *buf,
 	if (!memchr (buf, '{', len))
 		return NULL;
 
-	body = g_string_new_len (buf, len);
+	memset (&filter, 0, sizeof (filter));
+	g_return_val_if_fail (mapi_id_filter_scan_namespaces (&filter, buf, len), NULL);
 
-	/* Find the start and end of namespace declarations */
-	p = strstr (body->str, " xmlns:");
-	g_return_val_if_fail (p != NULL, NULL);
-	start = p + 1 - body->str;
+	body = out = g_malloc (len + 1);
+	mapi_id_filter_run (&filter, buf, len, sanitize_emit, &out);
+	mapi_id_filter_flush (&filter, sanitize_emit, &out);
+	*out = '\0';
 
-	p = strchr (p, '>');
-	g_return_val_if_fail (p != NULL, NULL);
+	return body;
+}
 
-	while (1) {
-		if (strncmp (body->str + start, "xmlns:", 6) != 0)
-			break;
-		if (strncmp (body->str + start + 7, "=\"", 2) != 0)
-			break;
-		if (strncmp (body->str + start + 9, E2K_NS_MAPI_ID, E2K_NS_MAPI_ID_LEN) != 0)
-			goto next;
+/* Streaming parser */
 
-		ns = body->str[start + 6];
+struct E2kResultParser {
+	xmlParserCtxt *ctxt;
 
-		/* Find properties in this namespace and strip the
-		 * initial '0' from their names to make them valid
-		 * XML NCNames.
-		 */
-		snprintf (badprop, 6, "<%c:0x", ns);
-		while ((p = strstr (body->str, badprop)))
-			g_string_erase (body, p + 3 - body->str, 1);
-		snprintf (badprop, 7, "</%c:0x", ns);
-		while ((p = strstr (body->str, badprop)))
-			g_string_erase (body, p + 4 - body->str, 1);
-
-	next:
-		p = strchr (body->str + start, '"');
-		if (!p)
-			break;
-		p = strchr (p + 1, '"');
-		if (!p)
-			break;
-		if (p[1] != ' ')
-			break;
+	E2kResultParserFunc func;
+	gpointer user_data;
+
+	/* Data held back until the namespace declarations are seen */
+	GString *head;
+	E2kMapiIdFilter filter;
+};
+
+static void
+parser_error_handler (gpointer ctx,
+                      const gchar *msg,
+                      ...)
+{
+	;
+}
+
+/* The tree is built by the stock SAX2 handlers; we just pick off
+ * each <D:response> as it closes, turn it into an E2kResult, and
+ * throw the subtree away, so at most one response is ever in memory.
+ */
+static void
+parser_end_element (gpointer ctx,
+                    const xmlChar *localname,
+                    const xmlChar *prefix,
+                    const xmlChar *uri)
+{
+	xmlParserCtxt *ctxt = ctx;
+	E2kResultParser *parser = ctxt->_private;
+	xmlNode *node = ctxt->node;
+	E2kResult result;
+
+	xmlSAX2EndElementNs (ctx, localname, prefix, uri);
+
+	if (!node || !node->parent ||
+	    node->parent != xmlDocGetRootElement (ctxt->myDoc) ||
+	    !E2K_IS_NODE (node->parent, "DAV:", "multistatus") ||
+	    !E2K_IS_NODE (node, "DAV:", "response"))
+		return;
+
+	if (response_parse (node, &result))
+		parser->func (&result, parser->user_data);
+
+	xmlUnlinkNode (node);
+	xmlFreeNode (node);
+}
+
+static void
+parser_emit (const gchar *data,
+             gsize length,
+             gpointer user_data)
+{
+	E2kResultParser *parser = user_data;
+
+	xmlParseChunk (parser->ctxt, data, length, 0);
+}
+
+/**
+ * e2k_result_parser_new:
+ * @func: function to call with each result
+ * @user_data: data to pass to @func
+ *
+ * Creates a parser for a 207 Multi-Status response body that can be
+ * fed a piece at a time with e2k_result_parser_feed(). @func is
+ * called with each #E2kResult as soon as its &lt;response&gt;
+ * element is complete, and takes ownership of the result's
+ * contents. Unlike e2k_results_array_add_from_multistatus(), the
+ * whole response is never held in memory at once.
+ *
+ * Return value: the new parser
+ **/
+E2kResultParser *
+e2k_result_parser_new (E2kResultParserFunc func,
+                       gpointer user_data)
+{
+	E2kResultParser *parser;
+	xmlSAXHandler sax;
+
+	g_return_val_if_fail (func != NULL, NULL);
+
+	xmlInitParser ();
+
+	memset (&sax, 0, sizeof (sax));
+	xmlSAXVersion (&sax, 2);
+	sax.endElementNs = parser_end_element;
+	sax.warning = parser_error_handler;
+	sax.error = parser_error_handler;
+
+	parser = g_new0 (E2kResultParser, 1);
+	parser->func = func;
+	parser->user_data = user_data;
+	parser->head = g_string_new (NULL);
 
-		start = p + 2 - body->str;
+	parser->ctxt = xmlCreatePushParserCtxt (&sax, NULL, NULL, 0, NULL);
+	parser->ctxt->_private = parser;
+
+	/* As in e2k_parse_xml(), Exchange can send control
+	 * characters that make the XML not well-formed.
+	 */
+	parser->ctxt->recovery = TRUE;
+	parser->ctxt->vctxt.error = parser_error_handler;
+	parser->ctxt->vctxt.warning = parser_error_handler;
+
+	return parser;
+}
+
+/**
+ * e2k_result_parser_feed:
+ * @parser: an #E2kResultParser
+ * @data: the next piece of the response body
+ * @length: the length of @data
+ *
+ * Parses @data, invoking @parser's callback for every response that
+ * it completes.
+ **/
+void
+e2k_result_parser_feed (E2kResultParser *parser,
+                        const gchar *data,
+                        gsize length)
+{
+	g_return_if_fail (parser != NULL);
+
+	if (!parser->head) {
+		mapi_id_filter_run (&parser->filter, data, length,
+				    parser_emit, parser);
+		return;
 	}
 
-	ret = body->str;
-	g_string_free (body, FALSE);
-	return ret;
+	g_string_append_len (parser->head, data, length);
+	if (!mapi_id_filter_scan_namespaces (&parser->filter, parser->head->str,
+					     parser->head->len))
+		return;
+
+	mapi_id_filter_run (&parser->filter, parser->head->str,
+			    parser->head->len, parser_emit, parser);
+	g_string_free (parser->head, TRUE);
+	parser->head = NULL;
+}
+
+/**
+ * e2k_result_parser_finish:
+ * @parser: an #E2kResultParser
+ *
+ * Tells @parser that the whole body has been fed to it.
+ **/
+void
+e2k_result_parser_finish (E2kResultParser *parser)
+{
+	g_return_if_fail (parser != NULL);
+
+	if (parser->head) {
+		mapi_id_filter_scan_namespaces (&parser->filter,
+						parser->head->str,
+						parser->head->len);
+		mapi_id_filter_run (&parser->filter, parser->head->str,
+				    parser->head->len, parser_emit, parser);
+		g_string_free (parser->head, TRUE);
+		parser->head = NULL;
+	}
+	mapi_id_filter_flush (&parser->filter, parser_emit, parser);
+
+	xmlParseChunk (parser->ctxt, NULL, 0, 1);
+}
+
+/**
+ * e2k_result_parser_free:
+ * @parser: an #E2kResultParser
+ *
+ * Frees @parser.
+ **/
+void
+e2k_result_parser_free (E2kResultParser *parser)
+{
+	g_return_if_fail (parser != NULL);
+
+	if (parser->ctxt->myDoc)
+		xmlFreeDoc (parser->ctxt->myDoc);
+	xmlFreeParserCtxt (parser->ctxt);
+	if (parser->head)
+		g_string_free (parser->head, TRUE);
+	g_free (parser);
+}
+
+#define E2K_RESULT_STREAM_KEY "e2k-result-stream"
+
+typedef struct {
+	E2kResultParser *parser;
+	GArray *results_array;
+} E2kResultStream;
+
+static void
+stream_add_result (E2kResult *result,
+                   gpointer user_data)
+{
+	GArray *results_array = user_data;
+
+	g_array_append_val (results_array, *result);
+}
+
+static void
+stream_clear (E2kResultStream *stream)
+{
+	gint i;
+
+	if (stream->parser) {
+		e2k_result_parser_free (stream->parser);
+		stream->parser = NULL;
+	}
+
+	for (i = 0; i < stream->results_array->len; i++)
+		e2k_result_clear (&g_array_index (stream->results_array, E2kResult, i));
+	g_array_set_size (stream->results_array, 0);
+}
+
+static void
+stream_free (gpointer data)
+{
+	E2kResultStream *stream = data;
+
+	stream_clear (stream);
+	g_array_free (stream->results_array, TRUE);
+	g_free (stream);
+}
+
+static void
+stream_got_headers (SoupMessage *msg,
+                    gpointer user_data)
+{
+	E2kResultStream *stream = user_data;
+
+	/* Start over if the message is being resent */
+	stream_clear (stream);
+
+	if (msg->status_code != E2K_HTTP_MULTI_STATUS) {
+		soup_message_body_set_accumulate (msg->response_body, TRUE);
+		return;
+	}
+
+	stream->parser = e2k_result_parser_new (stream_add_result,
+						stream->results_array);
+	soup_message_body_set_accumulate (msg->response_body, FALSE);
+}
+
+static void
+stream_got_chunk (SoupMessage *msg,
+                  SoupBuffer *chunk,
+                  gpointer user_data)
+{
+	E2kResultStream *stream = user_data;
+
+	if (stream->parser)
+		e2k_result_parser_feed (stream->parser, chunk->data, chunk->length);
+}
+
+static void
+stream_got_body (SoupMessage *msg,
+                 gpointer user_data)
+{
+	E2kResultStream *stream = user_data;
+
+	if (stream->parser) {
+		e2k_result_parser_finish (stream->parser);
+		e2k_result_parser_free (stream->parser);
+		stream->parser = NULL;
+	}
+}
+
+/**
+ * e2k_results_stream_multistatus:
+ * @msg: a message that has not been sent yet
+ *
+ * Arranges for a 207 Multi-Status response to @msg to be parsed as
+ * it is read, rather than being accumulated and parsed afterwards.
+ * e2k_results_from_multistatus() and
+ * e2k_results_array_add_from_multistatus() will then return the
+ * already-parsed results, and @msg's response body will be empty.
+ * Other responses are accumulated as usual.
+ **/
+void
+e2k_results_stream_multistatus (SoupMessage *msg)
+{
+	E2kResultStream *stream;
+
+	g_return_if_fail (SOUP_IS_MESSAGE (msg));
+
+	stream = g_new0 (E2kResultStream, 1);
+	stream->results_array = e2k_results_array_new ();
+	g_object_set_data_full (G_OBJECT (msg), E2K_RESULT_STREAM_KEY,
+				stream, stream_free);
+
+	g_signal_connect (msg, "got-headers",
+			  G_CALLBACK (stream_got_headers), stream);
+	g_signal_connect (msg, "got-chunk",
+			  G_CALLBACK (stream_got_chunk), stream);
+	g_signal_connect (msg, "got-body",
+			  G_CALLBACK (stream_got_body), stream);
 }
 
 /**
@@ -306,13 +752,26 @@ void
 e2k_results_array_add_from_multistatus (GArray *results_array,
                                         SoupMessage *msg)
 {
+	E2kResultStream *stream;
 	xmlDoc *doc;
-	xmlNode *node, *rnode;
+	xmlNode *node;
 	E2kResult result;
 	gchar *body;
 
 	g_return_if_fail (msg->status_code == E2K_HTTP_MULTI_STATUS);
 
+	/* If the body was parsed as it arrived, just hand over the
+	 * results.
+	 */
+	stream = g_object_get_data (G_OBJECT (msg), E2K_RESULT_STREAM_KEY);
+	if (stream) {
+		g_array_append_vals (results_array,
+				     stream->results_array->data,
+				     stream->results_array->len);
+		g_array_set_size (stream->results_array, 0);
+		return;
+	}
+
 	body = sanitize_bad_multistatus (msg->response_body->data,
 					 msg->response_body->length);
 	if (body) {
@@ -331,35 +790,11 @@ e2k_results_array_add_from_multistatus (GArray *results_array,
 	}
 
 	for (node = node->xmlChildrenNode; node; node = node->next) {
-		if (!E2K_IS_NODE (node, "DAV:", "response") ||
-		    !node->xmlChildrenNode)
+		if (!E2K_IS_NODE (node, "DAV:", "response"))
 			continue;
 
-		memset (&result, 0, sizeof (result));
-		result.status = E2K_HTTP_OK; /* sometimes omitted if Brief */
-
-		for (rnode = node->xmlChildrenNode; rnode; rnode = rnode->next) {
-			if (rnode->type != XML_ELEMENT_NODE)
-				continue;
-
-			if (E2K_IS_NODE (rnode, "DAV:", "href"))
-				result.href = (gchar *) xmlNodeGetContent (rnode);
-			else if (E2K_IS_NODE (rnode, "DAV:", "status")) {
-				result.status = e2k_http_parse_status (
-					(gchar *) rnode->xmlChildrenNode->content);
-			} else if (E2K_IS_NODE (rnode, "DAV:", "propstat"))
-				propstat_parse (rnode, &result);
-			else
-				prop_parse (rnode, &result);
-		}
-
-		if (result.href) {
-			if (E2K_HTTP_STATUS_IS_SUCCESSFUL (result.status) &&
-			    !result.props)
-				result.props = e2k_properties_new ();
+		if (response_parse (node, &result))
 			g_array_append_val (results_array, result);
-		} else
-			e2k_result_clear (&result);
 	}
 
 	xmlFreeDoc (doc);
@@ -466,12 +901,27 @@ struct E2kResultIter {
 	gint nresults, next;
 	gint first, total;
 	gboolean ascending;
+	gint read_ahead;
 
 	E2kResultIterFetchFunc fetch_func;
+	E2kResultIterPrefetchFunc prefetch_func;
 	E2kResultIterFreeFunc free_func;
 	gpointer user_data;
 };
 
+static void
+iter_prefetch (E2kResultIter *iter)
+{
+	if (!iter->prefetch_func || iter->read_ahead <= 0)
+		return;
+	if (iter->nresults == 0 ||
+	    !E2K_HTTP_STATUS_IS_SUCCESSFUL (iter->status))
+		return;
+
+	iter->prefetch_func (iter, iter->ctx, iter->op,
+			     iter->read_ahead, iter->user_data);
+}
+
 static void
 iter_fetch (E2kResultIter *iter)
 {
@@ -491,6 +941,12 @@ iter_fetch (E2kResultIter *iter)
 					 &iter->total,
 					 iter->user_data);
 	iter->next = 0;
+
+	/* Top the read-ahead window back up before handing the new
+	 * batch to the caller, so the network keeps busy while the
+	 * caller is working through it.
+	 */
+	iter_prefetch (iter);
 }
 
 /**
@@ -529,6 +985,47 @@ e2k_result_iter_new (E2kContext *ctx,
                      E2kResultIterFetchFunc fetch_func,
                      E2kResultIterFreeFunc free_func,
                      gpointer user_data)
+{
+	return e2k_result_iter_new_full (ctx, op, ascending, total,
+					 fetch_func, NULL, free_func,
+					 user_data);
+}
+
+/**
+ * e2k_result_iter_new_full:
+ * @ctx: an #E2kContext
+ * @op: an #E2kOperation, to use for cancellation
+ * @ascending: %TRUE if results should be returned in ascending
+ * order, %FALSE if they should be returned in descending order
+ * @total: the total number of results that will be returned, or -1
+ * if not yet known
+ * @fetch_func: function to call to fetch more results
+ * @prefetch_func: function to call to start fetching upcoming
+ * batches in the background, or %NULL
+ * @free_func: function to call when the iterator is freed
+ * @user_data: data to pass to @fetch_func, @prefetch_func and
+ * @free_func
+ *
+ * As with e2k_result_iter_new(), but for sources that can have
+ * several batches in flight at once. If read-ahead has been enabled
+ * with e2k_result_iter_set_read_ahead(), @prefetch_func will be
+ * called after each batch is fetched, and should make sure that up
+ * to @depth further batches are being fetched. @fetch_func is then
+ * expected to return the oldest of those batches rather than
+ * starting a new request. @free_func must cancel any batches that
+ * are still outstanding.
+ *
+ * Return value: the new iterator
+ **/
+E2kResultIter *
+e2k_result_iter_new_full (E2kContext *ctx,
+                          E2kOperation *op,
+                          gboolean ascending,
+                          gint total,
+                          E2kResultIterFetchFunc fetch_func,
+                          E2kResultIterPrefetchFunc prefetch_func,
+                          E2kResultIterFreeFunc free_func,
+                          gpointer user_data)
 {
 	E2kResultIter *iter;
 
@@ -538,6 +1035,7 @@ e2k_result_iter_new (E2kContext *ctx,
 	iter->ascending = ascending;
 	iter->total = total;
 	iter->fetch_func = fetch_func;
+	iter->prefetch_func = prefetch_func;
 	iter->free_func = free_func;
 	iter->user_data = user_data;
 
@@ -546,6 +1044,31 @@ e2k_result_iter_new (E2kContext *ctx,
 	return iter;
 }
 
+/**
+ * e2k_result_iter_set_read_ahead:
+ * @iter: an #E2kResultIter
+ * @depth: the number of batches to keep in flight, or 0 to disable
+ * read-ahead
+ *
+ * Enables or disables read-ahead on @iter. With read-ahead enabled,
+ * up to @depth further batches of results are requested from the
+ * server while the caller is still working through the current one,
+ * so that a long iteration costs roughly one round-trip per @depth
+ * batches rather than one per batch.
+ *
+ * This has no effect on iterators whose source does not support
+ * read-ahead.
+ **/
+void
+e2k_result_iter_set_read_ahead (E2kResultIter *iter,
+                                gint depth)
+{
+	g_return_if_fail (iter != NULL);
+
+	iter->read_ahead = MAX (depth, 0);
+	iter_prefetch (iter);
+}
+
 /**
  * e2k_result_iter_next:
  * @iter: an #E2kResultIter
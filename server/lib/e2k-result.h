@@ -33,6 +33,21 @@ void       e2k_results_array_add_from_multistatus (GArray       *results_array,
 void       e2k_results_array_free                 (GArray       *results_array,
 						   gboolean      free_results);
 
+typedef struct E2kResultParser E2kResultParser;
+
+typedef void (*E2kResultParserFunc) (E2kResult *result,
+				     gpointer user_data);
+
+E2kResultParser *e2k_result_parser_new    (E2kResultParserFunc func,
+					   gpointer            user_data);
+void             e2k_result_parser_feed   (E2kResultParser    *parser,
+					   const gchar        *data,
+					   gsize               length);
+void             e2k_result_parser_finish (E2kResultParser    *parser);
+void             e2k_result_parser_free   (E2kResultParser    *parser);
+
+void       e2k_results_stream_multistatus         (SoupMessage  *msg);
+
 typedef struct E2kResultIter E2kResultIter;
 
 typedef E2kHTTPStatus (*E2kResultIterFetchFunc) (E2kResultIter *iter,
@@ -43,6 +58,11 @@ typedef E2kHTTPStatus (*E2kResultIterFetchFunc) (E2kResultIter *iter,
 						 gint *first,
 						 gint *total,
 						 gpointer user_data);
+typedef void          (*E2kResultIterPrefetchFunc) (E2kResultIter *iter,
+						    E2kContext *ctx,
+						    E2kOperation *op,
+						    gint depth,
+						    gpointer user_data);
 typedef void          (*E2kResultIterFreeFunc)  (E2kResultIter *iter,
 						 gpointer user_data);
 
@@ -53,6 +73,17 @@ E2kResultIter *e2k_result_iter_new         (E2kContext            *ctx,
 					    E2kResultIterFetchFunc fetch_func,
 					    E2kResultIterFreeFunc  free_func,
 					    gpointer               user_data);
+E2kResultIter *e2k_result_iter_new_full    (E2kContext            *ctx,
+					    E2kOperation          *op,
+					    gboolean               ascending,
+					    gint                    total,
+					    E2kResultIterFetchFunc fetch_func,
+					    E2kResultIterPrefetchFunc prefetch_func,
+					    E2kResultIterFreeFunc  free_func,
+					    gpointer               user_data);
+
+void           e2k_result_iter_set_read_ahead (E2kResultIter      *iter,
+					       gint                depth);
 
 E2kResult     *e2k_result_iter_next        (E2kResultIter         *iter);
 gint            e2k_result_iter_get_index   (E2kResultIter         *iter);
@@ -0,0 +1,162 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/* Copyright (C) 2001-2004 Novell, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Times parsing of synthetic multistatus responses full of mapi/id
+ * properties, at doubling sizes, to check that it stays linear.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "e2k-propnames.h"
+#include "e2k-result.h"
+#include "e2k-xml-utils.h"
+#include "test-utils.h"
+
+const gchar *test_program_name = "mstest";
+
+#define CHUNK_SIZE 8192
+
+static gchar *
+make_multistatus (gsize size,
+                  gsize *length,
+                  gint *nresponses)
+{
+	GString *body;
+	gint n = 0;
+
+	body = g_string_sized_new (size + 1024);
+	g_string_append (body, E2K_XML_HEADER);
+	g_string_append (body,
+			 "<a:multistatus xmlns:a=\"DAV:\" "
+			 "xmlns:b=\"urn:uuid:c2f41010-65b3-11d1-a29f-00aa00c14882/\" "
+			 "xmlns:c=\"" E2K_NS_MAPI_ID "{00062008-0000-0000-C000-000000000046}/\" "
+			 "xmlns:d=\"" E2K_NS_MAPI_ID "{00062003-0000-0000-C000-000000000046}/\">");
+
+	while (body->len < size) {
+		g_string_append_printf (
+			body,
+			"<a:response><a:href>http://exchange.example.com/exchange/user/Inbox/%d.EML</a:href>"
+			"<a:propstat><a:status>HTTP/1.1 200 OK</a:status><a:prop>"
+			"<c:0x8503 b:dt=\"boolean\">1</c:0x8503>"
+			"<c:0x8560 b:dt=\"dateTime.tz\">2004-01-01T00:00:00Z</c:0x8560>"
+			"<d:0x8101>%d</d:0x8101>"
+			"<a:getcontentlength>%d</a:getcontentlength>"
+			"</a:prop></a:propstat></a:response>",
+			n, n % 3, n * 17);
+		n++;
+	}
+	g_string_append (body, "</a:multistatus>");
+
+	*length = body->len;
+	*nresponses = n;
+	return g_string_free (body, FALSE);
+}
+
+static void
+count_result (E2kResult *result,
+              gpointer user_data)
+{
+	gint *count = user_data;
+
+	(*count)++;
+	e2k_results_free (g_memdup (result, sizeof (E2kResult)), 1);
+}
+
+static void
+check_count (const gchar *what,
+             gint got,
+             gint expected)
+{
+	if (got != expected) {
+		fprintf (stderr, "%s: got %d results, expected %d\n",
+			 what, got, expected);
+		exit (1);
+	}
+}
+
+void
+test_main (gint argc,
+           gchar **argv)
+{
+	gint max_mb = 16, mb, nresponses, nresults, count;
+	E2kResultParser *parser;
+	E2kResult *results;
+	SoupMessage *msg;
+	gchar *body;
+	gsize length, off;
+	gint64 start, dom_usecs, stream_usecs;
+
+	if (argc > 2) {
+		fprintf (stderr, "Usage: %s [max-megabytes]\n", argv[0]);
+		exit (1);
+	}
+	if (argc == 2)
+		max_mb = atoi (argv[1]);
+
+	printf ("%8s %10s %12s %10s %12s %10s\n", "MB", "responses",
+		"parse ms", "ns/byte", "stream ms", "ns/byte");
+
+	for (mb = 1; mb <= max_mb; mb *= 2) {
+		body = make_multistatus (mb * 1024 * 1024, &length, &nresponses);
+
+		/* Buffered: sanitize_bad_multistatus + DOM */
+		msg = soup_message_new ("SEARCH", "http://exchange.example.com/");
+		soup_message_set_status (msg, E2K_HTTP_MULTI_STATUS);
+		soup_message_body_append (msg->response_body, SOUP_MEMORY_COPY,
+					  body, length);
+		soup_message_body_flatten (msg->response_body);
+
+		start = g_get_monotonic_time ();
+		e2k_results_from_multistatus (msg, &results, &nresults);
+		dom_usecs = g_get_monotonic_time () - start;
+
+		check_count ("buffered", nresults, nresponses);
+		e2k_results_free (results, nresults);
+		g_object_unref (msg);
+
+		/* Streaming, fed in network-sized chunks */
+		count = 0;
+		start = g_get_monotonic_time ();
+		parser = e2k_result_parser_new (count_result, &count);
+		for (off = 0; off < length; off += CHUNK_SIZE) {
+			e2k_result_parser_feed (parser, body + off,
+						MIN (CHUNK_SIZE, length - off));
+		}
+		e2k_result_parser_finish (parser);
+		e2k_result_parser_free (parser);
+		stream_usecs = g_get_monotonic_time () - start;
+
+		check_count ("streamed", count, nresponses);
+
+		printf ("%8d %10d %12.1f %10.2f %12.1f %10.2f\n",
+			mb, nresponses,
+			dom_usecs / 1000.0, dom_usecs * 1000.0 / length,
+			stream_usecs / 1000.0, stream_usecs * 1000.0 / length);
+
+		g_free (body);
+	}
+
+	test_quit ();
+}
@@ -685,6 +685,37 @@ e_folder_exchange_propfind (EFolder *folder,
 		props, nprops, results, nresults);
 }
 
+/**
+ * e_folder_exchange_propfind_shared:
+ * @folder: the folder
+ * @op: pointer to an #E2kOperation to use for cancellation
+ * @props: array of properties to find
+ * @nprops: length of @props
+ * @results: on return, the results
+ * @nresults: length of @results
+ *
+ * As with e_folder_exchange_propfind(), but shares the response of
+ * an identical PROPFIND already in flight, if any. This is a
+ * convenience wrapper around e2k_context_propfind_shared(), qv.
+ *
+ * Return value: the HTTP status
+ **/
+E2kHTTPStatus
+e_folder_exchange_propfind_shared (EFolder *folder,
+                                   E2kOperation *op,
+                                   const gchar **props,
+                                   gint nprops,
+                                   E2kResult **results,
+                                   gint *nresults)
+{
+	g_return_val_if_fail (E_IS_FOLDER_EXCHANGE (folder), E2K_HTTP_MALFORMED);
+
+	return e2k_context_propfind_shared (
+		E_FOLDER_EXCHANGE_CONTEXT (folder), op,
+		E_FOLDER_EXCHANGE_URI (folder),
+		props, nprops, results, nresults);
+}
+
 /**
  * e_folder_exchange_bpropfind_start:
  * @folder: the folder
@@ -748,6 +779,31 @@ e_folder_exchange_search_start (EFolder *folder,
 		props, nprops, rn, orderby, ascending);
 }
 
+/**
+ * e_folder_exchange_search_count:
+ * @folder: the folder
+ * @op: pointer to an #E2kOperation to use for cancellation
+ * @rn: the search restriction
+ * @count: on return, the number of objects matching @rn
+ *
+ * Counts the contents of @folder that match @rn. This is a
+ * convenience wrapper around e2k_context_search_count(), qv.
+ *
+ * Return value: the HTTP status
+ **/
+E2kHTTPStatus
+e_folder_exchange_search_count (EFolder *folder,
+                                E2kOperation *op,
+                                E2kRestriction *rn,
+                                gint *count)
+{
+	g_return_val_if_fail (E_IS_FOLDER_EXCHANGE (folder), E2K_HTTP_MALFORMED);
+
+	return e2k_context_search_count (
+		E_FOLDER_EXCHANGE_CONTEXT (folder), op,
+		E_FOLDER_EXCHANGE_URI (folder), rn, count);
+}
+
 /**
  * e_folder_exchange_subscribe:
  * @folder: the folder to subscribe to notifications on
@@ -76,6 +76,12 @@ E2kHTTPStatus  e_folder_exchange_propfind          (EFolder *folder,
 						    gint nprops,
 						    E2kResult **results,
 						    gint *nresults);
+E2kHTTPStatus  e_folder_exchange_propfind_shared   (EFolder *folder,
+						    E2kOperation *op,
+						    const gchar **props,
+						    gint nprops,
+						    E2kResult **results,
+						    gint *nresults);
 E2kResultIter *e_folder_exchange_bpropfind_start   (EFolder *folder,
 						    E2kOperation *op,
 						    const gchar **hrefs,
@@ -90,6 +96,10 @@ E2kResultIter *e_folder_exchange_search_start      (EFolder *folder,
 						    E2kRestriction *rn,
 						    const gchar *orderby,
 						    gboolean ascending);
+E2kHTTPStatus  e_folder_exchange_search_count      (EFolder *folder,
+						    E2kOperation *op,
+						    E2kRestriction *rn,
+						    gint *count);
 
 void           e_folder_exchange_subscribe         (EFolder *folder,
 						    E2kContextChangeType,
@@ -1408,6 +1408,39 @@ hierarchies_created:
 	return TRUE;
 }
 
+static void
+set_connection_policy (ExchangeAccount *account)
+{
+	E2kContextConnectionPolicy policy;
+	GParamSpec *pspec;
+	guint idle_timeout, max_connections, request_timeout;
+	gboolean compress_responses;
+
+	g_object_get (
+		account->priv->settings,
+		"compress-responses", &compress_responses,
+		"idle-timeout", &idle_timeout,
+		"max-connections", &max_connections,
+		"request-timeout", &request_timeout,
+		NULL);
+
+	e2k_context_get_connection_policy (account->priv->ctx, &policy);
+	policy.max_conns_per_host = max_connections;
+	policy.idle_timeout = idle_timeout;
+
+	/* A request timeout left at its default doesn't override one
+	 * the context took from SOUP_SESSION_TIMEOUT.
+	 */
+	pspec = g_object_class_find_property (
+		G_OBJECT_GET_CLASS (account->priv->settings), "request-timeout");
+	if (request_timeout != G_PARAM_SPEC_UINT (pspec)->default_value)
+		policy.timeout = request_timeout;
+
+	e2k_context_set_connection_policy (account->priv->ctx, &policy);
+
+	e2k_context_set_compression (account->priv->ctx, compress_responses);
+}
+
 /**
  * exchange_account_connect:
  * @account: an #ExchangeAccount
@@ -1620,6 +1653,8 @@ exchange_account_connect (ExchangeAccount *account,
 	account->priv->gc = e2k_autoconfig_get_global_catalog (ac, NULL);
 	e2k_autoconfig_free (ac);
 
+	set_connection_policy (account);
+
 	status = e2k_context_propfind (account->priv->ctx, NULL,
 				       account->home_uri,
 				       mailbox_info_props,